@@ -55,9 +55,16 @@ class bootloader_module_can : public Bootloader_module
 
 		// Fields.
 
-		volatile Message_info reception_message; // This will be updated by CANIT ISR.
+		// Number of received messages which can be waiting to be handled at once.  This must be a power of two.
+		static const uint8_t RECEPTION_QUEUE_SIZE = 16;
 
-		volatile bool message_received; // This will be updated by CANIT ISR.
+		volatile Message_info reception_queue[RECEPTION_QUEUE_SIZE]; // This will be updated by CANIT ISR.
+
+		volatile uint8_t reception_queue_head; // This will be updated by CANIT ISR.
+
+		volatile uint8_t reception_queue_tail;
+
+		Message_info reception_message; // The message currently being handled, copied out of the reception queue.
 		
 		Message_info transmission_message;
 
@@ -179,6 +186,48 @@ class bootloader_module_can : public Bootloader_module
 		 *	RETURNS:	Nothing.
 		 */
 		void handle_write_data(void);
+
+		/**
+		 *	Procedure when a WRITE_DATA message is received while a windowed transfer has been negotiated.  Checks the sequence number
+		 *	of the message before saving its data into the buffer, and acknowledges once per window rather than once per message.
+		 *
+		 *	TAKES:		Nothing.
+		 *
+		 *	RETURNS:	Nothing.
+		 */
+		void handle_write_data_windowed(void);
+
+		/**
+		 *	Procedure when a SET_WINDOW message is received.  Stores the number of WRITE_DATA messages the uploader may send before
+		 *	waiting for an acknowledgement, limited to what the reception queue can hold.
+		 *
+		 *	NOTE - A window size of zero selects the legacy protocol, where every WRITE_DATA message is confirmed individually.
+		 *
+		 *	TAKES:		Nothing.
+		 *
+		 *	RETURNS:	Nothing.
+		 */
+		void handle_set_window(void);
+
+		/**
+		 *	Procedure when a PAGE_CHECKSUM message is received.  Calculates the CRC-32 of the specified range of flash and sends it back, so the
+		 *	uploader can skip writing pages which already hold the right data, and verify pages without reading them back.
+		 *
+		 *	TAKES:		Nothing.
+		 *
+		 *	RETURNS:	Nothing.
+		 */
+		void handle_page_checksum(void);
+
+		/**
+		 *	Procedure when an ERASE_MEMORY message is received.  Erases the flash sectors covering the specified range, so that the pages
+		 *	which follow only need writing, then confirms the command once the erase has finished.
+		 *
+		 *	TAKES:		Nothing.
+		 *
+		 *	RETURNS:	Nothing.
+		 */
+		void handle_erase_memory(void);
 	
 		/**
 		 *	Procedure when a READ_MEMORY message is received. Saves the Flash page number and the length of code to read.
@@ -219,6 +268,17 @@ class bootloader_module_can : public Bootloader_module
 		 */
 		void send_confirm_rxup(uint16_t id, bool success);
 
+		/**
+		 * Sends the uploader a cumulative acknowledgement for a window of WRITE_DATA messages.
+		 *
+		 * NOTE - The acknowledgement carries the sequence number of the next message expected, so the uploader knows where to resume.
+		 *
+		 * TAKES:	success	Flag indicating whether the received data was accepted or not.
+		 *
+		 * RETURNS:	Nothing.
+		 */
+		void send_window_ack(bool success);
+
 		/**
 		 * Sends the uploader a message containing information about this device information.
 		 *
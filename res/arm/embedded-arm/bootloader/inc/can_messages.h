@@ -56,6 +56,9 @@
 #define CANID_WRITE_DATA (CANID_BASE_ID+3)
 #define CANID_READ_MEMORY (CANID_BASE_ID+4)
 #define CANID_READ_DATA (CANID_BASE_ID+5)
+#define CANID_SET_WINDOW (CANID_BASE_ID+6)
+#define CANID_PAGE_CHECKSUM (CANID_BASE_ID+7)
+#define CANID_ERASE_MEMORY (CANID_BASE_ID+8)
 
 #endif  // __can_messages_H__
 
@@ -87,6 +87,12 @@ enum input_state {LO, HI};
 
 #define APP_START_ADDRESS	0x08020000
 
+// The flash is split into sectors of different sizes: four of 16K, then one of 64K, then 128K sectors up to the end.
+#define FLASH_SMALL_SECTOR_SIZE		0x4000
+#define FLASH_LARGE_SECTOR_SIZE		0x20000
+#define FLASH_SMALL_SECTORS			4
+#define FLASH_END_ADDRESS			0x08100000
+
 // Blink times for different states. Times are in ms.
 
 #define BLINK_PRSCL			(8400 - 1)
@@ -112,7 +118,7 @@ enum input_state {LO, HI};
 // #define BOOTLOADER_MODULE	<<<TC_INSERTS_BOOTLOADER_ACTIVE_MODULE_HERE>>>
 #define BOOTLOADER_MODULE	bootloader_module_can
 
-#define BOOTLOADER_VERSION	0x001  // TODO - how is this updated.
+#define BOOTLOADER_VERSION	0x0103  // TODO - how is this updated.  Version 1.1 adds RLE encoded page transfers, 1.2 windowed page reads, 1.3 erasing the image up front.
 
 #define DEVICE_SIGNATURE_0	0x00
 #define DEVICE_SIGNATURE_1	0x00
@@ -202,6 +208,24 @@ void write_flash_page(Firmware_page& buffer);
  */
 void read_flash_page(Firmware_page& buffer);
 
+/**
+ *	Works out which flash sector an address lies in.
+ *
+ *	TAKES:		address		An address within the flash.
+ *
+ *	RETURNS:	The number of the sector, as counted by the reference manual.
+ */
+uint8_t get_flash_sector(uint32_t address);
+
+/**
+ *	Works out where a flash sector starts.  The sector after the last one starts at the end of the flash.
+ *
+ *	TAKES:		sector		The number of the sector, as counted by the reference manual.
+ *
+ *	RETURNS:	The address of the first byte of the sector.
+ */
+uint32_t get_flash_sector_start(uint8_t sector);
+
 // IMPLEMENT PUBLIC STATIC FUNCTIONS.
 
 int main(void)
@@ -398,6 +422,113 @@ void get_device_signature(uint8_t* device_signature)
 	return;
 }
 
+uint32_t get_flash_checksum(uint32_t address, uint32_t length)
+{
+	// Start off with all bits set, as the CRC-32 standard requires.
+	uint32_t crc = 0xFFFFFFFF;
+
+	// Flash is memory mapped, so we can just read straight through it.
+	const uint8_t* data = reinterpret_cast<const uint8_t*>(address);
+
+	// Work through the flash byte by byte.
+	for (uint32_t i = 0; i < length; i++)
+	{
+		// Fold in the next byte of flash.
+		crc ^= data[i];
+
+		// Divide through by the (reflected) polynomial, one bit at a time.
+		for (uint8_t bit = 0; bit < 8; bit++)
+		{
+			crc = (crc & 1) ? ((crc >> 1) ^ 0xEDB88320) : (crc >> 1);
+		}
+	}
+
+	// All done.
+	return ~crc;
+}
+
+bool erase_flash(uint32_t address, uint32_t length)
+{
+	// The bootloader and its shutdown flag live below the application, so only the part of the range above that is erased.
+	if (address < APP_START_ADDRESS)
+	{
+		length = ((address + length) > APP_START_ADDRESS) ? (address + length - APP_START_ADDRESS) : 0;
+		address = APP_START_ADDRESS;
+	}
+
+	// Check there's something left to erase, and that it lies within the flash.
+	if ((length == 0) || (address >= FLASH_END_ADDRESS) || (length > (FLASH_END_ADDRESS - address)))
+	{
+		return false;
+	}
+
+	// Unlock the FLASH for erasing, and clear any errors left over from before.
+	FLASH_Unlock();
+	FLASH_ClearFlag(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+
+	// Erase each sector the range touches, one at a time.  Anything which runs from flash, including interrupts, stalls until each is done.
+	bool erased = true;
+	for (uint8_t sector = get_flash_sector(address); erased && (get_flash_sector_start(sector) < (address + length)); sector++)
+	{
+		erased = (FLASH_EraseSector(FLASH_Sector_0 + (static_cast<uint32_t>(sector) * FLASH_Sector_1), VoltageRange_3) == FLASH_COMPLETE);
+	}
+
+	// Lock the flash.
+	FLASH_Lock();
+
+	// All done.
+	return erased;
+}
+
+void fill_page(Firmware_page& buffer, const volatile uint8_t* data, uint8_t length)
+{
+	for (uint8_t i = 0; (i < length) && (buffer.current_byte < buffer.code_length); i++)
+	{
+		if (buffer.encoding == ENCODING_NONE)
+		{
+			// Plain data goes straight into the buffer.
+			buffer.data[buffer.current_byte++] = data[i];
+		}
+		else if (buffer.run_state == RUN_CONTROL)
+		{
+			// This is the start of a new run, so work out what sort it is and how long.
+			if (data[i] < 0x80)
+			{
+				buffer.run_state = RUN_LITERAL;
+				buffer.run_remaining = data[i] + 1;
+			}
+			else
+			{
+				buffer.run_state = RUN_REPEAT;
+				buffer.run_remaining = data[i] - 0x80 + 2;
+			}
+		}
+		else if (buffer.run_state == RUN_LITERAL)
+		{
+			// Literal bytes are copied across one at a time.
+			buffer.data[buffer.current_byte++] = data[i];
+			buffer.run_remaining--;
+			if (buffer.run_remaining == 0)
+			{
+				buffer.run_state = RUN_CONTROL;
+			}
+		}
+		else
+		{
+			// Expand the repeated byte, without running past the end of the page.
+			while ((buffer.run_remaining > 0) && (buffer.current_byte < buffer.code_length))
+			{
+				buffer.data[buffer.current_byte++] = data[i];
+				buffer.run_remaining--;
+			}
+			buffer.run_state = RUN_CONTROL;
+		}
+	}
+
+	// All done.
+	return;
+}
+
 void set_bootloader_state(State new_state)
 {
 	state = new_state;
@@ -491,8 +622,8 @@ void write_flash_page(Firmware_page& buffer)
 	// Unlock the FLASH for writing.
 	FLASH_Unlock();
 
-	// Erase the FLASH page that we're about to write.
-	#warning "This doesn't really work for the STM32F4xx. The flash pages are massive and not regularly sized."
+	// NOTE - The flash sectors are far bigger than a page and not regularly sized, so they aren't erased here.  The uploader erases the whole
+	//	image with an ERASE_MEMORY command before it starts writing pages.
 
 	// Write the data from the page to FLASH, one byte at a time.
 	for (uint16_t i = 0; i < buffer.code_length; i++)
@@ -540,6 +671,39 @@ void read_flash_page(Firmware_page& buffer)
 	return;
 }
 
+uint8_t get_flash_sector(uint32_t address)
+{
+	// Work out how far into the flash the address is.
+	uint32_t offset = address - FLASH_BASE;
+
+	// The small sectors come first, then the one medium sized sector, then the rest are large.
+	if (offset < (FLASH_SMALL_SECTORS * FLASH_SMALL_SECTOR_SIZE))
+	{
+		return offset / FLASH_SMALL_SECTOR_SIZE;
+	}
+	else if (offset < FLASH_LARGE_SECTOR_SIZE)
+	{
+		return FLASH_SMALL_SECTORS;
+	}
+	// Else the address lies in one of the large sectors.
+	return FLASH_SMALL_SECTORS + (offset / FLASH_LARGE_SECTOR_SIZE);
+}
+
+uint32_t get_flash_sector_start(uint8_t sector)
+{
+	// The small sectors come first, then the one medium sized sector, then the rest are large.
+	if (sector < FLASH_SMALL_SECTORS)
+	{
+		return FLASH_BASE + (sector * FLASH_SMALL_SECTOR_SIZE);
+	}
+	else if (sector == FLASH_SMALL_SECTORS)
+	{
+		return FLASH_BASE + (FLASH_SMALL_SECTORS * FLASH_SMALL_SECTOR_SIZE);
+	}
+	// Else this is one of the large sectors, the first of which starts one large sector's worth into the flash.
+	return FLASH_BASE + ((sector - FLASH_SMALL_SECTORS) * FLASH_LARGE_SECTOR_SIZE);
+}
+
 // IMPLEMENT INTERRUPT SERVICE ROUTINES.
 
 /*
@@ -44,6 +44,10 @@
 
 #define BOOTLOADER_START_ADDRESS	0x00000000
 
+// The application area of the flash, which must match bootloader.cpp.  Only this range may be read back by checksum requests.
+#define APP_START_ADDRESS	0x08020000
+#define FLASH_END_ADDRESS	0x08100000
+
 // CAN baud rate values.
 #warning #define CAN_BAUD_RATE	<<<TC_INSERTS_CAN_BAUD_RATE_HERE>>>
 #warning #define CLK_SPEED_IN_MHZ	<<<TC_INSERTS_CLK_SPEED_IN_MHZ_HERE>>>
@@ -105,6 +109,22 @@ bool write_details_stored;
 // Flag indicating an error has occurred.  Currently, once an error occurs, there is no way to clear it other than a reset.
 volatile bool error;
 
+// Number of WRITE_DATA messages the uploader may send before waiting for an acknowledgement.  Zero means the legacy protocol.
+uint8_t window_size;
+
+// Sequence number of the next WRITE_DATA message we expect to receive during a windowed transfer.
+uint8_t expected_sequence;
+
+// Flag indicating we've already told the uploader about a missing WRITE_DATA message, so we don't repeat ourselves.
+bool sequence_error_reported;
+
+// Flag indicating the last page was received in full under the windowed protocol, and nothing has been asked of us since.
+bool page_completed;
+
+// Number of READ_DATA messages of the current page we've sent, and how many of them the uploader has acknowledged, during a windowed read.
+uint8_t read_sequence;
+uint8_t read_acknowledged;
+
 // NOTE - Invalid commands received via CAN don't count as errors, handling them is 'normal' behaviour.  An error is like CAN transmission fails.
 
 // DEFINE PRIVATE FUNCTION PROTOTYPES.
@@ -190,12 +210,23 @@ void bootloader_module_can::exit(void)
 
 void bootloader_module_can::event_idle()
 {
-	// Check if we've recieved a new message.
-	if (message_received)
-	{		
+	// Check if we've recieved a new message.  During a windowed read, the uploader asks for the next page while the last of this one is still going
+	// out, so that has to finish first.  If the window is full though, the uploader has given up on this page, and it is abandoned.
+	if ((reception_queue_tail != reception_queue_head) &&
+		!((reception_queue[reception_queue_tail].message_type == CANID_READ_MEMORY) && (window_size > 0) && transmission_queued && !transmission_unconfirmed))
+	{
+		// Take a copy of the oldest message, so that the ISR is free to reuse its slot.
+		reception_message.message_type = reception_queue[reception_queue_tail].message_type;
+		reception_message.dlc = reception_queue[reception_queue_tail].dlc;
+		for (uint8_t i = 0; i < 8; i++)
+		{
+			reception_message.message[i] = reception_queue[reception_queue_tail].message[i];
+		}
+		reception_queue_tail = (reception_queue_tail + 1) & (RECEPTION_QUEUE_SIZE - 1);
+
 		// Handle the incoming message.
 		filter_message();
-	}	
+	}
 
 	// Check if we've just finished reading a flash page that we want to send.
 	if (!buffer.ready_to_read && ready_to_send_page)
@@ -221,8 +252,9 @@ void bootloader_module_can::event_idle()
 			// Increment the current_byte for next message.
 			buffer.current_byte += transmission_message.dlc;
 
-			// Now, we need to wait for confirmation before we do this again.
-			transmission_unconfirmed = true;
+			// Now, we need to wait for confirmation before we do this again.  A windowed read only waits once the window is full.
+			read_sequence++;
+			transmission_unconfirmed = ((window_size == 0) || (static_cast<uint8_t>(read_sequence - read_acknowledged) >= window_size));
 
 			// If that was the last chunk, then we haven't anything more to do.
 			if (buffer.current_byte >= buffer.code_length)
@@ -413,13 +445,22 @@ void bootloader_module_can::handle_write_memory(void)
 	transmission_unconfirmed = false;
 	transmission_queued = false;
 
+	// The uploader has moved on from the last page.
+	page_completed = false;
+
 	// Initially, we'll assume the command to be sane.
 	bool command_ok = true;
 
-	// Check the DLC was what we expected.
-	if (reception_message.dlc != 7)
+	// Check the DLC was what we expected.  An eighth byte, if present, says how the page data will be encoded.
+	if ((reception_message.dlc != 7) && (reception_message.dlc != 8))
+	{
+		command_ok = false;
+	}
+	else if ((reception_message.dlc == 8) && (reception_message.message[7] > ENCODING_RLE))
 	{
+		// We don't know how to decode the page.
 		command_ok = false;
+		write_details_stored = false;
 	}
 	else
 	{
@@ -451,6 +492,14 @@ void bootloader_module_can::handle_write_memory(void)
 
 			// We start writing at the first byte of the specified page.
 			buffer.current_byte = 0;
+
+			// Get ready to decode the page data, if it's going to be encoded.
+			buffer.encoding = (reception_message.dlc == 8) ? reception_message.message[7] : ENCODING_NONE;
+			buffer.run_state = RUN_CONTROL;
+
+			// Windowed transfers number their messages from the start of each page.
+			expected_sequence = 0;
+			sequence_error_reported = false;
 		}
 	}
 
@@ -467,29 +516,21 @@ void bootloader_module_can::handle_write_data(void)
 	transmission_unconfirmed = false;
 	transmission_queued = false;
 
+	// If the uploader negotiated a windowed transfer, then the message carries a sequence number and is handled differently.
+	if (window_size > 0)
+	{
+		handle_write_data_windowed();
+		return;
+	}
+
 	// Initially, we'll assume the command to be sane.
 	bool command_ok = true;
 
 	// Only write to buffer if a valid memory address and code length have already been provided.
 	if (write_details_stored)
 	{
-		// Check for possible array overflow.
-		if ((buffer.current_byte + (reception_message.dlc - 1)) > buffer.code_length)
-		{
-			// Limit the DLC if we're up to the last byte.
-			reception_message.dlc = (buffer.code_length - buffer.current_byte) + 1;
-
-			// NOTE - The message DLC has to be one longer than the number of bytes, because of the node ID in the first byte.
-		}
-
-		// Store data from received message (max seven bytes because of node ID) into the buffer.
-		for (uint8_t i = 1; i < reception_message.dlc; i++)
-		{
-			buffer.data[buffer.current_byte + i - 1] = reception_message.message[i];
-		}
-
-		// Increment the current byte in buffer.
-		buffer.current_byte += (reception_message.dlc - 1);
+		// Store data from received message (max seven bytes because of node ID) into the buffer, decoding it if need be.
+		fill_page(buffer, &reception_message.message[1], reception_message.dlc - 1);
 
 		// Check if the buffer is ready to be written to flash.
 		if (buffer.current_byte >= (buffer.code_length))
@@ -514,6 +555,73 @@ void bootloader_module_can::handle_write_data(void)
 	return;
 }
 
+void bootloader_module_can::handle_write_data_windowed(void)
+{
+	// Only write to buffer if a valid memory address and code length have already been provided.
+	if (!write_details_stored || (reception_message.dlc < 2))
+	{
+		// If this is the last message of the page we just finished, our acknowledgement must have gone missing and the uploader is asking for it
+		// again, so tell it the page is done rather than making it start the page over.
+		if (page_completed && (reception_message.dlc >= 2) && (reception_message.message[1] == static_cast<uint8_t>(expected_sequence - 1)))
+		{
+			send_window_ack(true);
+			return;
+		}
+
+		// Something was wrong with the command.  Probably trying to write data before setting the destination details.
+		send_window_ack(false);
+		return;
+	}
+
+	// Check whether this is the message we were expecting next.
+	if (reception_message.message[1] != expected_sequence)
+	{
+		// Part of the window must have gone missing (or this is a repeat of something we already have), so we discard the data.
+
+		// Tell the uploader where to resume from, but only once, since the rest of the window will be out of sequence too.
+		if (!sequence_error_reported)
+		{
+			send_window_ack(true);
+			sequence_error_reported = true;
+		}
+
+		// All done.
+		return;
+	}
+
+	// This message is in sequence, so any earlier gap has now been filled.
+	sequence_error_reported = false;
+
+	// Store data from received message into the buffer, decoding it if need be.  The message DLC includes the node ID and the sequence number,
+	// so there are at most six bytes of data.
+	fill_page(buffer, &reception_message.message[2], reception_message.dlc - 2);
+
+	// Move on to the next message in the sequence.
+	expected_sequence++;
+
+	// Check if the buffer is ready to be written to flash.
+	if (buffer.current_byte >= buffer.code_length)
+	{
+		// Queue up writing the buffer into flash.
+		buffer.ready_to_write = true;
+
+		// We need new address details before we can write more data.
+		write_details_stored = false;
+		page_completed = true;
+
+		// The last message of a page always gets acknowledged, even if the window isn't full.
+		send_window_ack(true);
+	}
+	else if ((expected_sequence % window_size) == 0)
+	{
+		// That was the end of a window, so let the uploader know it can send the next one.
+		send_window_ack(true);
+	}
+
+	// All done.
+	return;
+}
+
 void bootloader_module_can::handle_read_memory(void)
 {	
 	// If we were in the middle of transmitting page data, we abandon that idea.
@@ -542,6 +650,8 @@ void bootloader_module_can::handle_read_memory(void)
 
 		// Start from the first byte.
 		buffer.current_byte = 0;
+		read_sequence = 0;
+		read_acknowledged = 0;
 
 		// Check for errors in message details.
 		if (buffer.code_length > SPM_PAGESIZE)
@@ -566,11 +676,154 @@ void bootloader_module_can::handle_read_memory(void)
 	return;
 }
 
-void bootloader_module_can::filter_message(void)
+void bootloader_module_can::handle_set_window(void)
+{
+	// If we were in the middle of transmitting page data, we abandon that idea.
+	transmission_unconfirmed = false;
+	transmission_queued = false;
+
+	// Initially, we'll assume the command to be sane.
+	bool command_ok = true;
+
+	// Check the DLC was what we expected.
+	if (reception_message.dlc != 2)
+	{
+		command_ok = false;
+	}
+	else
+	{
+		// Store the requested window size, but never allow more messages in flight than we have room to queue.
+		window_size = reception_message.message[1];
+		if (window_size > (RECEPTION_QUEUE_SIZE - 1))
+		{
+			window_size = RECEPTION_QUEUE_SIZE - 1;
+		}
+
+		// NOTE - One slot of the reception queue is always left empty, so the ISR can tell a full queue from an empty one.
+
+		// Any page which was partly received under the old protocol can't be finished under the new one.
+		write_details_stored = false;
+		page_completed = false;
+	}
+
+	// Reply with the window size we actually settled on, so the uploader knows how many messages it may send.
+	transmission_message.message_type = CANID_SET_WINDOW;
+	transmission_message.dlc = 3;
+	transmission_message.message[0] = command_ok ? 1 : 0;
+	transmission_message.message[1] = window_size;
+	transmission_message.message[2] = NODE_ID;
+
+	// Actually send the message.
+	transmit_CAN_message();
+
+	// All done.
+	return;
+}
+
+void bootloader_module_can::handle_page_checksum(void)
+{
+	// If we were in the middle of transmitting page data, we abandon that idea.
+	transmission_unconfirmed = false;
+	transmission_queued = false;
+
+	// Initially, we'll assume the command to be sane.
+	bool command_ok = true;
+	uint32_t checksum = 0;
+
+	// Check the DLC was what we expected.  The long form of the command has a 24 bit length, for checking a whole image at once.
+	if ((reception_message.dlc != 7) && (reception_message.dlc != 8))
+	{
+		command_ok = false;
+	}
+	else
+	{
+		// Fetch the 32 bit address to start from.
+		uint32_t address = (((static_cast<uint32_t>(reception_message.message[1])) << 24) |
+									 ((static_cast<uint32_t>(reception_message.message[2])) << 16) |
+									 ((static_cast<uint32_t>(reception_message.message[3])) << 8) |
+									 (static_cast<uint32_t>(reception_message.message[4])));
+
+		// Fetch the 16 bit (or 24 bit) length to include.
+		uint32_t length = 0;
+		for (uint8_t i = 5; i < reception_message.dlc; i++)
+		{
+			length = (length << 8) | reception_message.message[i];
+		}
+
+		// Check for errors in message details.  Flash is read through a raw pointer, so anything outside the application area would fault.
+		if ((address < APP_START_ADDRESS) || (address >= FLASH_END_ADDRESS) || (length > (FLASH_END_ADDRESS - address)))
+		{
+			// Something was wrong with the command.  Probably the specified range strays outside the application.
+			command_ok = false;
+		}
+		else
+		{
+			// Work out the checksum of what is in flash at the moment.  This blocks for a while if the range is a whole image.
+			checksum = get_flash_checksum(address, length);
+		}
+	}
+
+	// Reply with the checksum, or a failure if the command wasn't sane.
+	transmission_message.message_type = CANID_PAGE_CHECKSUM;
+	transmission_message.dlc = 6;
+	transmission_message.message[0] = command_ok ? 1 : 0;
+	transmission_message.message[1] = static_cast<uint8_t>(checksum >> 24);
+	transmission_message.message[2] = static_cast<uint8_t>(checksum >> 16);
+	transmission_message.message[3] = static_cast<uint8_t>(checksum >> 8);
+	transmission_message.message[4] = static_cast<uint8_t>(checksum);
+	transmission_message.message[5] = NODE_ID;
+
+	// Actually send the message.
+	transmit_CAN_message();
+
+	// All done.
+	return;
+}
+
+void bootloader_module_can::handle_erase_memory(void)
 {
-	// Whatever the case, we won't need to worry about this same message again.
-	message_received = false;
+	// If we were in the middle of transmitting page data, we abandon that idea.
+	transmission_unconfirmed = false;
+	transmission_queued = false;
 
+	// Any page we were partway through writing can't be finished now, so the uploader will have to start it again.
+	write_details_stored = false;
+	page_completed = false;
+
+	// Initially, we'll assume the command to be sane.
+	bool command_ok = true;
+
+	// Check the DLC was what we expected.
+	if (reception_message.dlc != 8)
+	{
+		command_ok = false;
+	}
+	else
+	{
+		// Fetch the 32 bit address to start from.
+		uint32_t address = (((static_cast<uint32_t>(reception_message.message[1])) << 24) |
+									 ((static_cast<uint32_t>(reception_message.message[2])) << 16) |
+									 ((static_cast<uint32_t>(reception_message.message[3])) << 8) |
+									 (static_cast<uint32_t>(reception_message.message[4])));
+
+		// Fetch the 24 bit length to erase.
+		uint32_t length = (((static_cast<uint32_t>(reception_message.message[5])) << 16) |
+									 ((static_cast<uint32_t>(reception_message.message[6])) << 8) |
+									 (static_cast<uint32_t>(reception_message.message[7])));
+
+		// Erase the sectors.  This blocks for a while, but the uploader waits for the confirmation before it sends anything else.
+		command_ok = erase_flash(address, length);
+	}
+
+	// Confirm the command, once the erase has finished.
+	send_confirm_rxup(CANID_ERASE_MEMORY, command_ok);
+
+	// All done.
+	return;
+}
+
+void bootloader_module_can::filter_message(void)
+{
 	// NOTE - We test the NODE_ID first, then the actual message type, solely because it makes the code a little tidier.
 
 	// If this message is intended for this node, then data[0] should match our own NODE_ID.
@@ -615,11 +868,30 @@ void bootloader_module_can::filter_message(void)
 			handle_read_memory();
 			break;
 
+		case CANID_SET_WINDOW:
+			handle_set_window();
+			break;
+
+		case CANID_PAGE_CHECKSUM:
+			handle_page_checksum();
+			break;
+
+		case CANID_ERASE_MEMORY:
+			handle_erase_memory();
+			break;
+
 		case CANID_READ_DATA:
 			// This is a confirmation message from the uploader, indicating that it received the page we sent ok.
 
 			// If we were previously transmitting a message, we aren't any longer.
 			module.transmission_unconfirmed = false;
+
+			// During a windowed read, the uploader says how many messages of the page it has received, which makes room in the window for more.
+			if ((window_size > 0) && (reception_message.dlc >= 2))
+			{
+				read_acknowledged = reception_message.message[1];
+				module.transmission_unconfirmed = (static_cast<uint8_t>(read_sequence - read_acknowledged) >= window_size);
+			}
 			break;
 
 		default:
@@ -663,8 +935,11 @@ void bootloader_module_can::send_confirm_rxup(uint16_t id, bool success)
 {
 	// Assemble the message to send.
 	transmission_message.message_type = id;
-	transmission_message.dlc = 1;
-	transmission_message.message[0] = (true) ? 1 : 0;
+	transmission_message.dlc = 2;
+	transmission_message.message[0] = success ? 1 : 0;
+	transmission_message.message[1] = NODE_ID;
+
+	// NOTE - The trailing NODE_ID lets an uploader talking to several nodes at once tell whose reply this is.
 	
 	// Actually send the message.	
 	transmit_CAN_message();
@@ -673,6 +948,22 @@ void bootloader_module_can::send_confirm_rxup(uint16_t id, bool success)
 	return;
 }
 
+void bootloader_module_can::send_window_ack(bool success)
+{
+	// Assemble the message to send.
+	transmission_message.message_type = CANID_WRITE_DATA;
+	transmission_message.dlc = 3;
+	transmission_message.message[0] = success ? 1 : 0;
+	transmission_message.message[1] = expected_sequence;
+	transmission_message.message[2] = NODE_ID;
+
+	// Actually send the message.
+	transmit_CAN_message();
+
+	// All done.
+	return;
+}
+
 void bootloader_module_can::send_device_info(void)
 {
 	// Fetch the device signaure.
@@ -684,13 +975,14 @@ void bootloader_module_can::send_device_info(void)
 	
 	// Assemble the message to send.
 	transmission_message.message_type = CANID_GET_INFO;
-	transmission_message.dlc = 6;
+	transmission_message.dlc = 7;
 	transmission_message.message[0] = device_signature[0];
 	transmission_message.message[1] = device_signature[1];
 	transmission_message.message[2] = device_signature[2];
 	transmission_message.message[3] = device_signature[3];
 	transmission_message.message[4] = static_cast<uint8_t>(bootloader_version >> 8);
 	transmission_message.message[5] = static_cast<uint8_t>(bootloader_version);
+	transmission_message.message[6] = NODE_ID;
 	
 	// Actually send the message.
 	transmit_CAN_message();
@@ -734,13 +1026,13 @@ void bootloader_module_can::send_read_data()
  */
 extern "C" void CAN1_RX0_IRQHandler(void)
 {
-	// Store the message ID.
-	module.reception_message.message_type = (uint16_t)((uint32_t)0x000007FF & (CAN1->sFIFOMailBox[0].RIR >> 21));
+	// Work out where the message will go once it has been queued.
+	uint8_t next_head = (module.reception_queue_head + 1) & (bootloader_module_can::RECEPTION_QUEUE_SIZE - 1);
 
-	// If the previously recieved message hasn't been handled yet, then panic.
-	if (module.message_received)
+	// If the queue is full of messages which haven't been handled yet, then panic.
+	if (next_head == module.reception_queue_tail)
 	{
-		// We don't have much option but to discard the previous message.  But try alert the user about this.
+		// We don't have much option but to discard the new message.  But try alert the user about this.
 
 		// Change the bootloader status to indicate an error.
 		set_bootloader_state(BOOT_ERROR);
@@ -748,28 +1040,39 @@ extern "C" void CAN1_RX0_IRQHandler(void)
 		// Set our own error flag.
 		error = true;
 	}
+	else
+	{
+		volatile bootloader_module_can::Message_info& message = module.reception_queue[module.reception_queue_head];
 
-	// Store the DLC of the incoming message.
-	module.reception_message.dlc = (uint16_t)((uint8_t)0x0F & CAN1->sFIFOMailBox[0].RDTR);
+		// Store the message ID.
+		message.message_type = (uint16_t)((uint32_t)0x000007FF & (CAN1->sFIFOMailBox[0].RIR >> 21));
 
-	// Make sure the DLC is within range.
-	if (module.reception_message.dlc > 8)  // We use 7 here since we count from zero, not from one.
-	{
-		module.reception_message.dlc = 8;  // This check is required as CAN controller may give a value greater than 8.
-	}
+		// Store the DLC of the incoming message.
+		message.dlc = (uint16_t)((uint8_t)0x0F & CAN1->sFIFOMailBox[0].RDTR);
 
-	// Store the message.
-	module.reception_message.message[0] = (uint8_t)0xFF & CAN1->sFIFOMailBox[0].RDLR;
-	module.reception_message.message[1] = (uint8_t)0xFF & (CAN1->sFIFOMailBox[0].RDLR >> 8);
-	module.reception_message.message[2] = (uint8_t)0xFF & (CAN1->sFIFOMailBox[0].RDLR >> 16);
-	module.reception_message.message[3] = (uint8_t)0xFF & (CAN1->sFIFOMailBox[0].RDLR >> 24);
-	module.reception_message.message[4] = (uint8_t)0xFF & CAN1->sFIFOMailBox[0].RDHR;
-	module.reception_message.message[5] = (uint8_t)0xFF & (CAN1->sFIFOMailBox[0].RDHR >> 8);
-	module.reception_message.message[6] = (uint8_t)0xFF & (CAN1->sFIFOMailBox[0].RDHR >> 16);
-	module.reception_message.message[7] = (uint8_t)0xFF & (CAN1->sFIFOMailBox[0].RDHR >> 24);
+		// Make sure the DLC is within range.
+		if (message.dlc > 8)
+		{
+			message.dlc = 8;  // This check is required as CAN controller may give a value greater than 8.
+		}
 
-	// Tell the synchronous part of the module that a message was received.
-	module.message_received = true;
+		// Store the message.
+		message.message[0] = (uint8_t)0xFF & CAN1->sFIFOMailBox[0].RDLR;
+		message.message[1] = (uint8_t)0xFF & (CAN1->sFIFOMailBox[0].RDLR >> 8);
+		message.message[2] = (uint8_t)0xFF & (CAN1->sFIFOMailBox[0].RDLR >> 16);
+		message.message[3] = (uint8_t)0xFF & (CAN1->sFIFOMailBox[0].RDLR >> 24);
+		message.message[4] = (uint8_t)0xFF & CAN1->sFIFOMailBox[0].RDHR;
+		message.message[5] = (uint8_t)0xFF & (CAN1->sFIFOMailBox[0].RDHR >> 8);
+		message.message[6] = (uint8_t)0xFF & (CAN1->sFIFOMailBox[0].RDHR >> 16);
+		message.message[7] = (uint8_t)0xFF & (CAN1->sFIFOMailBox[0].RDHR >> 24);
+
+		// Only keep messages addressed to this node, so traffic for other nodes sharing the bus can't fill up the queue.
+		if ((message.dlc >= 1) && (message.message[0] == NODE_ID))
+		{
+			// Tell the synchronous part of the module that a message was received.
+			module.reception_queue_head = next_head;
+		}
+	}
 
 	// Release the FIFO so the next message can be seen.
 	CAN1->RF0R |= CAN_RF0R_RFOM0;
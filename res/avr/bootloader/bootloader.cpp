@@ -90,7 +90,7 @@ enum input_state {LO,HI};
 
 #define BOOTLOADER_MODULE	<<<TC_INSERTS_BOOTLOADER_ACTIVE_MODULE_HERE>>>
 
-#define BOOTLOADER_VERSION  0x0100 // TODO - how is this updated.
+#define BOOTLOADER_VERSION  0x0102 // TODO - how is this updated.  Version 1.1 adds RLE encoded page transfers, 1.2 windowed page reads.
 
 #define DEVICE_SIGNATURE_0 0x00 // In case of using a  microcontroller with a 32-bit device signature.
 #define DEVICE_SIGNATURE_1 SIGNATURE_0
@@ -109,6 +109,12 @@ enum input_state {LO,HI};
 
 // DEFINE PRIVATE TYPES AND STRUCTS.
 
+/**
+ *	Where the flash is up to with programming a page.  The page is held in the temporary page buffer of the SPM unit meanwhile, which frees up the
+ *	firmware_page buffer to receive the next page.
+ */
+enum Flash_state { FLASH_IDLE, FLASH_ERASING, FLASH_WRITING };
+
 // DECLARE PRIVATE GLOBAL VARIABLES.
 
 // All periodic functionality is queued by a 1ms timer interrupt.  To time longer periods, you need to accumulate a count of ticks.
@@ -131,6 +137,10 @@ Bootloader_module& mod = module;
 
 Firmware_page buffer;
 
+// Where the flash is up to with the page being programmed, and which page that is.
+Flash_state flash_state = FLASH_IDLE;
+uint32_t flash_page = 0;
+
 // DEFINE PRIVATE FUNCTION PROTOTYPES.
 #ifndef __AVR_AT90CAN128__
 void wdt_init(void) __attribute__((naked)) __attribute__((section(".init3")));
@@ -165,9 +175,10 @@ bool is_clean(void);
 void run_application(void);
 
 /**
- *	Flashes a single page of data to NRWW EEPROM.
+ *	Starts flashing a single page of data to NRWW EEPROM.  The data is loaded into the temporary page buffer and the erase is started, after which the
+ *	firmware_page is free to be used again straight away.  Call continue_flash_page() until the flash is idle again to finish the job.
  *
- *	Blocks until EEPROM IO operations are completed.
+ *	Only blocks while the data is loaded, and only if the flash is still busy with a previous page.
  *
  *	NOTE - There is no testing that the arguments provided are valid; invalid arguments may result in undefined behaviour.
  *
@@ -177,6 +188,16 @@ void run_application(void);
  */
 void write_flash_page(Firmware_page& buffer);
 
+/**
+ *	Moves a page being flashed along to the next step, once the flash has finished the last one.  Interrupts stay enabled throughout, since the
+ *	bootloader runs from the NRWW section and can carry on receiving while the RWW section is busy.
+ *
+ *	TAKES: 		Nothing.
+ *
+ *	RETURNS: 	Nothing.
+ */
+void continue_flash_page(void);
+
 /**
  *	Reads a single page of data from NRWW EEPROM into a buffer.
  *
@@ -278,15 +299,21 @@ int main(void)
 		// Perform any module specific functionality which needs to be executed as fast as possible.
 		mod.event_idle();
 
-		// If the buffer is ready to be written, write it to memory.
-		if (buffer.ready_to_write)
+		// If the buffer is ready to be written, and the flash has finished with the last page, start writing it to memory.
+		if (buffer.ready_to_write && (flash_state == FLASH_IDLE))
 		{
-			// Write the buffer to flash. This blocks, with interrupts disabled, whilst the operation is in progress.
+			// This only blocks while the page is handed over; the next page can be received into the buffer while this one is programmed.
 			write_flash_page(buffer);
 		}
 
-		// If the buffer is ready to be read from, read it back again.
-		if (buffer.ready_to_read)
+		// If the flash is busy with a page, see if it's ready for the next step.
+		if (flash_state != FLASH_IDLE)
+		{
+			continue_flash_page();
+		}
+
+		// If the buffer is ready to be read from, read it back again, but not while the flash is busy since it can't be read until it's done.
+		if (buffer.ready_to_read && (flash_state == FLASH_IDLE))
 		{
 			// Read from flash into the buffer.  This blocks, with interrupts disabled, whilst the operation is in progress.
 			read_flash_page(buffer);
@@ -412,6 +439,93 @@ void set_bootloader_state(State new_state)
 	}
 }
 
+bool page_buffer_free(void)
+{
+	return !buffer.ready_to_write;
+}
+
+bool flash_idle(void)
+{
+	return !buffer.ready_to_write && (flash_state == FLASH_IDLE);
+}
+
+uint32_t get_flash_checksum(uint32_t address, uint32_t length)
+{
+	// Start off with all bits set, as the CRC-32 standard requires.
+	uint32_t crc = 0xFFFFFFFF;
+
+	// Work through the flash byte by byte.  A lookup table would be faster, but would take up more of the bootloader section than it's worth.
+	for (uint32_t i = 0; i < length; i++)
+	{
+		// Fold in the next byte of flash.
+		crc ^= READ_FLASH_BYTE(address + i);
+
+		// Divide through by the (reflected) polynomial, one bit at a time.
+		for (uint8_t bit = 0; bit < 8; bit++)
+		{
+			crc = (crc & 1) ? ((crc >> 1) ^ 0xEDB88320) : (crc >> 1);
+		}
+
+		// Touch the watchdog now and again, in case we've been asked for a large range.
+		if ((i & 0xFF) == 0xFF)
+		{
+			wdt_reset();
+		}
+	}
+
+	// All done.
+	return ~crc;
+}
+
+void fill_page(Firmware_page& buffer, const volatile uint8_t* data, uint8_t length)
+{
+	for (uint8_t i = 0; (i < length) && (buffer.current_byte < buffer.code_length); i++)
+	{
+		if (buffer.encoding == ENCODING_NONE)
+		{
+			// Plain data goes straight into the buffer.
+			buffer.data[buffer.current_byte++] = data[i];
+		}
+		else if (buffer.run_state == RUN_CONTROL)
+		{
+			// This is the start of a new run, so work out what sort it is and how long.
+			if (data[i] < 0x80)
+			{
+				buffer.run_state = RUN_LITERAL;
+				buffer.run_remaining = data[i] + 1;
+			}
+			else
+			{
+				buffer.run_state = RUN_REPEAT;
+				buffer.run_remaining = data[i] - 0x80 + 2;
+			}
+		}
+		else if (buffer.run_state == RUN_LITERAL)
+		{
+			// Literal bytes are copied across one at a time.
+			buffer.data[buffer.current_byte++] = data[i];
+			buffer.run_remaining--;
+			if (buffer.run_remaining == 0)
+			{
+				buffer.run_state = RUN_CONTROL;
+			}
+		}
+		else
+		{
+			// Expand the repeated byte, without running past the end of the page.
+			while ((buffer.run_remaining > 0) && (buffer.current_byte < buffer.code_length))
+			{
+				buffer.data[buffer.current_byte++] = data[i];
+				buffer.run_remaining--;
+			}
+			buffer.run_state = RUN_CONTROL;
+		}
+	}
+
+	// All done.
+	return;
+}
+
 void get_bootloader_information(Shared_bootloader_constants* bootloader_information)
 {
 	bootloader_information->bootloader_version = BOOTLOADER_VERSION;
@@ -527,11 +641,8 @@ void write_flash_page(Firmware_page& buffer)
 		// Wait until the EEPROM is ready.
 		eeprom_busy_wait();
 
-		// Erase the FLASH page that we are about to write.
-		boot_page_erase(buffer.page);
-		boot_spm_busy_wait();
-
-		// Set up the page of data to write, one word (two bytes) at at time.
+		// Set up the page of data to write, one word (two bytes) at at time.  Filling the temporary page buffer before the page is erased is allowed,
+		// and means the buffer can be released before the erase starts.
 		for (uint16_t i = 0; i < buffer.code_length; i += 2)
 		{
 			// Set up a little-endian word composed of the next two bytes of data to be written.
@@ -542,19 +653,48 @@ void write_flash_page(Firmware_page& buffer)
 			boot_page_fill((buffer.page + i), w);
 		}
 
-		// Write the temporary EEPROM page buffer to the FLASH.
-		boot_page_write(buffer.page);
-		boot_spm_busy_wait();
+		// Start erasing the FLASH page that we are about to write.  The write itself is started once this finishes.
+		boot_page_erase(buffer.page);
+		flash_page = buffer.page;
+		flash_state = FLASH_ERASING;
+	}
+	// Else something went terribly wrong, but we assume bootloader code always works.
 
-		// Reenable the RWW EEPROM again.
-		boot_rww_enable();
+	// Clear the buffer so that it may be used again, whether or not the page was valid, so that the bootloader doesn't get stuck on it.
+	buffer.ready_to_write = false;
+	buffer.page = 0;
+	buffer.current_byte = 0;
 
-		// Clear the buffer so that it may be used again.
-		buffer.ready_to_write = false;
-		buffer.page = 0;
-		buffer.current_byte = 0;
+	// Re-enable interrupts.
+	sei();
+
+	// All done.
+	return;
+}
+
+void continue_flash_page(void)
+{
+	// Nothing to do until the flash has finished whatever it's doing at the moment.
+	if (boot_spm_busy())
+	{
+		return;
+	}
+
+	// NOTE - The SPM instructions have to be issued within a few cycles of setting them up, so interrupts are disabled while we do.
+	cli();
+
+	if (flash_state == FLASH_ERASING)
+	{
+		// The page is erased, so write the temporary EEPROM page buffer to the FLASH.
+		boot_page_write(flash_page);
+		flash_state = FLASH_WRITING;
+	}
+	else
+	{
+		// The page is written, so reenable the RWW EEPROM again.
+		boot_rww_enable();
+		flash_state = FLASH_IDLE;
 	}
-	// Else something went terribly wrong, but we assume bootloader code always works.
 
 	// Re-enable interrupts.
 	sei();
@@ -52,6 +52,17 @@ enum State { IDLE, COMMUNICATING, ERROR };
 
 const uint16_t MODULE_EVENT_PERIOD = 1; // Time in milliseconds between calls of event_periodic() for the bootloader module.
 
+/**
+ *	The ways the data for a page may be encoded while it is being transferred.  RLE data is a series of runs, each starting with a control byte;
+ *	a control byte below 0x80 is followed by (control + 1) literal bytes, otherwise the single byte after it is repeated (control - 0x80 + 2) times.
+ */
+enum Page_encoding { ENCODING_NONE = 0, ENCODING_RLE = 1 };
+
+/**
+ *	Where the decoder is up to within the current RLE run, since a run may be split across several messages.
+ */
+enum Run_state { RUN_CONTROL, RUN_LITERAL, RUN_REPEAT };
+
 struct Firmware_page
 {
 		bool ready_to_write;
@@ -60,6 +71,9 @@ struct Firmware_page
 		uint16_t current_byte;
 		uint8_t data[SPM_PAGESIZE];
 		uint16_t code_length;
+		uint8_t encoding;
+		Run_state run_state;
+		uint8_t run_remaining;
 };
 
 class Bootloader_module
@@ -198,6 +212,54 @@ void get_device_signature(uint8_t* device_signature_array);
  */
 void set_bootloader_state(State new_state);
 
+/**
+ *	Checks whether the page buffer is free to be filled with a new page.  The flash programs one page while the next is being received, so this is
+ *	false while a received page is waiting for the flash to finish with the one before.
+ *
+ *	TAKES:		Nothing.
+ *
+ *	RETURNS:	True if a new page may be started, false if the command which starts it must wait.
+ */
+bool page_buffer_free(void);
+
+/**
+ *	Checks whether every page received has been programmed into flash.  Anything which reads the flash, or resets the microcontroller, must wait
+ *	until it has.
+ *
+ *	TAKES:		Nothing.
+ *
+ *	RETURNS:	True if the flash is idle, false if there is still a page waiting for it or being programmed.
+ */
+bool flash_idle(void);
+
+/**
+ *	Calculates a CRC-32 (the same one used by zlib) over a range of the application flash, so the host can tell whether it already holds
+ *	what the host was going to write, without reading it all back.
+ *
+ *	Blocks until the calculation is complete.
+ *
+ *	NOTE - There is no testing that the arguments provided are valid; the caller must make sure the range lies within the application section.
+ *
+ *	TAKES:		address		The address of the first byte to include.
+ *				length		The number of bytes to include.
+ *
+ *	RETURNS:	The CRC-32 of the flash contents.
+ */
+uint32_t get_flash_checksum(uint32_t address, uint32_t length);
+
+/**
+ *	Adds some more received data to a page buffer, decoding it first if the page is being sent encoded.  Data beyond the end of the page is ignored.
+ *
+ *	NOTE - The encoding and run state of the buffer must be set up before the first data for each page arrives.
+ *
+ *	TAKES:		buffer		The firmware_page being filled.
+ *				data		The received data.
+ *				length		The number of bytes of received data.
+ *
+ *	RETURNS:	Nothing.
+ */
+void fill_page(Firmware_page& buffer, const volatile uint8_t* data, uint8_t length);
+
 #endif // __BOOTLOADER_MODULE_H__
 
 // ALL DONE.
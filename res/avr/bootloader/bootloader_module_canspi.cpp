@@ -578,7 +578,7 @@ void bootloader_module_canspi::event_periodic()
 			}
 		}
 	}
-	else
+	else if (ready_for_message(reception_message.message_type))
 	{
 		communication_started = true;
 		
@@ -1024,8 +1024,12 @@ void bootloader_module_canspi::write_memory_procedure(Firmware_page& current_fir
 	current_firmware_page.code_length = (((static_cast<uint16_t>(reception_message.message[4])) << 8) | 
 										(static_cast<uint16_t>(reception_message.message[5])));
 
+	// A seventh byte, if present, says how the page data will be encoded.
+	current_firmware_page.encoding = (reception_message.dlc >= 7) ? reception_message.message[6] : ENCODING_NONE;
+	current_firmware_page.run_state = RUN_CONTROL;
+
 	// Check for errors in message details.
-	if ((current_firmware_page.code_length > SPM_PAGESIZE) || (current_firmware_page.page >= BOOTLOADER_START_ADDRESS))
+	if ((current_firmware_page.code_length > SPM_PAGESIZE) || (current_firmware_page.page >= BOOTLOADER_START_ADDRESS) || (current_firmware_page.encoding > ENCODING_RLE))
 	{
 		// Message failure.
 		message_confirmation_success = false;
@@ -1049,20 +1053,8 @@ void bootloader_module_canspi::write_data_procedure(Firmware_page& current_firmw
 	// Only wrtie to buffer if a memory address and length have been provided.
 	if(write_details_stored)
 	{
-		// Check for possible array overflow.
-		if ((current_firmware_page.current_byte + reception_message.dlc) > current_firmware_page.code_length)
-		{
-			reception_message.dlc = current_firmware_page.code_length - current_firmware_page.current_byte; // Limit the dlc.
-		}
-
-		// Store data from filter buffer(message data of 7 bytes) into the current_firmware_page(byte by byte).
-		for (uint8_t i = 0; i < reception_message.dlc; i++)
-		{
-			current_firmware_page.data[current_firmware_page.current_byte + i] = reception_message.message[i];
-		}
-
-		// Increment the current byte in buffer.
-		current_firmware_page.current_byte += reception_message.dlc;
+		// Store data from filter buffer(message data of 7 bytes) into the current_firmware_page, decoding it if need be.
+		fill_page(current_firmware_page, reception_message.message, reception_message.dlc);
 
 		// Check if the buffer is ready to be written to the flash.
 		if (current_firmware_page.current_byte >= (current_firmware_page.code_length))
@@ -1168,6 +1160,24 @@ void bootloader_module_canspi::send_flash_page(Firmware_page& current_firmware_p
 	return;
 }
 
+bool bootloader_module_canspi::ready_for_message(uint16_t message_type)
+{
+	switch (message_type)
+	{
+		case WRITE_DATA:
+			// Data for the current page can always be handled.
+			return true;
+
+		case WRITE_MEMORY:
+			// A new page can be received while the last one is being programmed, but no more than that.
+			return page_buffer_free();
+
+		default:
+			// Anything else might read the flash or reset, so must wait until everything received has been programmed.
+			return flash_idle();
+	}
+}
+
 void bootloader_module_canspi::filter_message(Firmware_page& current_firmware_page)
 {
 	// Determine the corresponding procedure for the received message.
@@ -126,6 +126,17 @@ class bootloader_module_canspi: public Bootloader_module
 
 		// Class methods.
 
+		/**
+		 *	Checks whether the bootloader is ready to handle a message of a given type yet.  Page data is always handled straight away, but a new page
+		 *	has to wait until the page buffer is free, and anything else until the flash is idle.  Leaving a command unhandled until then holds off its
+		 *	confirmation, which in turn holds off the uploader.
+		 *
+		 *	TAKES:		message_type	The type of the message waiting to be handled.
+		 *
+		 *	RETURNS:	True if the message can be handled now, false if it must wait.
+		 */
+		bool ready_for_message(uint16_t message_type);
+
 		/**
 		 *	Procedure when a REQUEST_RESET message is received. Either starts the application or resets the Bootloader.
 		 *
@@ -175,7 +175,11 @@ class Can_buffer_imp
 		
 		Can_send_status blocking_read(Can_message& msg);
 		 
-		Can_send_status write(Can_message msg);
+		Can_send_status write(const Can_message& msg);
+		
+		Can_send_status read_batch(Can_message* msgs, size_t count, size_t& num_read);
+		
+		Can_send_status write_batch(const Can_message* msgs, size_t count, size_t& num_written);
 		
 		uint8_t queue_length(void);
 		
@@ -246,6 +250,16 @@ class Can_imp
 		uint8_t get_num_buffers(void);
 
 		Can_buffer** get_buffers(void);
+		
+#if HAL_CAN_TX_QUEUE_ENABLE
+		Can_config_status attach_tx_queue(Can_id_buffer buffer);
+		
+		Can_config_status detach_tx_queue(Can_id_buffer buffer);
+		
+		Can_send_status queue_message(const Can_message& msg);
+		
+		uint8_t get_tx_queue_length(void);
+#endif
     
 	private:
 
@@ -422,8 +436,39 @@ volatile static IsrHandler chanIntFunc[CAN_NUM_CHAN_INT];
 volatile Can_id_buffer interrupt_service_buffer;
 volatile bool in_buffer_interrupt = false;
 
+#if HAL_CAN_TX_QUEUE_ENABLE
+/* A message waiting in the transmit queue, with its place in arbitration order. */
+struct Can_tx_entry
+{
+	Can_message msg;
+	uint32_t key;	// the arbitration field as it goes on the bus, so lower keys win
+	uint16_t seq;	// the order messages were queued in, to keep messages with the same key in order
+};
+
+/* The transmit queue is a binary heap, with the next message to send at the top.  It is only touched with interrupts disabled, or from the CAN ISR. */
+static Can_tx_entry tx_heap[CAN_TX_QUEUE_LENGTH];
+static uint8_t tx_heap_size = 0;
+static uint16_t tx_next_seq = 0;
+
+static uint16_t tx_queue_mobs = 0;					// MObs which belong to the queue
+static uint16_t tx_busy_mobs = 0;					// MObs which are sending a queued message
+static uint32_t tx_mob_keys[CAN_NUM_BUFFERS];		// the key of the message each busy MOb is sending
+#endif
+
 // DEFINE PRIVATE STATIC FUNCTION PROTOTYPES.
 
+#if HAL_CAN_TX_QUEUE_ENABLE
+static uint32_t can_tx_key(const Can_message& msg);
+
+static bool can_tx_before(const Can_tx_entry& a, const Can_tx_entry& b);
+
+static void can_tx_heap_pop(void);
+
+static bool can_tx_load(uint8_t mob);
+
+static void can_tx_refill(void);
+#endif
+
 // IMPLEMENT PUBLIC STATIC FUNCTIONS.
 
 // IMPLEMENT PUBLIC CLASS FUNCTIONS (METHODS).
@@ -531,11 +576,21 @@ Can_send_status Can_buffer::blocking_read(Can_message& message)
 	return imp->blocking_read(message);
 }
 
-Can_send_status Can_buffer::write(Can_message msg)
+Can_send_status Can_buffer::write(const Can_message& msg)
 {
 	return imp->write(msg);
 }
 
+Can_send_status Can_buffer::read_batch(Can_message* msgs, size_t count, size_t& num_read)
+{
+	return imp->read_batch(msgs, count, num_read);
+}
+
+Can_send_status Can_buffer::write_batch(const Can_message* msgs, size_t count, size_t& num_written)
+{
+	return imp->write_batch(msgs, count, num_written);
+}
+
 Can_config_status Can_buffer::free_message(void)
 {
 	return imp->free_message();
@@ -677,6 +732,28 @@ Can_buffer** Can::get_buffers(void)
 	return imp->get_buffers();
 }
 
+#if HAL_CAN_TX_QUEUE_ENABLE
+Can_config_status Can::attach_tx_queue(Can_id_buffer buffer)
+{
+	return imp->attach_tx_queue(buffer);
+}
+
+Can_config_status Can::detach_tx_queue(Can_id_buffer buffer)
+{
+	return imp->detach_tx_queue(buffer);
+}
+
+Can_send_status Can::queue_message(const Can_message& msg)
+{
+	return imp->queue_message(msg);
+}
+
+uint8_t Can::get_tx_queue_length(void)
+{
+	return imp->get_tx_queue_length();
+}
+#endif
+
 Can::~Can(void)
 {
 	// Some targets need to make calls to imp when falling out of scope, AVR doesn't, so do nothing.
@@ -687,6 +764,146 @@ Can::~Can(void)
 
 // IMPLEMENT PRIVATE STATIC FUNCTIONS.
 
+#if HAL_CAN_TX_QUEUE_ENABLE
+static uint32_t can_tx_key(const Can_message& msg)
+{
+	/* Lay the arbitration field out the way it goes on the bus: the base ID, then RTR (or SRR, which is recessive) and IDE, then the
+	 * extended ID and its RTR.  A standard frame then beats an extended frame with the same base ID, and a data frame beats a remote
+	 * frame, just as they do in arbitration. */
+	if (msg.ext)
+	{
+		return ((msg.id >> 18) << 21) | (1UL << 20) | (1UL << 19) | ((msg.id & 0x3FFFFUL) << 1) | (msg.rtr ? 1UL : 0UL);
+	}
+	else
+	{
+		return ((msg.id & 0x7FFUL) << 21) | (msg.rtr ? (1UL << 20) : 0UL);
+	}
+}
+
+static bool can_tx_before(const Can_tx_entry& a, const Can_tx_entry& b)
+{
+	if (a.key != b.key)
+	{
+		return (a.key < b.key);
+	}
+	
+	// The sequence numbers wrap, but there are never more than CAN_TX_QUEUE_LENGTH of them in the queue.
+	return (static_cast<int16_t>(a.seq - b.seq) < 0);
+}
+
+static void can_tx_heap_pop(void)
+{
+	tx_heap_size--;
+	if (tx_heap_size == 0)
+	{
+		return;
+	}
+	
+	/* move the last entry to the top and sift it down */
+	Can_tx_entry entry = tx_heap[tx_heap_size];
+	uint8_t i = 0;
+	
+	while (true)
+	{
+		uint8_t child = 2 * i + 1;
+		if (child >= tx_heap_size)
+		{
+			break;
+		}
+		if ((child + 1 < tx_heap_size) && can_tx_before(tx_heap[child + 1], tx_heap[child]))
+		{
+			child++;
+		}
+		if (!can_tx_before(tx_heap[child], entry))
+		{
+			break;
+		}
+		tx_heap[i] = tx_heap[child];
+		i = child;
+	}
+	tx_heap[i] = entry;
+	
+	// All done.
+	return;
+}
+
+static bool can_tx_load(uint8_t mob)
+{
+	const Can_tx_entry& next = tx_heap[0];
+	
+	/* The controller sends whichever pending MOb has the lowest ID, and the lowest numbered MOb out of those with the same ID, so a message
+	 * can't be loaded while one with the same key is still being sent, or they might go out of order. */
+	for (uint8_t i=0; i<CAN_NUM_BUFFERS; i++)
+	{
+		if ((tx_busy_mobs & (1U << i)) && (tx_mob_keys[i] == next.key))
+		{
+			return false;
+		}
+	}
+	
+	Can_set_mob(mob);	//select the corresponding MOb
+	Can_clear_status_mob();
+	CANCDMOB = 0x00;	// disables the MOb and clears the IDE and DLC
+	
+	/* set arbitration */
+	uint32_t id = next.msg.id;
+	if (next.msg.ext)
+	{
+		Can_set_ext_id(id);
+	}
+	else
+	{
+		CANIDT4 = 0x00;
+		Can_set_std_id(id);
+	}
+	if (next.msg.rtr)
+	{
+		Can_set_rtr();
+	}
+	else
+	{
+		Can_clear_rtr();
+	}
+	Can_set_dlc(next.msg.dlc);
+	
+	/* write to buffer */
+	for (uint8_t i=0; i<next.msg.dlc; i++)
+	{
+		CANMSG = next.msg.data[i];		// CANMSG is auto-incremented
+	}
+	
+	tx_busy_mobs |= (1U << mob);
+	tx_mob_keys[mob] = next.key;
+	can_tx_heap_pop();
+	
+	Can_config_tx();
+	
+	return true;
+}
+
+static void can_tx_refill(void)
+{
+	uint8_t canpage_copy = CANPAGE;
+	
+	/* give the messages at the top of the queue to any of the queue's MObs which are free */
+	for (uint8_t mob=0; (mob<CAN_NUM_BUFFERS) && (tx_heap_size > 0); mob++)
+	{
+		if ((tx_queue_mobs & ~tx_busy_mobs) & (1U << mob))
+		{
+			if (!can_tx_load(mob))
+			{
+				break;
+			}
+		}
+	}
+	
+	CANPAGE = canpage_copy;
+	
+	// All done.
+	return;
+}
+#endif
+
 // IMPLEMENT PRIVATE CLASS FUNCTIONS (METHODS).
 
 // Can_filmask.
@@ -992,7 +1209,51 @@ Can_config_status Can_buffer_imp::free_message(void)
 	return ret_code;
 }
 
-Can_send_status Can_buffer_imp::write(Can_message msg)
+Can_send_status Can_buffer_imp::read_batch(Can_message* msgs, size_t count, size_t& num_read)
+{
+	num_read = 0;
+	
+	if (count == 0)
+	{
+		return CAN_SND_SUCCESS;
+	}
+	
+	/* a MOb holds one message, so that is all there can be */
+	Can_send_status ret_code = read(msgs[0]);
+	if (ret_code != CAN_SND_SUCCESS)
+	{
+		return ret_code;
+	}
+	num_read = 1;
+	
+	/* free the MOb and set it receiving again, ready for the next message */
+	free_message();
+	set_mode(CAN_OBJ_RX);
+	
+	return (count > 1) ? CAN_SND_BUSY : CAN_SND_SUCCESS;
+}
+
+Can_send_status Can_buffer_imp::write_batch(const Can_message* msgs, size_t count, size_t& num_written)
+{
+	num_written = 0;
+	
+	if (count == 0)
+	{
+		return CAN_SND_SUCCESS;
+	}
+	
+	/* a MOb sends one message at a time, so the rest have to wait for it to finish */
+	Can_send_status ret_code = write(msgs[0]);
+	if (ret_code != CAN_SND_SUCCESS)
+	{
+		return ret_code;
+	}
+	num_written = 1;
+	
+	return (count > 1) ? CAN_SND_BUSY : CAN_SND_SUCCESS;
+}
+
+Can_send_status Can_buffer_imp::write(const Can_message& msg)
 {
 	Can_set_mob(buf_no);	//select the corresponding MOb	
 	
@@ -1873,6 +2134,116 @@ Can_buffer** Can_imp::get_buffers(void)
 	return buffers;
 }
 
+#if HAL_CAN_TX_QUEUE_ENABLE
+Can_config_status Can_imp::attach_tx_queue(Can_id_buffer buffer)
+{
+	if (buffer >= CAN_NUM_BUFFERS)
+	{
+		return CAN_CFG_FAILED;
+	}
+	
+	// This may be called with interrupts already disabled, so put SREG back afterwards rather than just enabling them again.
+	uint8_t sreg_copy = SREG;
+	cli();
+	
+	uint8_t canpage_copy = CANPAGE;
+	
+	/* free the MOb, and enable its transmit complete interrupt so the ISR can refill it */
+	buffers[buffer]->clear_status();
+	buffers[buffer]->set_mode(CAN_OBJ_DISABLE);
+	buffers[buffer]->enable_interrupt();
+	CANGIE |= (1<<ENTX);
+	
+	tx_queue_mobs |= (1U << buffer);
+	
+	CANPAGE = canpage_copy;
+	
+	/* there may already be messages waiting */
+	can_tx_refill();
+	
+	SREG = sreg_copy;
+	
+	return CAN_CFG_SUCCESS;
+}
+
+Can_config_status Can_imp::detach_tx_queue(Can_id_buffer buffer)
+{
+	if (buffer >= CAN_NUM_BUFFERS)
+	{
+		return CAN_CFG_FAILED;
+	}
+	
+	Can_config_status ret_code = CAN_CFG_SUCCESS;
+	
+	uint8_t sreg_copy = SREG;
+	cli();
+	
+	if (tx_busy_mobs & (1U << buffer))
+	{
+		ret_code = CAN_CFG_IMMUTABLE;	// still sending, try again once it has finished
+	}
+	else if (tx_queue_mobs & (1U << buffer))
+	{
+		tx_queue_mobs &= ~(1U << buffer);
+		buffers[buffer]->disable_interrupt();
+	}
+	
+	SREG = sreg_copy;
+	
+	return ret_code;
+}
+
+Can_send_status Can_imp::queue_message(const Can_message& msg)
+{
+	if (msg.dlc > 8)
+	{
+		return CAN_SND_DLCERR;
+	}
+	
+	Can_tx_entry entry;
+	entry.msg = msg;
+	entry.key = can_tx_key(msg);
+	
+	// This may be called from an interrupt handler, so put SREG back afterwards rather than just enabling interrupts again.
+	uint8_t sreg_copy = SREG;
+	cli();
+	
+	if (tx_heap_size >= CAN_TX_QUEUE_LENGTH)
+	{
+		SREG = sreg_copy;
+		return CAN_SND_TXFULL;
+	}
+	
+	entry.seq = tx_next_seq++;
+	
+	/* add the entry at the bottom of the heap and sift it up */
+	uint8_t i = tx_heap_size++;
+	while (i > 0)
+	{
+		uint8_t parent = (i - 1) / 2;
+		if (!can_tx_before(entry, tx_heap[parent]))
+		{
+			break;
+		}
+		tx_heap[i] = tx_heap[parent];
+		i = parent;
+	}
+	tx_heap[i] = entry;
+	
+	/* if any of the queue's MObs are free, start sending straight away */
+	can_tx_refill();
+	
+	SREG = sreg_copy;
+	
+	return CAN_SND_SUCCESS;
+}
+
+uint8_t Can_imp::get_tx_queue_length(void)
+{
+	return tx_heap_size;
+}
+#endif
+
 // IMPLEMENT INTERRUPT SERVICE ROUTINES.
 
 /* NOTE - HAL functions not used here because of speed and also because they cannot be accessed from here. */
@@ -1880,6 +2251,9 @@ Can_buffer** Can_imp::get_buffers(void)
 // CAN transfer complete or error vector
 SIGNAL(GEN_CAN_IT_VECT)
 {	
+	/* the interrupted code may be partway through accessing a MOb, so its page has to be put back afterwards */
+	uint8_t canpage_copy = CANPAGE;
+	
 	/* find out whether a mob interrupt occured */
 	uint8_t canhpmob_copy = CANHPMOB;
 	
@@ -1890,18 +2264,36 @@ SIGNAL(GEN_CAN_IT_VECT)
 		CANPAGE = CANHPMOB;
 		interrupt_service_buffer = static_cast<Can_id_buffer>(canhpmob_copy>>4);
 		
-		/* check MOb status and check whether the callback pointer valid before executing */
-		if ((CANSTMOB & MOB_RX_COMPLETED) && (bufIntFunc[interrupt_service_buffer][CAN_RX_COMPLETE]))
-		{
-			bufIntFunc[interrupt_service_buffer][CAN_RX_COMPLETE]();
-		}
-		if ((CANSTMOB & MOB_TX_COMPLETED) && (bufIntFunc[interrupt_service_buffer][CAN_TX_COMPLETE]))
+#if HAL_CAN_TX_QUEUE_ENABLE
+		if (tx_queue_mobs & (1U << interrupt_service_buffer))
 		{
-			bufIntFunc[interrupt_service_buffer][CAN_TX_COMPLETE]();
+			/* The MOb belongs to the transmit queue, so there are no callbacks to run.  After an error the controller retries by itself, so
+			 * the MOb is only free again once the message has gone. */
+			uint8_t canstmob_copy = CANSTMOB;
+			Can_clear_status_mob();
+			
+			if (canstmob_copy & MOB_TX_COMPLETED)
+			{
+				tx_busy_mobs &= ~(1U << interrupt_service_buffer);
+				can_tx_refill();
+			}
 		}
-		if ((CANSTMOB & ERR_MOB_MSK) && (bufIntFunc[interrupt_service_buffer][CAN_GEN_ERROR]))
+		else
+#endif
 		{
-			bufIntFunc[interrupt_service_buffer][CAN_GEN_ERROR]();
+			/* check MOb status and check whether the callback pointer valid before executing */
+			if ((CANSTMOB & MOB_RX_COMPLETED) && (bufIntFunc[interrupt_service_buffer][CAN_RX_COMPLETE]))
+			{
+				bufIntFunc[interrupt_service_buffer][CAN_RX_COMPLETE]();
+			}
+			if ((CANSTMOB & MOB_TX_COMPLETED) && (bufIntFunc[interrupt_service_buffer][CAN_TX_COMPLETE]))
+			{
+				bufIntFunc[interrupt_service_buffer][CAN_TX_COMPLETE]();
+			}
+			if ((CANSTMOB & ERR_MOB_MSK) && (bufIntFunc[interrupt_service_buffer][CAN_GEN_ERROR]))
+			{
+				bufIntFunc[interrupt_service_buffer][CAN_GEN_ERROR]();
+			}
 		}
 		
 		// user must clear interrupt flag on their callback function
@@ -1913,6 +2305,8 @@ SIGNAL(GEN_CAN_IT_VECT)
 	{
 		chanIntFunc[CAN_BUS_OFF]();
 	}
+	
+	CANPAGE = canpage_copy;
 }
 
 // CAN timer overrun vector
@@ -148,6 +148,15 @@ enum Can_bank_mode {CAN_BNK_MODE_FM};
 enum Can_buffer_interrupt_type {CAN_RX_COMPLETE, CAN_TX_COMPLETE, CAN_GEN_ERROR};
 enum Can_channel_interrupt_type {CAN_BUS_OFF, CAN_TIME_OVERRUN};
 
+// Messages can be queued in software, to be sent from whichever MObs are given to the queue.  The queue takes RAM and a branch in the CAN
+// interrupt, so it is only built when the application defines HAL_CAN_TX_QUEUE_ENABLE as true in its build flags.
+#ifndef HAL_CAN_TX_QUEUE_ENABLE
+	#define HAL_CAN_TX_QUEUE_ENABLE false
+#endif
+#ifndef CAN_TX_QUEUE_LENGTH
+	#define CAN_TX_QUEUE_LENGTH 16
+#endif
+
 // This shows which pins have External Interrupts, and which have pin change interrupts assignable. The AT90CAN128 has 6 ports each with 8 pins. It only has external interrupt pins and no pin-change interrupts.
 static const int_bank_t PC_INT[NUM_PORTS][NUM_PINS] =
 						   {{PCINT_NONE, PCINT_NONE, PCINT_NONE, PCINT_NONE, PCINT_NONE, PCINT_NONE, PCINT_NONE, PCINT_NONE},	// A
@@ -64,6 +64,9 @@ extern "C" {
 #define CANID_WRITE_DATA (CANID_BASE_ID + 3)
 #define CANID_READ_MEMORY (CANID_BASE_ID + 4)
 #define CANID_READ_DATA (CANID_BASE_ID + 5)
+#define CANID_SET_WINDOW (CANID_BASE_ID + 6)
+#define CANID_PAGE_CHECKSUM (CANID_BASE_ID + 7)
+#define CANID_ERASE_MEMORY (CANID_BASE_ID + 8)
 
 #endif // __<<<TC_INSERTS_UC_FILE_BASENAME_HERE>>>_H__
 
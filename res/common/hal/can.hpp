@@ -114,6 +114,16 @@
 	#include "hal/spi.hpp"
 #endif
 
+// Targets which can tell when each message arrived turn this on in target_config.hpp.
+#ifndef HAL_CAN_TIMESTAMPS_ENABLE
+	#define HAL_CAN_TIMESTAMPS_ENABLE false
+#endif
+
+// Targets which can queue messages to send in software leave this for the application to turn on in its build flags.
+#ifndef HAL_CAN_TX_QUEUE_ENABLE
+	#define HAL_CAN_TX_QUEUE_ENABLE false
+#endif
+
 // DEFINE PUBLIC MACROS.
 
 // SELECT NAMESPACES.
@@ -201,6 +211,33 @@ typedef struct
 	uint32_t     :  1;	// Fill to 32 bits.
 } Can_filmask_value;
 
+#if HAL_CAN_TIMESTAMPS_ENABLE
+
+// Number of buckets in a latency histogram, bucket n counts samples under 2^n us, and the last takes anything longer.
+#define CAN_HISTOGRAM_BUCKETS 24
+
+// The latencies which each buffer keeps a histogram of.
+enum Can_histogram_type {CAN_HIST_INTERARRIVAL, CAN_HIST_TX_ECHO, CAN_NB_HIST};
+
+// Time a message was received.
+typedef struct
+{
+	uint64_t ns;		// Nanoseconds since the epoch, or on the hardware's own clock.
+	bool hardware;		// Flag indicating whether the time was taken by the CAN hardware rather than by the software receiving it.
+} Can_timestamp;
+
+// Histogram of latencies, with buckets that double in width.
+typedef struct
+{
+	uint32_t buckets[CAN_HISTOGRAM_BUCKETS];
+	uint32_t count;
+	uint64_t total_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+} Can_histogram;
+
+#endif
+
 /**
  * CAN filter/mask class; abstracts either a binary filter or mask which selects which incoming CAN messages are accepted into an attached buffer.
  */
@@ -402,7 +439,30 @@ class Can_buffer
 		 * @param   msg    Message to write to the buffer.
 		 * @return  Nothing.
 		 */
-		Can_send_status write(Can_message msg);
+		Can_send_status write(const Can_message& msg);
+		
+		/**
+		 * Gets as many waiting messages as will fit into an array, without waiting for more.  On targets with a FIFO behind each buffer this
+		 * takes many messages for the cost of one call; where a buffer holds only one message, at most one is read, and the buffer is freed
+		 * to receive the next.
+		 * 
+		 * @param	msgs		Array to store the returned messages.
+		 * @param	count		Number of messages the array can hold.
+		 * @param	num_read	Set to the number of messages read.
+		 * @return	Return code for the first message which couldn't be read (CAN_SND_BUSY once there are no more), or success if all were.
+		 */
+		Can_send_status read_batch(Can_message* msgs, size_t count, size_t& num_read);
+		
+		/**
+		 * Writes messages to buffer in order, stopping at the first which can't be written.  Where a buffer sends only one message at a time,
+		 * at most one is written.
+		 * 
+		 * @param	msgs		Messages to write to the buffer.
+		 * @param	count		Number of messages to write.
+		 * @param	num_written	Set to the number of messages written.
+		 * @return	Return code for the first message which couldn't be written, or success if all were.
+		 */
+		Can_send_status write_batch(const Can_message* msgs, size_t count, size_t& num_written);
 		
 		/**
 		 * Reset status register of buffer
@@ -473,6 +533,33 @@ class Can_buffer
 		*/
 		Can_int_status clear_interrupt_flags(Can_buffer_interrupt_type interrupt);
 		
+#if HAL_CAN_TIMESTAMPS_ENABLE
+		/**
+		* Returns the time the last message read from this buffer was received.
+		* 
+		* @param	Nothing.
+		* @return	The time the message was received.
+		*/
+		Can_timestamp get_timestamp(void);
+		
+		/**
+		* Returns a copy of one of the latency histograms this buffer keeps: the time between messages arriving, or the time from writing a
+		* message until it has been sent on the bus.
+		* 
+		* @param	type	The histogram to return.
+		* @return	The histogram.
+		*/
+		Can_histogram get_histogram(Can_histogram_type type);
+		
+		/**
+		* Empties all of the latency histograms this buffer keeps.
+		* 
+		* @param	Nothing.
+		* @return	Nothing.
+		*/
+		void clear_histograms(void);
+#endif
+		
 	private:
 		
 		// Methods.
@@ -610,6 +697,44 @@ class Can
 		 * @return	Array of buffers in this controller.
 		 */
 		Can_buffer** get_buffers(void);
+		
+#if HAL_CAN_TX_QUEUE_ENABLE
+		/**
+		 * Hands a buffer over to the transmit queue, which then uses it to send queued messages.  The buffer shouldn't be used directly, or
+		 * have interrupts attached to it, until it is detached again.  The queue is refilled from the transmit complete interrupt, so
+		 * interrupts must be enabled for this controller for queued messages to be sent.
+		 *
+		 * @param	buffer	The buffer to give to the queue.
+		 * @return	Whether the buffer could be given to the queue.
+		 */
+		Can_config_status attach_tx_queue(Can_id_buffer buffer);
+		
+		/**
+		 * Takes a buffer back from the transmit queue.  This fails while the buffer is still sending a queued message.
+		 *
+		 * @param	buffer	The buffer to take back from the queue.
+		 * @return	Whether the buffer could be taken back from the queue.
+		 */
+		Can_config_status detach_tx_queue(Can_id_buffer buffer);
+		
+		/**
+		 * Adds a message to the transmit queue, without waiting for it to be sent.  Queued messages are sent in arbitration order, so the
+		 * message with the lowest ID goes first, and messages with the same ID go in the order they were queued.  May be called from
+		 * interrupt handlers.
+		 *
+		 * @param	msg		The message to send.
+		 * @return	CAN_SND_SUCCESS if the message was queued, or CAN_SND_TXFULL if the queue is full.
+		 */
+		Can_send_status queue_message(const Can_message& msg);
+		
+		/**
+		 * Returns the number of messages in the transmit queue which haven't yet been given to a buffer to send.
+		 *
+		 * @param	Nothing.
+		 * @return	The number of messages waiting in the queue.
+		 */
+		uint8_t get_tx_queue_length(void);
+#endif
     
 	private:
 	
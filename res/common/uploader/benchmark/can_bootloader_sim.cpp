@@ -0,0 +1,163 @@
+// Copyright (C) 2012  Unison Networks Ltd
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+/********************************************************************************************************************************
+ *
+ *  FILE: 		can_bootloader_sim.cpp
+ *
+ *  SUB-SYSTEM:		flashing tools
+ *
+ *  COMPONENT:		Benchmarks
+ *
+ *  AUTHOR: 		agent
+ *
+ *  DATE CREATED:	17-10-2026
+ *
+ *	Runs a simulated CAN bootloader node on a SocketCAN interface (usually vcan), so the uploader can be run against it with can-type=socket exactly
+ *	as it would be against real hardware.  Run one of these per node, with a different target each, to simulate a fleet.
+ *
+ *	Usage: can_bootloader_sim <iface> target=<node ID> [sim-...=<value> ...]
+ *
+ ********************************************************************************************************************************/
+
+// INCLUDE REQUIRED HEADER FILES.
+
+#include <iostream>
+#include <string>
+
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include "../canbootloadersimulator.hpp"
+#include "../socketcannetworkinterface.hpp"
+#include "../util.hpp"
+
+#include "gen/can_messages.h"
+
+// DEFINE PRIVATE MACROS.
+
+// Longest to wait for the uploader when no replies are waiting to go, in ms.
+#define POLL_TIMEOUT 100
+
+// Timeout for sending a reply, in ms.
+#define SEND_TIMEOUT 1000
+
+// DECLARE PRIVATE GLOBAL VARIABLES.
+
+static volatile sig_atomic_t quit = 0;
+
+// DECLARE PRIVATE FUNCTION PROTOTYPES.
+
+void handle_signal(int signal);
+
+// IMPLEMENT MAIN FUNCTION.
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		std::cerr << "Usage: " << argv[0] << " <iface> target=<node ID> [sim-...=<value> ...]" << std::endl;
+		return 1;
+	}
+	Params params;
+	params["iface"] = argv[1];
+	for (int i = 2; i < argc; i++)
+	{
+		std::string param = argv[i];
+		size_t equals = param.find('=');
+		if (equals == std::string::npos)
+		{
+			std::cerr << "Parameters must be given as key=value: " << param << std::endl;
+			return 1;
+		}
+		params[param.substr(0, equals)] = param.substr(equals + 1);
+	}
+
+	CAN_bootloader_simulator simulator;
+	Socket_CAN_network_interface bus;
+	if (!simulator.init(params) || !bus.init(params))
+	{
+		return 1;
+	}
+
+	// Only listen for commands from the uploader, not the replies of any other simulated nodes.
+	if (!bus.set_filter_mode(CAN_network_interface::EXCLUDE_ALL_BUT_FILTER) ||
+		!bus.set_filter(CANID_REQUEST_RESET, CAN_network_interface::INCLUDE) ||
+		!bus.set_filter(CANID_GET_INFO, CAN_network_interface::INCLUDE) ||
+		!bus.set_filter(CANID_WRITE_MEMORY, CAN_network_interface::INCLUDE) ||
+		!bus.set_filter(CANID_WRITE_DATA, CAN_network_interface::INCLUDE) ||
+		!bus.set_filter(CANID_READ_MEMORY, CAN_network_interface::INCLUDE) ||
+		!bus.set_filter(CANID_READ_DATA, CAN_network_interface::INCLUDE) ||
+		!bus.set_filter(CANID_SET_WINDOW, CAN_network_interface::INCLUDE) ||
+		!bus.set_filter(CANID_PAGE_CHECKSUM, CAN_network_interface::INCLUDE) ||
+		!bus.set_filter(CANID_ERASE_MEMORY, CAN_network_interface::INCLUDE))
+	{
+		std::cerr << "Failed to set filter" << std::endl;
+		return 1;
+	}
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	std::string node = (params.find("sim-node") != params.end()) ? params["sim-node"] : params["target"];
+	std::cout << "Simulating node " << node << " on " << argv[1] << ", press Ctrl-C to stop." << std::endl;
+
+	while (!quit)
+	{
+		// Send every reply which is due.
+		timespec now;
+		timespec due;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		CAN_message msg;
+		while (simulator.next_message_due(due) && (elapsed_nanoseconds(now, due) == 0))
+		{
+			simulator.pop_message(msg);
+			if (!bus.send_message(msg, SEND_TIMEOUT))
+			{
+				std::cerr << "Failed to send reply." << std::endl;
+			}
+		}
+
+		// Wait for the uploader until the next reply is due.  Receive timeouts are only in ms, so the last part of the wait is slept instead.
+		uint32_t timeout = POLL_TIMEOUT;
+		if (simulator.next_message_due(due))
+		{
+			timeout = elapsed_nanoseconds(now, due) / 1000000;
+			if (timeout == 0)
+			{
+				while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR && !quit)
+				{
+					// Keep sleeping.
+				}
+				continue;
+			}
+		}
+		if (bus.receive_message(msg, timeout))
+		{
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			simulator.receive_message(msg, now);
+		}
+	}
+	simulator.print_stats();
+	return 0;
+}
+
+// IMPLEMENT PRIVATE FUNCTIONS.
+
+void handle_signal(int)
+{
+	quit = 1;
+}
+
+//ALL DONE.
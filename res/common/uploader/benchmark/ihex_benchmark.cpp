@@ -0,0 +1,131 @@
+// Copyright (C) 2012  Unison Networks Ltd
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+/********************************************************************************************************************************
+ *
+ *  FILE: 		ihex_benchmark.cpp
+ *
+ *  SUB-SYSTEM:		flashing tools
+ *
+ *  COMPONENT:		Benchmarks
+ *
+ *  AUTHOR: 		agent
+ *
+ *  DATE CREATED:	17-10-2026
+ *
+ *	Times loading an Intel HEX file with the memory mapped loader against the original line by line one, and checks they agree.
+ *
+ *	Usage: ihex_benchmark <file.hex> [memory size in bytes] [iterations]
+ *
+ ********************************************************************************************************************************/
+
+// INCLUDE REQUIRED HEADER FILES.
+
+#include <iostream>
+#include <string>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../memory.hpp"
+#include "../util.hpp"
+
+// DEFINE PRIVATE MACROS.
+
+// Big enough for the largest ARM targets we load.
+#define DEFAULT_MEMORY_SIZE (2*1024*1024)
+
+#define DEFAULT_ITERATIONS 20
+
+// DECLARE PRIVATE FUNCTION PROTOTYPES.
+
+double time_loader(std::string filename, size_t memory_size, int iterations, bool by_line, Memory_map& result);
+
+// IMPLEMENT MAIN FUNCTION.
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		std::cerr << "Usage: " << argv[0] << " <file.hex> [memory size in bytes] [iterations]" << std::endl;
+		return 1;
+	}
+	std::string filename = argv[1];
+	size_t memory_size = (argc > 2) ? strtoul(argv[2], NULL, 0) : DEFAULT_MEMORY_SIZE;
+	int iterations = (argc > 3) ? atoi(argv[3]) : DEFAULT_ITERATIONS;
+	if (memory_size == 0 || iterations <= 0)
+	{
+		std::cerr << "Invalid memory size or iteration count" << std::endl;
+		return 1;
+	}
+
+	Memory_map by_line(memory_size, Memory_map::FLASH);
+	Memory_map mapped(memory_size, Memory_map::FLASH);
+	double by_line_time = time_loader(filename, memory_size, iterations, true, by_line);
+	double mapped_time = time_loader(filename, memory_size, iterations, false, mapped);
+	if (by_line_time < 0 || mapped_time < 0)
+	{
+		return 1;
+	}
+
+	// Both loaders have to end up with exactly the same image.
+	if (by_line.get_extents() != mapped.get_extents())
+	{
+		std::cerr << "Loaders disagree on which memory is allocated" << std::endl;
+		return 1;
+	}
+	const Memory_map::Extent_map& extents = mapped.get_extents();
+	for (Memory_map::Extent_map::const_iterator it = extents.begin(); it != extents.end(); ++it)
+	{
+		if (memcmp(by_line.get_memory() + it->first, mapped.get_memory() + it->first, it->second - it->first) != 0)
+		{
+			std::cerr << "Loaders disagree between addresses: " << it->first << " and " << it->second << std::endl;
+			return 1;
+		}
+	}
+
+	std::cout << "Line by line: " << by_line_time * 1000 << " ms per load" << std::endl;
+	std::cout << "Mapped:       " << mapped_time * 1000 << " ms per load" << std::endl;
+	std::cout << "Speedup:      " << by_line_time / mapped_time << "x" << std::endl;
+	return 0;
+}
+
+// IMPLEMENT PRIVATE FUNCTIONS.
+
+double time_loader(std::string filename, size_t memory_size, int iterations, bool by_line, Memory_map& result)
+{
+	double total = 0;
+	for (int i = 0; i < iterations; i++)
+	{
+		// Start from a fresh map each time, the same as the uploader does, but keep the last image so the two loaders can be compared.
+		Memory_map scratch(memory_size, Memory_map::FLASH);
+		Memory_map& memory = (i == iterations - 1) ? result : scratch;
+		timespec start;
+		timespec end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		bool loaded = by_line ? memory.read_from_ihex_file_by_line(filename) : memory.read_from_ihex_file(filename);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (!loaded)
+		{
+			std::cerr << "Failed to read input file: " << filename << std::endl;
+			return -1;
+		}
+		total += elapsed_nanoseconds(start, end) / 1e9;
+	}
+	return total / iterations;
+}
+
+//ALL DONE.
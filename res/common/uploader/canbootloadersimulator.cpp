@@ -0,0 +1,870 @@
+// Copyright (C) 2012  Unison Networks Ltd
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+/********************************************************************************************************************************
+ *
+ *  FILE: 		canbootloadersimulator.cpp
+ *
+ *  SUB-SYSTEM:		flashing tools
+ *
+ *  COMPONENT:		CAN Interface
+ *
+ *  AUTHOR: 		agent
+ *
+ *  DATE CREATED:	17-10-2026
+ *
+ *	Implementation of the simulated CAN bootloader.  The message handling follows bootloader_module_can.cpp from the AVR bootloader, so the two
+ *	should be changed together.
+ *
+ ********************************************************************************************************************************/
+
+// INCLUDE THE MATCHING HEADER FILE.
+
+#include "canbootloadersimulator.hpp"
+
+// INCLUDE IMPLEMENTATION SPECIFIC HEADER FILES.
+
+#include <iostream>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "gen/can_messages.h"
+
+// DEFINE PRIVATE MACROS.
+
+// How page data is encoded, as given in the last byte of a long WRITE_MEMORY command.
+#define ENCODING_NONE 0
+#define ENCODING_RLE 1
+
+// Number of messages the bootloader can hold before handling them.  One slot is always left empty, so one fewer than this can actually wait.
+#define RECEPTION_QUEUE_SIZE 16
+
+// DEFINE PRIVATE TYPES AND STRUCTS.
+
+// DECLARE IMPORTED GLOBAL VARIABLES.
+
+// DECLARE PRIVATE GLOBAL VARIABLES.
+
+// DEFINE PRIVATE FUNCTION PROTOTYPES.
+
+bool read_number(Params& params, std::string name, int base, unsigned long maximum, unsigned long& value);
+
+bool read_time(Params& params, std::string name, uint64_t& time);
+
+uint64_t to_nanoseconds(const timespec& time);
+
+// IMPLEMENT PUBLIC FUNCTIONS.
+
+CAN_bootloader_simulator::CAN_bootloader_simulator() :
+	node_id(0),
+	signature(0x1E9781),
+	version(0x0102),
+	max_window(RECEPTION_QUEUE_SIZE - 1),
+	checksum_supported(true),
+	fd_supported(false),
+	page_size(256),
+	sector_size(0),
+	latency(100000),
+	frame_time(130000),
+	fd_frame_time(30000),
+	fd_byte_time(2000),
+	erase_time(4000000),
+	write_time(4000000),
+	checksum_time(5000),
+	boot_time(20000000),
+	drop_rate(0),
+	seed(1),
+	window_size(0),
+	expected_sequence(0),
+	sequence_error_reported(false),
+	write_details_stored(false),
+	page_completed(false),
+	page_address(0),
+	code_length(0),
+	current_byte(0),
+	encoding(ENCODING_NONE),
+	run_state(RUN_CONTROL),
+	run_remaining(0),
+	reading(false),
+	read_address(0),
+	read_length(0),
+	read_offset(0),
+	read_sequence(0),
+	read_acknowledged(0),
+	to_node_free(0),
+	to_host_free(0),
+	handled(0),
+	page_buffer_free(0),
+	flash_idle(0),
+	frames_received(0),
+	frames_sent(0),
+	frames_dropped(0),
+	queue_overflows(0),
+	pages_programmed(0)
+{
+	// Nothing to do here.
+}
+
+bool CAN_bootloader_simulator::init(Params params)
+{
+	// The node answers to the same ID the uploader is looking for, unless told otherwise.
+	std::string node = (params.find("sim-node") != params.end()) ? params["sim-node"] : params["target"];
+	char* end;
+	unsigned long value = strtoul(node.c_str(), &end, 16);
+	if (node.empty() || (*end != '\0') || (value > 0xFF))
+	{
+		std::cerr << "No valid node ID given for the simulated bootloader." << std::endl;
+		return false;
+	}
+	node_id = value;
+
+	unsigned long flash_size = 0x1E000;
+	unsigned long window = max_window;
+	unsigned long page_bytes = page_size;
+	unsigned long sector_bytes = sector_size;
+	value = signature;
+	if (!read_number(params, "sim-signature", 16, 0xFFFFFFFF, value) ||
+		!read_number(params, "sim-window", 10, RECEPTION_QUEUE_SIZE - 1, window) ||
+		!read_number(params, "sim-page-size", 10, 0xFFFF, page_bytes) ||
+		!read_number(params, "sim-sector-size", 10, 0xFFFFFF, sector_bytes) ||
+		!read_number(params, "sim-flash-size", 16, 0xFFFFFFFF, flash_size) ||
+		!read_time(params, "sim-latency", latency) ||
+		!read_time(params, "sim-frame-time", frame_time) ||
+		!read_time(params, "sim-fd-frame-time", fd_frame_time) ||
+		!read_time(params, "sim-fd-byte-time", fd_byte_time) ||
+		!read_time(params, "sim-erase-time", erase_time) ||
+		!read_time(params, "sim-write-time", write_time) ||
+		!read_time(params, "sim-crc-time", checksum_time) ||
+		!read_time(params, "sim-boot-time", boot_time))
+	{
+		return false;
+	}
+	signature = value;
+	max_window = window;
+	page_size = page_bytes;
+	sector_size = sector_bytes;
+	if (page_size == 0)
+	{
+		std::cerr << "Invalid sim-page-size parameter." << std::endl;
+		return false;
+	}
+	if (params.find("sim-version") != params.end())
+	{
+		unsigned int major;
+		unsigned int minor;
+		char extra;
+		if ((sscanf(params["sim-version"].c_str(), "%u.%u%c", &major, &minor, &extra) != 2) || (major > 0xFF) || (minor > 0xFF))
+		{
+			std::cerr << "Invalid sim-version parameter." << std::endl;
+			return false;
+		}
+		version = (major << 8) | minor;
+	}
+	if (params.find("sim-checksum") != params.end())
+	{
+		if (params["sim-checksum"] == "off")
+		{
+			checksum_supported = false;
+		}
+		else if (params["sim-checksum"] != "on")
+		{
+			std::cerr << "Invalid sim-checksum parameter." << std::endl;
+			return false;
+		}
+	}
+	if (params.find("sim-fd") != params.end())
+	{
+		if (params["sim-fd"] == "on")
+		{
+			fd_supported = true;
+		}
+		else if (params["sim-fd"] != "off")
+		{
+			std::cerr << "Invalid sim-fd parameter." << std::endl;
+			return false;
+		}
+	}
+	if (params.find("sim-drop") != params.end())
+	{
+		drop_rate = strtod(params["sim-drop"].c_str(), &end) / 100;
+		if ((*end != '\0') || (drop_rate < 0) || (drop_rate > 1))
+		{
+			std::cerr << "Invalid sim-drop parameter." << std::endl;
+			return false;
+		}
+	}
+	value = seed;
+	if (!read_number(params, "sim-seed", 10, 0xFFFFFFFF, value))
+	{
+		return false;
+	}
+	seed = value;
+
+	// Flash starts off erased.
+	flash.assign(flash_size, 0xFF);
+	page.resize(page_size);
+	return true;
+}
+
+void CAN_bootloader_simulator::receive_message(const CAN_message& msg, const timespec& sent)
+{
+	// The message has to get through the uploader's adapter, then wait its turn on the bus.
+	uint64_t on_bus = to_nanoseconds(sent) + latency;
+	if (on_bus < to_node_free)
+	{
+		on_bus = to_node_free;
+	}
+	uint64_t arrival = on_bus + frame_duration(msg);
+	to_node_free = arrival;
+	frames_received++;
+	if (frame_lost())
+	{
+		return;
+	}
+
+	// A classic CAN controller can't receive CAN-FD frames at all.
+	if (msg.is_fd() && !fd_supported)
+	{
+		return;
+	}
+
+	// The bootloader's CAN controller only lets through messages for this node.
+	if ((msg.get_length() < 1) || (msg.get_data()[0] != node_id))
+	{
+		return;
+	}
+
+	// Messages wait in the reception queue until the bootloader is ready for them, in the same order they arrived.
+	uint64_t now = (arrival > handled) ? arrival : handled;
+	switch (msg.get_id())
+	{
+		case CANID_WRITE_DATA:
+		case CANID_READ_DATA:
+			// Data for the current page, or a confirmation of data we sent, can always be handled.
+			break;
+
+		case CANID_WRITE_MEMORY:
+			// A new page can be received while the last one is being programmed, but no more than that.
+			now = (now > page_buffer_free) ? now : page_buffer_free;
+			break;
+
+		case CANID_REQUEST_RESET:
+		case CANID_GET_INFO:
+		case CANID_READ_MEMORY:
+		case CANID_SET_WINDOW:
+		case CANID_PAGE_CHECKSUM:
+		case CANID_ERASE_MEMORY:
+			// Anything else might read the flash or reset, so must wait until everything received has been programmed.
+			now = (now > flash_idle) ? now : flash_idle;
+			break;
+
+		default:
+			// This isn't a message the bootloader listens for.
+			return;
+	}
+
+	// Forget about anything which has already been handled by the time this arrives, then see if there is room for this message.
+	while (!reception_queue.empty() && (reception_queue.front() <= arrival))
+	{
+		reception_queue.pop_front();
+	}
+	if (reception_queue.size() >= (RECEPTION_QUEUE_SIZE - 1))
+	{
+		// The bootloader has no choice but to discard the message.
+		queue_overflows++;
+		return;
+	}
+	reception_queue.push_back(now);
+	handled = now;
+	handle_message(msg, now);
+}
+
+bool CAN_bootloader_simulator::next_message_due(timespec& due)
+{
+	if (replies.empty())
+	{
+		return false;
+	}
+	due.tv_sec = replies.front().due / 1000000000ULL;
+	due.tv_nsec = replies.front().due % 1000000000ULL;
+	return true;
+}
+
+bool CAN_bootloader_simulator::pop_message(CAN_message& msg)
+{
+	if (replies.empty())
+	{
+		return false;
+	}
+	msg = replies.front().msg;
+	replies.pop_front();
+	return true;
+}
+
+void CAN_bootloader_simulator::print_stats()
+{
+	std::cout << "Simulated node " << std::hex << static_cast<int>(node_id) << std::dec << ": received " << frames_received << " frames, sent " << frames_sent
+		<< ", dropped " << frames_dropped << ", reception queue overflows " << queue_overflows << ", pages programmed " << pages_programmed << std::endl;
+}
+
+// IMPLEMENT PRIVATE FUNCTIONS.
+
+void CAN_bootloader_simulator::handle_message(const CAN_message& msg, uint64_t now)
+{
+	switch (msg.get_id())
+	{
+		case CANID_REQUEST_RESET:
+			handle_request_reset(msg, now);
+			break;
+
+		case CANID_GET_INFO:
+		{
+			reading = false;
+			uint8_t info[7];
+			info[0] = (signature >> 24) & 0xFF;
+			info[1] = (signature >> 16) & 0xFF;
+			info[2] = (signature >> 8) & 0xFF;
+			info[3] = (signature) & 0xFF;
+			info[4] = (version >> 8) & 0xFF;
+			info[5] = (version) & 0xFF;
+			info[6] = node_id;
+			send_reply(CANID_GET_INFO, info, sizeof(info), now);
+			break;
+		}
+
+		case CANID_WRITE_MEMORY:
+			handle_write_memory(msg, now);
+			break;
+
+		case CANID_WRITE_DATA:
+			reading = false;
+			if (window_size > 0)
+			{
+				handle_write_data_windowed(msg, now);
+			}
+			else
+			{
+				handle_write_data(msg, now);
+			}
+			break;
+
+		case CANID_READ_MEMORY:
+			handle_read_memory(msg, now);
+			break;
+
+		case CANID_SET_WINDOW:
+			handle_set_window(msg, now);
+			break;
+
+		case CANID_PAGE_CHECKSUM:
+			handle_page_checksum(msg, now);
+			break;
+
+		case CANID_ERASE_MEMORY:
+			handle_erase_memory(msg, now);
+			break;
+
+		case CANID_READ_DATA:
+			if ((window_size > 0) && (msg.get_length() >= 2))
+			{
+				// During a windowed read, the uploader says how many chunks of the page it has, which makes room in the window for more.
+				read_acknowledged = msg.get_data()[1];
+				send_read_window(now);
+			}
+			else if (reading)
+			{
+				// The uploader got the last chunk of the page, so send it the next one.
+				send_read_data(now);
+			}
+			break;
+	}
+}
+
+void CAN_bootloader_simulator::handle_request_reset(const CAN_message& msg, uint64_t now)
+{
+	send_confirmation(CANID_REQUEST_RESET, true, now);
+
+	// The node comes back up with everything forgotten, apart from what is in flash.
+	reading = false;
+	window_size = 0;
+	write_details_stored = false;
+	page_completed = false;
+	handled = now + boot_time;
+
+	// A node asked to run its application stays in the bootloader, so it can be programmed again straight away.  Otherwise it lets the uploader
+	// know that it is ready.
+	if ((msg.get_length() >= 2) && (msg.get_data()[1] == 0))
+	{
+		send_reply(CANID_HOST_ALERT, &node_id, 1, handled);
+	}
+}
+
+void CAN_bootloader_simulator::handle_write_memory(const CAN_message& msg, uint64_t now)
+{
+	reading = false;
+	page_completed = false;
+	const uint8_t* data = msg.get_data();
+	bool command_ok = true;
+	if ((msg.get_length() != 7) && (msg.get_length() != 8))
+	{
+		command_ok = false;
+	}
+	else if ((msg.get_length() == 8) && ((version < 0x0101) || (data[7] > ENCODING_RLE)))
+	{
+		// Bootloaders before version 1.1 didn't know about encodings at all.
+		command_ok = false;
+		write_details_stored = false;
+	}
+	else
+	{
+		page_address = (static_cast<uint32_t>(data[1]) << 24) | (data[2] << 16) | (data[3] << 8) | data[4];
+		code_length = (data[5] << 8) | data[6];
+		if ((code_length > page_size) || (page_address >= flash.size()))
+		{
+			command_ok = false;
+			write_details_stored = false;
+		}
+		else
+		{
+			write_details_stored = true;
+			current_byte = 0;
+			encoding = (msg.get_length() == 8) ? data[7] : ENCODING_NONE;
+			run_state = RUN_CONTROL;
+			expected_sequence = 0;
+			sequence_error_reported = false;
+		}
+	}
+	send_confirmation(CANID_WRITE_MEMORY, command_ok, now);
+}
+
+void CAN_bootloader_simulator::handle_write_data(const CAN_message& msg, uint64_t now)
+{
+	bool command_ok = true;
+	if (write_details_stored)
+	{
+		fill_page(msg.get_data() + 1, msg.get_length() - 1);
+		if (current_byte >= code_length)
+		{
+			program_page(now);
+		}
+	}
+	else
+	{
+		command_ok = false;
+	}
+	send_confirmation(CANID_WRITE_DATA, command_ok, now);
+}
+
+void CAN_bootloader_simulator::handle_write_data_windowed(const CAN_message& msg, uint64_t now)
+{
+	if (!write_details_stored || (msg.get_length() < 2))
+	{
+		// A repeat of the last message of the page just finished means our acknowledgement was lost, so acknowledge it again.
+		if (page_completed && (msg.get_length() >= 2) && (msg.get_data()[1] == static_cast<uint8_t>(expected_sequence - 1)))
+		{
+			send_window_ack(true, now);
+			return;
+		}
+		send_window_ack(false, now);
+		return;
+	}
+
+	// Anything out of sequence is discarded, and the uploader told where to resume from, but only once.
+	if (msg.get_data()[1] != expected_sequence)
+	{
+		if (!sequence_error_reported)
+		{
+			send_window_ack(true, now);
+			sequence_error_reported = true;
+		}
+		return;
+	}
+	sequence_error_reported = false;
+	fill_page(msg.get_data() + 2, msg.get_length() - 2);
+	expected_sequence++;
+
+	// The last message of a page always gets acknowledged, as does the end of each window.
+	if (current_byte >= code_length)
+	{
+		program_page(now);
+		page_completed = true;
+		send_window_ack(true, now);
+	}
+	else if ((expected_sequence % window_size) == 0)
+	{
+		send_window_ack(true, now);
+	}
+}
+
+void CAN_bootloader_simulator::handle_read_memory(const CAN_message& msg, uint64_t now)
+{
+	reading = false;
+	const uint8_t* data = msg.get_data();
+	bool command_ok = true;
+	if (msg.get_length() != 7)
+	{
+		command_ok = false;
+	}
+	else
+	{
+		read_address = (static_cast<uint32_t>(data[1]) << 24) | (data[2] << 16) | (data[3] << 8) | data[4];
+		read_length = (data[5] << 8) | data[6];
+		read_offset = 0;
+		read_sequence = 0;
+		read_acknowledged = 0;
+		if ((read_length > page_size) || (read_address >= flash.size()) || (read_length > flash.size() - read_address))
+		{
+			command_ok = false;
+		}
+		else
+		{
+			reading = true;
+		}
+	}
+	send_confirmation(CANID_READ_MEMORY, command_ok, now);
+
+	// The first chunk of the page follows straight after, and each of the rest once the uploader has confirmed the one before.  During a windowed
+	// read, which version 1.2 bootloaders do once a window has been set, chunks keep coming until the window is full.
+	if (reading)
+	{
+		send_read_window(now);
+	}
+}
+
+void CAN_bootloader_simulator::handle_set_window(const CAN_message& msg, uint64_t now)
+{
+	// Bootloaders without windowed transfers don't recognise the command, and stay silent.
+	if (max_window == 0)
+	{
+		return;
+	}
+	reading = false;
+	bool command_ok = true;
+
+	// Bootloaders which can take CAN-FD frames also accept the long form of the command, which says how long the WRITE_DATA messages may be.
+	if ((msg.get_length() != 2) && ((msg.get_length() != 3) || !fd_supported))
+	{
+		command_ok = false;
+	}
+	else
+	{
+		window_size = (msg.get_data()[1] > max_window) ? max_window : msg.get_data()[1];
+		write_details_stored = false;
+		page_completed = false;
+	}
+	if (command_ok && (msg.get_length() == 3))
+	{
+		// Reply with the longest message we can take which is no longer than asked for, and is a length a CAN-FD frame can have.
+		size_t frame_length = (msg.get_data()[2] > CAN_FD_MAX_LENGTH) ? CAN_FD_MAX_LENGTH : msg.get_data()[2];
+		while (round_up_fd_length(frame_length) != frame_length)
+		{
+			frame_length--;
+		}
+		uint8_t reply[4];
+		reply[0] = 1;
+		reply[1] = window_size;
+		reply[2] = frame_length;
+		reply[3] = node_id;
+		send_reply(CANID_SET_WINDOW, reply, sizeof(reply), now);
+		return;
+	}
+	uint8_t reply[3];
+	reply[0] = command_ok ? 1 : 0;
+	reply[1] = window_size;
+	reply[2] = node_id;
+	send_reply(CANID_SET_WINDOW, reply, sizeof(reply), now);
+}
+
+void CAN_bootloader_simulator::handle_page_checksum(const CAN_message& msg, uint64_t now)
+{
+	// Bootloaders without checksums don't recognise the command, and stay silent.
+	if (!checksum_supported)
+	{
+		return;
+	}
+	reading = false;
+	const uint8_t* data = msg.get_data();
+	bool command_ok = true;
+	uint32_t checksum = 0;
+	if ((msg.get_length() != 7) && (msg.get_length() != 8))
+	{
+		command_ok = false;
+	}
+	else
+	{
+		size_t address = (static_cast<uint32_t>(data[1]) << 24) | (data[2] << 16) | (data[3] << 8) | data[4];
+		size_t length = 0;
+		for (size_t i = 5; i < msg.get_length(); i++)
+		{
+			length = (length << 8) | data[i];
+		}
+		if ((address >= flash.size()) || (length > flash.size() - address))
+		{
+			command_ok = false;
+		}
+		else
+		{
+			// The bootloader works the checksum out a bit at a time, and can't do anything else meanwhile.
+			checksum = crc32(0, &flash[address], length);
+			now += length * checksum_time;
+			handled = now;
+		}
+	}
+	uint8_t reply[6];
+	reply[0] = command_ok ? 1 : 0;
+	reply[1] = (checksum >> 24) & 0xFF;
+	reply[2] = (checksum >> 16) & 0xFF;
+	reply[3] = (checksum >> 8) & 0xFF;
+	reply[4] = (checksum) & 0xFF;
+	reply[5] = node_id;
+	send_reply(CANID_PAGE_CHECKSUM, reply, sizeof(reply), now);
+}
+
+void CAN_bootloader_simulator::handle_erase_memory(const CAN_message& msg, uint64_t now)
+{
+	// Bootloaders before version 1.3 don't recognise the command, and stay silent.
+	if (version < 0x0103)
+	{
+		return;
+	}
+	reading = false;
+	write_details_stored = false;
+	page_completed = false;
+	const uint8_t* data = msg.get_data();
+	bool command_ok = true;
+	if (msg.get_length() != 8)
+	{
+		command_ok = false;
+	}
+	else
+	{
+		size_t address = (static_cast<uint32_t>(data[1]) << 24) | (data[2] << 16) | (data[3] << 8) | data[4];
+		size_t length = (data[5] << 16) | (data[6] << 8) | data[7];
+		if ((length == 0) || (address >= flash.size()) || (length > flash.size() - address))
+		{
+			command_ok = false;
+		}
+		else if (sector_size > 0)
+		{
+			// Every sector the range touches is erased in turn, and the bootloader can't do anything else meanwhile.  Without sectors, each
+			// page is still erased as it is programmed, so there's nothing to do here.
+			for (size_t sector = address - (address % sector_size); sector < address + length; sector += sector_size)
+			{
+				for (size_t i = sector; (i < sector + sector_size) && (i < flash.size()); i++)
+				{
+					flash[i] = 0xFF;
+				}
+				now += erase_time;
+			}
+			flash_idle = now;
+			handled = now;
+		}
+	}
+	send_confirmation(CANID_ERASE_MEMORY, command_ok, now);
+}
+
+void CAN_bootloader_simulator::fill_page(const uint8_t* data, size_t length)
+{
+	for (size_t i = 0; (i < length) && (current_byte < code_length); i++)
+	{
+		if (encoding == ENCODING_NONE)
+		{
+			page[current_byte++] = data[i];
+		}
+		else if (run_state == RUN_CONTROL)
+		{
+			if (data[i] < 0x80)
+			{
+				run_state = RUN_LITERAL;
+				run_remaining = data[i] + 1;
+			}
+			else
+			{
+				run_state = RUN_REPEAT;
+				run_remaining = data[i] - 0x80 + 2;
+			}
+		}
+		else if (run_state == RUN_LITERAL)
+		{
+			page[current_byte++] = data[i];
+			if (--run_remaining == 0)
+			{
+				run_state = RUN_CONTROL;
+			}
+		}
+		else
+		{
+			while ((run_remaining > 0) && (current_byte < code_length))
+			{
+				page[current_byte++] = data[i];
+				run_remaining--;
+			}
+			run_state = RUN_CONTROL;
+		}
+	}
+}
+
+void CAN_bootloader_simulator::program_page(uint64_t now)
+{
+	// The page waits for the flash to finish with the last one, and the buffer is free again as soon as programming starts.
+	uint64_t start = (now > flash_idle) ? now : flash_idle;
+	page_buffer_free = start;
+	flash_idle = start + ((sector_size > 0) ? 0 : erase_time) + write_time;
+	write_details_stored = false;
+	pages_programmed++;
+
+	// Without sectors, the whole flash page containing the address is erased, then the new code written over the start of it.
+	if (sector_size == 0)
+	{
+		size_t erase_start = page_address - (page_address % page_size);
+		for (size_t i = erase_start; (i < erase_start + page_size) && (i < flash.size()); i++)
+		{
+			flash[i] = 0xFF;
+		}
+	}
+
+	// Programming can only clear bits, so a page written over one which wasn't erased first ends up with a mix of both.
+	for (size_t i = 0; (i < code_length) && (page_address + i < flash.size()); i++)
+	{
+		flash[page_address + i] &= page[i];
+	}
+}
+
+void CAN_bootloader_simulator::send_read_data(uint64_t now)
+{
+	if (read_offset >= read_length)
+	{
+		// That was the whole page, so this is just the confirmation of the last chunk.
+		reading = false;
+		return;
+	}
+	size_t length = read_length - read_offset;
+	if (length > 8)
+	{
+		length = 8;
+	}
+	send_reply(CANID_READ_DATA, &flash[read_address + read_offset], length, now);
+	read_offset += length;
+}
+
+void CAN_bootloader_simulator::send_read_window(uint64_t now)
+{
+	if ((window_size == 0) || (version < 0x0102))
+	{
+		send_read_data(now);
+		return;
+	}
+	while (reading && (read_offset < read_length) && (static_cast<uint8_t>(read_sequence - read_acknowledged) < window_size))
+	{
+		send_read_data(now);
+		read_sequence++;
+	}
+}
+
+void CAN_bootloader_simulator::send_reply(uint32_t id, const uint8_t* data, size_t length, uint64_t now)
+{
+	// The reply waits its turn on the bus, then has to get through the uploader's adapter.
+	uint64_t on_bus = (now > to_host_free) ? now : to_host_free;
+	to_host_free = on_bus + frame_time;
+	frames_sent++;
+	if (frame_lost())
+	{
+		return;
+	}
+	Scheduled_message reply;
+	reply.msg = CAN_message(id, length, const_cast<uint8_t*>(data));
+	reply.due = to_host_free + latency;
+	replies.push_back(reply);
+}
+
+void CAN_bootloader_simulator::send_confirmation(uint32_t id, bool success, uint64_t now)
+{
+	uint8_t reply[2];
+	reply[0] = success ? 1 : 0;
+	reply[1] = node_id;
+	send_reply(id, reply, sizeof(reply), now);
+}
+
+void CAN_bootloader_simulator::send_window_ack(bool success, uint64_t now)
+{
+	uint8_t reply[3];
+	reply[0] = success ? 1 : 0;
+	reply[1] = expected_sequence;
+	reply[2] = node_id;
+	send_reply(CANID_WRITE_DATA, reply, sizeof(reply), now);
+}
+
+bool CAN_bootloader_simulator::frame_lost()
+{
+	if ((drop_rate <= 0) || ((rand_r(&seed) / (RAND_MAX + 1.0)) >= drop_rate))
+	{
+		return false;
+	}
+	frames_dropped++;
+	return true;
+}
+
+uint64_t CAN_bootloader_simulator::frame_duration(const CAN_message& msg)
+{
+	// CAN-FD frames only send their header at the nominal bitrate, and switch to the faster data bitrate for the rest.
+	if (msg.is_fd())
+	{
+		return fd_frame_time + msg.get_length() * fd_byte_time;
+	}
+	return frame_time;
+}
+
+bool read_number(Params& params, std::string name, int base, unsigned long maximum, unsigned long& value)
+{
+	if (params.find(name) == params.end())
+	{
+		return true;
+	}
+	char* end;
+	unsigned long number = strtoul(params[name].c_str(), &end, base);
+	if (params[name].empty() || (*end != '\0') || (number > maximum))
+	{
+		std::cerr << "Invalid " << name << " parameter." << std::endl;
+		return false;
+	}
+	value = number;
+	return true;
+}
+
+bool read_time(Params& params, std::string name, uint64_t& time)
+{
+	// Times are given in us, but may have a fraction.
+	if (params.find(name) == params.end())
+	{
+		return true;
+	}
+	char* end;
+	double us = strtod(params[name].c_str(), &end);
+	if (params[name].empty() || (*end != '\0') || (us < 0))
+	{
+		std::cerr << "Invalid " << name << " parameter." << std::endl;
+		return false;
+	}
+	time = static_cast<uint64_t>(us * 1000);
+	return true;
+}
+
+uint64_t to_nanoseconds(const timespec& time)
+{
+	return static_cast<uint64_t>(time.tv_sec) * 1000000000ULL + time.tv_nsec;
+}
+
+//ALL DONE.
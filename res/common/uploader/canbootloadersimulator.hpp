@@ -0,0 +1,230 @@
+// Copyright (C) 2012  Unison Networks Ltd
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+/**
+ *
+ * 
+ *  @file		canbootloadersimulator.hpp
+ *  A header file for a host side simulation of the CAN bootloader, for exercising and benchmarking the uploader without any hardware.
+ * 
+ *  @author 		agent
+ *
+ *  @date		17-10-2026
+ * 
+ *  @section 		Licence
+ * 
+ * Copyright (C) 2012  Unison Networks Ltd
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ * 
+ */
+ 
+//Only include header once.
+#ifndef __CANBOOTLOADERSIMULATOR_H__
+#define __CANBOOTLOADERSIMULATOR_H__
+
+// INCLUDE REQUIRED HEADER FILES.
+
+#include <deque>
+#include <vector>
+
+#include <stdint.h>
+#include <time.h>
+
+#include "cannetworkinterface.hpp"
+#include "util.hpp"
+
+// DEFINE PUBLIC TYPES AND ENUMERATIONS.
+
+// FORWARD DEFINE PRIVATE PROTOTYPES.
+
+// DEFINE PUBLIC CLASSES.
+
+/**
+ *  Simulates a single node running the CAN module of the AVR bootloader, speaking the same CANID_* protocol.
+ *
+ *  The simulation doesn't run in real time by itself.  Each message from the uploader is handed over along with the time it was sent, and the
+ *  simulator works out when the bootloader would have handled it and when each reply would reach the uploader, allowing for bus and adapter latency,
+ *  the time taken to erase and program flash pages and the bootloader only handling one message at a time.  Since the bootloader only ever reacts
+ *  to the uploader, this gives the same answers as running it in real time.  Replies are queued in the order they arrive, and the caller delivers
+ *  each one once its time has come.
+ *
+ *  Every parameter starts with "sim-", so they can share the uploader's -C parameters with everything else.
+ */
+class CAN_bootloader_simulator
+{
+public:
+
+	// Functions.
+	CAN_bootloader_simulator();
+	
+	/**
+	 * Sets up the simulated node from the parameters given, falling back to an AT90CAN128 on a 1Mbps bus for anything not given.
+	 * Returns false if a parameter was invalid.
+	 */
+	bool init(Params params);
+	
+	/**
+	 * Hands the simulator a message sent by the uploader at the given (CLOCK_MONOTONIC) time.  Any replies are queued up for delivery.
+	 */
+	void receive_message(const CAN_message& msg, const timespec& sent);
+	
+	/**
+	 * Finds out when the next reply is due to reach the uploader.
+	 * Returns false if there are no replies waiting.
+	 */
+	bool next_message_due(timespec& due);
+	
+	/**
+	 * Takes the next reply off the queue, whether or not it is due yet.
+	 * Returns false if there are no replies waiting.
+	 */
+	bool pop_message(CAN_message& msg);
+	
+	/**
+	 * Prints how many frames were passed in each direction, dropped, and how many pages were programmed.
+	 */
+	void print_stats();
+	
+private:
+	// Types.
+	
+	/**
+	 *  A reply from the bootloader, along with the time it reaches the uploader.
+	 */
+	struct Scheduled_message
+	{
+		CAN_message msg;
+		uint64_t due;
+	};
+	
+	/**
+	 *  Where the decoding of a run length encoded page has got to, the same as in the bootloader.
+	 */
+	enum Run_state
+	{
+		RUN_CONTROL,
+		RUN_LITERAL,
+		RUN_REPEAT
+	};
+	
+	// Functions.
+	void handle_message(const CAN_message& msg, uint64_t now);
+	void handle_request_reset(const CAN_message& msg, uint64_t now);
+	void handle_write_memory(const CAN_message& msg, uint64_t now);
+	void handle_write_data(const CAN_message& msg, uint64_t now);
+	void handle_write_data_windowed(const CAN_message& msg, uint64_t now);
+	void handle_read_memory(const CAN_message& msg, uint64_t now);
+	void handle_set_window(const CAN_message& msg, uint64_t now);
+	void handle_page_checksum(const CAN_message& msg, uint64_t now);
+	void handle_erase_memory(const CAN_message& msg, uint64_t now);
+	
+	void fill_page(const uint8_t* data, size_t length);
+	void program_page(uint64_t now);
+	void send_read_data(uint64_t now);
+	void send_read_window(uint64_t now);
+	void send_reply(uint32_t id, const uint8_t* data, size_t length, uint64_t now);
+	void send_confirmation(uint32_t id, bool success, uint64_t now);
+	void send_window_ack(bool success, uint64_t now);
+	bool frame_lost();
+	uint64_t frame_duration(const CAN_message& msg);
+	
+	// Fields.
+	
+	// What the simulated node is.
+	uint8_t node_id;
+	uint32_t signature;
+	uint16_t version;
+	uint8_t max_window;
+	bool checksum_supported;
+	bool fd_supported;
+	size_t page_size;
+	
+	// Size of the flash sectors which ERASE_MEMORY erases, or zero if each page is erased as it is programmed.
+	size_t sector_size;
+	std::vector<uint8_t> flash;
+	
+	// How long things take, in ns.
+	uint64_t latency;
+	uint64_t frame_time;
+	uint64_t fd_frame_time;
+	uint64_t fd_byte_time;
+	uint64_t erase_time;
+	uint64_t write_time;
+	uint64_t checksum_time;
+	uint64_t boot_time;
+	
+	// Fraction of frames lost in each direction, and the state of the random numbers deciding which.
+	double drop_rate;
+	unsigned int seed;
+	
+	// The state of the bootloader's CAN module.
+	uint8_t window_size;
+	uint8_t expected_sequence;
+	bool sequence_error_reported;
+	bool write_details_stored;
+	bool page_completed;
+	size_t page_address;
+	size_t code_length;
+	size_t current_byte;
+	uint8_t encoding;
+	Run_state run_state;
+	size_t run_remaining;
+	std::vector<uint8_t> page;
+	bool reading;
+	size_t read_address;
+	size_t read_length;
+	size_t read_offset;
+	uint8_t read_sequence;
+	uint8_t read_acknowledged;
+	
+	// When the bus in each direction is next free, when the bootloader handled its last message, and when the page buffer and the flash are next free.
+	uint64_t to_node_free;
+	uint64_t to_host_free;
+	uint64_t handled;
+	uint64_t page_buffer_free;
+	uint64_t flash_idle;
+	
+	// When each message waiting in the bootloader's reception queue will be handled.
+	std::deque<uint64_t> reception_queue;
+	
+	// Replies on their way to the uploader.
+	std::deque<Scheduled_message> replies;
+	
+	// Statistics.
+	uint64_t frames_received;
+	uint64_t frames_sent;
+	uint64_t frames_dropped;
+	uint64_t queue_overflows;
+	uint64_t pages_programmed;
+};
+
+ 
+// DEFINE PUBLIC STATIC FUNCTION PROTOTYPES.
+ 
+#endif /*__CANBOOTLOADERSIMULATOR_H__*/
+
+//ALL DONE.
@@ -49,17 +49,19 @@
 
 CAN_message::CAN_message() :
 	id(0),
-	length(0)
+	length(0),
+	fd(false)
 {
-	for (size_t i = 0; i < 8; i++)
+	for (size_t i = 0; i < CAN_FD_MAX_LENGTH; i++)
 	{
 		this->data[i] = 0;
 	}
 }
 
-CAN_message::CAN_message( uint32_t id, size_t length, uint8_t* data) :
+CAN_message::CAN_message( uint32_t id, size_t length, uint8_t* data, bool fd) :
 	id(id),
-	length(length)
+	length(length),
+	fd(fd)
 {
 	for (size_t i = 0; i < length; i++)
 	{
@@ -82,6 +84,11 @@ uint32_t CAN_message::get_id() const
 	return id;
 }
 
+bool CAN_message::is_fd() const
+{
+	return fd;
+}
+
 void CAN_message::set_length(size_t new_length)
 {
 	length = new_length;
@@ -92,6 +99,11 @@ void CAN_message::set_id(uint32_t new_id)
 	id = new_id;
 }
 
+void CAN_message::set_fd(bool new_fd)
+{
+	fd = new_fd;
+}
+
 uint8_t* CAN_message::get_content()
 {
 	return &data[0];
@@ -99,7 +111,8 @@ uint8_t* CAN_message::get_content()
 
 
 
-CAN_network_interface::CAN_network_interface()
+CAN_network_interface::CAN_network_interface() :
+	filter_mode(INCLUDE_ALL)
 {
 
 }
@@ -109,6 +122,23 @@ CAN_network_interface::~CAN_network_interface()
 
 }
 
+bool CAN_network_interface::send_messages(const CAN_message_queue& msgs, uint32_t timeout)
+{
+	for (CAN_message_queue::const_iterator it = msgs.begin(); it != msgs.end(); it++)
+	{
+		if (!send_message(*it, timeout))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool CAN_network_interface::supports_fd()
+{
+	return false;
+}
+
 bool CAN_network_interface::set_filter( uint32_t id, Action act)
 {
 	if (act == INCLUDE)
@@ -153,7 +183,7 @@ bool CAN_network_interface::filter(uint32_t id)
 		return inclusion_filter.find(id) != inclusion_filter.end();
 		break;
 	case INCLUDE_ALL_BUT_FILTER:
-		return exclusion_filter.find(id) != exclusion_filter.end();
+		return exclusion_filter.find(id) == exclusion_filter.end();
 		break;
 	default:
 		return false;
@@ -161,6 +191,25 @@ bool CAN_network_interface::filter(uint32_t id)
 	}
 }
 
+size_t round_up_fd_length(size_t length)
+{
+	// Up to eight bytes, any length will do.
+	if (length <= CAN_CLASSIC_MAX_LENGTH)
+	{
+		return length;
+	}
+
+	// Beyond that, the lengths go up in fours to 24 bytes, then 32, 48 and 64.
+	if (length <= 24)
+	{
+		return (length + 3) & ~static_cast<size_t>(3);
+	}
+	if (length <= 32)
+	{
+		return 32;
+	}
+	return (length <= 48) ? 48 : CAN_FD_MAX_LENGTH;
+}
 
 // IMPLEMENT PRIVATE FUNCTIONS.
 
@@ -58,6 +58,12 @@
 
 #include "util.hpp"
 
+// DEFINE PUBLIC MACROS.
+
+// Most data a message can carry: eight bytes on classic CAN, or 64 on CAN-FD.
+#define CAN_CLASSIC_MAX_LENGTH 8
+#define CAN_FD_MAX_LENGTH 64
+
 // DEFINE PUBLIC TYPES AND ENUMERATIONS.
 
 typedef std::set<uint32_t> Filter_set;
@@ -68,6 +74,7 @@ typedef std::set<uint32_t> Filter_set;
 
 /**
  *  A CAN message class, this class represents a CAN message that could be received or transmitted over a CAN network.
+ *  Messages are classic CAN unless marked as CAN-FD, which lets them carry up to 64 bytes.
  * 
  */
 class CAN_message
@@ -76,14 +83,16 @@ public:
 	
 	// Functions.
 	CAN_message();
-	CAN_message( uint32_t id, size_t length, uint8_t* data);
+	CAN_message( uint32_t id, size_t length, uint8_t* data, bool fd = false);
 	
 	const uint8_t* get_data() const;
 	size_t get_length() const;
 	uint32_t get_id() const;
+	bool is_fd() const;
 	
 	void set_length(size_t new_length);
 	void set_id(uint32_t new_id);
+	void set_fd(bool new_fd);
 	uint8_t* get_content();
 	
 private:
@@ -93,7 +102,8 @@ private:
 	// Fields.
 	uint32_t id;
 	size_t length;
-	uint8_t data[8];
+	bool fd;
+	uint8_t data[CAN_FD_MAX_LENGTH];
 };
 
 /**
@@ -136,6 +146,12 @@ public:
 	 * If it returns false it does not necessarily mean that the message wont be sent in future.
 	 */
 	virtual bool send_message(const CAN_message& msg, uint32_t timeout)=0;
+	/**
+	 * This method is called to send several CAN_messages in order, a timeout is supplied for waiting for successful transmission.
+	 * Interfaces which can submit many messages at once should override this, the default just calls send_message for each one.
+	 * Returns true if all the messages were sent and false on failure.
+	 */
+	virtual bool send_messages(const CAN_message_queue& msgs, uint32_t timeout);
 	/**
 	 * This method is called to receive a can message, a timeout is supplied to allow it to not block indefinately.
 	 * It returns true if a message was received and false on failure.
@@ -146,6 +162,11 @@ public:
 	 * Returns true on success and false on failure.
 	 */
 	virtual bool drain_messages()=0;
+	/**
+	 * Returns true if the interface was set up for CAN-FD, so it can send and receive messages marked as CAN-FD.
+	 * By default interfaces only handle classic CAN.
+	 */
+	virtual bool supports_fd();
 	
 	/**
 	 * Sets a filter to include or exclude certain ID's from being received.
@@ -184,6 +205,12 @@ protected:
 
  
 // DEFINE PUBLIC STATIC FUNCTION PROTOTYPES.
+
+/**
+ * CAN-FD frames longer than eight bytes only come in certain lengths (12, 16, 20, 24, 32, 48 and 64 bytes).
+ * Returns the shortest length a CAN-FD frame can have which holds the given number of bytes.
+ */
+size_t round_up_fd_length(size_t length);
  
 #endif /*__CANNETWORKINTERFACE_H__*/
 
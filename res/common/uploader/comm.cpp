@@ -35,8 +35,17 @@
 
 // INCLUDE IMPLEMENTATION SPECIFIC HEADER FILES.
 
+#include <iostream>
+
+#include <stdlib.h>
+
 // DEFINE PRIVATE MACROS.
 
+// Timeout for replies until the first round trip has been timed, and the limits on it afterwards, in ms.
+#define INITIAL_REPLY_TIMEOUT 1000
+#define MIN_REPLY_TIMEOUT 50
+#define MAX_REPLY_TIMEOUT 10000
+
 // DEFINE PRIVATE TYPES AND STRUCTS.
 
 // DECLARE IMPORTED GLOBAL VARIABLES.
@@ -88,7 +97,80 @@ void Device_info::set_version_major(uint8_t new_version)
 }
 
 
-Comm_module::Comm_module(std::string name)
+Rtt_estimator::Rtt_estimator(uint32_t initial_timeout, uint32_t min_timeout, uint32_t max_timeout) :
+	initial_timeout(initial_timeout),
+	min_timeout(min_timeout),
+	max_timeout(max_timeout)
+{
+	reset();
+}
+
+void Rtt_estimator::reset(uint32_t fixed_timeout)
+{
+	this->fixed_timeout = fixed_timeout;
+	srtt = 0;
+	rttvar = 0;
+	have_sample = false;
+	skip_sample = false;
+	backoff = 0;
+}
+
+void Rtt_estimator::record_since(const timespec& sent)
+{
+	if (skip_sample)
+	{
+		skip_sample = false;
+		return;
+	}
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t rtt = elapsed_nanoseconds(sent, now);
+	if (!have_sample)
+	{
+		srtt = rtt;
+		rttvar = rtt / 2;
+		have_sample = true;
+	}
+	else
+	{
+		// RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - RTT|, then SRTT = 7/8 SRTT + 1/8 RTT.
+		uint64_t deviation = (srtt > rtt) ? srtt - rtt : rtt - srtt;
+		rttvar = (3 * rttvar + deviation) / 4;
+		srtt = (7 * srtt + rtt) / 8;
+	}
+	backoff = 0;
+}
+
+void Rtt_estimator::record_timeout()
+{
+	skip_sample = true;
+	if ((get_timeout() < max_timeout) && (backoff < 16))
+	{
+		backoff++;
+	}
+}
+
+uint32_t Rtt_estimator::get_timeout()
+{
+	if (fixed_timeout != 0)
+	{
+		return fixed_timeout;
+	}
+	uint64_t timeout = have_sample ? (srtt + 4 * rttvar) / 1000000 : initial_timeout;
+	timeout = (timeout < min_timeout) ? min_timeout : timeout;
+	timeout <<= backoff;
+	return (timeout > max_timeout) ? max_timeout : timeout;
+}
+
+void Rtt_estimator::add_to_report(Run_report& report)
+{
+	report.set_value("srtt_us", srtt / 1000.0);
+	report.set_value("rttvar_us", rttvar / 1000.0);
+	report.set_value("reply_timeout_ms", get_timeout());
+}
+
+Comm_module::Comm_module(std::string name) :
+	reply_timer(INITIAL_REPLY_TIMEOUT, MIN_REPLY_TIMEOUT, MAX_REPLY_TIMEOUT)
 {
 	if (get_registry().find(name) == get_registry().end())
 	{
@@ -101,6 +183,70 @@ Comm_module::~Comm_module()
 	//Do nothing by default here.
 }
 
+bool Comm_module::page_matches(Memory_map& expected, size_t size, size_t address)
+{
+	Memory_map current(address + size, expected.get_type());
+	if (!read_page(current, size, address))
+	{
+		return false;
+	}
+	return current.get_checksum(address, size) == expected.get_checksum(address, size);
+}
+
+bool Comm_module::image_matches(Memory_map& /* expected */, size_t /* length */)
+{
+	// The uploader goes on to check each page instead.
+	return false;
+}
+
+bool Comm_module::erase_memory(size_t /* address */, size_t /* length */)
+{
+	// Each page gets erased as it is written instead.
+	return true;
+}
+
+bool Comm_module::erases_each_page()
+{
+	return true;
+}
+
+bool Comm_module::read_pages(Memory_map& destination, size_t page_size, size_t address, size_t length)
+{
+	for (size_t page_address = address; page_address < address + length; page_address += page_size)
+	{
+		size_t size = (address + length - page_address < page_size) ? address + length - page_address : page_size;
+		if (!read_page(destination, size, page_address))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Comm_module::write_fleet(std::vector<Fleet_job>& /* jobs */, size_t /* page_size */, uint32_t /* signature */)
+{
+	std::cerr << "This communication module can't program more than one device at once." << std::endl;
+	return false;
+}
+
+bool Comm_module::get_compression_stats(size_t& /* raw_bytes */, size_t& /* sent_bytes */)
+{
+	// Nothing was compressed.
+	return false;
+}
+
+void Comm_module::add_to_report(Run_report& report)
+{
+	size_t raw_bytes;
+	size_t sent_bytes;
+	if (get_compression_stats(raw_bytes, sent_bytes))
+	{
+		report.add_to_counter("page_bytes", raw_bytes);
+		report.add_to_counter("page_bytes_sent", sent_bytes);
+	}
+	reply_timer.add_to_report(report);
+}
+
 Comm_module_registry& Comm_module::get_registry()
 {
 	if (the_registry == NULL)
@@ -110,6 +256,26 @@ Comm_module_registry& Comm_module::get_registry()
 	return *the_registry;
 }
 
+// IMPLEMENT PROTECTED FUNCTIONS.
+
+bool Comm_module::init_reply_timeout(Params& params)
+{
+	uint32_t fixed_timeout = 0;
+	if (params.find("reply-timeout") != params.end())
+	{
+		char* end;
+		unsigned long timeout = strtoul(params["reply-timeout"].c_str(), &end, 10);
+		if (params["reply-timeout"].empty() || (*end != '\0') || (timeout == 0) || (timeout > MAX_REPLY_TIMEOUT))
+		{
+			std::cerr << "Invalid reply timeout" << std::endl;
+			return false;
+		}
+		fixed_timeout = timeout;
+	}
+	reply_timer.reset(fixed_timeout);
+	return true;
+}
+
 // IMPLEMENT PRIVATE FUNCTIONS.
 
 Comm_module_registry* Comm_module::the_registry = NULL;
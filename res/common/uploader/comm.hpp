@@ -51,10 +51,12 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
 #include <stdint.h>
 
 #include "memory.hpp"
+#include "report.hpp"
 #include "util.hpp"
 
 
@@ -64,6 +66,19 @@ class Comm_module;
 
 typedef std::map<std::string, Comm_module*> Comm_module_registry;
 
+/**
+ *  One device to be programmed as part of a fleet, the image to program it with, and how far it has got.
+ */
+struct Fleet_job
+{
+	std::string target;
+	Memory_map* image;
+	size_t pages_written;
+	size_t pages_total;
+	bool failed;
+	std::string error;
+};
+
 // FORWARD DEFINE PRIVATE PROTOTYPES.
 
 // DEFINE PUBLIC CLASSES.
@@ -97,6 +112,55 @@ private:
 	uint8_t version_major;
 };
 
+/**
+ *  Works out how long to wait for a reply on a link from the round trip times seen so far, the same way TCP does (RFC 6298).
+ *  The timeout is the smoothed round trip time plus four times its variation, kept within limits, and it doubles each time a reply doesn't come.
+ *  Until the first round trip has been timed, the initial timeout is used.  All timeouts are in ms.
+ */
+class Rtt_estimator
+{
+public:
+	
+	// Functions.
+	Rtt_estimator(uint32_t initial_timeout, uint32_t min_timeout, uint32_t max_timeout);
+	
+	/**
+	 *  Forgets everything measured so far.  If a fixed timeout is given, that is always used instead.
+	 */
+	void reset(uint32_t fixed_timeout = 0);
+	/**
+	 *  Adds the round trip of a reply to a request sent at the given (CLOCK_MONOTONIC) time.
+	 */
+	void record_since(const timespec& sent);
+	/**
+	 *  Notes that a reply didn't come in time, which backs off the timeout.
+	 *  The next reply may be to the request which timed out rather than to the one sent again, so it isn't timed (Karn's algorithm).
+	 */
+	void record_timeout();
+	uint32_t get_timeout();
+	/**
+	 *  Adds the smoothed round trip time and its variation (in us) and the current timeout to a report.
+	 */
+	void add_to_report(Run_report& report);
+	
+private:
+	
+	// Fields.
+	uint32_t initial_timeout;
+	uint32_t min_timeout;
+	uint32_t max_timeout;
+	uint32_t fixed_timeout;
+	
+	// The smoothed round trip time and its variation, in ns.
+	uint64_t srtt;
+	uint64_t rttvar;
+	bool have_sample;
+	bool skip_sample;
+	
+	// How many times the timeout has been doubled since the last reply which was timed.
+	unsigned int backoff;
+};
+
 /**
  * This is the abstract base class for all communication modules.
  * This defines the interface needed to be able to program a microcontroller.
@@ -143,17 +207,82 @@ public:
 	 *  it supplies the memory map to write into, the size of the page to read and the start address.
 	 */
 	virtual bool read_page(Memory_map& destination, size_t size, size_t address)=0;
+	/**
+	 *  This function is called by the uploader in diff mode to find out whether a page on the device already holds the expected contents,
+	 *  so that writing it can be skipped.  It returns false if the page differs, or if it couldn't be checked, so that the page gets written.
+	 *  By default it reads the page back, modules which can have the device checksum the page override this.
+	 */
+	virtual bool page_matches(Memory_map& expected, size_t size, size_t address);
+	/**
+	 *  This function is called by the uploader in diff mode to find out whether the device already holds the whole image, from address zero
+	 *  up to the given length, in one go.  It returns false if the image differs, or if it couldn't be checked this way.
+	 *  By default it can't, modules which can have the device checksum a range of memory override this.
+	 */
+	virtual bool image_matches(Memory_map& expected, size_t length);
+	/**
+	 *  This function is called by the uploader in dump mode to read a whole region of memory from the device into a memory map, a page at a time,
+	 *  it supplies the memory map to write into, the page size, and the start address and length of the region.  If it fails part way, every page
+	 *  before the one it failed on has been read in full, so the uploader can carry on from there.
+	 *  By default it reads each page in turn, modules which can ask for the next page while the last is still arriving override this.
+	 */
+	virtual bool read_pages(Memory_map& destination, size_t page_size, size_t address, size_t length);
+	/**
+	 *  This function is called by the uploader before writing anything, to have the device erase the whole of the image in one go,
+	 *  it supplies the start address and length of the image.  It isn't called in diff mode, since that would erase the pages being skipped.
+	 *  By default it does nothing, since most bootloaders erase each page as they write it, modules which can erase a range override this.
+	 */
+	virtual bool erase_memory(size_t address, size_t length);
+	/**
+	 *  This function is called by the uploader in diff mode to find out whether pages can be written without erasing them with erase_memory
+	 *  first.  It returns false if the device erases more than a page at a time, so that only some pages of the image can't be rewritten.
+	 *  By default it returns true, since most bootloaders erase each page as they write it.
+	 */
+	virtual bool erases_each_page();
 	
 	/**
 	 *  The uploader will call this function to reset the target, with a boolean parameter specifying whether it starts the application or returns to the bootloader.
 	 */
 	virtual bool reset_device(bool run_application)=0;
 	
+	/**
+	 *  This function is called by the uploader to write, verify and start several devices sharing the same link at once,
+	 *  it supplies the list of jobs, the page size and the signature every device must have.
+	 *  The outcome for each device is recorded in its job, and it only returns true if every device was programmed.
+	 *  Modules which can address more than one device override this, by default it just fails.
+	 */
+	virtual bool write_fleet(std::vector<Fleet_job>& jobs, size_t page_size, uint32_t signature);
+	
+	/**
+	 *  The uploader calls this once writing is finished, to report how much the page data was compressed on the way to the device.
+	 *  It gives the number of bytes of page data written, and how many bytes were actually sent for them.
+	 *  Modules which don't compress anything leave this alone, by default it just returns false.
+	 */
+	virtual bool get_compression_stats(size_t& raw_bytes, size_t& sent_bytes);
+	
+	/**
+	 *  The uploader calls this at the end of a run, so the module can add what it measured (round trip times, retries and so on) to the report.
+	 *  By default it just adds the compression stats, modules which measure more override this and call it as well.
+	 */
+	virtual void add_to_report(Run_report& report);
+	
 	/**
 	 *  This method will return the map that holds all of the existing communication modules.
 	 */
 	static Comm_module_registry& get_registry();
 	
+protected:
+	// Functions.
+	
+	/**
+	 *  Sets up the reply timeout from the parameters: "reply-timeout" gives a fixed timeout in ms, otherwise it adapts to the link.
+	 *  Returns false if the parameter was invalid.
+	 */
+	bool init_reply_timeout(Params& params);
+	
+	//Fields.
+	
+	// Decides how long to wait for replies on the link, and is shared by everything the module sends.
+	Rtt_estimator reply_timer;
 	
 private:
 	// Functions.
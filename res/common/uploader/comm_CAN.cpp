@@ -36,6 +36,7 @@
 // INCLUDE REQUIRED HEADER FILES FOR IMPLEMENTATION.
 
 #include <iostream>
+#include <sstream>
 
 #include <stdlib.h>
 #include <memory.h>
@@ -44,18 +45,39 @@
 #include <sys/time.h>
 
 #include "microchipcannetworkinterface.hpp"
+#include "simulatedcannetworkinterface.hpp"
 #include "socketcannetworkinterface.hpp"
 
-#include "can_messages.h"
+#include "gen/can_messages.h"
+#include "util.hpp"
 
 // DEFINE PRIVATE MACROS.
 
+// How page data in a WRITE_DATA sequence is encoded, as given in the last byte of a long WRITE_MEMORY command.
+#define ENCODING_NONE 0
+#define ENCODING_RLE 1
+
 // Number of tries to attempt (for the overall uploading process) before declaring failure.
 #define MAX_RETRIES 5
 
-// Timeout for CAN RX (and TX) operations, in ms. 
+// Timeout for CAN TX operations, and for replies which take a fixed time rather than a round trip (like the bootloader starting up), in ms. 
 #define TIMEOUT 10000
 
+// Timeout for the bootloader to answer an ERASE_MEMORY command, in ms.  Erasing takes a second or two for each large sector.
+#define ERASE_TIMEOUT 30000
+
+// Timeout for the bootloader to answer a SET_WINDOW command, in ms.  Older bootloaders never answer, so this is kept short.
+#define NEGOTIATION_TIMEOUT 500
+
+// Window size to ask the bootloader for, when none is given in the parameters.
+#define DEFAULT_WINDOW_SIZE 15
+
+// Number of data bytes in a windowed WRITE_DATA message, after the node ID and the sequence number, unless longer CAN-FD messages are agreed.
+#define WINDOWED_PAYLOAD 6
+
+// Longest to wait for any reply at all while writing a fleet, before checking whether any node has timed out, in ms.
+#define FLEET_POLL 10
+
 // SELECT NAMESPACES.
 
 // DEFINE PRIVATE CLASSES, TYPES AND ENUMERATIONS.
@@ -68,8 +90,18 @@ static CAN_module module;
 
 CAN_message make_command(uint32_t id, uint8_t target, size_t length);
 
+CAN_message make_range_command(uint32_t id, uint8_t target, size_t size, size_t address);
+
+CAN_message make_write_memory(uint8_t target, size_t size, size_t address, uint8_t encoding);
+
+CAN_message make_write_data(const std::vector<uint8_t>& payload, uint8_t target, size_t sequence, size_t frame_payload, bool fd);
+
 bool check_reply(CAN_message& msg);
 
+bool parse_node_id(std::string text, uint8_t& node);
+
+bool is_window_boundary(size_t sequence, size_t number_of_messages, uint8_t window);
+
 // IMPLEMENT PUBLIC STATIC FUNCTIONS.
 
 // IMPLEMENT PUBLIC CLASS FUNCTIONS.
@@ -94,9 +126,32 @@ CAN_module::~CAN_module()
 bool CAN_module::init(Params params)
 {
 	connected = false;
+	have_target = false;
+	replies_tagged = false;
+	window_negotiated = false;
+	window_size = 0;
+	frame_payload = WINDOWED_PAYLOAD;
+	fd_frames = false;
+	windowed_reads_supported = false;
+	erase_supported = false;
+	requested_window = DEFAULT_WINDOW_SIZE;
+	checksum_probed = false;
+	checksum_supported = false;
+	verify_readback = false;
+	compress = true;
+	compression_supported = false;
+	raw_bytes = 0;
+	sent_bytes = 0;
+	reply_timeouts = 0;
+	resends = 0;
+	reply_rtt = Latency_histogram();
+	clock_gettime(CLOCK_MONOTONIC, &request_sent);
+	if (!init_reply_timeout(params))
+	{
+		return false;
+	}
 	bool have_CAN_type = false;
 	std::string can_type;
-	bool have_target = false;
 	if (params.find("can-type") != params.end())
 	{
 		can_type = params["can-type"];
@@ -105,39 +160,79 @@ bool CAN_module::init(Params params)
 	if (params.find("target") != params.end())
 	{
 		have_target = true;
-		char* end;
-		target = strtoul(params["target"].c_str(), &end, 16);
-		if ((end - params["target"].c_str()) != params["target"].length())
+		if (!parse_node_id(params["target"], target))
 		{
-			//std::cerr << *end << std::endl;
 			std::cerr << "Invalid target node ID" << std::endl;
 			return false;
 		}
 	}
-	if (have_CAN_type)
+	if (params.find("window") != params.end())
 	{
-		if (can_type == "socket")
-		{
-			iface = new Socket_CAN_network_interface;
-		}
-		if (can_type == "microchip")
+		char* end;
+		unsigned long window = strtoul(params["window"].c_str(), &end, 10);
+		if ((static_cast<size_t>(end - params["window"].c_str()) != params["window"].length()) || (window > 255))
 		{
-			iface = new Microchip_CAN_network_interface;
+			std::cerr << "Invalid window size" << std::endl;
+			return false;
 		}
+		requested_window = window;
 	}
-	else
+	if (params.find("verify") != params.end())
 	{
-		iface = new Microchip_CAN_network_interface;
+		if (params["verify"] == "readback")
+		{
+			verify_readback = true;
+		}
+		else if (params["verify"] != "crc")
+		{
+			std::cerr << "Invalid verify mode" << std::endl;
+			return false;
+		}
 	}
-	if (!have_target)
+	if (params.find("compress") != params.end())
 	{
-		std::cerr << "No target node ID given." << std::endl;
-		return false;
+		if (params["compress"] == "off")
+		{
+			compress = false;
+		}
+		else if (params["compress"] != "on")
+		{
+			std::cerr << "Invalid compress setting" << std::endl;
+			return false;
+		}
 	}
-	if (!iface->init(params))
+	// The interface is only opened the first time, so that a daemon can keep it open from one job to the next.
+	if (iface == NULL)
 	{
-		std::cerr << "Failed To init Network interface" << std::endl;
-		return false;
+		if (have_CAN_type)
+		{
+			if (can_type == "socket")
+			{
+				iface = new Socket_CAN_network_interface;
+			}
+			if (can_type == "microchip")
+			{
+				iface = new Microchip_CAN_network_interface;
+			}
+			if (can_type == "sim")
+			{
+				iface = new Simulated_CAN_network_interface;
+			}
+		}
+		else
+		{
+			iface = new Microchip_CAN_network_interface;
+		}
+		if (iface == NULL)
+		{
+			std::cerr << "Unknown CAN interface type" << std::endl;
+			return false;
+		}
+		if (!iface->init(params))
+		{
+			std::cerr << "Failed To init Network interface" << std::endl;
+			return false;
+		}
 	}
 	if (!iface->set_filter_mode(CAN_network_interface::EXCLUDE_ALL_BUT_FILTER))
 	{
@@ -222,6 +317,13 @@ bool CAN_module::connect_to_device()
 
 bool CAN_module::get_device_info( Device_info& info)
 {
+	// When programming a fleet, the targets come from the manifest instead, so this is only checked once one is needed.
+	if (!have_target)
+	{
+		std::cerr << "No target node ID given." << std::endl;
+		return false;
+	}
+
 	CAN_message get_info = make_command(CANID_GET_INFO, target, 1);
 	if (!iface->clear_filter())
 	{
@@ -239,12 +341,7 @@ bool CAN_module::get_device_info( Device_info& info)
 		std::cerr << "Failed to drain message" << std::endl;
 		return false;
 	}
-	if (!iface->send_message(get_info, TIMEOUT))
-	{
-		std::cerr << "Failed to send message" << std::endl;
-		return false;
-	}
-	if (!iface->receive_message(get_info, TIMEOUT))
+	if (!transact(get_info))
 	{
 		std::cerr << "Failed to receive message" << std::endl;
 		return false;
@@ -260,19 +357,32 @@ bool CAN_module::get_device_info( Device_info& info)
 	info.set_signature(signature);
 	info.set_version_major(data[4]);
 	info.set_version_minor(data[5]);
+
+	// Newer bootloaders add their own node ID to the end of every reply.
+	replies_tagged = (get_info.get_length() >= 7) && (data[6] == target);
+	
+	// Version 1.1 and later bootloaders can decode run length encoded pages.
+	compression_supported = (data[4] > 1) || ((data[4] == 1) && (data[5] >= 1));
+	
+	// Version 1.2 and later bootloaders can stream pages they read a window at a time.
+	windowed_reads_supported = (data[4] > 1) || ((data[4] == 1) && (data[5] >= 2));
+	
+	// Version 1.3 and later bootloaders can erase the whole image before it is written.
+	erase_supported = (data[4] > 1) || ((data[4] == 1) && (data[5] >= 3));
 	return true;
 }
 
 bool CAN_module::write_page(Memory_map& source, size_t size, size_t address)
 {
-	CAN_message write_memory = make_command(CANID_WRITE_MEMORY, target, 7);
-	uint8_t* data = write_memory.get_content();
-	data[1] = (address >> 24) & 0xFF;
-	data[2] = (address >> 16) & 0xFF;
-	data[3] = (address >> 8) &0xFF;
-	data[4] = (address) & 0xFF;
-	data[5] = (size >> 8) &0xFF;
-	data[6] = (size) & 0xFF;
+	// Find out whether the bootloader can take windowed transfers, the first time we write anything.
+	if (!window_negotiated && !negotiate_window())
+	{
+		return false;
+	}
+
+	std::vector<uint8_t> payload;
+	uint8_t encoding = encode_page(source, size, address, compress && compression_supported, payload);
+	CAN_message write_memory = make_write_memory(target, size, address, encoding);
 	if (!iface->clear_filter())
 	{
 		return false;
@@ -286,12 +396,7 @@ bool CAN_module::write_page(Memory_map& source, size_t size, size_t address)
 	{
 		return false;
 	}
-	if (!iface->send_message(write_memory, TIMEOUT))
-	{
-		std::cerr << "Failed to send read memory command" << std::endl;
-		return false;
-	}
-	if (!iface->receive_message(write_memory, TIMEOUT))
+	if (!transact(write_memory))
 	{
 		std::cerr << "Failed to receive reply" << std::endl;
 		return false;
@@ -310,31 +415,25 @@ bool CAN_module::write_page(Memory_map& source, size_t size, size_t address)
 		std::cerr << "Failed to set filter" << std::endl;
 		return false;
 	}
-	size_t remaining = size;
+	if (window_size > 0)
+	{
+		return write_page_windowed(payload);
+	}
+	size_t remaining = payload.size();
 	size_t current_message = 0;
 	while (remaining > 0)
 	{
 		//std::cout << "Sending Message: " << current_message << std::endl;
 		size_t packet_size = (remaining > 7) ? 7 : remaining;
 		write_memory = make_command(CANID_WRITE_DATA, target, packet_size+1);
-		for (size_t j = 0; j < packet_size; j++)
-		{
-			if (source.get_allocated_map()[address+(current_message*7)+j] == Memory_map::ALLOCATED)
-			{
-				write_memory.get_content()[j+1] = source.get_memory()[address+(current_message*7)+j];
-			}
-			else
-			{
-				write_memory.get_content()[j+1] = 0xFF;
-			}
-		}
+		memcpy(write_memory.get_content()+1, &payload[current_message*7], packet_size);
 		
-		if (!iface->send_message(write_memory, TIMEOUT))
+		if (!send_request(write_memory))
 		{
 			std::cerr << "Failed to send data packet: " << current_message << std::endl;
 			return false;
 		}
-		if (!iface->receive_message(write_memory, TIMEOUT))
+		if (!await_reply(write_memory, CANID_WRITE_DATA))
 		{
 			std::cerr << "Failed to receive message acknowledge, WritePage: " << current_message << std::endl;
 			return false;
@@ -352,6 +451,31 @@ bool CAN_module::write_page(Memory_map& source, size_t size, size_t address)
 
 bool CAN_module::verify_page(Memory_map& expected, size_t size, size_t address)
 {
+	// Unless reading the whole page back was asked for, have the bootloader checksum it instead, which only takes one frame each way.
+	if (!verify_readback && (!checksum_probed || checksum_supported))
+	{
+		uint32_t checksum;
+		if (read_checksum(size, address, checksum))
+		{
+			if (checksum != expected.get_checksum(address, size))
+			{
+				std::cout << "Verification failed." << std::endl;
+				return false;
+			}
+			return true;
+		}
+		if (checksum_supported)
+		{
+			return false;
+		}
+	}
+
+	// Only allocated bytes are compared, so a page with none can't fail and doesn't need reading back.
+	if (!expected.is_page_allocated(address, size))
+	{
+		return true;
+	}
+
 	CAN_message read_memory = make_command(CANID_READ_MEMORY, target, 7);
 	uint8_t* data = read_memory.get_content();
 	data[1] = (address >> 24) & 0xFF;
@@ -376,12 +500,12 @@ bool CAN_module::verify_page(Memory_map& expected, size_t size, size_t address)
 	{
 		return false;
 	}
-	if (!iface->send_message(read_memory, TIMEOUT))
+	if (!send_request(read_memory))
 	{
 		std::cerr << "Failed to send read memory command" << std::endl;
 		return false;
 	}
-	if (!iface->receive_message(read_memory, TIMEOUT))
+	if (!await_reply(read_memory, CANID_READ_MEMORY))
 	{
 		std::cerr << "Failed to receive reply" << std::endl;
 		return false;
@@ -403,7 +527,7 @@ bool CAN_module::verify_page(Memory_map& expected, size_t size, size_t address)
 	bool verified = true;
 	for (int i = 0; i < number_of_messages; i++)
 	{
-		if (!iface->receive_message(read_memory, TIMEOUT))
+		if (!await_reply(read_memory, CANID_READ_DATA))
 		{
 			std::cerr << "Failed to receive message: " << i << std::endl;
 			return false;
@@ -411,7 +535,7 @@ bool CAN_module::verify_page(Memory_map& expected, size_t size, size_t address)
 		for (size_t j = 0; j < read_memory.get_length(); j++)
 		{
 			//std::cout << "Verifying address: " << (address+(i*8)+j) << std::endl;
-			if (expected.get_allocated_map()[address+(i*8)+j] == Memory_map::ALLOCATED)
+			if (expected.is_allocated(address+(i*8)+j))
 			{
 				if (expected.get_memory()[address+(i*8)+j] != read_memory.get_data()[j])
 				{
@@ -422,7 +546,7 @@ bool CAN_module::verify_page(Memory_map& expected, size_t size, size_t address)
 		}
 		read_memory = make_command(CANID_READ_DATA, target, 1);
 		//usleep(1*1000);
-		if (!iface->send_message(read_memory, TIMEOUT))
+		if (!send_request(read_memory))
 		{
 			bool check_reply(CAN_message& msg);
 			std::cerr << "Failed to send acknowledgement for message: " << i << std::endl;
@@ -457,13 +581,12 @@ bool CAN_module::read_page(Memory_map& destination, size_t size, size_t address)
 	{
 		return false;
 	}
-	std::cout << " " << data[5] << std::endl;
-	if (!iface->send_message(read_memory, TIMEOUT))
+	if (!send_request(read_memory))
 	{
 		std::cerr << "Failed to send read memory command" << std::endl;
 		return false;
 	}
-	if (!iface->receive_message(read_memory, TIMEOUT))
+	if (!await_reply(read_memory, CANID_READ_MEMORY))
 	{
 		std::cerr << "Failed to receive reply" << std::endl;
 		return false;
@@ -484,20 +607,15 @@ bool CAN_module::read_page(Memory_map& destination, size_t size, size_t address)
 	}
 	for (int i = 0; i < number_of_messages; i++)
 	{
-		if (!iface->receive_message(read_memory, TIMEOUT))
+		if (!await_reply(read_memory, CANID_READ_DATA))
 		{
 			std::cerr << "Failed to receive message: " << i << std::endl;
 			return false;
 		}
-		for (size_t j = 0; j < read_memory.get_length(); j++)
-		{
-			//std::cout << "Writing to address: " << (address+(i*8)+j) << std::endl;
-			destination.get_memory()[address+(i*8)+j] = read_memory.get_data()[j];
-			destination.get_allocated_map()[address+(i*8)+j] = Memory_map::ALLOCATED;
-		}
+		destination.write(address+(i*8), read_memory.get_data(), read_memory.get_length());
 		read_memory = make_command(CANID_READ_DATA, target, 1);
 		//usleep(1*1000);bool check_reply(CAN_message& msg);
-		if (!iface->send_message(read_memory, TIMEOUT))
+		if (!send_request(read_memory))
 		{
 			std::cerr << "Failed to send acknowledgement for message: " << i << std::endl;
 			return false;
@@ -506,6 +624,277 @@ bool CAN_module::read_page(Memory_map& destination, size_t size, size_t address)
 	return true;
 }
 
+bool CAN_module::read_pages(Memory_map& destination, size_t page_size, size_t address, size_t length)
+{
+	// Pages can only be streamed once a window has been agreed, and only by bootloaders new enough to do it.
+	if (!window_negotiated && !negotiate_window())
+	{
+		return false;
+	}
+	if ((window_size == 0) || !windowed_reads_supported)
+	{
+		return Comm_module::read_pages(destination, page_size, address, length);
+	}
+
+	if (!iface->clear_filter())
+	{
+		return false;
+	}
+	if (!iface->set_filter(CANID_READ_MEMORY, CAN_network_interface::INCLUDE) ||
+		!iface->set_filter(CANID_READ_DATA, CAN_network_interface::INCLUDE))
+	{
+		std::cerr << "Failed to set filter" << std::endl;
+		return false;
+	}
+
+	// Confirmations don't say which page they're for, so anything still on its way from a read which was given up on has to be out of the way first.
+	CAN_message stale;
+	while (iface->receive_message(stale, reply_timer.get_timeout()))
+	{
+		// Nothing to do here.
+	}
+
+	// Acknowledging every half window means the bootloader never has to stop and wait for us.
+	size_t ack_interval = (window_size > 1) ? (window_size / 2) : 1;
+	size_t end = address + length;
+	bool requested = false;
+	std::vector<uint8_t> page;
+	for (size_t page_address = address; page_address < end; page_address += page_size)
+	{
+		size_t size = (end - page_address < page_size) ? end - page_address : page_size;
+		if (!requested && !send_request(make_range_command(CANID_READ_MEMORY, target, size, page_address)))
+		{
+			std::cerr << "Failed to send read memory command" << std::endl;
+			return false;
+		}
+		requested = false;
+
+		// Anything still arriving from a page which was given up on is skipped.
+		CAN_message reply;
+		if (!await_reply(reply, CANID_READ_MEMORY))
+		{
+			std::cerr << "Failed to receive reply, ReadPages: " << page_address << std::endl;
+			return false;
+		}
+		if (!check_reply(reply))
+		{
+			std::cerr << "Reply indicates failure, ReadPages: " << page_address << std::endl;
+			return false;
+		}
+
+		// READ_DATA messages carry no sequence number, so the page is only kept once every message has arrived, each of the length expected.
+		size_t number_of_messages = (size + 7) / 8;
+		size_t received = 0;
+		size_t acknowledged = 0;
+		size_t next_address = page_address + page_size;
+		page.resize(size);
+		while (received < number_of_messages)
+		{
+			// The messages stream in without being asked for one at a time, so they're not timed as round trips.
+			if (!receive_reply(reply, reply_timer.get_timeout()))
+			{
+				reply_timer.record_timeout();
+				std::cerr << "Failed to receive message: " << received << " ReadPages: " << page_address << std::endl;
+				return false;
+			}
+			size_t expected_length = (size - received * 8 > 8) ? 8 : size - received * 8;
+			if ((reply.get_id() != CANID_READ_DATA) || (reply.get_length() != expected_length))
+			{
+				std::cerr << "Message missing from page, ReadPages: " << page_address << std::endl;
+				return false;
+			}
+			memcpy(&page[received * 8], reply.get_data(), expected_length);
+			received++;
+
+			// Once the next page has been asked for, the bootloader is done with this one, and any more acknowledgements would count against the next.
+			if (requested || (received == number_of_messages))
+			{
+				continue;
+			}
+			if (received - acknowledged >= ack_interval)
+			{
+				CAN_message read_data = make_command(CANID_READ_DATA, target, 2);
+				read_data.get_content()[1] = received & 0xFF;
+				if (!send_request(read_data))
+				{
+					std::cerr << "Failed to send acknowledgement for message: " << received << std::endl;
+					return false;
+				}
+				acknowledged = received;
+			}
+
+			// As soon as the rest of the page fits in the window, ask for the next one, which the bootloader starts on as soon as this one is out.
+			if ((number_of_messages - acknowledged <= window_size) && (next_address < end))
+			{
+				size_t next_size = (end - next_address < page_size) ? end - next_address : page_size;
+				if (!send_request(make_range_command(CANID_READ_MEMORY, target, next_size, next_address)))
+				{
+					std::cerr << "Failed to send read memory command" << std::endl;
+					return false;
+				}
+				requested = true;
+			}
+		}
+		destination.write(page_address, &page[0], size);
+	}
+	return true;
+}
+
+bool CAN_module::erase_memory(size_t address, size_t length)
+{
+	// Older bootloaders erase each page as it is written.
+	if (!erase_supported)
+	{
+		return true;
+	}
+	CAN_message erase = make_range_command(CANID_ERASE_MEMORY, target, length, address);
+	erase.set_length(8);
+	uint8_t* data = erase.get_content();
+	data[5] = (length >> 16) & 0xFF;
+	data[6] = (length >> 8) & 0xFF;
+	data[7] = (length) & 0xFF;
+	if (!iface->clear_filter())
+	{
+		return false;
+	}
+	if (!iface->set_filter(CANID_ERASE_MEMORY, CAN_network_interface::INCLUDE))
+	{
+		std::cerr << "Failed to set filter" << std::endl;
+		return false;
+	}
+	if (!iface->drain_messages())
+	{
+		return false;
+	}
+
+	// Erasing takes the bootloader much longer than a round trip, so this gets its own fixed timeout.  Erasing again does no harm, so a lost
+	// reply just means asking again.
+	for (int tries = 0; tries <= MAX_RETRIES; tries++)
+	{
+		if (tries > 0)
+		{
+			resends++;
+		}
+		CAN_message reply = erase;
+		if (!send_request(erase))
+		{
+			std::cerr << "Failed to send erase command" << std::endl;
+			return false;
+		}
+		if (receive_reply(reply, ERASE_TIMEOUT))
+		{
+			if (!check_reply(reply))
+			{
+				std::cerr << "Reply indicates failure, EraseMemory" << std::endl;
+				return false;
+			}
+			return true;
+		}
+	}
+	std::cerr << "Failed to receive erase confirmation" << std::endl;
+	return false;
+}
+
+bool CAN_module::erases_each_page()
+{
+	// Bootloaders which can erase a range do so because they can only erase whole sectors, and don't erase anything as they write pages.
+	return !erase_supported;
+}
+
+bool CAN_module::page_matches(Memory_map& expected, size_t size, size_t address)
+{
+	if (!checksum_probed || checksum_supported)
+	{
+		uint32_t checksum;
+		if (read_checksum(size, address, checksum))
+		{
+			return checksum == expected.get_checksum(address, size);
+		}
+		if (checksum_supported)
+		{
+			return false;
+		}
+	}
+
+	// Bootloaders which can't checksum a page have it read back instead.
+	return Comm_module::page_matches(expected, size, address);
+}
+
+bool CAN_module::image_matches(Memory_map& expected, size_t length)
+{
+	if (checksum_probed && !checksum_supported)
+	{
+		return false;
+	}
+	uint32_t checksum;
+	return read_checksum(length, 0, checksum) && (checksum == expected.get_checksum(0, length));
+}
+
+bool CAN_module::read_checksum(size_t size, size_t address, uint32_t& checksum)
+{
+	// Ranges longer than a 16 bit length use the long form of the command, with a 24 bit length instead.
+	CAN_message page_checksum = make_range_command(CANID_PAGE_CHECKSUM, target, size, address);
+	if (size > 0xFFFF)
+	{
+		page_checksum.set_length(8);
+		uint8_t* data = page_checksum.get_content();
+		data[5] = (size >> 16) & 0xFF;
+		data[6] = (size >> 8) & 0xFF;
+		data[7] = (size) & 0xFF;
+	}
+	if (!iface->clear_filter())
+	{
+		return false;
+	}
+	if (!iface->set_filter(CANID_PAGE_CHECKSUM, CAN_network_interface::INCLUDE))
+	{
+		std::cerr << "Failed to set filter" << std::endl;
+		return false;
+	}
+	if (!iface->drain_messages())
+	{
+		return false;
+	}
+
+	// Checksumming the whole image takes the bootloader much longer than a round trip, so that gets the fixed timeout.
+	bool replied;
+	if (checksum_probed && (size <= 0xFFFF))
+	{
+		replied = transact(page_checksum);
+	}
+	else
+	{
+		if (!send_request(page_checksum))
+		{
+			std::cerr << "Failed to send page checksum command" << std::endl;
+			return false;
+		}
+		replied = receive_reply(page_checksum, checksum_probed ? TIMEOUT : NEGOTIATION_TIMEOUT);
+	}
+	if (!replied)
+	{
+		if (!checksum_probed)
+		{
+			// Older bootloaders just ignore the command, so the caller has to fall back to reading pages back.
+			checksum_probed = true;
+			std::cout << "Bootloader can't checksum pages, reading them back instead." << std::endl;
+			return false;
+		}
+		std::cerr << "Failed to receive page checksum" << std::endl;
+		return false;
+	}
+	checksum_probed = true;
+	checksum_supported = true;
+	if (!check_reply(page_checksum) || page_checksum.get_length() < 5)
+	{
+		std::cerr << "Reply indicates failure, PageChecksum" << std::endl;
+		return false;
+	}
+	const uint8_t* data = page_checksum.get_data();
+	checksum = (static_cast<uint32_t>(data[1]) << 24) | (data[2] << 16) | (data[3] << 8) | (data[4]);
+	return true;
+}
+
 bool CAN_module::reset_device(bool run_application)
 {
 	CAN_message reset_message = make_command(CANID_REQUEST_RESET, target, 2);
@@ -524,11 +913,11 @@ bool CAN_module::reset_device(bool run_application)
 		return false;
 	}
 	// std::cout << "DATA [1] : " << (run_application ? 1 : 0) << std::endl;
-	if (!iface->send_message(reset_message, TIMEOUT))
+	if (!send_request(reset_message))
 	{
 		return false;
 	}
-	if (!iface->receive_message(reset_message, TIMEOUT))
+	if (!receive_reply(reset_message, TIMEOUT))
 	{
 		std::cerr << "Warning did not receive reset reply." << std::endl;
 	}
@@ -568,15 +957,716 @@ bool CAN_module::reset_device(bool run_application)
 	return connect_to_device();
 }
 
-CAN_message make_command(uint32_t id, uint8_t target, size_t length)
+bool CAN_module::send_request(const CAN_message& msg)
 {
-	CAN_message msg;
-	msg.set_id(id);
-	msg.set_length(length);
-	msg.get_content()[0]=target;
-	return msg;
-}
-
+	if (!iface->send_message(msg, TIMEOUT))
+	{
+		return false;
+	}
+
+	// The round trip is timed from when the request has gone, so it doesn't include waiting for the interface.
+	clock_gettime(CLOCK_MONOTONIC, &request_sent);
+	return true;
+}
+
+bool CAN_module::send_requests(const CAN_message_queue& msgs)
+{
+	if (!iface->send_messages(msgs, TIMEOUT))
+	{
+		return false;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &request_sent);
+	return true;
+}
+
+bool CAN_module::receive_reply(CAN_message& msg, uint32_t timeout)
+{
+	if (!iface->receive_message(msg, timeout))
+	{
+		reply_timeouts++;
+		return false;
+	}
+	reply_rtt.record_since(request_sent);
+	return true;
+}
+
+bool CAN_module::await_reply(CAN_message& msg, uint32_t id)
+{
+	// Replies to anything else are left over from a request which was sent again, so they're skipped.
+	do
+	{
+		if (!receive_reply(msg, reply_timer.get_timeout()))
+		{
+			reply_timer.record_timeout();
+			return false;
+		}
+	}
+	while (msg.get_id() != id);
+	reply_timer.record_since(request_sent);
+	
+	// All done.
+	return true;
+}
+
+bool CAN_module::transact(CAN_message& msg)
+{
+	// Only used for commands which do the same thing however many times they're received, so a lost request or reply just means asking again.
+	CAN_message request = msg;
+	for (int tries = 0; tries <= MAX_RETRIES; tries++)
+	{
+		if (tries > 0)
+		{
+			resends++;
+		}
+		if (!send_request(request))
+		{
+			return false;
+		}
+		if (await_reply(msg, request.get_id()))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+bool CAN_module::negotiate_window()
+{
+	// Whatever happens, we only try this once.
+	window_negotiated = true;
+	window_size = 0;
+	frame_payload = WINDOWED_PAYLOAD;
+	fd_frames = false;
+	if (requested_window == 0)
+	{
+		// The legacy protocol was asked for explicitly.
+		return true;
+	}
+
+	CAN_message set_window = make_command(CANID_SET_WINDOW, target, 2);
+	set_window.get_content()[1] = requested_window;
+	if (!iface->clear_filter())
+	{
+		return false;
+	}
+	if (!iface->set_filter(CANID_SET_WINDOW, CAN_network_interface::INCLUDE))
+	{
+		std::cerr << "Failed to set filter" << std::endl;
+		return false;
+	}
+	if (!iface->drain_messages())
+	{
+		return false;
+	}
+
+	// Over CAN-FD, first ask for WRITE_DATA messages as long as a CAN-FD frame can be.  Bootloaders which can take them say how long they may be
+	// in their reply, and the rest refuse this form of the command, so are asked again without it.
+	if (iface->supports_fd())
+	{
+		CAN_message set_window_fd = set_window;
+		set_window_fd.set_length(3);
+		set_window_fd.get_content()[2] = CAN_FD_MAX_LENGTH;
+		if (!send_request(set_window_fd))
+		{
+			std::cerr << "Failed to send set window command" << std::endl;
+			return false;
+		}
+		if (!receive_reply(set_window_fd, NEGOTIATION_TIMEOUT))
+		{
+			// Older bootloaders just ignore the command, however it is sent.
+			std::cout << "Bootloader does not support windowed transfers, using legacy protocol." << std::endl;
+			return true;
+		}
+		size_t frame_length = (set_window_fd.get_length() >= 4) ? set_window_fd.get_data()[2] : 0;
+		if (check_reply(set_window_fd) && (frame_length > CAN_CLASSIC_MAX_LENGTH) && (frame_length <= CAN_FD_MAX_LENGTH) &&
+			(round_up_fd_length(frame_length) == frame_length))
+		{
+			window_size = set_window_fd.get_data()[1];
+			frame_payload = frame_length - 2;
+			fd_frames = true;
+			std::cout << "Using windowed CAN-FD transfers, window size: " << (int)window_size << ", message length: " << frame_length << std::endl;
+			return true;
+		}
+	}
+	if (!send_request(set_window))
+	{
+		std::cerr << "Failed to send set window command" << std::endl;
+		return false;
+	}
+	if (!receive_reply(set_window, NEGOTIATION_TIMEOUT) || !check_reply(set_window) || set_window.get_length() < 2)
+	{
+		// Older bootloaders just ignore the command, so fall back to acknowledging every message.
+		std::cout << "Bootloader does not support windowed transfers, using legacy protocol." << std::endl;
+		return true;
+	}
+	window_size = set_window.get_data()[1];
+	std::cout << "Using windowed transfers, window size: " << (int)window_size << std::endl;
+	return true;
+}
+
+bool CAN_module::write_page_windowed(const std::vector<uint8_t>& payload)
+{
+	// Each message carries the node ID, a sequence number and up to six bytes of data, or more if CAN-FD messages were agreed.
+	size_t number_of_messages = (payload.size() + frame_payload - 1) / frame_payload;
+	size_t acknowledged = 0;
+	size_t next_message = 0;
+	int retries = 0;
+	CAN_message write_data;
+	while (acknowledged < number_of_messages)
+	{
+		// Keep queueing messages until the window is full, or there is nothing left to send.
+		CAN_message_queue window;
+		while (next_message < number_of_messages && next_message < acknowledged + window_size)
+		{
+			window.push_back(make_write_data(payload, target, next_message, frame_payload, fd_frames));
+			next_message++;
+		}
+
+		// Hand the whole window to the interface at once, so it can batch the transmission.
+		if (!window.empty() && !send_requests(window))
+		{
+			std::cerr << "Failed to send data packets: " << acknowledged << std::endl;
+			return false;
+		}
+
+		// The bootloader acknowledges once per window, and at the end of the page.
+		if (!await_reply(write_data, CANID_WRITE_DATA))
+		{
+			if (++retries > MAX_RETRIES)
+			{
+				std::cerr << "Failed to receive window acknowledge, WritePage: " << acknowledged << std::endl;
+				return false;
+			}
+			resends++;
+			if ((retries == 1) && (next_message > acknowledged))
+			{
+				// Usually it's just the acknowledgement or the last message which went missing, and the last message was the end of a window,
+				// so sending only that makes the bootloader say where it got up to, without sending the whole window again.
+				if (!send_request(make_write_data(payload, target, next_message - 1, frame_payload, fd_frames)))
+				{
+					std::cerr << "Failed to send data packet: " << next_message - 1 << std::endl;
+					return false;
+				}
+				continue;
+			}
+			// That didn't get an answer either, so go back and resend everything which hasn't been acknowledged.
+			next_message = acknowledged;
+			continue;
+		}
+		if (!check_reply(write_data) || write_data.get_length() < 2)
+		{
+			std::cerr << "Acknowledge indicates failure:" << acknowledged << std::endl;
+			return false;
+		}
+
+		// The acknowledgement holds the next sequence number expected, which is only eight bits, so work out how far we moved.
+		size_t progress = static_cast<uint8_t>(write_data.get_data()[1] - (acknowledged & 0xFF));
+		if (acknowledged + progress > next_message)
+		{
+			std::cerr << "Acknowledge out of sequence:" << acknowledged << std::endl;
+			return false;
+		}
+		if (progress > 0)
+		{
+			retries = 0;
+		}
+		acknowledged += progress;
+
+		// The bootloader only acknowledges part way through a window when part of it was lost, so resend from where it got up to.
+		if (!is_window_boundary(acknowledged, number_of_messages, window_size))
+		{
+			next_message = acknowledged;
+		}
+	}
+	return true;
+}
+
+uint8_t CAN_module::encode_page(Memory_map& source, size_t size, size_t address, bool allow_compression, std::vector<uint8_t>& payload)
+{
+	std::vector<uint8_t> page(size);
+	source.read(address, &page[0], size);
+	raw_bytes += size;
+
+	// Only send the page encoded if that actually makes it shorter, since data which doesn't repeat grows slightly.
+	payload.clear();
+	if (allow_compression)
+	{
+		rle_compress(page, payload);
+		if (payload.size() < page.size())
+		{
+			sent_bytes += payload.size();
+			return ENCODING_RLE;
+		}
+	}
+	payload.swap(page);
+	sent_bytes += payload.size();
+	return ENCODING_NONE;
+}
+
+bool CAN_module::get_compression_stats(size_t& raw_bytes, size_t& sent_bytes)
+{
+	raw_bytes = this->raw_bytes;
+	sent_bytes = this->sent_bytes;
+	return true;
+}
+
+void CAN_module::add_to_report(Run_report& report)
+{
+	Comm_module::add_to_report(report);
+	report.get_histogram("reply_rtt") = reply_rtt;
+	report.add_to_counter("reply_timeouts", reply_timeouts);
+	report.add_to_counter("resends", resends);
+	report.set_value("window_size", window_size);
+	report.set_value("write_data_length", frame_payload + 2);
+
+	// All done.
+	return;
+}
+
+bool CAN_module::write_fleet(std::vector<Fleet_job>& jobs, size_t page_size, uint32_t signature)
+{
+	std::vector<Fleet_node> nodes;
+	std::vector<Fleet_node> serial_nodes;
+
+	// Nodes are set up one at a time, since until we know a node tags its replies, they can't be told apart from anyone else's.
+	for (size_t i = 0; i < jobs.size(); i++)
+	{
+		Fleet_node node;
+		if (!prepare_fleet_node(jobs[i], page_size, signature, node))
+		{
+			continue;
+		}
+		if (node.replies_tagged && node.window > 0)
+		{
+			nodes.push_back(node);
+		}
+		else
+		{
+			std::cout << "Target " << jobs[i].target << " has an older bootloader, it will be written on its own." << std::endl;
+			serial_nodes.push_back(node);
+		}
+	}
+
+	// Write every node which can share the bus at once, then any others one after another.
+	if (!nodes.empty())
+	{
+		write_fleet_interleaved(nodes, page_size);
+	}
+	for (size_t i = 0; i < serial_nodes.size(); i++)
+	{
+		write_fleet_serial(serial_nodes[i], page_size);
+		nodes.push_back(serial_nodes[i]);
+	}
+
+	// Read back and start each node which was written successfully.
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		Fleet_node& node = nodes[i];
+		load_fleet_node(node);
+		for (size_t page_address = 0; (node.state == Fleet_node::DONE) && (page_address <= node.end_page); page_address += page_size)
+		{
+			int retries = 0;
+			while (!verify_page(*node.job->image, page_size, page_address))
+			{
+				if (++retries >= MAX_RETRIES)
+				{
+					std::ostringstream reason;
+					reason << "Verify flash page at: " << page_address << " Failed";
+					fail_fleet_node(node, reason.str());
+					break;
+				}
+			}
+		}
+		if ((node.state == Fleet_node::DONE) && !reset_device(true))
+		{
+			fail_fleet_node(node, "Failed to reset device.");
+		}
+	}
+
+	for (size_t i = 0; i < jobs.size(); i++)
+	{
+		if (jobs[i].failed)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool CAN_module::prepare_fleet_node(Fleet_job& job, size_t page_size, uint32_t signature, Fleet_node& node)
+{
+	node.job = &job;
+	node.window = 0;
+	node.page_address = 0;
+	node.retries = 0;
+	job.pages_written = 0;
+	job.pages_total = 0;
+	job.failed = false;
+	if (!parse_node_id(job.target, node.node))
+	{
+		fail_fleet_node(node, "Invalid target node ID");
+		return false;
+	}
+
+	// Every reply starts with a status byte of 0 or 1, so nodes with those IDs would take each other's replies for commands.
+	if (node.node <= 1)
+	{
+		fail_fleet_node(node, "Node IDs 0 and 1 can't be used when programming more than one device");
+		return false;
+	}
+	if (!job.image->find_last_allocated_page(page_size, node.end_page))
+	{
+		fail_fleet_node(node, "Could not find a last allocated page, is the memory map empty?");
+		return false;
+	}
+	job.pages_total = node.end_page/page_size + 1;
+
+	target = node.node;
+	have_target = true;
+	
+	// Nothing is known about this node's bootloader yet, whatever the last node could do.
+	checksum_probed = false;
+	checksum_supported = false;
+	Device_info info;
+	if (!get_device_info(info))
+	{
+		fail_fleet_node(node, "Failed to retrieve device information");
+		return false;
+	}
+	if (info.get_signature() != signature)
+	{
+		fail_fleet_node(node, "Signature Mismatch");
+		return false;
+	}
+
+	// Bootloaders which erase by sector don't erase anything as they write, so the image has to be erased before any of it is written.
+	if (!erase_memory(0, node.end_page + page_size))
+	{
+		fail_fleet_node(node, "Failed to erase the device");
+		return false;
+	}
+
+	// Each node negotiates its own window, since they may not all be running the same bootloader.
+	window_negotiated = false;
+	if (!negotiate_window())
+	{
+		fail_fleet_node(node, "Failed to negotiate window");
+		return false;
+	}
+	save_fleet_node(node);
+	node.compress = compress && compression_supported;
+	start_fleet_page(node, page_size);
+	return true;
+}
+
+void CAN_module::save_fleet_node(Fleet_node& node)
+{
+	node.window = window_size;
+	node.replies_tagged = replies_tagged;
+	node.frame_payload = frame_payload;
+	node.fd_frames = fd_frames;
+	node.windowed_reads_supported = windowed_reads_supported;
+	node.erase_supported = erase_supported;
+	node.checksum_probed = checksum_probed;
+	node.checksum_supported = checksum_supported;
+	node.compression_supported = compression_supported;
+}
+
+void CAN_module::load_fleet_node(const Fleet_node& node)
+{
+	// The module only keeps the capabilities of one bootloader at a time, so they have to be swapped over whenever the node changes.
+	target = node.node;
+	have_target = true;
+	window_size = node.window;
+	window_negotiated = true;
+	replies_tagged = node.replies_tagged;
+	frame_payload = node.frame_payload;
+	fd_frames = node.fd_frames;
+	windowed_reads_supported = node.windowed_reads_supported;
+	erase_supported = node.erase_supported;
+	checksum_probed = node.checksum_probed;
+	checksum_supported = node.checksum_supported;
+	compression_supported = node.compression_supported;
+}
+
+void CAN_module::write_fleet_interleaved(std::vector<Fleet_node>& nodes, size_t page_size)
+{
+	// From here on, only the replies to writing are of interest, whichever node they come from.
+	if (!iface->clear_filter() ||
+		!iface->set_filter(CANID_WRITE_MEMORY, CAN_network_interface::INCLUDE) ||
+		!iface->set_filter(CANID_WRITE_DATA, CAN_network_interface::INCLUDE) ||
+		!iface->drain_messages())
+	{
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			fail_fleet_node(nodes[i], "Failed to set filter");
+		}
+		return;
+	}
+
+	// Start every node off on its first page.
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		send_fleet_command(nodes[i], page_size);
+	}
+
+	size_t pages_written = 0;
+	bool active = true;
+	while (active)
+	{
+		CAN_message reply;
+		if (iface->receive_message(reply, FLEET_POLL) && reply.get_length() >= 2)
+		{
+			// Every reply ends with the ID of the node which sent it.
+			uint8_t sender = reply.get_data()[reply.get_length() - 1];
+			for (size_t i = 0; i < nodes.size(); i++)
+			{
+				if (nodes[i].node == sender)
+				{
+					handle_fleet_reply(nodes[i], reply, page_size);
+					break;
+				}
+			}
+		}
+
+		// Any node which has been quiet for too long gets everything it hasn't acknowledged sent again.
+		timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		active = false;
+		size_t total = 0;
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			Fleet_node& node = nodes[i];
+			total += node.job->pages_written;
+			if ((node.state != Fleet_node::WRITE_MEMORY) && (node.state != Fleet_node::WRITE_DATA))
+			{
+				continue;
+			}
+			if (elapsed_nanoseconds(node.deadline, now) > 0)
+			{
+				reply_timer.record_timeout();
+				if (++node.retries > MAX_RETRIES)
+				{
+					fail_fleet_node(node, "Timed out waiting for reply");
+					continue;
+				}
+				node.next_message = node.acknowledged;
+				resends++;
+				if (!send_fleet_command(node, page_size))
+				{
+					continue;
+				}
+			}
+			active = true;
+		}
+
+		// Show how far each node has got, whenever any of them finishes a page.
+		if (total != pages_written)
+		{
+			pages_written = total;
+			std::cout << "\rWriting:";
+			for (size_t i = 0; i < nodes.size(); i++)
+			{
+				std::cout << " " << nodes[i].job->target << " " << nodes[i].job->pages_written << "/" << nodes[i].job->pages_total;
+			}
+			std::cout.flush();
+		}
+	}
+	std::cout << std::endl;
+}
+
+void CAN_module::write_fleet_serial(Fleet_node& node, size_t page_size)
+{
+	load_fleet_node(node);
+	for (; node.page_address <= node.end_page; node.page_address += page_size)
+	{
+		std::cout << "Target " << node.job->target << " writing page: " << node.job->pages_written + 1 << " of : " << node.job->pages_total << std::endl;
+		int retries = 0;
+		while (!write_page(*node.job->image, page_size, node.page_address))
+		{
+			if (++retries >= MAX_RETRIES)
+			{
+				std::ostringstream reason;
+				reason << "Failed to write flash page at: " << node.page_address;
+				fail_fleet_node(node, reason.str());
+				return;
+			}
+		}
+		node.job->pages_written++;
+	}
+	node.state = Fleet_node::DONE;
+}
+
+void CAN_module::start_fleet_page(Fleet_node& node, size_t page_size)
+{
+	// The page is only encoded once, however many times it ends up being sent.
+	node.encoding = encode_page(*node.job->image, page_size, node.page_address, node.compress, node.payload);
+	node.state = Fleet_node::WRITE_MEMORY;
+}
+
+bool CAN_module::send_fleet_command(Fleet_node& node, size_t page_size)
+{
+	CAN_message_queue messages;
+	if (node.state == Fleet_node::WRITE_MEMORY)
+	{
+		messages.push_back(make_write_memory(node.node, page_size, node.page_address, node.encoding));
+	}
+	else
+	{
+		// Fill up whatever room there is in the node's window.
+		while (node.next_message < node.number_of_messages && node.next_message < node.acknowledged + node.window)
+		{
+			messages.push_back(make_write_data(node.payload, node.node, node.next_message, node.frame_payload, node.fd_frames));
+			node.next_message++;
+		}
+	}
+	if (!messages.empty() && !iface->send_messages(messages, TIMEOUT))
+	{
+		fail_fleet_node(node, "Failed to send command");
+		return false;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &node.sent);
+	node.deadline = node.sent;
+	add_milliseconds(node.deadline, reply_timer.get_timeout());
+	return true;
+}
+
+void CAN_module::handle_fleet_reply(Fleet_node& node, CAN_message& reply, size_t page_size)
+{
+	if (node.state == Fleet_node::WRITE_MEMORY)
+	{
+		// Anything else is left over from before the node moved on to this page.
+		if (reply.get_id() != CANID_WRITE_MEMORY)
+		{
+			return;
+		}
+		reply_rtt.record_since(node.sent);
+		reply_timer.record_since(node.sent);
+		if (!check_reply(reply))
+		{
+			fail_fleet_node(node, "Reply indicates failure, WritePage");
+			return;
+		}
+		node.state = Fleet_node::WRITE_DATA;
+		node.number_of_messages = (node.payload.size() + node.frame_payload - 1) / node.frame_payload;
+		node.acknowledged = 0;
+		node.next_message = 0;
+		node.retries = 0;
+		send_fleet_command(node, page_size);
+		return;
+	}
+	if ((node.state != Fleet_node::WRITE_DATA) || (reply.get_id() != CANID_WRITE_DATA) || (reply.get_length() < 3))
+	{
+		return;
+	}
+	if (!check_reply(reply))
+	{
+		// The bootloader has lost track of the page (usually because its last acknowledgement went missing), so start the page again.
+		if (++node.retries > MAX_RETRIES)
+		{
+			fail_fleet_node(node, "Acknowledge indicates failure");
+			return;
+		}
+		node.state = Fleet_node::WRITE_MEMORY;
+		send_fleet_command(node, page_size);
+		return;
+	}
+
+	// The acknowledgement holds the next sequence number expected, which is only eight bits, so work out how far we moved.
+	size_t progress = static_cast<uint8_t>(reply.get_data()[1] - (node.acknowledged & 0xFF));
+	if (node.acknowledged + progress > node.next_message)
+	{
+		// This must be left over from before a resend, so it tells us nothing.
+		return;
+	}
+	reply_rtt.record_since(node.sent);
+	reply_timer.record_since(node.sent);
+	if (progress > 0)
+	{
+		node.retries = 0;
+	}
+	node.acknowledged += progress;
+	if (node.acknowledged == node.number_of_messages)
+	{
+		// That was the whole page, so move on to the next one, if there is one.
+		node.job->pages_written++;
+		node.page_address += page_size;
+		if (node.page_address > node.end_page)
+		{
+			node.state = Fleet_node::DONE;
+			return;
+		}
+		start_fleet_page(node, page_size);
+		send_fleet_command(node, page_size);
+		return;
+	}
+
+	// The bootloader only acknowledges part way through a window when part of it was lost, so resend from where it got up to.
+	if (!is_window_boundary(node.acknowledged, node.number_of_messages, node.window))
+	{
+		node.next_message = node.acknowledged;
+	}
+	send_fleet_command(node, page_size);
+}
+
+void CAN_module::fail_fleet_node(Fleet_node& node, std::string reason)
+{
+	node.state = Fleet_node::FAILED;
+	node.job->failed = true;
+	node.job->error = reason;
+}
+
+CAN_message make_command(uint32_t id, uint8_t target, size_t length)
+{
+	CAN_message msg;
+	msg.set_id(id);
+	msg.set_length(length);
+	msg.get_content()[0]=target;
+	return msg;
+}
+
+CAN_message make_range_command(uint32_t id, uint8_t target, size_t size, size_t address)
+{
+	CAN_message command = make_command(id, target, 7);
+	uint8_t* data = command.get_content();
+	data[1] = (address >> 24) & 0xFF;
+	data[2] = (address >> 16) & 0xFF;
+	data[3] = (address >> 8) &0xFF;
+	data[4] = (address) & 0xFF;
+	data[5] = (size >> 8) &0xFF;
+	data[6] = (size) & 0xFF;
+	return command;
+}
+
+CAN_message make_write_memory(uint8_t target, size_t size, size_t address, uint8_t encoding)
+{
+	// Plain pages use the original form of the command, so that older bootloaders still understand it.
+	CAN_message write_memory = make_range_command(CANID_WRITE_MEMORY, target, size, address);
+	if (encoding != ENCODING_NONE)
+	{
+		write_memory.set_length(8);
+		write_memory.get_content()[7] = encoding;
+	}
+	return write_memory;
+}
+
+CAN_message make_write_data(const std::vector<uint8_t>& payload, uint8_t target, size_t sequence, size_t frame_payload, bool fd)
+{
+	size_t offset = sequence * frame_payload;
+	size_t packet_size = (payload.size() - offset > frame_payload) ? frame_payload : payload.size() - offset;
+	CAN_message write_data = make_command(CANID_WRITE_DATA, target, packet_size+2);
+	write_data.get_content()[1] = sequence & 0xFF;
+	memcpy(write_data.get_content()+2, &payload[offset], packet_size);
+	if (fd)
+	{
+		// CAN-FD frames only come in certain lengths, so the last message of a page may be padded out.  The bootloader ignores anything
+		// past the end of the page.
+		write_data.set_fd(true);
+		write_data.set_length(round_up_fd_length(packet_size + 2));
+	}
+	return write_data;
+}
+
 bool check_reply(CAN_message& msg)
 {
 	if (msg.get_length() < 1)
@@ -586,4 +1676,22 @@ bool check_reply(CAN_message& msg)
 	return msg.get_data()[0] != 0;
 }
 
+bool parse_node_id(std::string text, uint8_t& node)
+{
+	char* end;
+	unsigned long value = strtoul(text.c_str(), &end, 16);
+	if (text.empty() || (static_cast<size_t>(end - text.c_str()) != text.length()) || (value > 0xFF))
+	{
+		return false;
+	}
+	node = value;
+	return true;
+}
+
+bool is_window_boundary(size_t sequence, size_t number_of_messages, uint8_t window)
+{
+	// This has to match where the bootloader sends its acknowledgements, including its sequence number wrapping at eight bits.
+	return (sequence == number_of_messages) || (((sequence & 0xFF) % window) == 0);
+}
+
 //ALL DONE.
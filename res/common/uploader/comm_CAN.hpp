@@ -50,6 +50,8 @@
 
 // INCLUDE REQUIRED HEADER FILES.
 
+#include <time.h>
+
 #include "cannetworkinterface.hpp"
 #include "comm.hpp"
 
@@ -76,18 +78,128 @@ public:
 	virtual bool write_page(Memory_map& source, size_t size, size_t address);
 	virtual bool verify_page(Memory_map& expected, size_t size, size_t address);
 	virtual bool read_page(Memory_map& destination, size_t size, size_t address);
+	virtual bool page_matches(Memory_map& expected, size_t size, size_t address);
+	virtual bool image_matches(Memory_map& expected, size_t length);
+	virtual bool read_pages(Memory_map& destination, size_t page_size, size_t address, size_t length);
+	virtual bool erase_memory(size_t address, size_t length);
+	virtual bool erases_each_page();
 	
 	virtual bool reset_device(bool run_application);
 	
+	virtual bool write_fleet(std::vector<Fleet_job>& jobs, size_t page_size, uint32_t signature);
+	
+	virtual bool get_compression_stats(size_t& raw_bytes, size_t& sent_bytes);
+	virtual void add_to_report(Run_report& report);
 	
 private:
+	// Types.
+	
+	/**
+	 *  Where a single node has got to while several nodes are being written at once.
+	 */
+	struct Fleet_node
+	{
+		enum State
+		{
+			WRITE_MEMORY,
+			WRITE_DATA,
+			DONE,
+			FAILED
+		};
+		
+		Fleet_job* job;
+		uint8_t node;
+		uint8_t window;
+		bool compress;
+		
+		// What the node's bootloader can do, which is loaded back into the module before the node is written to or verified on its own.
+		bool replies_tagged;
+		size_t frame_payload;
+		bool fd_frames;
+		bool windowed_reads_supported;
+		bool erase_supported;
+		bool checksum_probed;
+		bool checksum_supported;
+		bool compression_supported;
+		
+		State state;
+		size_t end_page;
+		size_t page_address;
+		uint8_t encoding;
+		std::vector<uint8_t> payload;
+		size_t number_of_messages;
+		size_t acknowledged;
+		size_t next_message;
+		int retries;
+		timespec sent;
+		timespec deadline;
+	};
+	
 	// Functions.
+	bool send_request(const CAN_message& msg);
+	bool send_requests(const CAN_message_queue& msgs);
+	bool receive_reply(CAN_message& msg, uint32_t timeout);
+	bool await_reply(CAN_message& msg, uint32_t id);
+	bool transact(CAN_message& msg);
+	bool negotiate_window();
+	bool write_page_windowed(const std::vector<uint8_t>& payload);
+	uint8_t encode_page(Memory_map& source, size_t size, size_t address, bool allow_compression, std::vector<uint8_t>& payload);
+	bool read_checksum(size_t size, size_t address, uint32_t& checksum);
+	bool prepare_fleet_node(Fleet_job& job, size_t page_size, uint32_t signature, Fleet_node& node);
+	void save_fleet_node(Fleet_node& node);
+	void load_fleet_node(const Fleet_node& node);
+	void write_fleet_interleaved(std::vector<Fleet_node>& nodes, size_t page_size);
+	void write_fleet_serial(Fleet_node& node, size_t page_size);
+	void start_fleet_page(Fleet_node& node, size_t page_size);
+	bool send_fleet_command(Fleet_node& node, size_t page_size);
+	void handle_fleet_reply(Fleet_node& node, CAN_message& reply, size_t page_size);
+	void fail_fleet_node(Fleet_node& node, std::string reason);
 	
 	//Fields.
 	bool connected;
 	uint8_t target;
+	bool have_target;
+	
+	// Whether the bootloader ends each reply with its own node ID, which is what lets replies from several nodes be told apart.
+	bool replies_tagged;
 	CAN_network_interface* iface;
 	
+	// Window size asked for on the command line, and the one the bootloader agreed to (zero means the legacy protocol).
+	uint8_t requested_window;
+	uint8_t window_size;
+	bool window_negotiated;
+	
+	// Bytes of page data in each windowed WRITE_DATA message, and whether those messages are sent as CAN-FD frames.
+	size_t frame_payload;
+	bool fd_frames;
+	
+	// Whether the bootloader is new enough to stream the pages it reads a window at a time.
+	bool windowed_reads_supported;
+	
+	// Whether the bootloader is new enough to erase a range of flash up front, rather than each page as it is written.
+	bool erase_supported;
+	
+	// Whether we've found out yet if the bootloader can checksum pages, and if it can.
+	bool checksum_probed;
+	bool checksum_supported;
+	
+	// Whether pages are verified by reading them back in full, rather than by having the bootloader checksum them.
+	bool verify_readback;
+	
+	// Whether pages may be sent run length encoded, and whether the bootloader is new enough to decode them.
+	bool compress;
+	bool compression_supported;
+	
+	// Bytes of page data written so far, before and after encoding.
+	size_t raw_bytes;
+	size_t sent_bytes;
+	
+	// Time from the last request going out to each reply coming back, along with how many replies never came and had to be asked for again.
+	timespec request_sent;
+	Latency_histogram reply_rtt;
+	size_t reply_timeouts;
+	size_t resends;
+	
 };
 
  
@@ -52,7 +52,22 @@
 // DEFINE PRIVATE MACROS.
 
 #define MAX_RETRIES 5
-#define TIMEOUT 10
+
+// Time to wait for the bootloader to answer while syncing, in ms.  It may still be starting up, so this doesn't depend on the round trip.
+#define SYNC_TIMEOUT 1000
+
+// Size of the receive ring, must be a power of two.
+#define RX_RING_SIZE 1024
+
+// Maximum message body length for the STK500v2 protocol.
+#define MAX_MESSAGE_LENGTH 275
+
+// Extensions to the protocol, for bootloaders which can program pages in any order.
+// The parameter reads as the number of pages the bootloader can have in flight, a stock bootloader reads it as zero.
+#define PARAM_EXTENDED_DEPTH 0xC0
+// Erases and programs a single page: the byte address (4 bytes, big endian), the length (2 bytes, big endian) then the data.
+#define CMD_PROGRAM_PAGE_EXT 0x60
+#define PROGRAM_PAGE_EXT_HEADER 7
 
 // DEFINE PRIVATE TYPES AND STRUCTS.
 
@@ -68,13 +83,20 @@ speed_t get_speed(unsigned long speed);
 bool set_cts_dtr(int fd, bool on);
 bool serial_drain(int fd);
 bool serial_send(int fd, uint8_t* buf, size_t buf_len);
-bool serial_recv(int fd, uint8_t* buf, size_t buf_len, size_t& bytes_read);
 
 
 // IMPLEMENT PUBLIC FUNCTIONS.
 
 STK500v2_module::STK500v2_module() :
-	Comm_module("stk500v2")
+	Comm_module("stk500v2"),
+	rx_ring(RX_RING_SIZE),
+	rx_head(0),
+	rx_tail(0),
+	use_extended(true),
+	extended_depth(0),
+	failed_commands(0),
+	command_resends(0),
+	page_rewrites(0)
 {
 	//Nothing to do here.
 }
@@ -99,6 +121,10 @@ bool STK500v2_module::init(Params params)
 		speed_str = params["speed"];
 		have_speed = true;
 	}
+	if (params.find("extended") != params.end())
+	{
+		use_extended = (params["extended"] != "off");
+	}
 	
 	if (! have_tty)
 	{
@@ -114,6 +140,23 @@ bool STK500v2_module::init(Params params)
 	}
 	stk500_seq_no = 0;
 	connected = false;
+	command_rtt = Latency_histogram();
+	page_rtt = Latency_histogram();
+	failed_commands = 0;
+	command_resends = 0;
+	page_rewrites = 0;
+	if (!init_reply_timeout(params))
+	{
+		return false;
+	}
+
+	// A daemon initialises the module again for every job, so let go of the port from the last one first.
+	if (tty_fd > 0)
+	{
+		close_serial();
+	}
+	rx_head = 0;
+	rx_tail = 0;
 	if (!open_serial())
 	{
 		return false;
@@ -131,6 +174,11 @@ bool STK500v2_module::connect_to_device()
 	
 	if (connected)
 	{
+		extended_depth = 0;
+		if (use_extended && stk500_get_extended_depth() && extended_depth > 0)
+		{
+			std::cout << "Bootloader supports extended mode, with " << extended_depth << " pages in flight." << std::endl;
+		}
 		return true;
 	}
 	
@@ -175,6 +223,32 @@ bool STK500v2_module::get_device_info( Device_info& info)
 
 bool STK500v2_module::write_page(Memory_map& source, size_t size, size_t address)
 {
+	if (extended_depth > 0)
+	{
+		// Each page is erased on its own, so pages with nothing in them can simply be left out.
+		if (!source.is_page_allocated(address, size))
+		{
+			return true;
+		}
+		
+		// Don't wait for this page's reply, only for the ones which would leave too many in flight.
+		if (!collect_queued_pages(extended_depth - 1))
+		{
+			return false;
+		}
+		Queued_page page;
+		page.source = &source;
+		page.size = size;
+		page.address = address;
+		if (!send_page(source, size, address, page.sequence))
+		{
+			return false;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &page.sent);
+		queued_pages.push_back(page);
+		return true;
+	}
+	
 	if (!stk500_load_address(address >> 1, source.get_size() > 64*1024))
 	{
 		return false;
@@ -200,17 +274,7 @@ bool STK500v2_module::write_page(Memory_map& source, size_t size, size_t address
 	buffer[0] = CMD_PROGRAM_FLASH_ISP;
 	buffer[1] = (size >> 8) & 0xFF;
 	buffer[2] = (size) & 0xFF;
-	for (size_t i = 0; i < size; i++)
-	{
-		if (source.get_allocated_map()[address+i] == Memory_map::ALLOCATED)
-		{
-			buffer[i+10] = source.get_memory()[address+i];
-		}
-		else
-		{
-			buffer[i+10] = 0xFF;
-		}
-	}
+	source.read(address, &buffer[10], size);
 	if (!stk500_cmd(buffer, 10+size, reply_length))
 	{
 		return false;
@@ -220,6 +284,11 @@ bool STK500v2_module::write_page(Memory_map& source, size_t size, size_t address
 
 bool STK500v2_module::verify_page(Memory_map& expected, size_t size, size_t address)
 {
+	// Only allocated bytes are compared, so a page with none can't fail and doesn't need reading back.
+	if (!expected.is_page_allocated(address, size))
+	{
+		return true;
+	}
 	if (!stk500_load_address(address >> 1, expected.get_size() > 64*1024))
 	{
 		return false;
@@ -243,7 +312,7 @@ bool STK500v2_module::verify_page(Memory_map& expected, size_t size, size_t addr
 	
 	for (size_t i = 0; i < size; i++)
 	{
-		if (expected.get_allocated_map()[address+i] == Memory_map::ALLOCATED &&
+		if (expected.is_allocated(address+i) &&
 			expected.get_memory()[address+i] != buffer[2+i])
 		{
 			std::cerr << "Verify failure at address: " << address+i << 
@@ -279,17 +348,22 @@ bool STK500v2_module::read_page(Memory_map& destination, size_t size, size_t add
 		return false;
 	}
 	
-	for (size_t i = 0; i < size; i++)
-	{
-		destination.get_memory()[address+i] = buffer[2+i];
-		destination.get_allocated_map()[address+i] = Memory_map::ALLOCATED;
-	}
+	destination.write(address, &buffer[2], size);
 	
 	return true;
 }
 
+bool STK500v2_module::erases_each_page()
+{
+	// Only extended mode erases each page as it is written.  A stock bootloader only restarts its erase at page zero, so pages can't be skipped.
+	return extended_depth > 0;
+}
+
 bool STK500v2_module::reset_device(bool run_application)
 {
+	// Anything still in flight is lost once the device resets, so make sure it got there.
+	bool written = collect_queued_pages(0);
+	
 	//Do the reset here by holding the DTR line low for a time then releasing it.
 	set_cts_dtr(tty_fd, false);
 	usleep( 50 * 1000);
@@ -297,9 +371,20 @@ bool STK500v2_module::reset_device(bool run_application)
 	usleep( 50 * 1000);
 	if (run_application)
 	{
-		return true;
+		return written;
 	}
-	return connect_to_device();
+	return connect_to_device() && written;
+}
+
+void STK500v2_module::add_to_report(Run_report& report)
+{
+	Comm_module::add_to_report(report);
+	report.get_histogram("command_rtt") = command_rtt;
+	report.get_histogram("page_rtt") = page_rtt;
+	report.add_to_counter("failed_commands", failed_commands);
+	report.add_to_counter("command_resends", command_resends);
+	report.add_to_counter("page_rewrites", page_rewrites);
+	report.set_value("extended_depth", extended_depth);
 }
 
 
@@ -374,20 +459,24 @@ bool STK500v2_module::close_serial()
 	}
 	
 	close(tty_fd);
+	tty_fd = -1;
 	return true;
 }
 
-bool STK500v2_module::stk500_send(uint8_t* buf, size_t buf_len)
+bool STK500v2_module::stk500_send(uint8_t* buf, size_t buf_len, uint8_t& sequence)
 {
 	//Buffer for message, max message length is 275.
-	uint8_t buffer[275 + 6];
+	uint8_t buffer[MAX_MESSAGE_LENGTH + 6];
 	
-	if (buf_len > 275)
+	if (buf_len > MAX_MESSAGE_LENGTH)
 	{
 		return false;
 	}
+	
+	// Every message gets its own sequence number, so replies can be matched up while several are in flight.
+	sequence = stk500_seq_no++;
 	buffer[0] = MESSAGE_START;
-	buffer[1] = stk500_seq_no;
+	buffer[1] = sequence;
 	buffer[2] = buf_len / 256;
 	buffer[3] = buf_len % 256;
 	buffer[4] = TOKEN;
@@ -403,7 +492,7 @@ bool STK500v2_module::stk500_send(uint8_t* buf, size_t buf_len)
 	
 }
 
-bool STK500v2_module::stk500_recv(uint8_t* buf, size_t buf_len, size_t& bytes_read)
+bool STK500v2_module::stk500_recv(uint8_t* buf, size_t buf_len, size_t& bytes_read, uint8_t sequence, uint32_t timeout)
 {
 	enum states{
 		START,
@@ -418,21 +507,22 @@ bool STK500v2_module::stk500_recv(uint8_t* buf, size_t buf_len, size_t& bytes_re
 	states state = START;
 	uint8_t c;
 	uint8_t checksum;
-	bool timeout = false;
 	size_t message_length;
 	size_t current_length = 0;
 	
-	uint32_t now, start;
-	timeval tv;
-	gettimeofday(&tv, NULL);
-	start = tv.tv_sec;
+	// The timeout is how long the line may stay quiet, so a long reply at a slow speed isn't cut off part way.
+	timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	add_milliseconds(deadline, timeout);
 	
-	while ((state != DONE) && (!timeout))
+	while (state != DONE)
 	{
-		if (!serial_recv(tty_fd, &c, 1, bytes_read))
+		if (!serial_read_byte(c, deadline))
 		{
 			return false;
 		}
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		add_milliseconds(deadline, timeout);
 		checksum ^= c;
 		
 		switch (state)
@@ -448,9 +538,8 @@ bool STK500v2_module::stk500_recv(uint8_t* buf, size_t buf_len, size_t& bytes_re
 				break;
 			case SEQNO:
 			
-				if (c == stk500_seq_no)
+				if (c == sequence)
 				{
-					stk500_seq_no++;
 					state = LEN1;
 				}
 				else
@@ -532,15 +621,6 @@ bool STK500v2_module::stk500_recv(uint8_t* buf, size_t buf_len, size_t& bytes_re
 				
 				break;
 		}
-		
-		gettimeofday(&tv, NULL);
-		now = tv.tv_sec;
-		
-		if ((now - start) > TIMEOUT)
-		{
-			timeout = true;
-			return false;
-		}
 	}
 	
 	bytes_read = message_length;
@@ -557,18 +637,56 @@ bool STK500v2_module::stk500_cmd(uint8_t* buf, size_t cmd_len, size_t& bytes_rea
 {
 	size_t buf_length = bytes_read;
 	
-	stk500_send(buf, cmd_len);
-	
-	bool status = stk500_recv(buf, buf_length, bytes_read);
+	// Replies to queued pages come back first, so they have to be dealt with before anything else is sent.
+	if (!collect_queued_pages(0))
+	{
+		return false;
+	}
 	
-	if (status)
-	{	
-		if (buf[1] == STATUS_CMD_OK)
+	// Commands which do the same thing however many times they're received are sent again if the reply doesn't make it back.
+	// Programming and reading flash move the bootloader's address on, so those can't be.
+	bool idempotent = (buf[0] == CMD_LOAD_ADDRESS) || (buf[0] == CMD_GET_PARAMETER) || (buf[0] == CMD_SET_PARAMETER) ||
+		(buf[0] == CMD_READ_SIGNATURE_ISP) || (buf[0] == CMD_SIGN_ON);
+	uint8_t request[MAX_MESSAGE_LENGTH];
+	if (idempotent)
+	{
+		if (cmd_len > sizeof(request))
 		{
-			return true;
+			return false;
 		}
+		memcpy(request, buf, cmd_len);
 	}
+	
+	for (int tries = 0; tries <= (idempotent ? MAX_RETRIES : 0); tries++)
+	{
+		if (tries > 0)
+		{
+			memcpy(buf, request, cmd_len);
+			command_resends++;
+		}
+		uint8_t sequence;
+		if (!stk500_send(buf, cmd_len, sequence))
+		{
+			return false;
+		}
+		timespec sent;
+		clock_gettime(CLOCK_MONOTONIC, &sent);
 		
+		// A reply with another sequence number is left over from a command which was sent again, and is skipped.
+		if (stk500_recv(buf, buf_length, bytes_read, sequence, reply_timer.get_timeout()))
+		{
+			command_rtt.record_since(sent);
+			reply_timer.record_since(sent);
+			if (buf[1] == STATUS_CMD_OK)
+			{
+				return true;
+			}
+			break;
+		}
+		reply_timer.record_timeout();
+	}
+	
+	failed_commands++;
 	return false;
 }
 
@@ -578,6 +696,10 @@ bool STK500v2_module::stk500_sync()
 	{
 		return false;
 	}
+	// Whatever was in flight before is gone now.
+	rx_head = rx_tail = 0;
+	queued_pages.clear();
+	
 	uint8_t command[1];
 	uint8_t response[32];
 	
@@ -586,9 +708,10 @@ bool STK500v2_module::stk500_sync()
 	while( !done && tries < MAX_RETRIES )
 	{
 		command[0] = CMD_SIGN_ON;
-		stk500_send(command, 1);
+		uint8_t sequence;
+		stk500_send(command, 1, sequence);
 		size_t read;
-		if (stk500_recv(response, sizeof(response), read))
+		if (stk500_recv(response, sizeof(response), read, sequence, SYNC_TIMEOUT))
 		{
 			if (response[0] == CMD_SIGN_ON && response[1] == STATUS_CMD_OK && read > 3)
 			{
@@ -618,6 +741,149 @@ bool STK500v2_module::stk500_load_address(size_t address, bool far)
 	return stk500_cmd(buffer, 5, reply_length);
 }
 
+bool STK500v2_module::stk500_get_extended_depth()
+{
+	uint8_t buffer[MAX_MESSAGE_LENGTH];
+	
+	buffer[0] = CMD_GET_PARAMETER;
+	buffer[1] = PARAM_EXTENDED_DEPTH;
+	size_t reply_length = MAX_MESSAGE_LENGTH;
+	if (!stk500_cmd(buffer, 2, reply_length) || reply_length < 3)
+	{
+		return false;
+	}
+	extended_depth = buffer[2];
+	return true;
+}
+
+bool STK500v2_module::send_page(Memory_map& source, size_t size, size_t address, uint8_t& sequence)
+{
+	uint8_t buffer[MAX_MESSAGE_LENGTH];
+	
+	if (size + PROGRAM_PAGE_EXT_HEADER > MAX_MESSAGE_LENGTH)
+	{
+		std::cerr << "Page size is too big for extended mode." << std::endl;
+		return false;
+	}
+	buffer[0] = CMD_PROGRAM_PAGE_EXT;
+	buffer[1] = (address >> 24) & 0xFF;
+	buffer[2] = (address >> 16) & 0xFF;
+	buffer[3] = (address >> 8) & 0xFF;
+	buffer[4] = (address) & 0xFF;
+	buffer[5] = (size >> 8) & 0xFF;
+	buffer[6] = (size) & 0xFF;
+	source.read(address, &buffer[PROGRAM_PAGE_EXT_HEADER], size);
+	return stk500_send(buffer, PROGRAM_PAGE_EXT_HEADER + size, sequence);
+}
+
+bool STK500v2_module::receive_page_reply(uint8_t sequence)
+{
+	uint8_t buffer[MAX_MESSAGE_LENGTH];
+	size_t reply_length;
+	
+	if (!stk500_recv(buffer, sizeof(buffer), reply_length, sequence, reply_timer.get_timeout()))
+	{
+		reply_timer.record_timeout();
+		return false;
+	}
+	return reply_length >= 2 &&
+		buffer[0] == CMD_PROGRAM_PAGE_EXT && buffer[1] == STATUS_CMD_OK;
+}
+
+bool STK500v2_module::collect_queued_pages(size_t keep)
+{
+	std::vector<Queued_page> failed_pages;
+	while (queued_pages.size() > (failed_pages.empty() ? keep : 0))
+	{
+		Queued_page page = queued_pages.front();
+		queued_pages.pop_front();
+		if (!receive_page_reply(page.sequence))
+		{
+			// Wait for everything else in flight first, so the failed pages can be sent again one at a time.
+			failed_pages.push_back(page);
+			continue;
+		}
+		page_rtt.record_since(page.sent);
+		reply_timer.record_since(page.sent);
+	}
+	
+	for (size_t i = 0; i < failed_pages.size(); i++)
+	{
+		Queued_page& page = failed_pages[i];
+		std::cerr << "Writing page at address: " << page.address << " failed, writing it again." << std::endl;
+		page_rewrites++;
+		if (!send_page(*page.source, page.size, page.address, page.sequence) || !receive_page_reply(page.sequence))
+		{
+			std::cerr << "Failed to write page at address: " << page.address << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+bool STK500v2_module::serial_fill(const timespec& deadline)
+{
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t remaining = elapsed_nanoseconds(now, deadline) / 1000;
+	if (remaining == 0)
+	{
+		return false;
+	}
+	timeval timeout;
+	timeout.tv_sec = remaining / 1000000;
+	timeout.tv_usec = remaining % 1000000;
+	
+	fd_set waitset;
+	FD_ZERO(&waitset);
+	FD_SET(tty_fd, &waitset);
+	int number_ready = select(tty_fd+1, &waitset, NULL, NULL, &timeout);
+	if (number_ready == 0)
+	{
+		std::cerr << "Timed out waiting for a reply." << std::endl;
+		return false;
+	}
+	else if (number_ready == -1)
+	{
+		// Interrupted, so just try again.
+		return (errno == EINTR);
+	}
+	
+	// Read as much as will fit in one go, up to the end of the ring.
+	size_t offset = rx_head & (RX_RING_SIZE - 1);
+	size_t space = RX_RING_SIZE - (rx_head - rx_tail);
+	if (space > RX_RING_SIZE - offset)
+	{
+		space = RX_RING_SIZE - offset;
+	}
+	ssize_t return_code = read(tty_fd, &rx_ring[offset], space);
+	if (return_code < 0)
+	{
+		return (errno == EINTR || errno == EAGAIN);
+	}
+	else if (return_code == 0)
+	{
+		// The port has gone away.
+		return false;
+	}
+	rx_head += return_code;
+	return true;
+}
+
+bool STK500v2_module::serial_read_byte(uint8_t& c, const timespec& deadline)
+{
+	while (rx_head == rx_tail)
+	{
+		if (!serial_fill(deadline))
+		{
+			return false;
+		}
+	}
+	c = rx_ring[rx_tail & (RX_RING_SIZE - 1)];
+	rx_tail++;
+	return true;
+}
+
 
 // IMPLEMENT PRIVATE FUNCTIONS.
 
@@ -741,48 +1007,4 @@ bool serial_send(int fd, uint8_t* buf, size_t buf_len)
 	return true;
 }
 
-bool serial_recv(int fd, uint8_t* buf, size_t buf_len, size_t& bytes_read)
-{
-	timeval timeout;
-	fd_set waitset;
-	int number_ready;
-	FD_ZERO(&waitset);
-	FD_SET(fd, &waitset);
-	
-	timeout.tv_sec = 0;
-	timeout.tv_usec = 1000 * 1000;
-	bool have_read = false;
-	
-	while (!have_read)
-	{
-		number_ready = select(fd+1, &waitset, NULL, NULL, &timeout);
-		if (number_ready == 0)
-		{
-			//Error.
-			std::cerr << "Error" << std::endl;
-			return false;
-		}
-		else if (number_ready == -1)
-		{
-			if (errno != EINTR || errno != EAGAIN)
-			{
-				//Error.
-				std::cerr << "Error" << std::endl;
-				return false;
-			}
-		}
-		else
-		{
-			int return_code = read(fd, buf, buf_len);
-			if (return_code < 0)
-			{
-				return false;
-			}
-			bytes_read = return_code;
-			have_read = true;
-		}
-	}
-	return true;
-}
-
 //ALL DONE.
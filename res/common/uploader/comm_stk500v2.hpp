@@ -53,7 +53,11 @@
 // INCLUDE REQUIRED HEADER FILES.
 #include "comm.hpp"
 
+#include <deque>
+#include <vector>
+
 #include <termios.h>
+#include <time.h>
 
 // DEFINE PUBLIC TYPES AND ENUMERATIONS.
 
@@ -78,20 +82,48 @@ public:
 	virtual bool write_page(Memory_map& source, size_t size, size_t address);
 	virtual bool verify_page(Memory_map& expected, size_t size, size_t address);
 	virtual bool read_page(Memory_map& destination, size_t size, size_t address);
+	virtual bool erases_each_page();
 	
 	virtual bool reset_device(bool run_application);
 	
+	virtual void add_to_report(Run_report& report);
+	
 	
 private:
+	/**
+	 * A page sent in extended mode whose reply hasn't been received yet.
+	 */
+	struct Queued_page
+	{
+		uint8_t sequence;
+		Memory_map* source;
+		size_t size;
+		size_t address;
+		timespec sent;
+	};
+
 	// Functions.
 	bool open_serial();
 	bool setup_serial();
 	bool close_serial();
-	bool stk500_send(uint8_t* buf, size_t buf_len);
-	bool stk500_recv(uint8_t* buf, size_t buf_len, size_t& bytes_read);
+	bool serial_fill(const timespec& deadline);
+	bool serial_read_byte(uint8_t& c, const timespec& deadline);
+	bool stk500_send(uint8_t* buf, size_t buf_len, uint8_t& sequence);
+	bool stk500_recv(uint8_t* buf, size_t buf_len, size_t& bytes_read, uint8_t sequence, uint32_t timeout);
 	bool stk500_cmd(uint8_t* buf, size_t cmd_len, size_t& bytes_read);
 	bool stk500_sync();
 	bool stk500_load_address(size_t address, bool far);
+	bool stk500_get_extended_depth();
+	
+	/**
+	 * Sends a page in extended mode, where the bootloader erases it itself, without waiting for the reply.
+	 */
+	bool send_page(Memory_map& source, size_t size, size_t address, uint8_t& sequence);
+	bool receive_page_reply(uint8_t sequence);
+	/**
+	 * Receives replies for queued pages until no more than the given number are left in flight, writing any that failed again on their own.
+	 */
+	bool collect_queued_pages(size_t keep);
 	
 	//Fields.
 	std::string tty_path;
@@ -109,6 +141,23 @@ private:
 	uint32_t signature;
 	
 	uint8_t stk500_seq_no;
+	
+	// Bytes read from the serial port but not yet parsed, tail to head.
+	std::vector<uint8_t> rx_ring;
+	size_t rx_head;
+	size_t rx_tail;
+	
+	// Extended mode, in which pages carry their own erase and several may be in flight.  A depth of zero means it isn't in use.
+	bool use_extended;
+	size_t extended_depth;
+	std::deque<Queued_page> queued_pages;
+	
+	// Round trip times for commands and for queued pages, and how often things had to be done again.
+	Latency_histogram command_rtt;
+	Latency_histogram page_rtt;
+	size_t failed_commands;
+	size_t command_resends;
+	size_t page_rewrites;
 };
 
  
@@ -0,0 +1,462 @@
+// Copyright (C) 2012  Unison Networks Ltd
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+/********************************************************************************************************************************
+ *
+ *  FILE: 		daemon.cpp
+ *
+ *  SUB-SYSTEM:		flashing tools
+ *
+ *  COMPONENT:		Daemon
+ *
+ *  AUTHOR: 		agent
+ *
+ *  DATE CREATED:	17-10-2026
+ *
+ *	Implementation of the uploader daemon, and of sending jobs to it.
+ *
+ *	A job is sent as the directory it was started in, followed by its command line arguments, each ending with a NUL.  The sender then shuts down
+ *	its side of the connection.  The daemon sends back the job's output as a series of frames, each a tag byte and a 32 bit (big endian) length
+ *	followed by that many bytes, and finishes with an exit frame holding the job's exit status.
+ *
+ ********************************************************************************************************************************/
+
+// INCLUDE THE MATCHING HEADER FILE.
+
+#include "daemon.hpp"
+
+// INCLUDE IMPLEMENTATION SPECIFIC HEADER FILES.
+
+#include <iostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "util.hpp"
+
+// DEFINE PRIVATE MACROS.
+
+// Tags for the frames sent back to whoever sent a job.
+#define FRAME_STDOUT '1'
+#define FRAME_STDERR '2'
+#define FRAME_EXIT 'x'
+
+// Largest job request the daemon will accept, in bytes.
+#define MAX_REQUEST_SIZE (64*1024)
+
+// Largest frame of output the daemon will send back, in bytes.
+#define MAX_FRAME_SIZE 1024
+
+// DEFINE PRIVATE TYPES AND STRUCTS.
+
+/**
+ *  Sends whatever is written to a stream back to whoever sent the job, in frames with the given tag.
+ */
+class Job_output : public std::streambuf
+{
+public:
+	Job_output(int fd, char tag);
+
+protected:
+	virtual int overflow(int c);
+	virtual int sync();
+
+private:
+	void send_buffer();
+
+	int fd;
+	char tag;
+	char buffer[MAX_FRAME_SIZE];
+};
+
+// DECLARE IMPORTED GLOBAL VARIABLES.
+
+// DECLARE PRIVATE GLOBAL VARIABLES.
+
+static volatile sig_atomic_t stop_daemon = 0;
+
+// DEFINE PRIVATE FUNCTION PROTOTYPES.
+
+void run_client_job(int client, Options& daemon_opts, Comm_module* comm_module, Job_runner run_job);
+
+bool send_frame(int fd, char tag, const char* data, size_t length);
+
+bool write_all(int fd, const char* data, size_t length);
+
+bool read_all(int fd, char* data, size_t length);
+
+bool make_address(const char* socket_path, sockaddr_un& addr);
+
+void handle_stop_signal(int signal);
+
+// IMPLEMENT PUBLIC FUNCTIONS.
+
+int run_daemon(const char* socket_path, Options& opts, Job_runner run_job)
+{
+	Comm_module* comm_module = opts.get_comms_module();
+	if (comm_module == NULL)
+	{
+		std::cerr << "Unknown communications module." << std::endl;
+		return 1;
+	}
+	sockaddr_un addr;
+	if (!make_address(socket_path, addr))
+	{
+		return 1;
+	}
+
+	// If another daemon is already answering on the socket, leave it be.  Otherwise clear away anything a previous daemon left behind.
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0)
+	{
+		perror("Could not create socket");
+		return 1;
+	}
+	if (connect(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+	{
+		std::cerr << "Another daemon is already listening on " << socket_path << std::endl;
+		close(listener);
+		return 1;
+	}
+	close(listener);
+	unlink(socket_path);
+
+	// Open the connection to the bus up front, so that not even the first job has to wait for it.
+	if (!comm_module->init(opts.get_comms_params()))
+	{
+		std::cerr << "Failed to initialise communication module" << std::endl;
+		return 1;
+	}
+
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ((listener < 0) || (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) || (listen(listener, SOMAXCONN) < 0))
+	{
+		perror("Could not listen on socket");
+		return 1;
+	}
+
+	// Stop between jobs when asked to, rather than part way through one.  Without SA_RESTART, waiting for the next job is interrupted straight away.
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handle_stop_signal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	// Whoever sent a job may go away before it finishes, which mustn't take the daemon with it.
+	signal(SIGPIPE, SIG_IGN);
+
+	std::cout << "Uploader daemon listening on " << socket_path << std::endl;
+	while (!stop_daemon)
+	{
+		int client = accept(listener, NULL, NULL);
+		if (client < 0)
+		{
+			if (errno != EINTR)
+			{
+				perror("Could not accept job");
+				break;
+			}
+			continue;
+		}
+		run_client_job(client, opts, comm_module, run_job);
+		close(client);
+	}
+	close(listener);
+	unlink(socket_path);
+	std::cout << "Uploader daemon stopped." << std::endl;
+	return 0;
+}
+
+int queue_job(const char* socket_path, int argc, char* argv[])
+{
+	sockaddr_un addr;
+	if (!make_address(socket_path, addr))
+	{
+		return 1;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ((fd < 0) || (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0))
+	{
+		std::cerr << "Could not connect to the uploader daemon at " << socket_path << ": " << strerror(errno) << std::endl;
+		return 1;
+	}
+
+	// File names in the job are relative to where it was started, so the daemon has to be told where that is.
+	char cwd[PATH_MAX];
+	if (getcwd(cwd, sizeof(cwd)) == NULL)
+	{
+		perror("Could not get current directory");
+		close(fd);
+		return 1;
+	}
+	std::string request(cwd);
+	request.push_back('\0');
+	for (int i = 1; i < argc; i++)
+	{
+		request.append(argv[i]);
+		request.push_back('\0');
+	}
+	if (!write_all(fd, request.data(), request.size()) || (shutdown(fd, SHUT_WR) < 0))
+	{
+		perror("Could not send job");
+		close(fd);
+		return 1;
+	}
+
+	// Pass on the job's output until it finishes.
+	char header[5];
+	while (read_all(fd, header, sizeof(header)))
+	{
+		uint32_t length = (static_cast<uint8_t>(header[1]) << 24) | (static_cast<uint8_t>(header[2]) << 16) | (static_cast<uint8_t>(header[3]) << 8) |
+			static_cast<uint8_t>(header[4]);
+		if (length > MAX_FRAME_SIZE)
+		{
+			break;
+		}
+		char data[MAX_FRAME_SIZE];
+		if (!read_all(fd, data, length))
+		{
+			break;
+		}
+		if (header[0] == FRAME_STDOUT)
+		{
+			std::cout.write(data, length);
+			std::cout.flush();
+		}
+		else if (header[0] == FRAME_STDERR)
+		{
+			std::cerr.write(data, length);
+			std::cerr.flush();
+		}
+		else if ((header[0] == FRAME_EXIT) && (length == 1))
+		{
+			close(fd);
+			return static_cast<uint8_t>(data[0]);
+		}
+	}
+	std::cerr << "The uploader daemon stopped before the job finished." << std::endl;
+	close(fd);
+	return 1;
+}
+
+// IMPLEMENT PRIVATE FUNCTIONS.
+
+Job_output::Job_output(int fd, char tag) :
+	fd(fd),
+	tag(tag)
+{
+	setp(buffer, buffer + sizeof(buffer));
+}
+
+int Job_output::overflow(int c)
+{
+	send_buffer();
+	if (c != EOF)
+	{
+		*pptr() = c;
+		pbump(1);
+	}
+	return (c == EOF) ? 0 : c;
+}
+
+int Job_output::sync()
+{
+	send_buffer();
+	return 0;
+}
+
+void Job_output::send_buffer()
+{
+	// If whoever sent the job has gone away, the job carries on regardless, since stopping half way through would leave the target without an application.
+	if (pptr() > pbase())
+	{
+		send_frame(fd, tag, pbase(), pptr() - pbase());
+	}
+	setp(buffer, buffer + sizeof(buffer));
+}
+
+void run_client_job(int client, Options& daemon_opts, Comm_module* comm_module, Job_runner run_job)
+{
+	timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// Jobs run in their own directory, but the daemon has to come back afterwards, since the socket path may be relative.
+	char daemon_cwd[PATH_MAX];
+	if (getcwd(daemon_cwd, sizeof(daemon_cwd)) == NULL)
+	{
+		perror("Could not get current directory");
+		return;
+	}
+
+	// Read in the whole request, which ends when the sender shuts down its side of the connection.
+	std::vector<char> request;
+	char chunk[4096];
+	ssize_t count;
+	while (((count = read(client, chunk, sizeof(chunk))) > 0) && (request.size() <= MAX_REQUEST_SIZE))
+	{
+		request.insert(request.end(), chunk, chunk + count);
+	}
+	request.push_back('\0');
+
+	// Split it up into the directory to run in and the arguments, which the job's options will point into.
+	std::vector<char*> args;
+	args.push_back(const_cast<char*>("uploader"));
+	for (size_t i = 0; i < request.size() - 1; i += strlen(&request[i]) + 1)
+	{
+		args.push_back(&request[i]);
+	}
+	std::string cwd = (args.size() > 1) ? args[1] : "";
+	if (args.size() > 1)
+	{
+		args.erase(args.begin() + 1);
+	}
+
+	// Everything the job prints goes back to whoever sent it.
+	Job_output job_out(client, FRAME_STDOUT);
+	Job_output job_err(client, FRAME_STDERR);
+	std::streambuf* daemon_out = std::cout.rdbuf(&job_out);
+	std::streambuf* daemon_err = std::cerr.rdbuf(&job_err);
+	int status = 1;
+	Options job;
+	if ((request.size() > MAX_REQUEST_SIZE) || cwd.empty())
+	{
+		std::cerr << "Invalid job request." << std::endl;
+	}
+	else if (chdir(cwd.c_str()) < 0)
+	{
+		std::cerr << "Could not change to the job's directory " << cwd << ": " << strerror(errno) << std::endl;
+	}
+	else
+	{
+		// The arguments are parsed from scratch for every job.
+		optind = 0;
+		if (!job.read_from_args(args.size(), &args[0]))
+		{
+			job.print_usage();
+		}
+		else if (job.get_daemon_socket() != NULL)
+		{
+			std::cerr << "A job can't start another daemon." << std::endl;
+		}
+		else if (job.get_comms_module() != comm_module)
+		{
+			std::cerr << "The daemon can only run jobs using the communications module it was started with." << std::endl;
+		}
+		else
+		{
+			job.set_comms_defaults(daemon_opts);
+			status = run_job(job);
+		}
+	}
+	std::cout.flush();
+	std::cerr.flush();
+	std::cout.rdbuf(daemon_out);
+	std::cerr.rdbuf(daemon_err);
+	if (chdir(daemon_cwd) < 0)
+	{
+		perror("Could not return to the daemon's directory");
+	}
+
+	char code = status;
+	send_frame(client, FRAME_EXIT, &code, 1);
+
+	timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	std::cout << "Job in " << cwd << " finished with status " << status << " after " << elapsed_nanoseconds(start, end) / 1e9 << " s" << std::endl;
+}
+
+bool send_frame(int fd, char tag, const char* data, size_t length)
+{
+	char header[5];
+	header[0] = tag;
+	header[1] = (length >> 24) & 0xFF;
+	header[2] = (length >> 16) & 0xFF;
+	header[3] = (length >> 8) & 0xFF;
+	header[4] = (length) & 0xFF;
+	return write_all(fd, header, sizeof(header)) && write_all(fd, data, length);
+}
+
+bool write_all(int fd, const char* data, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t written = write(fd, data, length);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+		data += written;
+		length -= written;
+	}
+	return true;
+}
+
+bool read_all(int fd, char* data, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t got = read(fd, data, length);
+		if (got < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+		if (got == 0)
+		{
+			return false;
+		}
+		data += got;
+		length -= got;
+	}
+	return true;
+}
+
+bool make_address(const char* socket_path, sockaddr_un& addr)
+{
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+	{
+		std::cerr << "Socket path too long: " << socket_path << std::endl;
+		return false;
+	}
+	strcpy(addr.sun_path, socket_path);
+	return true;
+}
+
+void handle_stop_signal(int)
+{
+	stop_daemon = 1;
+}
+
+//ALL DONE.
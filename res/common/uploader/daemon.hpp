@@ -0,0 +1,80 @@
+// Copyright (C) 2012  Unison Networks Ltd
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+/**
+ *
+ * 
+ *  @file		daemon.hpp
+ *  A header file for running the uploader as a daemon, which keeps its connection to the bus open and runs upload jobs sent to it over a Unix socket.
+ * 
+ *  @author 		agent
+ *
+ *  @date		17-10-2026
+ * 
+ *  @section 		Licence
+ * 
+ * Copyright (C) 2012  Unison Networks Ltd
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ * 
+ */
+ 
+//Only include header once.
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+// INCLUDE REQUIRED HEADER FILES.
+
+#include "options.hpp"
+
+// DEFINE PUBLIC TYPES AND ENUMERATIONS.
+
+/**
+ * Runs a single upload job, as given on a command line, and returns the exit status for it.
+ */
+typedef int (*Job_runner)(Options& opts);
+
+// FORWARD DEFINE PRIVATE PROTOTYPES.
+
+// DEFINE PUBLIC CLASSES.
+ 
+// DEFINE PUBLIC STATIC FUNCTION PROTOTYPES.
+
+/**
+ *  Initialises the communications module given in the options once, then listens on a Unix socket for jobs and runs them one at a time, in the order
+ *  they arrive, until interrupted.  Each job's communications parameters are added to the daemon's own, and its output is sent back to whoever sent it.
+ *  Returns the exit status for the daemon.
+ */
+int run_daemon(const char* socket_path, Options& opts, Job_runner run_job);
+
+/**
+ *  Sends the command line to the daemon listening on a Unix socket, copies the job's output to our own, and returns the job's exit status.
+ */
+int queue_job(const char* socket_path, int argc, char* argv[]);
+ 
+#endif /*__DAEMON_H__*/
+
+//ALL DONE.
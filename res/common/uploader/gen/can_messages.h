@@ -0,0 +1,78 @@
+// Copyright (C) 2013  Unison Networks Ltd
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+/**
+ *
+ * 
+ *  @file		can_messages.h
+ *  A header file listing the CAN message IDs used by the toolchain.
+ * 
+ * 
+ *  @author 		Paul Davey
+ *
+ *  @date		24-01-2013
+ * 
+ *  @section 		Licence
+ * 
+ * Copyright (C) 2013  Unison Networks Ltd
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ * 
+ */
+
+// Support linking this C library from C++.
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Only include this header file once.
+#ifndef __CAN_MESSAGES_H__
+#define __CAN_MESSAGES_H__
+
+// DEFINE PUBLIC PREPROCESSOR MACROS.
+
+#define CANID_HOST_ALERT 0x2FF
+
+#define CANID_BASE_ID 0x120
+
+#define CANID_REQUEST_RESET CANID_BASE_ID
+#define CANID_GET_INFO (CANID_BASE_ID + 1)
+#define CANID_WRITE_MEMORY (CANID_BASE_ID + 2)
+#define CANID_WRITE_DATA (CANID_BASE_ID + 3)
+#define CANID_READ_MEMORY (CANID_BASE_ID + 4)
+#define CANID_READ_DATA (CANID_BASE_ID + 5)
+#define CANID_SET_WINDOW (CANID_BASE_ID + 6)
+#define CANID_PAGE_CHECKSUM (CANID_BASE_ID + 7)
+#define CANID_ERASE_MEMORY (CANID_BASE_ID + 8)
+
+#endif // __CAN_MESSAGES_H__
+
+// Support linking this C library from C++.
+#ifdef __cplusplus
+}
+#endif
+
+// ALL DONE.
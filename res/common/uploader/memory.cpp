@@ -38,7 +38,17 @@
 #include <fstream>
 #include <iostream>
 
+#include <elf.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "ihex.hpp"
+#include "util.hpp"
 
 // DEFINE PRIVATE MACROS.
 
@@ -48,14 +58,25 @@
 
 // DECLARE PRIVATE GLOBAL VARIABLES.
 
+// The value of each hex digit, indexed by its character, with anything which isn't a hex digit marked as 0xFF.
+static uint8_t hex_digit_values[256];
+static bool hex_digit_values_ready = false;
+
 // DEFINE PRIVATE FUNCTION PROTOTYPES.
 
+bool decode_hex(const char* text, uint8_t* bytes, size_t count);
+std::string describe_record(const char* text, size_t length);
+const char* map_file(const std::string& filename, size_t& length);
+void unmap_file(const char* data, size_t length);
+bool has_extension(const std::string& filename, const std::string& extension);
+void write_ihex_record(std::ostream& out, uint8_t type, uint16_t offset, const uint8_t* data, size_t length);
+
 
 // IMPLEMENT PUBLIC FUNCTIONS.
 
 Memory_map::Memory_map(size_t size, Memory_map::Type_flag type) :
 memory(new uint8_t[size]),
-allocated_map(new Memory_map::Allocated_flag[size]),
+allocated_bits(new uint64_t[(size + 63) / 64]()),
 type(type),
 size(size)
 {
@@ -65,7 +86,7 @@ size(size)
 Memory_map::~Memory_map()
 {
 	delete [] memory;
-	delete [] allocated_map;
+	delete [] allocated_bits;
 }
 
 uint8_t* Memory_map::get_memory()
@@ -73,11 +94,6 @@ uint8_t* Memory_map::get_memory()
 	return memory;
 }
 
-Memory_map::Allocated_flag* Memory_map::get_allocated_map()
-{
-	return allocated_map;
-}
-
 Memory_map::Type_flag Memory_map::get_type()
 {
 	return type;
@@ -89,26 +105,123 @@ size_t Memory_map::get_size()
 }
 
 
-bool Memory_map::find_last_allocated_page(size_t pageSize, size_t& pageStartAddress)
+bool Memory_map::is_allocated(size_t address)
+{
+	if (address >= size)
+	{
+		return false;
+	}
+	return (allocated_bits[address / 64] >> (address % 64)) & 1;
+}
+
+bool Memory_map::is_page_allocated(size_t address, size_t length)
+{
+	// Find the last range starting before the end of the page, and see whether it reaches into the page.
+	Extent_map::iterator it = extents.lower_bound(address + length);
+	if (it == extents.begin())
+	{
+		return false;
+	}
+	--it;
+	return it->second > address;
+}
+
+const Memory_map::Extent_map& Memory_map::get_extents()
+{
+	return extents;
+}
+
+void Memory_map::write(size_t address, const uint8_t* data, size_t length)
+{
+	if (length == 0)
+	{
+		return;
+	}
+	memcpy(memory + address, data, length);
+	
+	// Set the bits for the range, a word at a time where the range covers the whole word.
+	size_t end = address + length;
+	for (size_t i = address; i < end; )
+	{
+		size_t bit = i % 64;
+		size_t count = ((end - i) < (64 - bit)) ? (end - i) : (64 - bit);
+		uint64_t mask = (count == 64) ? ~static_cast<uint64_t>(0) : (((static_cast<uint64_t>(1) << count) - 1) << bit);
+		allocated_bits[i / 64] |= mask;
+		i += count;
+	}
+	add_extent(address, end);
+}
+
+void Memory_map::read(size_t address, uint8_t* data, size_t length)
 {
-	int64_t tempAddress = -1;
-	for (size_t pageAddress = 0; pageAddress < size; pageAddress += pageSize)
+	for (size_t i = 0; i < length; )
 	{
-		if (allocated_map[pageAddress] == ALLOCATED)
+		size_t current = address + i;
+		
+		// Whole words of the bitmap which are completely allocated, or not allocated at all, can be done in one go.
+		if ((current % 64 == 0) && (length - i >= 64) && (current + 64 <= size))
 		{
-			tempAddress = pageAddress;
+			uint64_t bits = allocated_bits[current / 64];
+			if (bits == ~static_cast<uint64_t>(0))
+			{
+				memcpy(data + i, memory + current, 64);
+				i += 64;
+				continue;
+			}
+			if (bits == 0)
+			{
+				memset(data + i, 0xFF, 64);
+				i += 64;
+				continue;
+			}
 		}
+		data[i] = is_allocated(current) ? memory[current] : 0xFF;
+		i++;
 	}
-	if (tempAddress < 0)
+}
+
+bool Memory_map::find_last_allocated_page(size_t pageSize, size_t& pageStartAddress)
+{
+	if (extents.empty())
 	{
 		return false;
 	}
-	pageStartAddress = (size_t) tempAddress;
+	
+	// The page holding the last allocated byte.
+	pageStartAddress = ((extents.rbegin()->second - 1) / pageSize) * pageSize;
 	return true;
 }
 
+uint32_t Memory_map::get_checksum(size_t address, size_t length)
+{
+	uint32_t crc = 0;
+	uint8_t chunk[256];
+	for (size_t i = 0; i < length; i += sizeof(chunk))
+	{
+		size_t count = ((length - i) < sizeof(chunk)) ? (length - i) : sizeof(chunk);
+		read(address + i, chunk, count);
+		crc = crc32(crc, chunk, count);
+	}
+	return crc;
+}
+
 
 bool Memory_map::read_from_ihex_file( std::string filename )
+{
+	// Map the whole file in, so the records can be decoded straight out of the page cache.
+	size_t length;
+	const char* text = map_file(filename, length);
+	if (text == NULL)
+	{
+		return false;
+	}
+	
+	bool result = read_ihex_records(text, length);
+	unmap_file(text, length);
+	return result;
+}
+
+bool Memory_map::read_from_ihex_file_by_line( std::string filename )
 {
 	std::ifstream file(filename.c_str(), std::ifstream::in | std::ifstream::binary);
 	if (!file.good())
@@ -142,18 +255,14 @@ bool Memory_map::read_from_ihex_file( std::string filename )
 							return false;
 						}
 						nextaddr = baseaddr + record.get_address();
-						for (size_t i = 0; i < record.get_length(); i++)
+						if (nextaddr + record.get_length() > size)
 						{
-							if (nextaddr + i >= size)
-							{
-								line.clear();
-								record.describe(line);
-								std::cerr << "Data outside of available memory (" << lineNumber << ") " << line << std::endl;
-								return false;
-							}
-							memory[nextaddr + i] = record.get_data()[i];
-							allocated_map[nextaddr + i] = ALLOCATED;
+							line.clear();
+							record.describe(line);
+							std::cerr << "Data outside of available memory (" << lineNumber << ") " << line << std::endl;
+							return false;
 						}
+						write(nextaddr, record.get_data(), record.get_length());
 						break;
 						
 					case Ihex_record::END_OF_FILE:
@@ -211,21 +320,480 @@ bool Memory_map::read_from_ihex_file( std::string filename )
 	return true;
 }
 
+bool Memory_map::read_from_elf_file( std::string filename )
+{
+	size_t length;
+	const char* file = map_file(filename, length);
+	if (file == NULL)
+	{
+		return false;
+	}
+	
+	// Only little endian ELF32 files are handled, which covers the AVR and ARM toolchains.
+	Elf32_Ehdr header;
+	if (length < sizeof(header))
+	{
+		std::cerr << "Not an ELF file: " << filename << std::endl;
+		unmap_file(file, length);
+		return false;
+	}
+	memcpy(&header, file, sizeof(header));
+	if (memcmp(header.e_ident, ELFMAG, SELFMAG) != 0 || header.e_ident[EI_CLASS] != ELFCLASS32 || header.e_ident[EI_DATA] != ELFDATA2LSB)
+	{
+		std::cerr << "Only little endian 32 bit ELF files can be read: " << filename << std::endl;
+		unmap_file(file, length);
+		return false;
+	}
+	if (header.e_phentsize != sizeof(Elf32_Phdr) || (size_t)header.e_phoff + (size_t)header.e_phnum * sizeof(Elf32_Phdr) > length)
+	{
+		std::cerr << "Invalid program header table in ELF file: " << filename << std::endl;
+		unmap_file(file, length);
+		return false;
+	}
+	
+	bool result = true;
+	for (size_t i = 0; i < header.e_phnum && result; i++)
+	{
+		Elf32_Phdr segment;
+		memcpy(&segment, file + header.e_phoff + i * sizeof(Elf32_Phdr), sizeof(segment));
+		
+		// Only the bytes a loadable segment holds in the file get programmed, the rest of it (.bss and the like) is set up at run time.
+		if (segment.p_type != PT_LOAD || segment.p_filesz == 0)
+		{
+			continue;
+		}
+		if ((size_t)segment.p_offset + segment.p_filesz > length)
+		{
+			std::cerr << "Segment " << i << " runs past the end of ELF file: " << filename << std::endl;
+			result = false;
+		}
+		else if (segment.p_paddr >= size)
+		{
+			// Things like the AVR's EEPROM and fuse sections are given addresses well past the end of flash, and don't belong in this memory.
+			std::cerr << "Skipping segment " << i << " at address: " << segment.p_paddr << " which is outside of available memory." << std::endl;
+		}
+		else if ((size_t)segment.p_paddr + segment.p_filesz > size)
+		{
+			std::cerr << "Segment " << i << " at address: " << segment.p_paddr << " doesn't fit in available memory." << std::endl;
+			result = false;
+		}
+		else
+		{
+			// The physical address is where the segment is loaded from, which for initialised data is in flash, not where it runs from in RAM.
+			write(segment.p_paddr, reinterpret_cast<const uint8_t*>(file + segment.p_offset), segment.p_filesz);
+		}
+	}
+	unmap_file(file, length);
+	return result;
+}
+
+bool Memory_map::read_from_bin_file( std::string filename, size_t base_address )
+{
+	size_t length;
+	const char* file = map_file(filename, length);
+	if (file == NULL)
+	{
+		return false;
+	}
+	
+	bool result = true;
+	if (base_address > size || length > size - base_address)
+	{
+		std::cerr << "Binary file doesn't fit in available memory at address: " << base_address << std::endl;
+		result = false;
+	}
+	else
+	{
+		write(base_address, reinterpret_cast<const uint8_t*>(file), length);
+	}
+	unmap_file(file, length);
+	return result;
+}
+
 bool Memory_map::read_from_file( std::string filename)
 {
-	size_t length = filename.length();
-	if (length >= 4 )
+	// A binary file may have its base address tacked on the end.
+	size_t base_address = 0;
+	std::string::size_type at = filename.rfind('@');
+	if (at != std::string::npos && has_extension(filename.substr(0, at), ".bin"))
 	{
-		std::string extension = filename.substr(length-4, 4);
-		if (extension == ".hex")
+		std::string address_str = filename.substr(at + 1);
+		char* end;
+		base_address = strtoul(address_str.c_str(), &end, 0);
+		if (address_str.empty() || *end != '\0')
 		{
-			return read_from_ihex_file(filename);
+			std::cerr << "Invalid base address for binary file: " << address_str << std::endl;
+			return false;
 		}
+		return read_from_bin_file(filename.substr(0, at), base_address);
+	}
+	
+	if (has_extension(filename, ".hex"))
+	{
+		return read_from_ihex_file(filename);
+	}
+	if (has_extension(filename, ".bin"))
+	{
+		return read_from_bin_file(filename, base_address);
+	}
+	if (has_extension(filename, ".elf"))
+	{
+		return read_from_elf_file(filename);
+	}
+	
+	// The toolchain's output often has no extension at all, so check for the ELF magic number.
+	char magic[SELFMAG];
+	std::ifstream file(filename.c_str(), std::ifstream::in | std::ifstream::binary);
+	if (file.read(magic, SELFMAG) && memcmp(magic, ELFMAG, SELFMAG) == 0)
+	{
+		return read_from_elf_file(filename);
 	}
 	return false;
 }
 
+bool Memory_map::write_to_ihex_file( std::string filename, size_t address, size_t length )
+{
+	std::ofstream file(filename.c_str(), std::ofstream::out | std::ofstream::trunc);
+	if (!file)
+	{
+		std::cerr << "Could not open file for writing: " << filename << std::endl;
+		return false;
+	}
+	
+	// Only the allocated ranges within the range asked for are written, with no record crossing a 64K boundary.
+	size_t end = (address + length < size) ? address + length : size;
+	size_t upper = 0;
+	for (Extent_map::const_iterator it = extents.begin(); it != extents.end(); ++it)
+	{
+		size_t start = (it->first > address) ? it->first : address;
+		size_t stop = (it->second < end) ? it->second : end;
+		while (start < stop)
+		{
+			if ((start >> 16) != upper)
+			{
+				upper = start >> 16;
+				uint8_t segment[2] = {static_cast<uint8_t>(upper >> 8), static_cast<uint8_t>(upper)};
+				write_ihex_record(file, 0x04, 0, segment, 2);
+			}
+			size_t record_length = stop - start;
+			if (record_length > 16)
+			{
+				record_length = 16;
+			}
+			if (record_length > 0x10000 - (start & 0xFFFF))
+			{
+				record_length = 0x10000 - (start & 0xFFFF);
+			}
+			write_ihex_record(file, 0x00, start & 0xFFFF, &memory[start], record_length);
+			start += record_length;
+		}
+	}
+	write_ihex_record(file, 0x01, 0, NULL, 0);
+	
+	file.close();
+	if (!file)
+	{
+		std::cerr << "Could not write file: " << filename << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool Memory_map::write_to_bin_file( std::string filename, size_t address, size_t length )
+{
+	if (address > size || length > size - address)
+	{
+		std::cerr << "Range to write is outside available memory: " << address << std::endl;
+		return false;
+	}
+	std::ofstream file(filename.c_str(), std::ofstream::out | std::ofstream::trunc | std::ofstream::binary);
+	if (!file)
+	{
+		std::cerr << "Could not open file for writing: " << filename << std::endl;
+		return false;
+	}
+	
+	std::string data(length, '\0');
+	read(address, reinterpret_cast<uint8_t*>(&data[0]), length);
+	file.write(data.data(), length);
+	file.close();
+	if (!file)
+	{
+		std::cerr << "Could not write file: " << filename << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool Memory_map::write_to_file( std::string filename, size_t address, size_t length )
+{
+	if (has_extension(filename, ".bin"))
+	{
+		return write_to_bin_file(filename, address, length);
+	}
+	return write_to_ihex_file(filename, address, length);
+}
+
 // IMPLEMENT PRIVATE FUNCTIONS.
 
+void Memory_map::add_extent(size_t start, size_t end)
+{
+	// Data is usually added in order, so the quickest thing to check for is that this just carries on from the last range.
+	if (!extents.empty() && (extents.rbegin()->first <= start) && (extents.rbegin()->second >= start))
+	{
+		if (extents.rbegin()->second < end)
+		{
+			extents.rbegin()->second = end;
+		}
+		return;
+	}
+	
+	// Otherwise try to grow the range this starts in (or just after) rather than adding another.
+	Extent_map::iterator it = extents.upper_bound(start);
+	if (it != extents.begin())
+	{
+		Extent_map::iterator previous = it;
+		--previous;
+		if (previous->second >= start)
+		{
+			it = previous;
+		}
+		else
+		{
+			it = extents.insert(it, std::make_pair(start, end));
+		}
+	}
+	else
+	{
+		it = extents.insert(it, std::make_pair(start, end));
+	}
+	if (it->second < end)
+	{
+		it->second = end;
+	}
+	
+	// Swallow any ranges which the grown one now overlaps or touches.
+	Extent_map::iterator next = it;
+	++next;
+	while ((next != extents.end()) && (next->first <= it->second))
+	{
+		if (it->second < next->second)
+		{
+			it->second = next->second;
+		}
+		extents.erase(next++);
+	}
+}
+
+bool Memory_map::read_ihex_records(const char* text, size_t length)
+{
+	const char* end = text + length;
+	size_t baseaddr = 0;
+	int lineNumber = 1;
+	
+	// Records hold at most 255 bytes of data, plus the checksum.
+	uint8_t header[4];
+	uint8_t data[256];
+	
+	for (const char* line = text; line < end; line++, lineNumber++)
+	{
+		const char* line_end = static_cast<const char*>(memchr(line, '\n', end - line));
+		if (line_end == NULL)
+		{
+			line_end = end;
+		}
+		size_t line_length = line_end - line;
+		const char* record_start = line;
+		line = line_end;
+		
+		// Like the line by line reader, anything which doesn't decode to a record with a good checksum is skipped.
+		// The header holds the data length, the address (big endian) and the record type.
+		if ((line_length < 11) || (record_start[0] != ':') || !decode_hex(record_start + 1, header, 4))
+		{
+			continue;
+		}
+		size_t record_length = header[0];
+		if ((line_length < 11 + 2*record_length) || !decode_hex(record_start + 9, data, record_length + 1))
+		{
+			continue;
+		}
+		uint8_t checksum = header[0] + header[1] + header[2] + header[3];
+		for (size_t i = 0; i <= record_length; i++)
+		{
+			checksum += data[i];
+		}
+		if (checksum != 0)
+		{
+			continue;
+		}
+		size_t address = (header[1] << 8) | header[2];
+		
+		switch (header[3])
+		{
+			case Ihex_record::DATA:
+			{
+				size_t nextaddr = baseaddr + address;
+				if (nextaddr + record_length > size)
+				{
+					std::cerr << "Data outside of available memory (" << lineNumber << ") " << describe_record(record_start, line_length) << std::endl;
+					return false;
+				}
+				write(nextaddr, data, record_length);
+				break;
+			}
+				
+			case Ihex_record::END_OF_FILE:
+				return true;
+				break;
+			
+			case Ihex_record::EXTENDED_SEG_ADDR:
+			case Ihex_record::EXTENDED_LINEAR_ADDR:
+				if (record_length != 2 || address != 0)
+				{
+					std::cerr << "Invalid extended " << ((header[3] == Ihex_record::EXTENDED_SEG_ADDR) ? "segment" : "linear") << " address record encountered (" << lineNumber << ") " << describe_record(record_start, line_length) << std::endl;
+					return false;
+				}
+				baseaddr = ((data[0] << 8) | data[1]) << ((header[3] == Ihex_record::EXTENDED_SEG_ADDR) ? 4 : 16);
+				if ( baseaddr >= size)
+				{
+					std::cerr << "Address specified outside of available memory (" << lineNumber << ") " << baseaddr << std::endl;
+					return false;
+				}
+				break;
+				
+			case Ihex_record::START_SEG_ADDR:
+			case Ihex_record::START_LINEAR_ADDR:
+				//We do nothing with these apparently, but they still end up in files. TODO: Find out what they are for and if they matter.
+				break;
+				
+			default:
+			{
+				std::cerr << "Unknown or invalid record encountered (" << lineNumber << ") " << describe_record(record_start, line_length) << std::endl;
+				return false;
+				break;
+			}
+		}
+	}
+	return true;
+}
+
+const char* map_file(const std::string& filename, size_t& length)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		std::cerr << "Could not open file: " << filename << std::endl;
+		return NULL;
+	}
+	struct stat info;
+	if (fstat(fd, &info) != 0)
+	{
+		std::cerr << "Could not read file: " << filename << std::endl;
+		close(fd);
+		return NULL;
+	}
+	length = info.st_size;
+	if (length == 0)
+	{
+		// There's nothing to map, and nothing to load either.
+		close(fd);
+		return "";
+	}
+	
+	void* data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		std::cerr << "Could not map file: " << filename << std::endl;
+		return NULL;
+	}
+	madvise(data, length, MADV_SEQUENTIAL);
+	return static_cast<const char*>(data);
+}
+
+void unmap_file(const char* data, size_t length)
+{
+	if (length > 0)
+	{
+		munmap(const_cast<char*>(data), length);
+	}
+}
+
+bool has_extension(const std::string& filename, const std::string& extension)
+{
+	return (filename.length() >= extension.length()) && (filename.compare(filename.length() - extension.length(), extension.length(), extension) == 0);
+}
+
+void write_ihex_record(std::ostream& out, uint8_t type, uint16_t offset, const uint8_t* data, size_t length)
+{
+	static const char digits[] = "0123456789ABCDEF";
+	uint8_t bytes[4 + 16];
+	bytes[0] = length;
+	bytes[1] = offset >> 8;
+	bytes[2] = offset & 0xFF;
+	bytes[3] = type;
+	if (length > 0)
+	{
+		memcpy(&bytes[4], data, length);
+	}
+	
+	// The checksum is the two's complement of the sum of every byte before it.
+	char line[1 + 2 * sizeof(bytes) + 2 + 1];
+	uint8_t sum = 0;
+	line[0] = ':';
+	size_t position = 1;
+	for (size_t i = 0; i < 4 + length; i++)
+	{
+		sum += bytes[i];
+		line[position++] = digits[bytes[i] >> 4];
+		line[position++] = digits[bytes[i] & 0x0F];
+	}
+	sum = -sum;
+	line[position++] = digits[sum >> 4];
+	line[position++] = digits[sum & 0x0F];
+	line[position++] = '\n';
+	out.write(line, position);
+}
+
+std::string describe_record(const char* text, size_t length)
+{
+	// This is only needed when something goes wrong, so the slow parser is fine for it.
+	std::string line(text, length);
+	Ihex_record record(line);
+	line.clear();
+	record.describe(line);
+	return line;
+}
+
+bool decode_hex(const char* text, uint8_t* bytes, size_t count)
+{
+	// Build the table of digit values the first time through.
+	if (!hex_digit_values_ready)
+	{
+		memset(hex_digit_values, 0xFF, sizeof(hex_digit_values));
+		for (int i = 0; i < 10; i++)
+		{
+			hex_digit_values['0' + i] = i;
+		}
+		for (int i = 0; i < 6; i++)
+		{
+			hex_digit_values['A' + i] = 10 + i;
+			hex_digit_values['a' + i] = 10 + i;
+		}
+		hex_digit_values_ready = true;
+	}
+	
+	// Collect any bad digits as we go, and only check once at the end, which keeps the loop free of branches.
+	uint8_t bad = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		uint8_t high = hex_digit_values[static_cast<uint8_t>(text[2*i])];
+		uint8_t low = hex_digit_values[static_cast<uint8_t>(text[2*i + 1])];
+		bad |= high | low;
+		bytes[i] = (high << 4) | low;
+	}
+	return (bad & 0xF0) == 0;
+}
+
 
 //ALL DONE.
@@ -49,6 +49,7 @@
 
 // INCLUDE REQUIRED HEADER FILES.
 
+#include <map>
 #include <string>
 
 #include <stdint.h>
@@ -63,11 +64,8 @@ class Memory_map
 {
 public:
 
-	enum Allocated_flag
-	{
-		UNALLOCATED = 0,
-		ALLOCATED
-	};
+	//The allocated ranges of memory, as a map from the start of each range to its end (exclusive).  Ranges never overlap or touch.
+	typedef std::map<size_t, size_t> Extent_map;
 	
 	enum Type_flag
 	{
@@ -81,17 +79,47 @@ public:
 	virtual ~Memory_map();
 	
 	uint8_t* get_memory();
-	Allocated_flag* get_allocated_map();
 	Type_flag get_type();
 	size_t get_size();
 	
+	//Whether a byte of memory holds data, rather than being left unallocated.
+	bool is_allocated(size_t address);
+	//Whether any byte in a range (usually a page) is allocated, which only needs to look at the allocated ranges, rather than every byte.
+	bool is_page_allocated(size_t address, size_t length);
+	const Extent_map& get_extents();
+	
+	//Copies data into memory, and marks it as allocated.  The caller must make sure it fits.
+	void write(size_t address, const uint8_t* data, size_t length);
+	//Copies a range of memory out, with unallocated bytes (or any beyond the end of memory) given as 0xFF, the same as erased flash.
+	void read(size_t address, uint8_t* data, size_t length);
+	
 	bool find_last_allocated_page(size_t page_size, size_t& page_start_address);
 	
+	//Returns the CRC-32 of a range of memory, counting unallocated bytes as 0xFF, since that is what gets written for them.
+	uint32_t get_checksum(size_t address, size_t length);
+	
+	//Reads an Intel HEX file by mapping it into memory and decoding the records in place, without copying or allocating anything per record.
 	virtual bool read_from_ihex_file( std::string filename );
+	//The original line by line reader, which builds an Ihex_record for every line.  It's much slower, but is kept to check the one above against.
+	bool read_from_ihex_file_by_line( std::string filename );
+	//Reads the PT_LOAD segments of an ELF32 file straight from the linker's output, at their load (physical) addresses.
+	//Only the bytes the segments hold in the file are allocated, so the extents match the image exactly.
+	virtual bool read_from_elf_file( std::string filename );
+	//Reads a raw binary file, placing its first byte at the given address.
+	virtual bool read_from_bin_file( std::string filename, size_t base_address );
 	//Reads from a file, must determine the filetype itself, mostly here for possible extension by subclasses.
-	//The implementation here will just call the hexfile reading function above if the filename ends in .hex.
+	//The implementation here reads .hex files as Intel HEX, .elf files (or anything starting with the ELF magic number) as ELF,
+	//and .bin files as raw binary.  A binary file may be given a base address with a suffix, as in image.bin@0x1000, otherwise it goes at 0.
 	virtual bool read_from_file( std::string filename);
 	
+	//Writes the allocated bytes of a range of memory to an Intel HEX file, sixteen bytes to a record, starting a new extended linear address
+	//record wherever the upper 16 bits of the address change.
+	virtual bool write_to_ihex_file( std::string filename, size_t address, size_t length );
+	//Writes a range of memory to a raw binary file, with unallocated bytes given as 0xFF.
+	virtual bool write_to_bin_file( std::string filename, size_t address, size_t length );
+	//Writes a range of memory to a file, as raw binary if its name ends in .bin, and otherwise as Intel HEX.
+	virtual bool write_to_file( std::string filename, size_t address, size_t length );
+	
 private:
 	// Functions.
 	//Make the object not default constructable or assignable.
@@ -99,10 +127,17 @@ private:
 	Memory_map( const Memory_map & other);
 	Memory_map& operator= ( const Memory_map& other );
 	
+	//Decodes the records of an Intel HEX file, which has already been read into memory.
+	bool read_ihex_records(const char* text, size_t length);
+	//Adds a range to the allocated extents, merging it with any it overlaps or touches.
+	void add_extent(size_t start, size_t end);
+	
 	
 	//Fields.
 	uint8_t* memory;
-	Allocated_flag* allocated_map;
+	//One bit per byte of memory, set if the byte is allocated.
+	uint64_t* allocated_bits;
+	Extent_map extents;
 	Type_flag type;
 	size_t size;
 
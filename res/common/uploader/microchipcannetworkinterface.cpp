@@ -35,9 +35,11 @@
 
 // INCLUDE IMPLEMENTATION SPECIFIC HEADER FILES.
 
+#include <algorithm>
 #include <iostream>
 #include <vector>
 
+#include <errno.h>
 #include <memory.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -58,6 +60,21 @@
 
 #define IN_ENDPOINT_READ_SIZE (MESSAGE_LENGTH*90)
 
+// Number of IN transfers kept submitted, so there is always somewhere for the adapter's next packet to go.
+#define IN_TRANSFER_COUNT 4
+
+// Timeout for transfers to the adapter, in ms.
+#define USB_TIMEOUT 500
+
+// Time the USB thread waits for events before checking whether it should quit, in us.
+#define USB_EVENT_POLL 100000
+
+// The adapter has three transmit buffers, and a full speed packet holds three messages.
+#define TX_SLOTS 3
+
+// Size of the receive ring, in messages.  Must be a power of two.
+#define RECV_RING_SIZE 4096
+
 #define CAN_ALIVE 0xF5
 #define USB_ALIVE 0xF7
 #define RECEIVE_MESSAGE 0xE3
@@ -146,17 +163,16 @@ private:
 	std::vector<uint8_t> content;
 };
 
-typedef std::deque<USB_message> Message_queue;
-
 // DECLARE IMPORTED GLOBAL VARIABLES.
 
 // DECLARE PRIVATE GLOBAL VARIABLES.
 
 // DEFINE PRIVATE FUNCTION PROTOTYPES.
-CAN_message parse_received_CAN_message(USB_message& m);
+CAN_message parse_received_CAN_message(const uint8_t* m);
+void unparse_transmit_message(const CAN_message& msg, uint8_t index, uint8_t* buffer);
 void print_buffer(uint8_t* buffer, size_t length);
 std::string message_name(uint8_t command);
-uint32_t parse_id(uint8_t* buffer);
+uint32_t parse_id(const uint8_t* buffer);
 void unparse_id(uint32_t id, uint8_t* buffer, bool extended);
 void print_message(uint8_t* buffer, size_t length);
 bool send_USB_message(USB_message& msg, libusb_device_handle* device);
@@ -166,15 +182,33 @@ bool send_USB_message(USB_message& msg, libusb_device_handle* device);
 
 
 Microchip_CAN_network_interface::Microchip_CAN_network_interface() :
-	recv_queue_lock(PTHREAD_MUTEX_INITIALIZER),
+	recv_ring(RECV_RING_SIZE),
+	recv_head(0),
+	recv_tail(0),
+	dropped_messages(0),
+	filter_lock(PTHREAD_MUTEX_INITIALIZER),
+	event_lock(PTHREAD_MUTEX_INITIALIZER),
+	events(0),
+	waiters(0),
+	transfers_in_flight(0),
+	tx_slots(TX_SLOTS),
+	tx_pending(0),
+	tx_confirmed(0),
+	tx_failed(false),
 	CAN_device(NULL),
 	quit(false),
 	drain(false),
-	transmitted(false),
 	overflow(false),
 	inited(false)
 {
 	ctx_holder = new libUSB_context_holder;
+	
+	// Timeouts are measured against the monotonic clock, so they aren't upset by changes to the wall clock.
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&event_cond, &attr);
+	pthread_condattr_destroy(&attr);
 }
 
 Microchip_CAN_network_interface::~Microchip_CAN_network_interface()
@@ -184,11 +218,20 @@ Microchip_CAN_network_interface::~Microchip_CAN_network_interface()
 	{
 		pthread_join(USB_thread, NULL);
 	}
+	for (size_t i = 0; i < in_transfers.size(); i++)
+	{
+		libusb_free_transfer(in_transfers[i]);
+	}
 	if (CAN_device)
 	{
 		libusb_close(CAN_device);
 	}
 	delete ctx_holder;
+	if (dropped_messages)
+	{
+		std::cerr << "Dropped " << dropped_messages << " received CAN messages because the receive ring was full." << std::endl;
+	}
+	pthread_cond_destroy(&event_cond);
 }
 
 bool Microchip_CAN_network_interface::init(Params params)
@@ -216,6 +259,15 @@ bool Microchip_CAN_network_interface::init(Params params)
 			termination = true;
 		}
 	}
+	if (params.find("tx-slots") != params.end())
+	{
+		tx_slots = strtoul(params["tx-slots"].c_str(), NULL, 10);
+		if (tx_slots < 1 || tx_slots > TX_SLOTS)
+		{
+			std::cerr << "tx-slots must be between 1 and " << TX_SLOTS << "." << std::endl;
+			return false;
+		}
+	}
 	libusb_context* ctx = ctx_holder->get_context();
 	CAN_device = libusb_open_device_with_vid_pid(ctx, VID, PID);
 	if (CAN_device == NULL)
@@ -236,11 +288,17 @@ bool Microchip_CAN_network_interface::init(Params params)
 		return false;
 	}
 	
+	if (!submit_in_transfers())
+	{
+		return false;
+	}
+	
 	int rc = pthread_create(&USB_thread, NULL, USB_thread_func, (void*) this);
 	if (rc != 0)
 	{
 		return false;
 	}
+	inited = true;
 	
 	USB_message msg;
 	
@@ -283,197 +341,302 @@ bool Microchip_CAN_network_interface::init(Params params)
 	usleep(500000);
 	//std::cout << "Waking" << std::endl;
 	
-	inited = true;
+	// Throw away anything that arrived while the adapter was being set up.
+	drain_messages();
 	
 	return true;
 }
 	
 bool Microchip_CAN_network_interface::send_message(const CAN_message& msg, uint32_t timeout)
 {
-	USB_message sendMessage;
-	timeval start, now;
-	//Transmit Message command.
-	sendMessage.get_content()[0] = TRANSMIT_MESSAGE_EV;
-	char buf[9];
-	snprintf(buf, 9, "%X", msg.get_id());
-	buf[8] = '\0';
-	//std::cerr << "ID: " << buf << ", ";
-	unparse_id(msg.get_id(), &(sendMessage.get_content()[1]), false);
-	//std::cerr << "Length: " << msg.getLength() << std::endl;
-	sendMessage.get_content()[DLC] = msg.get_length();
-	for (size_t i = 0; i < msg.get_length(); i++)
-	{
-		sendMessage.get_content()[DATA_START+i] = msg.get_data()[i];
-	}
-	sendMessage.get_content()[INDEX] = index++;
-	if (index > 2)
-	{
-		index = 0;
-	}
-	sendMessage.set_checksum(sendMessage.calculate_checksum());
-	send_USB_message(sendMessage, CAN_device);
-	gettimeofday(&start, NULL);
-	while (!__sync_fetch_and_add(&transmitted, 0))
+	CAN_message_queue msgs;
+	msgs.push_back(msg);
+	return send_messages(msgs, timeout);
+}
+
+bool Microchip_CAN_network_interface::send_messages(const CAN_message_queue& msgs, uint32_t timeout)
+{
+	timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	add_milliseconds(deadline, timeout);	// timeout is given in ms
+	
+	size_t next = 0;
+	uint32_t confirmed = __sync_fetch_and_add(&tx_confirmed, 0);
+	while (true)
 	{
-		gettimeofday(&now, NULL);
-		uint32_t msec = (now.tv_usec - start.tv_usec)/1000;
-		msec += (now.tv_sec - start.tv_sec)*1000;
-		if (msec > timeout )
+		uint32_t seen = event_count();
+		if (RESET_ATOMIC(tx_failed))
 		{
 			return false;
 		}
+		
+		// The timeout runs from the last time the adapter confirmed a message, so long batches aren't penalised.
+		uint32_t now_confirmed = __sync_fetch_and_add(&tx_confirmed, 0);
+		if (now_confirmed != confirmed)
+		{
+			confirmed = now_confirmed;
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			add_milliseconds(deadline, timeout);
+		}
+		
+		uint32_t pending = __sync_fetch_and_add(&tx_pending, 0);
+		if (next == msgs.size() && pending == 0)
+		{
+			// Everything has been transmitted.
+			return true;
+		}
+		if (next < msgs.size() && pending < tx_slots)
+		{
+			// Fill as many of the adapter's free transmit buffers as we can, in a single packet.
+			size_t count = std::min<size_t>(tx_slots - pending, msgs.size() - next);
+			if (!submit_transmit(msgs, next, count))
+			{
+				return false;
+			}
+			next += count;
+			continue;
+		}
+		if (!wait_for_event(seen, deadline))
+		{
+			// Give up on whatever is outstanding, so the next send isn't held up waiting for it.
+			confirm_transmit(__sync_fetch_and_add(&tx_pending, 0));
+			return false;
+		}
 	}
-	RESET_ATOMIC(transmitted);
-	return true;
 }
 
-
 bool Microchip_CAN_network_interface::receive_message( CAN_message& msg, uint32_t timeout)
 {
-	// if (__sync_fetch_and_add(&overflow, 0))
-	// {
-	// 	drain_messages();
-	// 	RESET_ATOMIC(overflow);
-	// 	return false;
-	// }
-		
-	timeval start, now;
-	gettimeofday(&start, NULL);
-	while (recv_queue.empty())
-	{
-		gettimeofday(&now, NULL);
-		uint32_t msec = (now.tv_usec - start.tv_usec)/100000;
-		//msec += (now.tv_sec - start.tv_sec)*1000;
-		if (msec > (timeout * 1000) )
+	timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	add_milliseconds(deadline, timeout);	// timeout is given in ms
+	
+	while (true)
+	{
+		uint32_t seen = event_count();
+		if (pop_message(msg))
 		{
-			return false;
+			return true;
+		}
+		// Sleep until the USB thread has something for us, rather than spinning.
+		if (!wait_for_event(seen, deadline))
+		{
+			return pop_message(msg);
 		}
 	}
-	pthread_mutex_lock( &recv_queue_lock );
-	msg = recv_queue.front();
-	recv_queue.pop_front();
-	pthread_mutex_unlock( &recv_queue_lock);
-	return true;
-	
 }
 
 bool Microchip_CAN_network_interface::drain_messages()
 {
-	pthread_mutex_lock( &recv_queue_lock );
-	recv_queue.clear();
-	pthread_mutex_unlock( &recv_queue_lock );
+	// The consumer owns the tail, so draining is just catching it up to the head.
+	__sync_lock_test_and_set(&recv_tail, __sync_fetch_and_add(&recv_head, 0));
 	return true;
 }
 
+bool Microchip_CAN_network_interface::set_filter( uint32_t id, Action act)
+{
+	pthread_mutex_lock( &filter_lock );
+	bool ok = CAN_network_interface::set_filter(id, act);
+	pthread_mutex_unlock( &filter_lock );
+	return ok;
+}
+
+bool Microchip_CAN_network_interface::set_filter_mode( Mode m)
+{
+	pthread_mutex_lock( &filter_lock );
+	bool ok = CAN_network_interface::set_filter_mode(m);
+	pthread_mutex_unlock( &filter_lock );
+	return ok;
+}
+
+bool Microchip_CAN_network_interface::remove_filter( uint32_t id)
+{
+	pthread_mutex_lock( &filter_lock );
+	bool ok = CAN_network_interface::remove_filter(id);
+	pthread_mutex_unlock( &filter_lock );
+	return ok;
+}
+
+bool Microchip_CAN_network_interface::clear_filter()
+{
+	pthread_mutex_lock( &filter_lock );
+	bool ok = CAN_network_interface::clear_filter();
+	pthread_mutex_unlock( &filter_lock );
+	return ok;
+}
+
 // IMPLEMENT PRIVATE FUNCTIONS.
 
 void* Microchip_CAN_network_interface::USB_thread_func(void* param)
 {
 	Microchip_CAN_network_interface* obj = static_cast<Microchip_CAN_network_interface*> (param);
-	Message_queue message_queue;
+	libusb_context* ctx = obj->ctx_holder->get_context();
+	timeval poll;
+	poll.tv_sec = 0;
+	poll.tv_usec = USB_EVENT_POLL;
+	
+	// All the work is done in the transfer callbacks, which libusb runs from here.
 	while (__sync_fetch_and_add(&obj->quit, 0) == 0)
 	{
-		obj->process_USB_events(&message_queue);
+		libusb_handle_events_timeout_completed(ctx, &poll, NULL);
+	}
+	
+	// Cancel the IN transfers, and wait for them and anything still being sent to finish before the device is closed.
+	for (size_t i = 0; i < obj->in_transfers.size(); i++)
+	{
+		libusb_cancel_transfer(obj->in_transfers[i]);
+	}
+	while (__sync_fetch_and_add(&obj->transfers_in_flight, 0) > 0)
+	{
+		libusb_handle_events_timeout_completed(ctx, &poll, NULL);
 	}
 	return 0;
 }
 
-void Microchip_CAN_network_interface::process_USB_events(void* m)
+void Microchip_CAN_network_interface::in_transfer_callback(libusb_transfer* transfer)
 {
-	uint8_t buffer[IN_ENDPOINT_READ_SIZE];
-	size_t length = 0;
-	int transferred;
-	Message_queue& message_queue = *(static_cast<Message_queue*>(m));
-	
-	
-	int rc ;
-	if ((rc = libusb_bulk_transfer(CAN_device, IN_ENDPOINT, buffer+length, IN_ENDPOINT_READ_SIZE, &transferred, 500)))
+	static_cast<Microchip_CAN_network_interface*>(transfer->user_data)->process_in_transfer(transfer);
+}
+
+void Microchip_CAN_network_interface::out_transfer_callback(libusb_transfer* transfer)
+{
+	static_cast<Microchip_CAN_network_interface*>(transfer->user_data)->process_out_transfer(transfer);
+}
+
+bool Microchip_CAN_network_interface::submit_in_transfers()
+{
+	for (size_t i = 0; i < IN_TRANSFER_COUNT; i++)
+	{
+		libusb_transfer* transfer = libusb_alloc_transfer(0);
+		if (transfer == NULL)
 		{
-			std::cerr << "Could not read from the in endpoint: " << libusb_error_name(rc) << std::endl;
-			perror("Actual Error");
-			SET_ATOMIC(quit);
-			return;
+			std::cerr << "Could not allocate a USB transfer." << std::endl;
+			return false;
 		}
 		
-		//std::cout << "Transferred: " << transferred << std::endl;
-		if ((transferred % MESSAGE_LENGTH == 0) & !__sync_fetch_and_add(&drain,0))
+		// The buffer is freed along with the transfer.
+		libusb_fill_bulk_transfer(transfer, CAN_device, IN_ENDPOINT, (unsigned char*) malloc(IN_ENDPOINT_READ_SIZE), IN_ENDPOINT_READ_SIZE, in_transfer_callback, this, 0);
+		transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+		in_transfers.push_back(transfer);
+		
+		int rc = libusb_submit_transfer(transfer);
+		if (rc)
 		{
-			
-			//std::cout << "Got a whole number of messages." << std::endl;
-			length += transferred;
-			
-			size_t curPos = 0;
+			std::cerr << "Could not read from the in endpoint: " << libusb_error_name(rc) << std::endl;
+			return false;
+		}
+		__sync_fetch_and_add(&transfers_in_flight, 1);
+	}
+	return true;
+}
 
-			while (length - curPos >= MESSAGE_LENGTH)
+void Microchip_CAN_network_interface::process_in_transfer(libusb_transfer* transfer)
+{
+	if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
+	{
+		__sync_fetch_and_sub(&transfers_in_flight, 1);
+		return;
+	}
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+	{
+		std::cerr << "Could not read from the in endpoint, transfer status: " << transfer->status << std::endl;
+		__sync_fetch_and_sub(&transfers_in_flight, 1);
+		SET_ATOMIC(quit);
+		return;
+	}
+	
+	size_t length = transfer->actual_length;
+	uint8_t* buffer = transfer->buffer;
+	
+	//std::cout << "Transferred: " << length << std::endl;
+	if ((length % MESSAGE_LENGTH == 0) && length > 0 && !__sync_fetch_and_add(&drain,0))
+	{
+		//std::cout << "Got a whole number of messages." << std::endl;
+		pthread_mutex_lock( &filter_lock );
+		for (size_t curPos = 0; curPos < length; curPos += MESSAGE_LENGTH)
+		{
+			//std::cout << "Current Position in buffer: " << curPos << std::endl;
+			uint8_t checksum = 0;
+			bool allFs = true;
+			for ( size_t i = 1; i < MESSAGE_CHECKSUM_LOCATION; i++)
 			{
-				//std::cout << "Current Position in buffer: " << curPos << std::endl;
-				uint8_t checksum = 0;
-				bool allFs = true;
-				for ( size_t i = 1; i < MESSAGE_CHECKSUM_LOCATION; i++)
+				checksum += buffer[i+curPos];
+				if (buffer[i+curPos] != 0xFF)
 				{
-					checksum += buffer[i+curPos];
-					if (buffer[i+curPos] != 0xFF)
-					{
-						allFs = false;
-					}
+					allFs = false;
 				}
-				if (checksum != buffer[MESSAGE_CHECKSUM_LOCATION+curPos])
-				{
-					if (!allFs)
-					{
-						//Increase error counter?
-						std::cout << "Checksum Error" << std::endl;
-						std::cout << "Calculated Checksum: " << (size_t)checksum << std::endl;
-						std::cout << "Message Checksum: " << (size_t)buffer[MESSAGE_CHECKSUM_LOCATION+curPos] << std::endl;
-					}
-				}
-				else
+			}
+			if (checksum != buffer[MESSAGE_CHECKSUM_LOCATION+curPos])
+			{
+				if (!allFs)
 				{
-					message_queue.push_back(USB_message(buffer+curPos, MESSAGE_LENGTH));
+					//Increase error counter?
+					std::cout << "Checksum Error" << std::endl;
+					std::cout << "Calculated Checksum: " << (size_t)checksum << std::endl;
+					std::cout << "Message Checksum: " << (size_t)buffer[MESSAGE_CHECKSUM_LOCATION+curPos] << std::endl;
 				}
-				curPos += MESSAGE_LENGTH;
 			}
-			
-			memmove(buffer, buffer+curPos, length-curPos);
-			length = length - curPos;
+			else
+			{
+				//print_message(buffer+curPos, MESSAGE_LENGTH);
+				process_message(buffer+curPos);
+			}
 		}
+		pthread_mutex_unlock( &filter_lock );
 		
-		int processed = 0;
-		
-		while (!message_queue.empty() && processed < 10)
+		// Wake the consumer once for the whole packet.
+		signal_event();
+	}
+	
+	// Put the transfer straight back, so the adapter is never left without somewhere to send to.
+	if (!__sync_fetch_and_add(&quit, 0))
+	{
+		int rc = libusb_submit_transfer(transfer);
+		if (rc == 0)
 		{
-			//std::cout << "Processing: " << processed << std::endl;
-			USB_message m = message_queue.front();
-			message_queue.pop_front();
-			//printBuffer(&(m.get_content()[0]), m.get_content().size());
-			print_message(&(m.get_content()[0]), m.get_content().size());
-			process_message(m);
-			processed++;
+			return;
 		}
+		std::cerr << "Could not read from the in endpoint: " << libusb_error_name(rc) << std::endl;
+		SET_ATOMIC(quit);
+	}
+	__sync_fetch_and_sub(&transfers_in_flight, 1);
+}
+
+void Microchip_CAN_network_interface::process_out_transfer(libusb_transfer* transfer)
+{
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED || transfer->actual_length != transfer->length)
+	{
+		std::cerr << "Failed to send message to CAN device." << std::endl;
 		
-		
+		// None of these messages will be confirmed now.
+		confirm_transmit(transfer->length / MESSAGE_LENGTH);
+		SET_ATOMIC(tx_failed);
+		signal_event();
+	}
+	
+	// The transfer and its buffer are freed by libusb once we return.
+	__sync_fetch_and_sub(&transfers_in_flight, 1);
 }
 
-void Microchip_CAN_network_interface::process_message(USB_message& m)
+void Microchip_CAN_network_interface::process_message(const uint8_t* m)
 {
-	if (m.get_content()[0] == RECEIVE_MESSAGE)
+	if (m[0] == RECEIVE_MESSAGE)
 	{
-		pthread_mutex_lock( &recv_queue_lock);
 		CAN_message msg = parse_received_CAN_message(m);
 		if (filter(msg.get_id()))
 		{
 			//std::cout << "Received" << std::endl;
-			recv_queue.push_back(msg);
+			push_message(msg);
 		}
-		pthread_mutex_unlock( &recv_queue_lock);
 	}
-	if (m.get_content()[0] == TRANSMIT_MESSAGE_RESPONSE)
+	if (m[0] == TRANSMIT_MESSAGE_RESPONSE)
 	{
-		SET_ATOMIC(transmitted);
+		confirm_transmit(1);
+		__sync_fetch_and_add(&tx_confirmed, 1);
 	}
-	if (m.get_content()[0] == CAN_ALIVE)
+	if (m[0] == CAN_ALIVE)
 	{
-		if (m.get_content()[3])
+		if (m[3])
 		{
 			//std::cout << "Overflow" << std::endl;
 			SET_ATOMIC(overflow);
@@ -481,18 +644,159 @@ void Microchip_CAN_network_interface::process_message(USB_message& m)
 	}
 }
 
-CAN_message parse_received_CAN_message(USB_message& m)
+bool Microchip_CAN_network_interface::submit_transmit(const CAN_message_queue& msgs, size_t first, size_t count)
+{
+	libusb_transfer* transfer = libusb_alloc_transfer(0);
+	if (transfer == NULL)
+	{
+		std::cerr << "Could not allocate a USB transfer." << std::endl;
+		return false;
+	}
+	
+	// Pack the messages back to back, so they go to the adapter in one packet.
+	size_t length = count * MESSAGE_LENGTH;
+	uint8_t* buffer = (uint8_t*) malloc(length);
+	for (size_t i = 0; i < count; i++)
+	{
+		unparse_transmit_message(msgs[first+i], index++, buffer + i*MESSAGE_LENGTH);
+		if (index > 2)
+		{
+			index = 0;
+		}
+	}
+	
+	// The transfer and its buffer are freed by libusb once it completes.
+	libusb_fill_bulk_transfer(transfer, CAN_device, OUT_ENDPOINT, buffer, length, out_transfer_callback, this, USB_TIMEOUT);
+	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+	
+	__sync_fetch_and_add(&tx_pending, count);
+	__sync_fetch_and_add(&transfers_in_flight, 1);
+	int rc = libusb_submit_transfer(transfer);
+	if (rc)
+	{
+		std::cerr << "Failed to send message to CAN device: " << libusb_error_name(rc) << std::endl;
+		__sync_fetch_and_sub(&transfers_in_flight, 1);
+		confirm_transmit(count);
+		libusb_free_transfer(transfer);
+		return false;
+	}
+	return true;
+}
+
+void Microchip_CAN_network_interface::confirm_transmit(uint32_t count)
+{
+	// Never go below zero, confirmations can turn up late for messages that have already been given up on.
+	uint32_t pending;
+	do
+	{
+		pending = __sync_fetch_and_add(&tx_pending, 0);
+		if (pending == 0)
+		{
+			return;
+		}
+	} while (!__sync_bool_compare_and_swap(&tx_pending, pending, (pending > count) ? (pending - count) : 0));
+}
+
+void Microchip_CAN_network_interface::push_message(const CAN_message& msg)
+{
+	size_t head = recv_head;
+	if (head - __sync_fetch_and_add(&recv_tail, 0) >= RECV_RING_SIZE)
+	{
+		// Nobody is consuming messages, and only the consumer may move the tail, so this one is lost.
+		dropped_messages++;
+		return;
+	}
+	recv_ring[head & (RECV_RING_SIZE - 1)] = msg;
+	
+	// Publish the message only once it has been written.
+	__sync_synchronize();
+	recv_head = head + 1;
+}
+
+bool Microchip_CAN_network_interface::pop_message(CAN_message& msg)
+{
+	size_t tail = recv_tail;
+	if (__sync_fetch_and_add(&recv_head, 0) == tail)
+	{
+		return false;
+	}
+	msg = recv_ring[tail & (RECV_RING_SIZE - 1)];
+	
+	// Only hand the slot back once the message has been copied out.
+	__sync_synchronize();
+	recv_tail = tail + 1;
+	return true;
+}
+
+uint32_t Microchip_CAN_network_interface::event_count()
+{
+	return __sync_fetch_and_add(&events, 0);
+}
+
+void Microchip_CAN_network_interface::signal_event()
+{
+	__sync_fetch_and_add(&events, 1);
+	
+	// The lock is only needed if somebody might be asleep, which is rare while messages are streaming in.
+	if (__sync_fetch_and_add(&waiters, 0))
+	{
+		pthread_mutex_lock( &event_lock );
+		pthread_cond_broadcast( &event_cond );
+		pthread_mutex_unlock( &event_lock );
+	}
+}
+
+bool Microchip_CAN_network_interface::wait_for_event(uint32_t seen, const timespec& deadline)
 {
-	uint32_t id = parse_id(&(m.get_content()[1]));
-	size_t length = m.get_content()[5];
+	bool timed_out = false;
+	pthread_mutex_lock( &event_lock );
+	__sync_fetch_and_add(&waiters, 1);
+	while (__sync_fetch_and_add(&events, 0) == seen && !timed_out)
+	{
+		timed_out = (pthread_cond_timedwait( &event_cond, &event_lock, &deadline) == ETIMEDOUT);
+	}
+	__sync_fetch_and_sub(&waiters, 1);
+	pthread_mutex_unlock( &event_lock );
+	return !timed_out || __sync_fetch_and_add(&events, 0) != seen;
+}
+
+CAN_message parse_received_CAN_message(const uint8_t* m)
+{
+	uint32_t id = parse_id(m+1);
+	size_t length = m[5];
+	if (length > 8)
+	{
+		length = 8;
+	}
 	uint8_t data[8];
 	for (size_t i = 0; i < length; i++)
 	{
-		data[i] = m.get_content()[6+i];
+		data[i] = m[6+i];
 	}
 	return CAN_message(id, length, &data[0]);
 }
 
+void unparse_transmit_message(const CAN_message& msg, uint8_t index, uint8_t* buffer)
+{
+	//Transmit Message command.
+	memset(buffer, 0, MESSAGE_LENGTH);
+	buffer[0] = TRANSMIT_MESSAGE_EV;
+	unparse_id(msg.get_id(), &buffer[1], false);
+	buffer[DLC] = msg.get_length();
+	for (size_t i = 0; i < msg.get_length(); i++)
+	{
+		buffer[DATA_START+i] = msg.get_data()[i];
+	}
+	buffer[INDEX] = index;
+	
+	uint8_t checksum = 0;
+	for (size_t i = 0; i < MESSAGE_CHECKSUM_LOCATION; i++)
+	{
+		checksum += buffer[i];
+	}
+	buffer[MESSAGE_CHECKSUM_LOCATION] = checksum;
+}
+
 void print_buffer(uint8_t* buffer, size_t length)
 {
 	char buf[3];
@@ -524,7 +828,7 @@ std::string message_name(uint8_t command)
 	}
 }
 
-uint32_t parse_id(uint8_t* buffer)
+uint32_t parse_id(const uint8_t* buffer)
 {
 	bool is_extended_id = false;
 	uint8_t eIdHi = (*buffer);
@@ -51,6 +51,11 @@
 
 #include "cannetworkinterface.hpp"
 
+#include <vector>
+
+#include <pthread.h>
+#include <time.h>
+
 #include <libusb-1.0/libusb.h>
 
 // DEFINE PUBLIC TYPES AND ENUMERATIONS.
@@ -74,20 +79,66 @@ public:
 	virtual bool init(Params params);
 	
 	virtual bool send_message(const CAN_message& msg, uint32_t timeout);
+	virtual bool send_messages(const CAN_message_queue& msgs, uint32_t timeout);
 	virtual bool receive_message( CAN_message& msg, uint32_t timeout);
 	virtual bool drain_messages();
 	
+	virtual bool set_filter( uint32_t id, Action act);
+	virtual bool set_filter_mode( Mode m);
+	virtual bool remove_filter( uint32_t id);
+	virtual bool clear_filter();
+	
 protected:
 	// Functions.
 	static void* USB_thread_func(void*);
-	void process_USB_events(void* m);
-	void process_message(USB_message& m);
+	static void in_transfer_callback(libusb_transfer* transfer);
+	static void out_transfer_callback(libusb_transfer* transfer);
+	bool submit_in_transfers();
+	void process_in_transfer(libusb_transfer* transfer);
+	void process_out_transfer(libusb_transfer* transfer);
+	void process_message(const uint8_t* m);
+	bool submit_transmit(const CAN_message_queue& msgs, size_t first, size_t count);
+	void confirm_transmit(uint32_t count);
+	
+	/**
+	 * Pushes a received message onto the receive ring, only ever called from the USB thread.
+	 */
+	void push_message(const CAN_message& msg);
+	/**
+	 * Pops a message off the receive ring, only ever called from the consumer.
+	 */
+	bool pop_message(CAN_message& msg);
+	
+	uint32_t event_count();
+	void signal_event();
+	bool wait_for_event(uint32_t seen, const timespec& deadline);
 	
 	//Fields.
-	CAN_message_queue recv_queue;
-	pthread_mutex_t recv_queue_lock;
 	
+	// The receive ring, a single producer (the USB thread) single consumer queue.  Each index is only written by one side.
+	std::vector<CAN_message> recv_ring;
+	size_t recv_head;
+	size_t recv_tail;
+	uint64_t dropped_messages;
+	
+	// Protects the filters, which the USB thread applies as messages arrive.
+	pthread_mutex_t filter_lock;
+	
+	// Lets the consumer sleep until the USB thread has something for it, only taken when somebody is waiting.
+	pthread_mutex_t event_lock;
+	pthread_cond_t event_cond;
+	uint32_t events;
+	uint32_t waiters;
+	
+	// The USB transfers, the IN transfers are kept submitted at all times so the adapter can always be read.
+	std::vector<libusb_transfer*> in_transfers;
+	uint32_t transfers_in_flight;
 	
+	// Transmit state, the number of messages the adapter hasn't yet confirmed and how many it has in total.
+	uint32_t tx_slots;
+	uint32_t tx_pending;
+	uint32_t tx_confirmed;
+	bool tx_failed;
 	
 	pthread_t USB_thread;
 	
@@ -95,7 +146,6 @@ protected:
 	libUSB_context_holder* ctx_holder;
 	bool quit;
 	bool drain;
-	bool transmitted;
 	bool overflow;
 	bool inited;
 	int index;
@@ -35,7 +35,9 @@
 
 // INCLUDE IMPLEMENTATION SPECIFIC HEADER FILES.
 
+#include <fstream>
 #include <iostream>
+#include <sstream>
 
 #include <stdint.h>
 #include <stdlib.h>
@@ -43,7 +45,7 @@
 
 // DEFINE PRIVATE MACROS.
 
-#define NUMBER_OF_LONGOPTS 6
+#define NUMBER_OF_LONGOPTS 14
 
 // DEFINE PRIVATE TYPES AND STRUCTS.
 
@@ -59,10 +61,18 @@ static ::option longopts[NUMBER_OF_LONGOPTS + 1] =
 	{ "memory-size", 1, NULL, 's'},
 	{ "page-size", 1, NULL, 'p'},
 	{ "target-signature", 1, NULL, 'S'},
+	{ "manifest", 1, NULL, 'm'},
+	{ "targets", 1, NULL, 'T'},
+	{ "diff", 0, NULL, 'd'},
+	{ "report", 1, NULL, 'r'},
+	{ "daemon", 1, NULL, 'D'},
+	{ "queue", 1, NULL, 'Q'},
+	{ "dump", 1, NULL, 'o'},
+	{ "dump-range", 1, NULL, 'R'},
 	{0, 0, 0, 0}
 };
 
-static std::string shortopts = "f:c:s:C:p:S:";
+static std::string shortopts = "f:c:s:C:p:S:m:T:dr:D:Q:o:R:";
 
 // DEFINE PRIVATE FUNCTION PROTOTYPES.
 
@@ -76,7 +86,16 @@ std::string substring_from_range(std::string string, size_t begin, size_t end);
 Options::Options() :
 	input_file(NULL),
 	comms_module(NULL),
-	memory_size(NULL)
+	memory_size(NULL),
+	manifest_file(NULL),
+	targets(NULL),
+	report_file(NULL),
+	daemon_socket(NULL),
+	queue_socket(NULL),
+	comms_defaults(NULL),
+	dump_file(NULL),
+	dump_range(NULL),
+	diff(false)
 {
 	//Nothing to do here.
 }
@@ -95,6 +114,8 @@ bool Options::read_from_args(int argc, char* argv[])
 	bool have_memory_size = false;
 	bool have_page_size = false;
 	bool have_signature = false;
+	bool have_manifest = false;
+	bool have_dump_file = false;
 	int optIndex = -1;
 	while (have_opts)
 	{
@@ -127,22 +148,68 @@ bool Options::read_from_args(int argc, char* argv[])
 				signature = optarg;
 				have_signature = true;
 				break;
+			case 'm':
+				manifest_file = optarg;
+				have_manifest = true;
+				break;
+			case 'T':
+				targets = optarg;
+				break;
+			case 'd':
+				diff = true;
+				break;
+			case 'r':
+				report_file = optarg;
+				break;
+			case 'D':
+				daemon_socket = optarg;
+				break;
+			case 'Q':
+				queue_socket = optarg;
+				break;
+			case 'o':
+				dump_file = optarg;
+				have_dump_file = true;
+				break;
+			case 'R':
+				dump_range = optarg;
+				break;
 			default:
 				
 				break;
 		}
 	}
-	if (!(have_in_file && have_memory_size && have_page_size && have_comms_module && have_signature))
+	if (daemon_socket != NULL)
+	{
+		// A daemon only needs to know how to reach the bus, everything else comes with each job.
+		return have_comms_module;
+	}
+	if (!((have_in_file || have_manifest || have_dump_file) && have_memory_size && have_page_size && have_comms_module && have_signature))
 	{
 		return false;
 	}
+	if ((have_in_file + have_manifest + have_dump_file) > 1)
+	{
+		std::cerr << "Only one of an input file, a manifest or a file to dump to may be given." << std::endl;
+		return false;
+	}
 	return true;
 }
 
 void Options::print_usage()
 {
-	std::cerr << "Usage: uploader -f file.hex -s memorySize -c commsModule -C comsparams -p pagesize -S signature" << std::endl;
+	std::cerr << "Usage: uploader -f file.hex -s memorySize -c commsModule -C comsparams -p pagesize -S signature [-d]" << std::endl;
+	std::cerr << "       uploader -m manifest -s memorySize -c commsModule -C comsparams -p pagesize -S signature" << std::endl;
+	std::cerr << "       uploader -f file.hex -T target,target... -s memorySize -c commsModule -C comsparams -p pagesize -S signature" << std::endl;
 	std::cerr << "       comsparams is of the form name=val:name=val... " << std::endl;
+	std::cerr << "       each line of a manifest is of the form target file.hex" << std::endl;
+	std::cerr << "       input files may be Intel HEX (.hex), ELF (.elf) or raw binary (.bin), a binary file may be given a base address as file.bin@address" << std::endl;
+	std::cerr << "       -d only writes pages which differ from what the device already holds" << std::endl;
+	std::cerr << "       -r report.json writes timings, round trip times and retry counts for the run to a JSON file" << std::endl;
+	std::cerr << "       uploader -D socket -c commsModule -C comsparams runs a daemon which keeps the connection open and runs the jobs sent to it" << std::endl;
+	std::cerr << "       -Q socket sends the job to the daemon listening on socket, instead of running it here" << std::endl;
+	std::cerr << "       uploader -o dump.hex [-R start,length] -s memorySize -c commsModule -C comsparams -p pagesize -S signature" << std::endl;
+	std::cerr << "       -o reads the device's memory back into a file instead, as raw binary (.bin) or otherwise Intel HEX, all of it unless -R is given" << std::endl;
 }
 
 const char* Options::get_input_file()
@@ -163,7 +230,21 @@ Comm_module* Options::get_comms_module()
 
 Params Options::get_comms_params()
 {
-	return parse_comms_params(comms_params);
+	// A job sent to a daemon starts off with the daemon's parameters, so it only needs to give what is different.
+	Params params;
+	if (comms_defaults != NULL)
+	{
+		params = parse_comms_params(comms_defaults);
+	}
+	if (comms_params != NULL)
+	{
+		Params own = parse_comms_params(comms_params);
+		for (Params::iterator it = own.begin(); it != own.end(); ++it)
+		{
+			params[it->first] = it->second;
+		}
+	}
+	return params;
 }
 
 size_t Options::get_memory_size()
@@ -189,6 +270,133 @@ uint32_t Options::get_signature()
 	return signature_int;
 }
 
+bool Options::is_diff()
+{
+	return diff;
+}
+
+const char* Options::get_report_file()
+{
+	return report_file;
+}
+
+const char* Options::get_daemon_socket()
+{
+	return daemon_socket;
+}
+
+const char* Options::get_queue_socket()
+{
+	return queue_socket;
+}
+
+const char* Options::get_dump_file()
+{
+	return dump_file;
+}
+
+bool Options::get_dump_range(size_t& address, size_t& length)
+{
+	// Without a range, the whole of memory is read.
+	address = 0;
+	length = get_memory_size();
+	if (dump_range == NULL)
+	{
+		return true;
+	}
+	
+	std::string range = dump_range;
+	size_t comma = range.find(',');
+	if (comma == std::string::npos)
+	{
+		std::cerr << "Dump range must be given as start,length." << std::endl;
+		return false;
+	}
+	char* end;
+	std::string start_str = range.substr(0, comma);
+	address = strtoul(start_str.c_str(), &end, 0);
+	if (start_str.empty() || *end != '\0')
+	{
+		std::cerr << "Dump range start not recognised." << std::endl;
+		return false;
+	}
+	length = parse_memory_size(range.c_str() + comma + 1);
+	if ((length == 0) || (address > get_memory_size()) || (length > get_memory_size() - address))
+	{
+		std::cerr << "Dump range is empty or outside of memory." << std::endl;
+		return false;
+	}
+	return true;
+}
+
+void Options::set_comms_defaults(const Options& daemon_opts)
+{
+	comms_defaults = daemon_opts.comms_params;
+}
+
+bool Options::is_fleet()
+{
+	return (manifest_file != NULL) || (targets != NULL);
+}
+
+bool Options::get_fleet(Fleet_manifest& manifest)
+{
+	manifest.clear();
+	if (manifest_file != NULL)
+	{
+		std::ifstream file(manifest_file);
+		if (!file.is_open())
+		{
+			std::cerr << "Could not open manifest: " << manifest_file << std::endl;
+			return false;
+		}
+		std::string line;
+		size_t line_number = 0;
+		while (std::getline(file, line))
+		{
+			line_number++;
+			std::istringstream fields(line);
+			std::string target;
+			std::string image;
+			if (!(fields >> target) || target[0] == '#')
+			{
+				// Blank lines and comments are skipped.
+				continue;
+			}
+			if (!(fields >> image))
+			{
+				std::cerr << "Manifest line " << line_number << " has no file for target " << target << std::endl;
+				return false;
+			}
+			manifest.push_back(std::make_pair(target, image));
+		}
+	}
+	else if (targets != NULL)
+	{
+		// Every target in the list gets the same file.
+		std::string list = targets;
+		size_t pos = 0;
+		size_t end = 0;
+		do
+		{
+			end = list.find(',', pos);
+			std::string target = substring_from_range(list, pos, end);
+			if (!target.empty())
+			{
+				manifest.push_back(std::make_pair(target, std::string(input_file)));
+			}
+			pos = (end == std::string::npos) ? std::string::npos : end+1;
+		}
+		while (pos != std::string::npos);
+	}
+	if (manifest.empty())
+	{
+		std::cerr << "No targets to program." << std::endl;
+		return false;
+	}
+	return true;
+}
+
 // IMPLEMENT PRIVATE FUNCTIONS.
 
 size_t parse_memory_size(const char*memory_size)
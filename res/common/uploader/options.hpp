@@ -50,6 +50,8 @@
 // INCLUDE REQUIRED HEADER FILES.
 
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <getopt.h>
 
@@ -57,6 +59,11 @@
 
 // DEFINE PUBLIC TYPES AND ENUMERATIONS.
 
+/**
+ * A list of targets to program, each paired with the name of the file to program it with.
+ */
+typedef std::vector<std::pair<std::string, std::string> > Fleet_manifest;
+
 // FORWARD DEFINE PRIVATE PROTOTYPES.
 
 // DEFINE PUBLIC CLASSES.
@@ -79,6 +86,15 @@ public:
 	size_t get_memory_size();
 	size_t get_page_size();
 	uint32_t get_signature();
+	bool is_fleet();
+	bool get_fleet(Fleet_manifest& manifest);
+	bool is_diff();
+	const char* get_report_file();
+	const char* get_daemon_socket();
+	const char* get_queue_socket();
+	const char* get_dump_file();
+	bool get_dump_range(size_t& address, size_t& length);
+	void set_comms_defaults(const Options& daemon_opts);
 
 	
 private:
@@ -93,6 +109,15 @@ private:
 	const char* memory_size;
 	const char* page_size;
 	const char* signature;
+	const char* manifest_file;
+	const char* targets;
+	const char* report_file;
+	const char* daemon_socket;
+	const char* queue_socket;
+	const char* comms_defaults;
+	const char* dump_file;
+	const char* dump_range;
+	bool diff;
 };
  
 // DEFINE PUBLIC STATIC FUNCTION PROTOTYPES.
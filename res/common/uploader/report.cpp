@@ -0,0 +1,280 @@
+// Copyright (C) 2012  Unison Networks Ltd
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+/********************************************************************************************************************************
+ *
+ *  FILE: 		report.cpp
+ *
+ *  SUB-SYSTEM:		flashing tools
+ *
+ *  COMPONENT:		Instrumentation
+ *
+ *  AUTHOR: 		agent
+ *
+ *  DATE CREATED:	17-10-2026
+ *
+ *	Implementation of the run report, which records where the time went during an upload and writes it out as JSON.
+ *
+ ********************************************************************************************************************************/
+
+// INCLUDE THE MATCHING HEADER FILE.
+
+#include "report.hpp"
+
+// INCLUDE IMPLEMENTATION SPECIFIC HEADER FILES.
+
+#include <fstream>
+#include <iostream>
+
+#include "util.hpp"
+
+// DEFINE PRIVATE MACROS.
+
+// DEFINE PRIVATE TYPES AND STRUCTS.
+
+// DECLARE IMPORTED GLOBAL VARIABLES.
+
+// DECLARE PRIVATE GLOBAL VARIABLES.
+
+// DEFINE PRIVATE FUNCTION PROTOTYPES.
+
+std::string json_string(const std::string& text);
+double seconds(uint64_t nanoseconds);
+
+// IMPLEMENT PUBLIC FUNCTIONS.
+
+Latency_histogram::Latency_histogram() :
+	count(0),
+	total(0),
+	min(0),
+	max(0)
+{
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		buckets[i] = 0;
+	}
+}
+
+void Latency_histogram::record(uint64_t nanoseconds)
+{
+	// Find the first bucket this fits under.
+	uint64_t microseconds = nanoseconds / 1000;
+	size_t bucket = 0;
+	while (bucket < HISTOGRAM_BUCKETS - 1 && microseconds >= (1ULL << bucket))
+	{
+		bucket++;
+	}
+	buckets[bucket]++;
+	
+	if (count == 0 || nanoseconds < min)
+	{
+		min = nanoseconds;
+	}
+	if (nanoseconds > max)
+	{
+		max = nanoseconds;
+	}
+	count++;
+	total += nanoseconds;
+}
+
+void Latency_histogram::record_since(const timespec& start)
+{
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	record(elapsed_nanoseconds(start, now));
+}
+
+uint64_t Latency_histogram::get_count()
+{
+	return count;
+}
+
+void Latency_histogram::write_json(std::ostream& out)
+{
+	out << "{\"count\": " << count;
+	out << ", \"mean_us\": " << ((count > 0) ? (total / count) / 1000.0 : 0.0);
+	out << ", \"min_us\": " << min / 1000.0;
+	out << ", \"max_us\": " << max / 1000.0;
+	
+	// Only the buckets up to the last one used are given, each with its upper bound.
+	size_t last = 0;
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		if (buckets[i] > 0)
+		{
+			last = i + 1;
+		}
+	}
+	out << ", \"buckets\": [";
+	for (size_t i = 0; i < last; i++)
+	{
+		out << ((i > 0) ? ", " : "") << "{\"lt_us\": ";
+		if (i == HISTOGRAM_BUCKETS - 1)
+		{
+			out << "null";
+		}
+		else
+		{
+			out << (1ULL << i);
+		}
+		out << ", \"count\": " << buckets[i] << "}";
+	}
+	out << "]}";
+}
+
+Run_report::Run_report()
+{
+	clock_gettime(CLOCK_MONOTONIC, &run_start);
+	phase_start = run_start;
+}
+
+void Run_report::begin_phase(std::string name)
+{
+	end_phase();
+	current_phase = name;
+	clock_gettime(CLOCK_MONOTONIC, &phase_start);
+}
+
+void Run_report::end_phase()
+{
+	if (current_phase.empty())
+	{
+		return;
+	}
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	find_entry(phases, current_phase) += elapsed_nanoseconds(phase_start, now);
+	current_phase.clear();
+}
+
+void Run_report::add_to_counter(std::string name, uint64_t amount)
+{
+	find_entry(counters, name) += amount;
+}
+
+void Run_report::set_value(std::string name, double value)
+{
+	find_entry(values, name) = value;
+}
+
+void Run_report::set_result(std::string name, std::string value)
+{
+	find_entry(results, name) = value;
+}
+
+Latency_histogram& Run_report::get_histogram(std::string name)
+{
+	return find_entry(histograms, name);
+}
+
+bool Run_report::write_json(std::string filename)
+{
+	end_phase();
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	std::ofstream out(filename.c_str());
+	if (!out.good())
+	{
+		std::cerr << "Could not open report file: " << filename << std::endl;
+		return false;
+	}
+	
+	out << "{" << std::endl;
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		out << "\t" << json_string(results[i].first) << ": " << json_string(results[i].second) << "," << std::endl;
+	}
+	out << "\t\"total_seconds\": " << seconds(elapsed_nanoseconds(run_start, now)) << "," << std::endl;
+	
+	out << "\t\"phases\": {";
+	for (size_t i = 0; i < phases.size(); i++)
+	{
+		out << ((i > 0) ? ", " : "") << json_string(phases[i].first) << ": " << seconds(phases[i].second);
+	}
+	out << "}," << std::endl;
+	
+	out << "\t\"counters\": {";
+	for (size_t i = 0; i < counters.size(); i++)
+	{
+		out << ((i > 0) ? ", " : "") << json_string(counters[i].first) << ": " << counters[i].second;
+	}
+	out << "}," << std::endl;
+	
+	out << "\t\"values\": {";
+	for (size_t i = 0; i < values.size(); i++)
+	{
+		out << ((i > 0) ? ", " : "") << json_string(values[i].first) << ": " << values[i].second;
+	}
+	out << "}," << std::endl;
+	
+	out << "\t\"histograms\": {";
+	for (size_t i = 0; i < histograms.size(); i++)
+	{
+		out << ((i > 0) ? "," : "") << std::endl << "\t\t" << json_string(histograms[i].first) << ": ";
+		histograms[i].second.write_json(out);
+	}
+	out << std::endl << "\t}" << std::endl;
+	out << "}" << std::endl;
+	
+	return out.good();
+}
+
+// IMPLEMENT PRIVATE FUNCTIONS.
+
+template <typename T> T& Run_report::find_entry(std::vector<std::pair<std::string, T> >& entries, const std::string& name)
+{
+	// There are only ever a handful of entries, so keeping them in order is worth more than a faster lookup.
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		if (entries[i].first == name)
+		{
+			return entries[i].second;
+		}
+	}
+	entries.push_back(std::make_pair(name, T()));
+	return entries.back().second;
+}
+
+std::string json_string(const std::string& text)
+{
+	std::string quoted = "\"";
+	for (size_t i = 0; i < text.length(); i++)
+	{
+		char c = text[i];
+		if (c == '"' || c == '\\')
+		{
+			quoted += '\\';
+			quoted += c;
+		}
+		else if (static_cast<unsigned char>(c) < 0x20)
+		{
+			quoted += ' ';
+		}
+		else
+		{
+			quoted += c;
+		}
+	}
+	return quoted + "\"";
+}
+
+double seconds(uint64_t nanoseconds)
+{
+	return nanoseconds / 1e9;
+}
+
+//ALL DONE.
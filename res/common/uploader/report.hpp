@@ -0,0 +1,138 @@
+// Copyright (C) 2012  Unison Networks Ltd
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+/**
+ *
+ * 
+ *  @file		report.hpp
+ *  A header file for recording how long an upload took, and where the time went.
+ * 
+ *  @author 		agent
+ *
+ *  @date		17-10-2026
+ * 
+ *  @section 		Licence
+ * 
+ * Copyright (C) 2012  Unison Networks Ltd
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ * 
+ */
+ 
+//Only include header once.
+#ifndef __REPORT_H__
+#define __REPORT_H__
+
+// INCLUDE REQUIRED HEADER FILES.
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+#include <time.h>
+
+// DEFINE PUBLIC TYPES AND ENUMERATIONS.
+
+// Number of buckets in a latency histogram, bucket n counts samples under 2^n us, and the last takes anything longer.
+#define HISTOGRAM_BUCKETS 24
+
+// FORWARD DEFINE PRIVATE PROTOTYPES.
+
+// DEFINE PUBLIC CLASSES.
+
+/**
+ *  A histogram of latencies, such as the round trip time of a request to a bootloader, with buckets that double in width.
+ */
+class Latency_histogram
+{
+public:
+
+	// Functions.
+	Latency_histogram();
+	
+	void record(uint64_t nanoseconds);
+	//Records the time from the given (CLOCK_MONOTONIC) time until now.
+	void record_since(const timespec& start);
+	
+	uint64_t get_count();
+	void write_json(std::ostream& out);
+	
+private:
+	
+	//Fields.
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+	uint64_t count;
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+};
+
+/**
+ *  Everything measured during a run of the uploader, which can be written out as JSON at the end so runs can be compared.
+ *  The time is split into named phases, and there are named counters, values and histograms, all reported in the order they were first used.
+ */
+class Run_report
+{
+public:
+
+	// Functions.
+	Run_report();
+	
+	//Starts timing a phase, ending whichever one was running.  Time spent in a phase more than once is added up.
+	void begin_phase(std::string name);
+	void end_phase();
+	
+	void add_to_counter(std::string name, uint64_t amount);
+	void set_value(std::string name, double value);
+	void set_result(std::string name, std::string value);
+	Latency_histogram& get_histogram(std::string name);
+	
+	bool write_json(std::string filename);
+	
+private:
+	// Functions.
+	template <typename T> T& find_entry(std::vector<std::pair<std::string, T> >& entries, const std::string& name);
+	
+	//Fields.
+	std::vector<std::pair<std::string, uint64_t> > phases;
+	std::vector<std::pair<std::string, uint64_t> > counters;
+	std::vector<std::pair<std::string, double> > values;
+	std::vector<std::pair<std::string, std::string> > results;
+	std::vector<std::pair<std::string, Latency_histogram> > histograms;
+	
+	std::string current_phase;
+	timespec phase_start;
+	timespec run_start;
+};
+ 
+// DEFINE PUBLIC STATIC FUNCTION PROTOTYPES.
+ 
+#endif /*__REPORT_H__*/
+
+//ALL DONE.
@@ -0,0 +1,150 @@
+// Copyright (C) 2012  Unison Networks Ltd
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+/********************************************************************************************************************************
+ *
+ *  FILE: 		simulatedcannetworkinterface.cpp
+ *
+ *  SUB-SYSTEM:		flashing tools
+ *
+ *  COMPONENT:		CAN Interface
+ *
+ *  AUTHOR: 		agent
+ *
+ *  DATE CREATED:	17-10-2026
+ *
+ *	Implementation of the CAN network interface to a simulated bootloader.
+ *
+ ********************************************************************************************************************************/
+
+// INCLUDE THE MATCHING HEADER FILE.
+
+#include "simulatedcannetworkinterface.hpp"
+
+// INCLUDE IMPLEMENTATION SPECIFIC HEADER FILES.
+
+#include <errno.h>
+#include <time.h>
+
+#include <iostream>
+
+// DEFINE PRIVATE MACROS.
+
+// DEFINE PRIVATE TYPES AND STRUCTS.
+
+// DECLARE IMPORTED GLOBAL VARIABLES.
+
+// DECLARE PRIVATE GLOBAL VARIABLES.
+
+// DEFINE PRIVATE FUNCTION PROTOTYPES.
+
+void sleep_until(const timespec& time);
+
+// IMPLEMENT PUBLIC FUNCTIONS.
+
+Simulated_CAN_network_interface::Simulated_CAN_network_interface() :
+	stats(false),
+	fd_mode(false)
+{
+	// Nothing to do here.
+}
+
+Simulated_CAN_network_interface::~Simulated_CAN_network_interface()
+{
+	if (stats)
+	{
+		simulator.print_stats();
+	}
+}
+
+bool Simulated_CAN_network_interface::init(Params params)
+{
+	if (params.find("sim-stats") != params.end())
+	{
+		stats = (params["sim-stats"] == "on");
+	}
+	if (params.find("fd") != params.end())
+	{
+		fd_mode = (params["fd"] == "on");
+	}
+	return simulator.init(params);
+}
+
+bool Simulated_CAN_network_interface::send_message(const CAN_message& msg, uint32_t /* timeout */)
+{
+	// An adapter which isn't in CAN-FD mode can't send CAN-FD frames.
+	if (msg.is_fd() && !fd_mode)
+	{
+		std::cerr << "Could not send, the interface isn't in CAN-FD mode." << std::endl;
+		return false;
+	}
+
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	simulator.receive_message(msg, now);
+	return true;
+}
+
+bool Simulated_CAN_network_interface::receive_message( CAN_message& msg, uint32_t timeout)
+{
+	timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	add_milliseconds(deadline, timeout);
+
+	// Nothing else can send us anything, so only the replies already on their way need waiting for.
+	timespec due;
+	while (simulator.next_message_due(due) && (elapsed_nanoseconds(deadline, due) == 0))
+	{
+		sleep_until(due);
+		simulator.pop_message(msg);
+		if (filter(msg.get_id()))
+		{
+			return true;
+		}
+	}
+	sleep_until(deadline);
+	return false;
+}
+
+bool Simulated_CAN_network_interface::drain_messages()
+{
+	// Throw away everything which would have arrived by now.
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespec due;
+	CAN_message msg;
+	while (simulator.next_message_due(due) && (elapsed_nanoseconds(now, due) == 0))
+	{
+		simulator.pop_message(msg);
+	}
+	return true;
+}
+
+bool Simulated_CAN_network_interface::supports_fd()
+{
+	return fd_mode;
+}
+
+// IMPLEMENT PRIVATE FUNCTIONS.
+
+void sleep_until(const timespec& time)
+{
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &time, NULL) == EINTR)
+	{
+		// Keep sleeping.
+	}
+}
+
+//ALL DONE.
@@ -0,0 +1,94 @@
+// Copyright (C) 2012  Unison Networks Ltd
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+/**
+ *
+ * 
+ *  @file		simulatedcannetworkinterface.hpp
+ *  A header file for a CAN network interface which talks to a simulated bootloader, instead of a real bus.
+ * 
+ *  @author 		agent
+ *
+ *  @date		17-10-2026
+ * 
+ *  @section 		Licence
+ * 
+ * Copyright (C) 2012  Unison Networks Ltd
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ * 
+ */
+ 
+//Only include header once.
+#ifndef __SIMULATEDCANNETWORKINTERFACE_H__
+#define __SIMULATEDCANNETWORKINTERFACE_H__
+
+// INCLUDE REQUIRED HEADER FILES.
+
+#include "canbootloadersimulator.hpp"
+#include "cannetworkinterface.hpp"
+
+// DEFINE PUBLIC TYPES AND ENUMERATIONS.
+
+// FORWARD DEFINE PRIVATE PROTOTYPES.
+
+// DEFINE PUBLIC CLASSES.
+
+/**
+ *  This class implements a CAN network interface with a simulated bootloader on the other end, selected with can-type=sim.
+ *  Replies are handed over once the simulation says they would have arrived, so uploads take as long as they would on a real bus.
+ */
+class Simulated_CAN_network_interface : public CAN_network_interface
+{
+public:
+
+	// Functions.
+	Simulated_CAN_network_interface();
+	virtual ~Simulated_CAN_network_interface();
+	
+	virtual bool init(Params params);
+	
+	virtual bool send_message(const CAN_message& msg, uint32_t timeout);
+	virtual bool receive_message( CAN_message& msg, uint32_t timeout);
+	virtual bool drain_messages();
+	virtual bool supports_fd();
+	
+private:
+	
+	//Fields.
+	CAN_bootloader_simulator simulator;
+	bool stats;
+	
+	// Whether the simulated adapter was set up for CAN-FD, the same as a SocketCAN one.
+	bool fd_mode;
+};
+
+ 
+// DEFINE PUBLIC STATIC FUNCTION PROTOTYPES.
+ 
+#endif /*__SIMULATEDCANNETWORKINTERFACE_H__*/
+
+//ALL DONE.
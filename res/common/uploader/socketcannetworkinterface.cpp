@@ -42,6 +42,7 @@
 
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #include <net/if.h>
 
@@ -58,6 +59,18 @@
 #define SET_ATOMIC(var) (__sync_bool_compare_and_swap(&(var), false, true))
 #define RESET_ATOMIC(var) (__sync_bool_compare_and_swap(&(var), true, false))
 
+// Maximum number of received messages held for the consumer, beyond this the oldest message is dropped.
+#define RECV_QUEUE_CAPACITY 4096
+
+// Maximum number of frames read from the socket in a single system call.
+#define RECV_BATCH_SIZE 32
+
+// Time to back off for when the interface's transmit queue is full, in us.
+#define SEND_BACKOFF 100
+
+// Bitrate of the data phase of CAN-FD frames, when none is given in the parameters.
+#define DEFAULT_DATA_BITRATE 4000000
+
 // DEFINE PRIVATE TYPES AND STRUCTS.
 
 // DECLARE IMPORTED GLOBAL VARIABLES.
@@ -65,18 +78,32 @@
 // DECLARE PRIVATE GLOBAL VARIABLES.
 
 // DEFINE PRIVATE FUNCTION PROTOTYPES.
-CAN_message parse_frame(can_frame frame);
+CAN_message parse_frame(const canfd_frame& frame, bool fd);
+
+canfd_frame unparse_frame(const CAN_message& msg);
 
 // IMPLEMENT PUBLIC FUNCTIONS.
 
 
 
 Socket_CAN_network_interface::Socket_CAN_network_interface() :
+	CAN_socket(0),
+	fd_mode(false),
 	quit(false),
 	inited(false),
-	recv_queue_lock(PTHREAD_MUTEX_INITIALIZER)
+	recv_queue_lock(PTHREAD_MUTEX_INITIALIZER),
+	latency_stats(false),
+	wakeups(0),
+	wakeup_latency_total(0),
+	wakeup_latency_max(0),
+	dropped_messages(0)
 {
-	//Nothing to do here.
+	// Receive timeouts are measured against the monotonic clock, so they aren't upset by changes to the wall clock.
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&recv_queue_cond, &attr);
+	pthread_condattr_destroy(&attr);
 }
 
 Socket_CAN_network_interface::~Socket_CAN_network_interface()
@@ -90,17 +117,22 @@ Socket_CAN_network_interface::~Socket_CAN_network_interface()
 	{
 		close(CAN_socket);
 	}
+	if (latency_stats)
+	{
+		report_latency();
+	}
+	pthread_cond_destroy(&recv_queue_cond);
 }
 
 bool Socket_CAN_network_interface::init(Params params)
 {
 	ifreq ifr;
 	sockaddr_can addr;
-	can_filter filter;
 	
 	
 	bool haveBitrate = false;
 	int bitrate = 1000000;
+	int data_bitrate = DEFAULT_DATA_BITRATE;
 	bool termination = false;
 	bool haveCanIface = false;
 	std::string canIface; 
@@ -127,17 +159,52 @@ bool Socket_CAN_network_interface::init(Params params)
 		canIface = params["iface"];
 		haveCanIface = true;
 	}
+	if (params.find("fd") != params.end())
+	{
+		if (params["fd"] == "on")
+		{
+			fd_mode = true;
+		}
+		else if (params["fd"] != "off")
+		{
+			std::cerr << "Invalid fd setting." << std::endl;
+			return false;
+		}
+	}
+	if (params.find("data-bitrate") != params.end())
+	{
+		data_bitrate = strtoul(params["data-bitrate"].c_str(), NULL, 10);
+	}
+	if (params.find("latency-stats") != params.end())
+	{
+		latency_stats = (params["latency-stats"] == "on");
+	}
 	if (!haveCanIface)
 	{
 		std::cerr << "No can interface specified." << std::endl;
 		return false;
 	}
 	
-	//Change bitrate?
-	std::stringstream ss;
-	ss << "sudo ip link set " << canIface << " down; sudo ip link set " << canIface << " up type can bitrate " << bitrate << " restart-ms 100 " <<  std::endl;
+	// Virtual interfaces have no bitrate to set, and reconfiguring a real one needs root, so it can be left to whoever brought the interface up.
+	bool link_setup = (canIface.compare(0, 4, "vcan") != 0);
+	if (params.find("link-setup") != params.end())
+	{
+		link_setup = (params["link-setup"] != "off");
+	}
 	
-	system(ss.str().c_str());
+	//Change bitrate?
+	if (link_setup)
+	{
+		std::stringstream ss;
+		ss << "sudo ip link set " << canIface << " down; sudo ip link set " << canIface << " up type can bitrate " << bitrate;
+		if (fd_mode)
+		{
+			ss << " dbitrate " << data_bitrate << " fd on";
+		}
+		ss << " restart-ms 100 " <<  std::endl;
+		
+		system(ss.str().c_str());
+	}
 	
 	
 	//Change mode?
@@ -167,6 +234,14 @@ bool Socket_CAN_network_interface::init(Params params)
 	
 	addr.can_ifindex = ifr.ifr_ifindex;
 	
+	// In CAN-FD mode, the socket passes both sorts of frame, each with its own size.
+	int enable_fd = 1;
+	if (fd_mode && (setsockopt(CAN_socket, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable_fd, sizeof(enable_fd)) < 0))
+	{
+		perror("Failed to enable CAN-FD frames");
+		return false;
+	}
+	
 	int rc = bind(CAN_socket, (sockaddr *)&addr, sizeof(addr));
 	if (rc < 0)
 	{
@@ -174,9 +249,11 @@ bool Socket_CAN_network_interface::init(Params params)
 		return false;
 	}
 	
-	filter.can_id = 0;
-	filter.can_mask = 0;
-	setsockopt(CAN_socket, SOL_CAN_RAW, CAN_RAW_FILTER, &filter, sizeof(struct can_filter));
+	// Only let through what the current filters allow, so the kernel drops everything else before it reaches us.
+	if (!apply_kernel_filter())
+	{
+		return false;
+	}
 	
 	rc = pthread_create(&socket_thread, NULL, socket_thread_func, (void*) this);
 	if (rc != 0)
@@ -191,17 +268,12 @@ bool Socket_CAN_network_interface::init(Params params)
 	
 bool Socket_CAN_network_interface::send_message(const CAN_message& msg, uint32_t timeout)
 {
-	can_frame frame;
-	frame.can_id = msg.get_id();
-	frame.can_dlc = msg.get_length();
-	for (size_t i = 0; i < msg.get_length(); i++)
-	{
-		frame.data[i] = msg.get_data()[i];
-	}
+	canfd_frame frame = unparse_frame(msg);
+	int size = msg.is_fd() ? CANFD_MTU : CAN_MTU;
 
-	int sent = write(CAN_socket, &frame, sizeof(frame));
+	int sent = write(CAN_socket, &frame, size);
 	
-	if (sent != sizeof(frame))
+	if (sent != size)
 	{
 		perror("Could not send");
 		return false;
@@ -213,28 +285,86 @@ bool Socket_CAN_network_interface::send_message(const CAN_message& msg, uint32_t
 }
 
 
-bool Socket_CAN_network_interface::receive_message( CAN_message& msg, uint32_t timeout)
+bool Socket_CAN_network_interface::send_messages(const CAN_message_queue& msgs, uint32_t timeout)
 {
+	std::vector<canfd_frame> frames(msgs.size());
+	std::vector<iovec> iovecs(msgs.size());
+	std::vector<mmsghdr> headers(msgs.size());
+	for (size_t i = 0; i < msgs.size(); i++)
+	{
+		frames[i] = unparse_frame(msgs[i]);
+		iovecs[i].iov_base = &frames[i];
+		iovecs[i].iov_len = msgs[i].is_fd() ? CANFD_MTU : CAN_MTU;
+		memset(&headers[i], 0, sizeof(mmsghdr));
+		headers[i].msg_hdr.msg_iov = &iovecs[i];
+		headers[i].msg_hdr.msg_iovlen = 1;
+	}
+	
+	timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	add_milliseconds(deadline, timeout);
+	
+	// Submit as many frames per system call as the kernel will take.
+	size_t sent = 0;
+	while (sent < frames.size())
+	{
+		int rc = sendmmsg(CAN_socket, &headers[sent], frames.size() - sent, 0);
+		if (rc < 0)
+		{
+			if (errno != ENOBUFS && errno != EAGAIN && errno != EINTR)
+			{
+				perror("Could not send");
+				return false;
+			}
+			
+			// The interface's transmit queue is full, so give it a moment to drain.
+			timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (elapsed_nanoseconds(deadline, now) > 0)
+			{
+				std::cerr << "Timed out sending CAN messages." << std::endl;
+				return false;
+			}
+			usleep(SEND_BACKOFF);
+			continue;
+		}
+		sent += rc;
+	}
+	return true;
+}
 
-	timeval start, now;
-	gettimeofday(&start, NULL);
-	//std::cout << "TRying receive" << std::endl;
+bool Socket_CAN_network_interface::receive_message( CAN_message& msg, uint32_t timeout)
+{
+	timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	add_milliseconds(deadline, timeout);	// timeout is given in ms
+	
+	pthread_mutex_lock( &recv_queue_lock );
+	bool waited = false;
 	while (recv_queue.empty())
 	{
-		gettimeofday(&now, NULL);
-		uint32_t msec = (now.tv_usec - start.tv_usec)/100000;
-		// msec += (now.tv_sec - start.tv_sec)*1000;
-		//msec += (now.tv_usec - start.tv_usec);
-		if (msec > (timeout * 1000)) 	// timeout is given in ms
+		// Sleep until the socket thread queues something, rather than spinning.
+		waited = true;
+		if (pthread_cond_timedwait( &recv_queue_cond, &recv_queue_lock, &deadline) == ETIMEDOUT && recv_queue.empty())
 		{
-
-			//std::cout << "Timeout" << std::endl;
+			pthread_mutex_unlock( &recv_queue_lock );
 			return false;
 		}
 	}
-	//std::cout << "Got message" << std::endl;
-	pthread_mutex_lock( &recv_queue_lock );
-	msg = recv_queue.front();
+	msg = recv_queue.front().msg;
+	if (waited)
+	{
+		// We were woken up by this message, so record how long that took.
+		timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		uint64_t latency = elapsed_nanoseconds(recv_queue.front().queued, now);
+		wakeups++;
+		wakeup_latency_total += latency;
+		if (latency > wakeup_latency_max)
+		{
+			wakeup_latency_max = latency;
+		}
+	}
 	recv_queue.pop_front();
 	pthread_mutex_unlock( &recv_queue_lock);
 	return true;
@@ -249,6 +379,31 @@ bool Socket_CAN_network_interface::drain_messages()
 	return true;
 }
 
+bool Socket_CAN_network_interface::supports_fd()
+{
+	return fd_mode;
+}
+
+bool Socket_CAN_network_interface::set_filter( uint32_t id, Action act)
+{
+	return CAN_network_interface::set_filter(id, act) && apply_kernel_filter();
+}
+
+bool Socket_CAN_network_interface::set_filter_mode( Mode m)
+{
+	return CAN_network_interface::set_filter_mode(m) && apply_kernel_filter();
+}
+
+bool Socket_CAN_network_interface::remove_filter( uint32_t id)
+{
+	return CAN_network_interface::remove_filter(id) && apply_kernel_filter();
+}
+
+bool Socket_CAN_network_interface::clear_filter()
+{
+	return CAN_network_interface::clear_filter() && apply_kernel_filter();
+}
+
 // IMPLEMENT PRIVATE FUNCTIONS.
 
 void* Socket_CAN_network_interface::socket_thread_func(void* param)
@@ -264,7 +419,6 @@ void* Socket_CAN_network_interface::socket_thread_func(void* param)
 void Socket_CAN_network_interface::process_socket_events()
 {
 	//Receive a message and stuff it in the recv_queue.
-	can_frame frame;
 	timeval timeout;
 	fd_set waitset;
 	int numberReady;
@@ -290,43 +444,172 @@ void Socket_CAN_network_interface::process_socket_events()
 	}
 	else
 	{
-
-		int bytes_read = read( CAN_socket, &frame, sizeof(frame) );
-		if (bytes_read == sizeof(frame))
+		// Pull in everything that's waiting, in as few system calls as possible.
+		// Classic frames are read into the start of a CAN-FD frame, which is laid out the same way.
+		canfd_frame frames[RECV_BATCH_SIZE];
+		iovec iovecs[RECV_BATCH_SIZE];
+		mmsghdr headers[RECV_BATCH_SIZE];
+		memset(headers, 0, sizeof(headers));
+		for (size_t i = 0; i < RECV_BATCH_SIZE; i++)
 		{
-			CAN_message msg = parse_frame(frame);
-			if (filter(msg.get_id()))
+			iovecs[i].iov_base = &frames[i];
+			iovecs[i].iov_len = sizeof(canfd_frame);
+			headers[i].msg_hdr.msg_iov = &iovecs[i];
+			headers[i].msg_hdr.msg_iovlen = 1;
+		}
+		
+		int frames_read = recvmmsg( CAN_socket, headers, RECV_BATCH_SIZE, MSG_DONTWAIT, NULL );
+		if (frames_read < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			{
+				perror("Receive");
+			}
+			return;
+		}
+		
+		Queued_message queued;
+		clock_gettime(CLOCK_MONOTONIC, &queued.queued);
+		pthread_mutex_lock( &recv_queue_lock );
+		for (int i = 0; i < frames_read; i++)
+		{
+			if ((headers[i].msg_len != CAN_MTU) && (headers[i].msg_len != CANFD_MTU))
 			{
-				pthread_mutex_lock( &recv_queue_lock );
-				recv_queue.push_back(msg);
-				pthread_mutex_unlock( &recv_queue_lock );
+				continue;
 			}
-			// std::cout << std::hex;
-			// std::cout << "Received ID: " << msg.get_id() << " DLC: " << msg.get_length() << std::endl;
-			// std::cout << std::dec;
+			
+			// The kernel filter does most of the work, but anything already queued in the socket when the filters changed still has to be checked.
+			queued.msg = parse_frame(frames[i], headers[i].msg_len == CANFD_MTU);
+			if (filter(queued.msg.get_id()))
+			{
+				if (recv_queue.size() >= RECV_QUEUE_CAPACITY)
+				{
+					// Nobody is consuming messages, so make room by throwing away the oldest.
+					recv_queue.pop_front();
+					dropped_messages++;
+				}
+				recv_queue.push_back(queued);
+			}
+		}
+		if (!recv_queue.empty())
+		{
+			pthread_cond_signal( &recv_queue_cond );
+		}
+		pthread_mutex_unlock( &recv_queue_lock );
+	}
+	
+	
+}
+
+bool Socket_CAN_network_interface::apply_kernel_filter()
+{
+	if (CAN_socket <= 0)
+	{
+		// Not bound to an interface yet, init will install the filter once it is.
+		return true;
+	}
 	
+	std::vector<can_filter> filters;
+	bool join_filters = false;
+	switch (filter_mode)
+	{
+	case INCLUDE_ALL:
+		// A single filter with an empty mask matches everything.
+		filters.push_back(can_filter());
+		filters.back().can_id = 0;
+		filters.back().can_mask = 0;
+		break;
+	case EXCLUDE_ALL_BUT_FILTER:
+		// One filter per included ID, any of which may match.  No filters at all means nothing is received.
+		for (Filter_set::const_iterator it = inclusion_filter.begin(); it != inclusion_filter.end(); it++)
+		{
+			filters.push_back(can_filter());
+			filters.back().can_id = *it;
+			filters.back().can_mask = CAN_EFF_MASK;
+		}
+		break;
+	case INCLUDE_ALL_BUT_FILTER:
+		// One inverted filter per excluded ID, all of which must match.
+		for (Filter_set::const_iterator it = exclusion_filter.begin(); it != exclusion_filter.end(); it++)
+		{
+			filters.push_back(can_filter());
+			filters.back().can_id = *it | CAN_INV_FILTER;
+			filters.back().can_mask = CAN_EFF_MASK;
 		}
-		else
+		join_filters = !filters.empty();
+		if (filters.empty())
 		{
-			perror("Receive");
+			// Nothing is excluded, so a single filter which matches everything will do.
+			filters.push_back(can_filter());
+			filters.back().can_id = 0;
+			filters.back().can_mask = 0;
 		}
+		break;
 	}
 	
+	// CAN_RAW_JOIN_FILTERS is an enumeration in linux/can/raw.h rather than a macro, so whether the kernel supports it can only be found out here.
+	int join = join_filters ? 1 : 0;
+	if (setsockopt(CAN_socket, SOL_CAN_RAW, CAN_RAW_JOIN_FILTERS, &join, sizeof(join)) < 0 && join_filters)
+	{
+		// An older kernel, which can't join filters, so let everything through and filter in user space.
+		filters.clear();
+		filters.push_back(can_filter());
+		filters.back().can_id = 0;
+		filters.back().can_mask = 0;
+	}
 	
+	if (setsockopt(CAN_socket, SOL_CAN_RAW, CAN_RAW_FILTER, filters.empty() ? NULL : &filters[0], filters.size() * sizeof(can_filter)) < 0)
+	{
+		perror("Failed to set CAN filter");
+		return false;
+	}
+	return true;
 }
 
-CAN_message parse_frame(can_frame frame)
+void Socket_CAN_network_interface::report_latency()
+{
+	pthread_mutex_lock( &recv_queue_lock );
+	std::cout << "SocketCAN receive wake-ups: " << wakeups;
+	if (wakeups > 0)
+	{
+		std::cout << " mean latency: " << (wakeup_latency_total / wakeups) / 1000 << "us";
+		std::cout << " max latency: " << wakeup_latency_max / 1000 << "us";
+	}
+	std::cout << " dropped: " << dropped_messages << std::endl;
+	pthread_mutex_unlock( &recv_queue_lock );
+}
+
+CAN_message parse_frame(const canfd_frame& frame, bool fd)
 {
 	CAN_message msg;
 	uint32_t id = frame.can_id;
 	id &= CAN_EFF_MASK;
 	msg.set_id(id);
-	msg.set_length(frame.can_dlc);
-	for (size_t i = 0; i < frame.can_dlc; i++)
+	msg.set_fd(fd);
+	size_t max_length = fd ? CAN_FD_MAX_LENGTH : CAN_CLASSIC_MAX_LENGTH;
+	size_t length = (frame.len > max_length) ? max_length : frame.len;
+	msg.set_length(length);
+	for (size_t i = 0; i < length; i++)
 	{
 		msg.get_content()[i] = frame.data[i];
 	}
 	return msg;
 }
 
+canfd_frame unparse_frame(const CAN_message& msg)
+{
+	canfd_frame frame;
+	memset(&frame, 0, sizeof(frame));
+	frame.can_id = msg.get_id();
+	frame.len = msg.get_length();
+
+	// CAN-FD frames switch to the faster data bitrate for their data.
+	frame.flags = msg.is_fd() ? CANFD_BRS : 0;
+	for (size_t i = 0; i < msg.get_length(); i++)
+	{
+		frame.data[i] = msg.get_data()[i];
+	}
+	return frame;
+}
+
 //ALL DONE.
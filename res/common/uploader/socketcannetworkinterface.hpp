@@ -51,6 +51,11 @@
 
 #include "cannetworkinterface.hpp"
 
+#include <deque>
+
+#include <pthread.h>
+#include <time.h>
+
 #include <sys/socket.h>
 
 // DEFINE PUBLIC TYPES AND ENUMERATIONS.
@@ -71,23 +76,50 @@ public:
 	virtual bool init(Params params);
 	
 	virtual bool send_message(const CAN_message& msg, uint32_t timeout);
+	virtual bool send_messages(const CAN_message_queue& msgs, uint32_t timeout);
 	virtual bool receive_message( CAN_message& msg, uint32_t timeout);
 	virtual bool drain_messages();
+	virtual bool supports_fd();
+	
+	virtual bool set_filter( uint32_t id, Action act);
+	virtual bool set_filter_mode( Mode m);
+	virtual bool remove_filter( uint32_t id);
+	virtual bool clear_filter();
 	
 protected:
+	/**
+	 * A received message, along with the (monotonic) time it was queued, so the consumer wake-up latency can be measured.
+	 */
+	struct Queued_message
+	{
+		CAN_message msg;
+		timespec queued;
+	};
+
 	// Functions.
 	static void* socket_thread_func(void*);
 	void process_socket_events();
+	void report_latency();
+	bool apply_kernel_filter();
 	
 	//Fields.
-	CAN_message_queue recv_queue;
+	std::deque<Queued_message> recv_queue;
 	pthread_mutex_t recv_queue_lock;
+	pthread_cond_t recv_queue_cond;
 	
-	
+	// Wake-up latency statistics, only updated while holding recv_queue_lock.
+	bool latency_stats;
+	uint64_t wakeups;
+	uint64_t wakeup_latency_total;
+	uint64_t wakeup_latency_max;
+	uint64_t dropped_messages;
 	
 	pthread_t socket_thread;
 	
 	int CAN_socket;
+	
+	// Whether the socket was set up to send and receive CAN-FD frames as well as classic ones.
+	bool fd_mode;
 	bool quit;
 	bool inited;
 };
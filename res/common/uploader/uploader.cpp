@@ -35,17 +35,35 @@
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <vector>
 #include <unistd.h>
+#include <time.h>
 
+#include "daemon.hpp"
 #include "ihex.hpp"
 #include "memory.hpp"
 #include "options.hpp"
+#include "report.hpp"
+#include "util.hpp"
 
 
 #define MAX_RETRIES 10
 
+// Smallest piece a page which keeps failing to read is split into, which is one CAN message.
+#define MIN_READ_SIZE 8
+
 // DECLARE PRIVATE FUNCTION PROTOTYPES.
 
+int run_job(Options& opts);
+
+int upload_image(Options& opts, Run_report& report);
+
+int upload_fleet(Options& opts, Comm_module* comm_module, Run_report& report);
+
+int dump_image(Options& opts, Run_report& report);
+
+void print_transfer_summary(Comm_module* comm_module, size_t bytes_written, const timespec& start, Run_report& report);
+
 // IMPLEMENT MAIN FUNCTION.
 int main(int argc, char* argv[])
 {
@@ -56,11 +74,59 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
+	// Jobs can be handed to a daemon which already has the bus open, or this can be the daemon.
+	if (opts.get_queue_socket() != NULL)
+	{
+		return queue_job(opts.get_queue_socket(), argc, argv);
+	}
+	if (opts.get_daemon_socket() != NULL)
+	{
+		return run_daemon(opts.get_daemon_socket(), opts, run_job);
+	}
+	return run_job(opts);
+}
+
+// IMPLEMENT PRIVATE FUNCTIONS.
+
+int run_job(Options& opts)
+{
+	Run_report report;
+	int result;
+	if (opts.get_dump_file() != NULL)
+	{
+		result = dump_image(opts, report);
+	}
+	else if (opts.is_fleet())
+	{
+		result = upload_fleet(opts, opts.get_comms_module(), report);
+	}
+	else
+	{
+		result = upload_image(opts, report);
+	}
+
+	// The report is written whatever happened, since failed runs are the ones most worth looking at.
+	if (opts.get_report_file() != NULL)
+	{
+		Comm_module* comm_module = opts.get_comms_module();
+		if (comm_module != NULL)
+		{
+			comm_module->add_to_report(report);
+		}
+		report.set_result("result", (result == 0) ? "ok" : "failed");
+		report.write_json(opts.get_report_file());
+	}
+	return result;
+}
+
+int upload_image(Options& opts, Run_report& report)
+{
 	std::string filename = opts.get_input_file();
 	size_t memory_size = opts.get_memory_size();
 
 	Memory_map memory(memory_size, Memory_map::FLASH);
 
+	report.begin_phase("load");
 	if (!memory.read_from_file(filename))
 	{
 		std::cerr << "Failed to read input file." << std::endl;
@@ -75,6 +141,7 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
+	report.begin_phase("connect");
 	if (!comm_module->init(opts.get_comms_params()))
 	{
 		std::cerr << "Failed to initialise communication module" << std::endl;
@@ -83,6 +150,7 @@ int main(int argc, char* argv[])
 
 	Device_info info;
 
+	report.begin_phase("device_info");
 	if (!comm_module->get_device_info(info))
 	{
 		std::cerr << "Failed to retrieve device information" << std::endl;
@@ -113,15 +181,81 @@ int main(int argc, char* argv[])
 	int retries = 0;
 	bool failed = false;
 	int max_page = end_page/opts.get_page_size();
+	int skipped_pages = 0;
+
+	bool up_to_date = false;
+
+	timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	report.add_to_counter("pages_total", max_page + 1);
+
+	// In diff mode, see if the device already holds the whole image before checking it page by page.
+	if (opts.is_diff())
+	{
+		report.begin_phase("diff");
+	}
+	if (opts.is_diff() && comm_module->image_matches(memory, end_page + opts.get_page_size()))
+	{
+		std::cout << "Device already holds this image, nothing to write." << std::endl;
+		skipped_pages = max_page + 1;
+		up_to_date = true;
+	}
+
+	// Bootloaders which don't erase each page as it is written can't rewrite only the pages which changed, since erasing the sectors which hold
+	// them would wipe the unchanged pages alongside them too, and skipping pages leaves others unerased.  Unless the device already holds the
+	// image, they get the whole image written.
+	bool partial = opts.is_diff() && !up_to_date;
+	if (partial && !comm_module->erases_each_page())
+	{
+		std::cout << "The bootloader doesn't erase each page as it writes it, so the whole image will be written." << std::endl;
+		partial = false;
+	}
+
+	// In diff mode, work out which pages need writing before writing any, since bootloaders can only check pages once they've finished writing.
+	std::vector<bool> pending(max_page + 1, !up_to_date);
+	for (size_t page_address = 0; partial && (page_address <= end_page); page_address += opts.get_page_size())
+	{
+		int page_number = page_address/opts.get_page_size();
+
+		// Pages the device already holds don't need writing or verifying again.
+		if (comm_module->page_matches(memory, opts.get_page_size(), page_address))
+		{
+			std::cout << "Page: " << page_number + 1 << " of : " << max_page + 1 << " unchanged" << std::endl;
+			pending[page_number] = false;
+			skipped_pages++;
+		}
+	}
 
+	// Bootloaders which can erase the whole image in one go do that first, so writing each page only has to program it.  This isn't done when
+	// only some pages are being written, since it would erase the pages being skipped too, or when there is nothing to write.
+	if (!partial && !up_to_date)
+	{
+		report.begin_phase("erase");
+		if (!comm_module->erase_memory(0, end_page + opts.get_page_size()))
+		{
+			std::cerr << "Failed to erase the device" << std::endl;
+			return 1;
+		}
+	}
+
+	// Write every page before verifying any, so that bootloaders which can program one page while receiving the next don't have to stop and wait.
+	report.begin_phase("write");
+	Latency_histogram& page_write = report.get_histogram("page_write");
 	for (size_t page_address = 0; page_address <= end_page; page_address += opts.get_page_size())
 	{
 		retries = 0;
 		int page_number = page_address/opts.get_page_size();
+		if (!pending[page_number])
+		{
+			continue;
+		}
+
 		do
 		{
 			std::cout << "Writing page: " <<  page_number + 1 << " of : " << max_page + 1 << std::endl;
 			std::cout.flush();
+			timespec page_start;
+			clock_gettime(CLOCK_MONOTONIC, &page_start);
 			if (!comm_module->write_page(memory, opts.get_page_size(), page_address))
 			{
 				failed = true;
@@ -130,23 +264,38 @@ int main(int argc, char* argv[])
 			{
 				failed = false;
 			}
+			page_write.record_since(page_start);
 			retries++;
 			std::cout << "\r                                        " << "\r";
 		}
 		while (failed && retries < MAX_RETRIES);
+		report.add_to_counter("write_retries", retries - 1);
 
 		if (failed)
 		{
 			std::cerr << "Failed to write flash page at: " << page_address << std::endl;
 			return 1;
 		}
+	}
 
+	report.begin_phase("verify");
+	Latency_histogram& page_verify = report.get_histogram("page_verify");
+	for (size_t page_address = 0; page_address <= end_page; page_address += opts.get_page_size())
+	{
 		retries = 0;
+		int page_number = page_address/opts.get_page_size();
+		if (!pending[page_number])
+		{
+			continue;
+		}
+
 		do
 		{
 			std::cout.flush();
 			std::cout << "Verifying page: " <<  page_number + 1 << " of : " << max_page + 1 << std::endl;
 			std::cout.flush();
+			timespec page_start;
+			clock_gettime(CLOCK_MONOTONIC, &page_start);
 			if (!comm_module->verify_page(memory, opts.get_page_size(), page_address))
 			{
 				failed = true;
@@ -155,6 +304,7 @@ int main(int argc, char* argv[])
 			{
 				failed = false;
 			}
+			page_verify.record_since(page_start);
 			retries++;
 			if (page_address != end_page)
 			{
@@ -162,6 +312,7 @@ int main(int argc, char* argv[])
 			}
 		}
 		while (failed && retries < MAX_RETRIES);
+		report.add_to_counter("verify_retries", retries - 1);
 
 
 		if (failed)
@@ -173,17 +324,254 @@ int main(int argc, char* argv[])
 
 	std::cout << std::endl;
 
+	if (opts.is_diff())
+	{
+		std::cout << "Skipped " << skipped_pages << " of " << max_page + 1 << " pages, which were unchanged." << std::endl;
+	}
+	report.add_to_counter("pages_skipped", skipped_pages);
+	print_transfer_summary(comm_module, (max_page + 1 - skipped_pages) * opts.get_page_size(), start, report);
 
+	report.begin_phase("reset");
 	if (!comm_module->reset_device(true))
 	{
 		std::cerr << "Failed to reset device." << std::endl;
 		return 1;
 	}
+	report.end_phase();
 
 	return 0;
 }
 
-// IMPLEMENT PRIVATE FUNCTIONS.
+int upload_fleet(Options& opts, Comm_module* comm_module, Run_report& report)
+{
+	Fleet_manifest manifest;
+	if (!opts.get_fleet(manifest))
+	{
+		opts.print_usage();
+		return 1;
+	}
+
+	if (comm_module == NULL)
+	{
+		std::cerr << "Unknown communication module selected" << std::endl;
+		return 1;
+	}
+
+	// Each target gets its own memory map, even when they share a file, since the module records progress against them.
+	std::vector<Memory_map*> images;
+	std::vector<Fleet_job> jobs;
+	int result = 0;
+	report.begin_phase("load");
+	for (size_t i = 0; i < manifest.size(); i++)
+	{
+		Memory_map* memory = new Memory_map(opts.get_memory_size(), Memory_map::FLASH);
+		images.push_back(memory);
+		if (!memory->read_from_file(manifest[i].second))
+		{
+			std::cerr << "Failed to read input file: " << manifest[i].second << std::endl;
+			result = 1;
+		}
+		Fleet_job job;
+		job.target = manifest[i].first;
+		job.image = memory;
+		job.pages_written = 0;
+		job.pages_total = 0;
+		job.failed = false;
+		jobs.push_back(job);
+	}
+
+	report.begin_phase("connect");
+	if (result == 0 && !comm_module->init(opts.get_comms_params()))
+	{
+		std::cerr << "Failed to initialise communication module" << std::endl;
+		result = 1;
+	}
+
+	if (result == 0)
+	{
+		timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		report.begin_phase("fleet");
+		if (!comm_module->write_fleet(jobs, opts.get_page_size(), opts.get_signature()))
+		{
+			result = 1;
+		}
+		report.end_phase();
+
+		// Summarise what happened to each target.
+		size_t bytes_written = 0;
+		for (size_t i = 0; i < jobs.size(); i++)
+		{
+			bytes_written += jobs[i].pages_written * opts.get_page_size();
+			report.add_to_counter("pages_written", jobs[i].pages_written);
+			if (jobs[i].failed)
+			{
+				std::cerr << "Target " << jobs[i].target << ": FAILED - " << jobs[i].error << std::endl;
+				report.add_to_counter("targets_failed", 1);
+			}
+			else
+			{
+				std::cout << "Target " << jobs[i].target << ": OK - " << jobs[i].pages_written << " pages" << std::endl;
+				report.add_to_counter("targets_ok", 1);
+			}
+		}
+		print_transfer_summary(comm_module, bytes_written, start, report);
+	}
+
+	for (size_t i = 0; i < images.size(); i++)
+	{
+		delete images[i];
+	}
+	return result;
+}
+
+int dump_image(Options& opts, Run_report& report)
+{
+	size_t page_size = opts.get_page_size();
+	size_t start_address;
+	size_t length;
+	if ((page_size == 0) || !opts.get_dump_range(start_address, length))
+	{
+		opts.print_usage();
+		return 1;
+	}
+
+	Comm_module* comm_module = opts.get_comms_module();
+	if (comm_module == NULL)
+	{
+		std::cerr << "Unknown communication module selected" << std::endl;
+		return 1;
+	}
+
+	report.begin_phase("connect");
+	if (!comm_module->init(opts.get_comms_params()))
+	{
+		std::cerr << "Failed to initialise communication module" << std::endl;
+		return 1;
+	}
+
+	Device_info info;
+
+	report.begin_phase("device_info");
+	if (!comm_module->get_device_info(info))
+	{
+		std::cerr << "Failed to retrieve device information" << std::endl;
+		return 1;
+	}
+
+	std::cout << "Name: " << info.get_name() << " Signature: " << info.get_signature() << std::endl;
+	//Check signature.
+	if (info.get_signature() != opts.get_signature())
+	{
+		std::cerr << "Signature Mismatch" << std::endl;
+		return 1;
+	}
+
+	Memory_map memory(opts.get_memory_size(), Memory_map::FLASH);
+	size_t end_address = start_address + length;
+	size_t next_address = start_address;
+	int retries = 0;
+	size_t total_retries = 0;
+
+	timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	report.add_to_counter("pages_total", (length + page_size - 1) / page_size);
+
+	// The module reads the whole range in one go, so it can have the next page on its way while the last is arriving.  If it fails part way,
+	// carry on from the page it failed on, which is the first one not entirely read.  Each page gets its own retries, as when writing.
+	// A page which keeps failing is read in halves, then quarters and so on, so less has to be read again each time a message goes missing.
+	size_t read_size = page_size;
+	report.begin_phase("read");
+	std::cout << "Reading " << length << " bytes from: " << start_address << std::endl;
+	while (next_address < end_address)
+	{
+		// Only the page which was failing is split up, then it's back to reading whole pages.
+		size_t read_end = end_address;
+		if (read_size < page_size)
+		{
+			read_end = next_address - ((next_address - start_address) % page_size) + page_size;
+			read_end = (read_end < end_address) ? read_end : end_address;
+		}
+		if (comm_module->read_pages(memory, read_size, next_address, read_end - next_address))
+		{
+			next_address = read_end;
+			read_size = page_size;
+			retries = 0;
+			continue;
+		}
+		const Memory_map::Extent_map& extents = memory.get_extents();
+		Memory_map::Extent_map::const_iterator read = extents.find(start_address);
+		size_t failed_address = (read == extents.end()) ? start_address : read->second;
+		failed_address -= (failed_address - start_address) % read_size;
+		retries = (failed_address == next_address) ? retries + 1 : 1;
+		total_retries++;
+		next_address = failed_address;
+		if (retries >= MAX_RETRIES)
+		{
+			std::cerr << "Failed to read flash page at: " << next_address << std::endl;
+			report.add_to_counter("read_retries", total_retries);
+			return 1;
+		}
+		if ((retries > 1) && (read_size > MIN_READ_SIZE))
+		{
+			read_size /= 2;
+		}
+		std::cerr << "Retrying from: " << next_address << std::endl;
+	}
+	report.add_to_counter("read_retries", total_retries);
+
+	timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double seconds = elapsed_nanoseconds(start, end) / 1e9;
+	std::cout << "Read " << length << " bytes in " << seconds << " s";
+	report.add_to_counter("bytes_read", length);
+	if (seconds > 0)
+	{
+		std::cout << " (" << static_cast<size_t>(length / seconds) << " bytes/s)";
+		report.set_value("bytes_per_second", length / seconds);
+	}
+	std::cout << std::endl;
+
+	report.begin_phase("save");
+	if (!memory.write_to_file(opts.get_dump_file(), start_address, length))
+	{
+		std::cerr << "Failed to write output file." << std::endl;
+		return 1;
+	}
+
+	report.begin_phase("reset");
+	if (!comm_module->reset_device(true))
+	{
+		std::cerr << "Failed to reset device." << std::endl;
+		return 1;
+	}
+	report.end_phase();
+
+	return 0;
+}
+
+void print_transfer_summary(Comm_module* comm_module, size_t bytes_written, const timespec& start, Run_report& report)
+{
+	timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double seconds = elapsed_nanoseconds(start, end) / 1e9;
+	std::cout << "Wrote " << bytes_written << " bytes in " << seconds << " s";
+	report.add_to_counter("bytes_written", bytes_written);
+	if (seconds > 0)
+	{
+		std::cout << " (" << static_cast<size_t>(bytes_written / seconds) << " bytes/s)";
+		report.set_value("bytes_per_second", bytes_written / seconds);
+	}
+	std::cout << std::endl;
+
+	// Modules which compress pages on the way also say how well that went.
+	size_t raw_bytes;
+	size_t sent_bytes;
+	if (comm_module->get_compression_stats(raw_bytes, sent_bytes) && (sent_bytes > 0))
+	{
+		std::cout << "Sent " << sent_bytes << " bytes for " << raw_bytes << " bytes of page data (ratio " << static_cast<double>(raw_bytes) / sent_bytes << ":1)" << std::endl;
+	}
+}
 
 //ALL DONE.
 
@@ -0,0 +1,135 @@
+// Copyright (C) 2012  Unison Networks Ltd
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+/********************************************************************************************************************************
+ *
+ *  FILE: 		util.cpp
+ *
+ *  SUB-SYSTEM:		flashing tools
+ *
+ *  COMPONENT:		Utilities
+ *
+ *  AUTHOR: 		agent
+ *
+ *  DATE CREATED:	17-10-2026
+ *
+ *	Implementation of the general utility functions.
+ *
+ ********************************************************************************************************************************/
+
+// INCLUDE THE MATCHING HEADER FILE.
+
+#include "util.hpp"
+
+// INCLUDE IMPLEMENTATION SPECIFIC HEADER FILES.
+
+// DEFINE PRIVATE MACROS.
+
+// Longest run of literal bytes, and of one repeated byte, which a single run length encoding control byte can describe.
+#define RLE_MAX_LITERAL 128
+#define RLE_MAX_REPEAT 129
+
+// DEFINE PRIVATE TYPES AND STRUCTS.
+
+// DECLARE IMPORTED GLOBAL VARIABLES.
+
+// DECLARE PRIVATE GLOBAL VARIABLES.
+
+static uint32_t crc32_table[256];
+static bool crc32_table_ready = false;
+
+// DEFINE PRIVATE FUNCTION PROTOTYPES.
+
+// IMPLEMENT PUBLIC FUNCTIONS.
+
+void add_milliseconds(timespec& time, uint32_t ms)
+{
+	time.tv_sec += ms / 1000;
+	time.tv_nsec += (ms % 1000) * 1000000L;
+	if (time.tv_nsec >= 1000000000L)
+	{
+		time.tv_sec++;
+		time.tv_nsec -= 1000000000L;
+	}
+}
+
+uint64_t elapsed_nanoseconds(const timespec& from, const timespec& to)
+{
+	int64_t elapsed = (static_cast<int64_t>(to.tv_sec) - from.tv_sec) * 1000000000LL + (to.tv_nsec - from.tv_nsec);
+	return (elapsed > 0) ? elapsed : 0;
+}
+
+uint32_t crc32(uint32_t crc, const uint8_t* data, size_t length)
+{
+	// Build the table for the reflected polynomial the first time through.
+	if (!crc32_table_ready)
+	{
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t entry = i;
+			for (int bit = 0; bit < 8; bit++)
+			{
+				entry = (entry & 1) ? ((entry >> 1) ^ 0xEDB88320) : (entry >> 1);
+			}
+			crc32_table[i] = entry;
+		}
+		crc32_table_ready = true;
+	}
+
+	crc = ~crc;
+	for (size_t i = 0; i < length; i++)
+	{
+		crc = crc32_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+void rle_compress(const std::vector<uint8_t>& input, std::vector<uint8_t>& output)
+{
+	size_t i = 0;
+	while (i < input.size())
+	{
+		// Runs of three or more bytes are worth encoding as a repeat.
+		size_t run = 1;
+		while ((i + run < input.size()) && (run < RLE_MAX_REPEAT) && (input[i + run] == input[i]))
+		{
+			run++;
+		}
+		if (run >= 3)
+		{
+			output.push_back(0x80 + (run - 2));
+			output.push_back(input[i]);
+			i += run;
+			continue;
+		}
+
+		// Otherwise gather literals up until the next run which is worth encoding.
+		size_t start = i;
+		while ((i < input.size()) && (i - start < RLE_MAX_LITERAL))
+		{
+			if ((i + 2 < input.size()) && (input[i] == input[i + 1]) && (input[i] == input[i + 2]))
+			{
+				break;
+			}
+			i++;
+		}
+		output.push_back(i - start - 1);
+		output.insert(output.end(), input.begin() + start, input.begin() + i);
+	}
+}
+
+// IMPLEMENT PRIVATE FUNCTIONS.
+
+//ALL DONE.
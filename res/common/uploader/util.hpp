@@ -50,6 +50,10 @@
 
 #include <map>
 #include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <time.h>
 
 // DEFINE PUBLIC TYPES AND ENUMERATIONS.
 
@@ -60,5 +64,27 @@ typedef std::map<std::string, std::string> Params;
 // DEFINE PUBLIC CLASSES.
  
 // DEFINE PUBLIC STATIC FUNCTION PROTOTYPES.
+
+/**
+ *  Moves a (CLOCK_MONOTONIC) time forward by a number of milliseconds, for working out deadlines.
+ */
+void add_milliseconds(timespec& time, uint32_t ms);
+
+/**
+ *  Returns the number of nanoseconds from one time to a later one, or zero if the second time is not later.
+ */
+uint64_t elapsed_nanoseconds(const timespec& from, const timespec& to);
+
+/**
+ *  Updates a CRC-32 (the same one used by zlib and the bootloaders) with some more data.
+ *  Start with a CRC of zero; the result of one call can be passed back in to carry on over more data.
+ */
+uint32_t crc32(uint32_t crc, const uint8_t* data, size_t length);
+
+/**
+ *  Run length encodes some data in the form the bootloaders decode, appending it to the output.
+ *  A control byte below 0x80 is followed by that many plus one literal bytes, otherwise the byte after it is repeated (control - 0x80 + 2) times.
+ */
+void rle_compress(const std::vector<uint8_t>& input, std::vector<uint8_t>& output);
  
 #endif /*__UTIL_H__*/
@@ -35,30 +35,63 @@
 
 #include "can_platform.hpp"
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
-#include <fcntl.h> 
+#include <pthread.h>
 #include <net/if.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <linux/can.h>
 #include <linux/can/raw.h>
+#include <linux/can/error.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 
 #include <string.h>
 
 // ADAM
 #include <iostream>
 #include <errno.h>
+#include <atomic>
 
 // DEFINE PRIVATE MACROS.
 
+#define CAN_BANK_PAIRS	4	// Filter/mask pairs in each bank.
+
+// Sources the interrupt thread waits on, after one for each buffer.
+#define CAN_INT_WAKE_EVENT	CAN_NUM_BUFFERS
+#define CAN_INT_ERROR_EVENT	(CAN_NUM_BUFFERS+1)
+#define CAN_INT_MAX_EVENTS	(CAN_NUM_BUFFERS+2)
+
+// Error frames which are reported to buffers with a CAN_GEN_ERROR handler.
+#define CAN_GEN_ERROR_MASK	(CAN_ERR_TX_TIMEOUT | CAN_ERR_ACK | CAN_ERR_PROT | CAN_ERR_BUSERROR)
+
+// Most messages read or written with one system call.
+#define CAN_BATCH_SIZE	32
+
+// Messages each buffer remembers writing, until their echoes come back; enough for a couple of batches.
+#define CAN_TX_ECHO_SLOTS	64
+
+// Timestamps the kernel is asked for on each socket: the adapter's own where it has a clock, and the kernel's otherwise.
+#define CAN_TIMESTAMPING_FLAGS	(SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE | SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE)
 
 // DEFINE PRIVATE CLASSES, TYPES AND ENUMERATIONS.
 
-int s;	// unfortunately, the use of a tree data structure meant that the children can't readily access parent fields, thus the socket is global
+// A message written to a buffer, waiting for its echo so the time it took to be sent can be measured.
+typedef struct
+{
+	canid_t can_id;
+	uint8_t dlc;
+	uint8_t data[8];
+	uint64_t written_ns;
+} Can_tx_record;
 
 /**
  * Private, target specific implementation class for public Can_filmask class.
@@ -214,11 +247,13 @@ class Can_filter_bank_imp
 		
 		Can_bank_mode bnk_mode;
 		
-		Can_filmask* filmasks[8];		// up to 4 filter/mask pairs, filter and masks are adjacent
+		Can_filmask* filmasks[2*CAN_BANK_PAIRS];		// up to 4 filter/mask pairs, filter and masks are adjacent
 		
 		Can_buffer* buffer_link;
 		
-		struct can_filter rfilters[4];	// SocketCAN filter type
+		Can_imp* ctrl_link;		// the controller, which applies the filters of every bank attached to a buffer onto its socket
+		
+		struct can_filter rfilters[CAN_BANK_PAIRS];	// SocketCAN filter type
 };
 
 /**
@@ -294,7 +329,27 @@ class Can_buffer_imp
 		 * @param   msg    Message to write to the buffer.
 		 * @return  Nothing.
 		 */
-		Can_send_status write(Can_message msg);
+		Can_send_status write(const Can_message& msg);
+		
+		/**
+		 * Get as many waiting messages as will fit, without waiting for more
+		 * 
+		 * @param	msgs		Array to store the incoming messages.
+		 * @param	count		Number of messages the array can hold.
+		 * @param	num_read	Set to the number of messages read.
+		 * @return	Return code for the first message which couldn't be read, or success if all were.
+		 */
+		Can_send_status read_batch(Can_message* msgs, size_t count, size_t& num_read);
+		
+		/**
+		 * Write messages to buffer, in order
+		 * 
+		 * @param	msgs		Messages to write to the buffer.
+		 * @param	count		Number of messages to write.
+		 * @param	num_written	Set to the number of messages written.
+		 * @return	Return code for the first message which couldn't be written, or success if all were.
+		 */
+		Can_send_status write_batch(const Can_message* msgs, size_t count, size_t& num_written);
 		
 		/**
 		 * Get the number of message in the buffer
@@ -373,10 +428,107 @@ class Can_buffer_imp
 		 */
 		Can_int_status clear_interrupt_flags(Can_buffer_interrupt_type interrupt);
 		
+		/**
+		 * Returns the time the last message read from this buffer was received.
+		 * 
+		 * @param	Nothing.
+		 * @return	The time the message was received.
+		 */
+		Can_timestamp get_timestamp(void);
+		
+		/**
+		 * Returns a copy of one of the latency histograms this buffer keeps.
+		 * 
+		 * @param	type	The histogram to return.
+		 * @return	The histogram.
+		 */
+		Can_histogram get_histogram(Can_histogram_type type);
+		
+		/**
+		 * Empties all of the latency histograms this buffer keeps.
+		 * 
+		 * @param	Nothing.
+		 * @return	Nothing.
+		 */
+		void clear_histograms(void);
+		
+		/**
+		 * Opens the CAN_RAW socket behind this buffer and binds it to a SocketCAN interface.
+		 * 
+		 * @param	interface_name	The name of the interface to bind to, such as can0.
+		 * @return	Flag indicating whether the socket was opened and bound.
+		 */
+		bool open(const char* interface_name);
+		
+		/**
+		 * Closes the socket behind this buffer.
+		 * 
+		 * @param	Nothing.
+		 * @return	Nothing.
+		 */
+		void close(void);
+		
 	private:
 		
 		// Methods.
 		
+		/**
+		 * Reads one message from the socket, passing over the frames which are only of interest to interrupt handlers.  A message the interrupt
+		 * thread has already taken off the socket is returned first.
+		 * 
+		 * @param	msg		Can_message struct to store the incoming message.
+		 * @param	flags	Flags for recv, MSG_DONTWAIT to return straight away if there is no frame waiting.
+		 * @return	Return code indicating whether operation was successful.
+		 */
+		Can_send_status receive(Can_message& msg, int flags);
+		
+		/**
+		 * Reads one frame from the socket, whatever it is, and records how long it took to arrive.
+		 * 
+		 * @param	frame		SocketCAN frame to store the incoming frame.
+		 * @param	flags		Flags for recvmsg.
+		 * @param	msg_flags	Set to the flags SocketCAN returns with the frame; MSG_CONFIRM marks a frame this socket sent.
+		 * @param	stamp		Set to the time the frame was received.
+		 * @return	The number of bytes read, or negative for failure.
+		 */
+		int recv_frame(struct can_frame& frame, int flags, int& msg_flags, Can_timestamp& stamp);
+		
+		/**
+		 * Works out when a frame read from the socket was received, and records how long it took to arrive.  The caller must hold the timing lock.
+		 * 
+		 * @param	hdr		The header the frame was read with, holding the timestamps the kernel passed up.
+		 * @param	frame	The frame which was read.
+		 * @param	stamp	Set to the time the frame was received.
+		 * @return	Nothing.
+		 */
+		void take_frame(const struct msghdr& hdr, const struct can_frame& frame, Can_timestamp& stamp);
+		
+		/**
+		 * Remembers frames about to be written, until their echoes come back.
+		 * 
+		 * @param	frames	The frames to be written.
+		 * @param	count	The number of frames.
+		 * @return	Nothing.
+		 */
+		void remember_written(const struct can_frame* frames, size_t count);
+		
+		/**
+		 * Forgets the frames most recently remembered, when they couldn't be written after all.
+		 * 
+		 * @param	count	The number of frames to forget.
+		 * @return	Nothing.
+		 */
+		void forget_written(size_t count);
+		
+		/**
+		 * Called from the interrupt thread when a frame is waiting on the socket.  Takes the frame off the socket and runs the handler for it, in
+		 * the same way as the MOb interrupt on the AVR.
+		 * 
+		 * @param	Nothing.
+		 * @return	Nothing.
+		 */
+		void service_interrupt(void);
+		
 		Can_buffer_imp(void);	// Poisoned.
 
 		Can_buffer_imp(Can_buffer_imp*);	// Poisoned.
@@ -390,6 +542,40 @@ class Can_buffer_imp
 		Can_buffer_mode buf_mode;
 		
 		Can_filter_bank* bank_link;
+		
+		int sock;	// each buffer has its own socket, so its filters and reads don't affect any other buffer
+		
+		Can_imp* ctrl_link;
+		
+		volatile IsrHandler int_handlers[CAN_NUM_BUF_INT];
+		
+		volatile Can_buffer_status buf_status;	// status of the last interrupt event, until its flag is cleared
+		
+		// Handover of a message from the interrupt thread, which runs alongside whoever reads the buffer rather than interrupting them.
+		
+		pthread_mutex_t pending_lock;
+		
+		Can_message pending;		// message taken off the socket by the interrupt thread, until it is read or freed
+		
+		bool rx_pending;
+		
+		Can_timestamp pending_timestamp;
+		
+		Can_timestamp rx_timestamp;	// time the last message read was received
+		
+		// Latency measurement, shared between the interrupt thread and whoever writes to the buffer.
+		
+		pthread_mutex_t timing_lock;
+		
+		Can_histogram histograms[CAN_NB_HIST];
+		
+		uint64_t last_arrival_ns;
+		
+		Can_tx_record tx_records[CAN_TX_ECHO_SLOTS];	// ring of messages written and not yet echoed, oldest first
+		
+		uint8_t tx_head;
+		
+		uint8_t tx_count;
 };
 
 /**
@@ -508,11 +694,64 @@ class Can_imp
 		 * Close the socket for SocketCAN
 		 */
 		void close(void);
+		
+		/**
+		 * Applies the filters of every bank attached to a buffer onto the buffer's socket.  A buffer with no banks attached gets the SocketCAN default
+		 * filter back, which accepts everything.
+		 * 
+		 * @param	buffer	The buffer whose socket to apply the filters to.
+		 * @return		Zero for success, or non-zero for failure.
+		 */
+		Can_config_status apply_filters(Can_buffer* buffer);
+		
+		/**
+		 * Returns the buffer whose interrupt handler is running, or NULL outside of a buffer interrupt.
+		 * 
+		 * @param	Nothing.
+		 * @return	The buffer being serviced.
+		 */
+		Can_buffer* get_interrupted_buffer(void);
+		
+		/**
+		 * Starts or stops the interrupt thread waiting on a socket.
+		 * 
+		 * @param	fd		The socket (or other descriptor) to wait on.
+		 * @param	source	Which source the events are for, either a buffer number or one of the CAN_INT_*_EVENTs.
+		 * @param	watch	True to start waiting on the socket, false to stop.
+		 * @return	Nothing.
+		 */
+		void watch_socket(int fd, uint32_t source, bool watch);
+		
+		/**
+		 * The body of the interrupt thread, which waits on the sockets of buffers with interrupts enabled and runs their handlers until interrupts
+		 * are disabled.
+		 * 
+		 * @param	Nothing.
+		 * @return	Nothing.
+		 */
+		void service_interrupts(void);
     
 	private:
 
 		// Methods.
 		
+		/**
+		 * Waits for an interrupt thread which has been told to stop, but may still be finishing a handler, to exit.  Two threads must never
+		 * service the same sockets at once.
+		 * 
+		 * @param	Nothing.
+		 * @return	Nothing.
+		 */
+		void wait_for_interrupt_thread(void);
+		
+		/**
+		 * Called from the interrupt thread when a notice is waiting on the error socket.
+		 * 
+		 * @param	Nothing.
+		 * @return	Nothing.
+		 */
+		void service_channel_interrupt(void);
+		
 		Can_imp(void);	// Poisoned.
 
 		Can_imp(Can_imp*);	// Poisoned.
@@ -525,7 +764,7 @@ class Can_imp
 
 			// Objects for the CAN tree.
 			
-			// NOTE - Only managed to get one buffer working on SocketCAN
+			// NOTE - Each buffer is a socket of its own, and is paired with the bank of the same number when the controller is created.
 			
 			Can_buffer* buffers[CAN_NUM_BUFFERS];
 			Can_filter_bank* banks[CAN_NUM_BANKS];
@@ -535,9 +774,27 @@ class Can_imp
 			Can_buffer_imp buf_0i;
 			Can_buffer buf_0;
 
+			Can_buffer_imp buf_1i;
+			Can_buffer buf_1;
+
+			Can_buffer_imp buf_2i;
+			Can_buffer buf_2;
+
+			Can_buffer_imp buf_3i;
+			Can_buffer buf_3;
+
 			Can_filter_bank_imp bnk_0i;
 			Can_filter_bank bnk_0;
 
+			Can_filter_bank_imp bnk_1i;
+			Can_filter_bank bnk_1;
+
+			Can_filter_bank_imp bnk_2i;
+			Can_filter_bank bnk_2;
+
+			Can_filter_bank_imp bnk_3i;
+			Can_filter_bank bnk_3;
+
 			Can_filmask_imp fil_0i;
 			Can_filmask_imp fil_1i;
 			Can_filmask_imp fil_2i;
@@ -548,6 +805,36 @@ class Can_imp
 			Can_filmask fil_2;
 			Can_filmask fil_3;
 			
+			Can_filmask_imp fil_4i;
+			Can_filmask_imp fil_5i;
+			Can_filmask_imp fil_6i;
+			Can_filmask_imp fil_7i;
+			
+			Can_filmask fil_4;
+			Can_filmask fil_5;
+			Can_filmask fil_6;
+			Can_filmask fil_7;
+			
+			Can_filmask_imp fil_8i;
+			Can_filmask_imp fil_9i;
+			Can_filmask_imp fil_10i;
+			Can_filmask_imp fil_11i;
+			
+			Can_filmask fil_8;
+			Can_filmask fil_9;
+			Can_filmask fil_10;
+			Can_filmask fil_11;
+			
+			Can_filmask_imp fil_12i;
+			Can_filmask_imp fil_13i;
+			Can_filmask_imp fil_14i;
+			Can_filmask_imp fil_15i;
+			
+			Can_filmask fil_12;
+			Can_filmask fil_13;
+			Can_filmask fil_14;
+			Can_filmask fil_15;
+			
 			Can_filmask_imp msk_0i;
 			Can_filmask_imp msk_1i;
 			Can_filmask_imp msk_2i;
@@ -558,13 +845,131 @@ class Can_imp
 			Can_filmask msk_2;
 			Can_filmask msk_3;
 			
+			Can_filmask_imp msk_4i;
+			Can_filmask_imp msk_5i;
+			Can_filmask_imp msk_6i;
+			Can_filmask_imp msk_7i;
+			
+			Can_filmask msk_4;
+			Can_filmask msk_5;
+			Can_filmask msk_6;
+			Can_filmask msk_7;
+			
+			Can_filmask_imp msk_8i;
+			Can_filmask_imp msk_9i;
+			Can_filmask_imp msk_10i;
+			Can_filmask_imp msk_11i;
+			
+			Can_filmask msk_8;
+			Can_filmask msk_9;
+			Can_filmask msk_10;
+			Can_filmask msk_11;
+			
+			Can_filmask_imp msk_12i;
+			Can_filmask_imp msk_13i;
+			Can_filmask_imp msk_14i;
+			Can_filmask_imp msk_15i;
+			
+			Can_filmask msk_12;
+			Can_filmask msk_13;
+			Can_filmask msk_14;
+			Can_filmask msk_15;
+			
+			Can_id_controller ctrl_no;
+			
 			// *** TARGET AGNOSTIC.
+			
+			// Interrupt emulation.
+			
+			int epoll_fd;
+			
+			int wake_fd;	// written to get the interrupt thread to check whether it should stop
+			
+			int err_sock;	// socket which only receives bus off notices, open while a CAN_BUS_OFF handler is attached
+			
+			pthread_t int_thread;
+			
+			std::atomic<bool> int_running;		// cleared to tell the interrupt thread to stop
+			
+			std::atomic<bool> int_thread_alive;	// set from starting the interrupt thread until it has stopped, even once detached
+			
+			bool int_self_stopped;	// set when a handler stopped the interrupt thread, so nothing will join it
+			
+			volatile IsrHandler chan_int_handlers[CAN_NUM_CHAN_INT];
+			
+			volatile bool bus_off;
+			
+			volatile bool in_buffer_interrupt;
+			
+			volatile Can_id_buffer interrupt_service_buffer;
 };
 
 // DECLARE PRIVATE GLOBAL VARIABLES.
 
+// The SocketCAN interface behind each controller.
+const char* can_interface_names[NB_CTRL] = CAN_INTERFACE_NAMES;
+
 // DEFINE PRIVATE STATIC FUNCTION PROTOTYPES.
 
+/**
+ * Opens a CAN_RAW socket and binds it to a SocketCAN interface.
+ *
+ * @param	interface_name	The name of the interface to bind to, such as can0.
+ * @return	The socket, or negative for failure.
+ */
+static int open_can_socket(const char* interface_name);
+
+/**
+ * Wraps a SocketCAN frame as a ValleyForge message.
+ *
+ * @param	frame	The frame which was received.
+ * @param	msg		Can_message struct to store the message in.
+ * @return	Nothing.
+ */
+static void frame_to_message(const struct can_frame& frame, Can_message& msg);
+
+/**
+ * Wraps a ValleyForge message as a SocketCAN frame.
+ *
+ * @param	msg		The message to send.
+ * @param	frame	SocketCAN frame to store the message in.
+ * @return	Nothing.
+ */
+static void message_to_frame(const Can_message& msg, struct can_frame& frame);
+
+/**
+ * Works out the buffer status which best describes an error frame.
+ *
+ * @param	frame	The error frame which was received.
+ * @return	The buffer status for the error.
+ */
+static Can_buffer_status error_frame_status(const struct can_frame& frame);
+
+/**
+ * Converts a time to nanoseconds.
+ *
+ * @param	ts		The time to convert.
+ * @return	The time in nanoseconds.
+ */
+static uint64_t timespec_to_ns(const struct timespec& ts);
+
+/**
+ * Adds a latency to a histogram.
+ *
+ * @param	histogram	The histogram to add to.
+ * @param	ns			The latency in nanoseconds.
+ * @return	Nothing.
+ */
+static void histogram_record(Can_histogram& histogram, uint64_t ns);
+
+/**
+ * Entry point of the interrupt thread for a controller.
+ *
+ * @param	arg		The Can_imp to service interrupts for.
+ * @return	Nothing.
+ */
+static void* can_interrupt_thread(void* arg);
+
 // IMPLEMENT PUBLIC STATIC FUNCTIONS.
 
 // IMPLEMENT PUBLIC CLASS FUNCTIONS (METHODS).
@@ -673,11 +1078,21 @@ Can_send_status Can_buffer::blocking_read(Can_message& message)
 	return imp->blocking_read(message);
 }
 
-Can_send_status Can_buffer::write(Can_message msg)
+Can_send_status Can_buffer::write(const Can_message& msg)
 {
 	return imp->write(msg);
 }
 
+Can_send_status Can_buffer::read_batch(Can_message* msgs, size_t count, size_t& num_read)
+{
+	return imp->read_batch(msgs, count, num_read);
+}
+
+Can_send_status Can_buffer::write_batch(const Can_message* msgs, size_t count, size_t& num_written)
+{
+	return imp->write_batch(msgs, count, num_written);
+}
+
 Can_config_status Can_buffer::free_message(void)
 {
 	return imp->free_message();
@@ -693,6 +1108,51 @@ void Can_buffer::clear_status(void)
 	imp->clear_status();
 }
 
+void Can_buffer::enable_interrupt(void)
+{
+	imp->enable_interrupt();
+}
+
+void Can_buffer::disable_interrupt(void)
+{
+	imp->disable_interrupt();
+}
+
+Can_int_status Can_buffer::attach_interrupt(Can_buffer_interrupt_type interrupt, IsrHandler callback)
+{
+	return imp->attach_interrupt(interrupt, callback);
+}
+
+Can_int_status Can_buffer::detach_interrupt(Can_buffer_interrupt_type interrupt)
+{
+	return imp->detach_interrupt(interrupt);
+}
+
+bool Can_buffer::test_interrupt(Can_buffer_interrupt_type interrupt)
+{
+	return imp->test_interrupt(interrupt);
+}
+
+Can_int_status Can_buffer::clear_interrupt_flags(Can_buffer_interrupt_type interrupt)
+{
+	return imp->clear_interrupt_flags(interrupt);
+}
+
+Can_timestamp Can_buffer::get_timestamp(void)
+{
+	return imp->get_timestamp();
+}
+
+Can_histogram Can_buffer::get_histogram(Can_histogram_type type)
+{
+	return imp->get_histogram(type);
+}
+
+void Can_buffer::clear_histograms(void)
+{
+	imp->clear_histograms();
+}
+
 // Can.
 
 Can::Can(Can_imp* implementation)
@@ -714,13 +1174,45 @@ Can Can::bind(Can_id_controller controller)
 {
 	// *** TARGET CONFIGURATION SPECIFIC.
 	
-	// There already exists a static instance of the implementation class for each of the CAN peripherals.
-	static Can_imp can_imp_0 = Can_imp(CAN_0);
+	// There is a static instance of the implementation class for each of the CAN peripherals, which opens its sockets the first time it is bound.
+	Can_imp* imp;
 	
-	// NOTE - There is only one CAN peripheral, so we don't really have any logic here.
+	switch (controller)
+	{
+		case CAN_0:
+		{
+			static Can_imp can_imp_0(CAN_0);
+			imp = &can_imp_0;
+			break;
+		}
+		case CAN_1:
+		{
+			static Can_imp can_imp_1(CAN_1);
+			imp = &can_imp_1;
+			break;
+		}
+		case CAN_2:
+		{
+			static Can_imp can_imp_2(CAN_2);
+			imp = &can_imp_2;
+			break;
+		}
+		case CAN_3:
+		{
+			static Can_imp can_imp_3(CAN_3);
+			imp = &can_imp_3;
+			break;
+		}
+		default:
+		{
+			static Can_imp can_imp_vcan_0(CAN_VCAN_0);
+			imp = &can_imp_vcan_0;
+			break;
+		}
+	}
 	
 	// Create an interface class and attach the relevant implementation to it.
-	Can new_can = Can(&can_imp_0);
+	Can new_can = Can(imp);
 	
 	// *** TARGET AGNOSTIC.
 	
@@ -733,48 +1225,249 @@ Can_config_status Can::initialise(Can_rate rate)
 	return imp->initialise(rate);
 }
 
-uint8_t Can::get_num_banks(void)
+void Can::enable_interrupts(void)
 {
-	return imp->get_num_banks();
+	imp->enable_interrupts();
 }
 
-Can_filter_bank** Can::get_banks(void)
+void Can::disable_interrupts(void)
 {
-	return imp->get_banks();
+	imp->disable_interrupts();
 }
 
-uint8_t Can::get_num_buffers(void)
+Can_int_status Can::attach_interrupt(Can_channel_interrupt_type interrupt, IsrHandler callback)
 {
-	return imp->get_num_buffers();
+	return imp->attach_interrupt(interrupt, callback);
 }
 
-Can_buffer** Can::get_buffers(void)
+Can_int_status Can::detach_interrupt(Can_channel_interrupt_type interrupt)
 {
-	return imp->get_buffers();
+	return imp->detach_interrupt(interrupt);
 }
 
-
-// IMPLEMENT PRIVATE CLASS METHODS
-
-// Can_filmask_imp
-
-Can_filmask_imp::Can_filmask_imp(Can_id_filter filter)
+bool Can::test_interrupt(Can_channel_interrupt_type interrupt)
 {
-	// constructor creates a filter 
-	filmask_mode = CAN_FM_FIL;
-	filmask_no = static_cast<Can_id_filmask>(filter);
+	return imp->test_interrupt(interrupt);
 }
 
-Can_filmask_imp::Can_filmask_imp(Can_id_mask mask)
+Can_int_status Can::clear_interrupt_flags(Can_channel_interrupt_type interrupt)
 {
-	// constructor creates a mask
-	filmask_mode = CAN_FM_MSK;
-	filmask_no = static_cast<Can_id_filmask>(mask);
+	return imp->clear_interrupt_flags(interrupt);
 }
 
-Can_filmask_value Can_filmask_imp::get(void)
+Can_buffer* Can::get_interrupted_buffer(void)
 {
-	return filmask_val;
+	return imp->get_interrupted_buffer();
+}
+
+uint8_t Can::get_num_banks(void)
+{
+	return imp->get_num_banks();
+}
+
+Can_filter_bank** Can::get_banks(void)
+{
+	return imp->get_banks();
+}
+
+uint8_t Can::get_num_buffers(void)
+{
+	return imp->get_num_buffers();
+}
+
+Can_buffer** Can::get_buffers(void)
+{
+	return imp->get_buffers();
+}
+
+// IMPLEMENT PRIVATE STATIC FUNCTIONS.
+
+static int open_can_socket(const char* interface_name)
+{
+	struct ifreq ifr; 
+	struct sockaddr_can addr; 
+	
+	// Zero the structures we just created.
+	memset(&ifr, 0x0, sizeof(ifr));
+	memset(&addr, 0x0, sizeof(addr));
+
+	// Open a CAN_RAW socket.
+	int sock = socket(PF_CAN, SOCK_RAW, CAN_RAW); 
+	if (sock < 0)
+	{
+		fprintf(stderr, "open: couldn't open a socket for [%s]: %s\n", interface_name, strerror(errno));
+		return -1;
+	}
+
+	// Convert the interface name to interface index.
+	strncpy(ifr.ifr_name, interface_name, IFNAMSIZ - 1);
+	if (ioctl(sock, SIOCGIFINDEX, &ifr) < 0)
+	{
+		fprintf(stderr, "open: no such interface [%s]: %s\n", interface_name, strerror(errno));
+		::close(sock);
+		return -1;
+	}
+
+	// Setup address for bind. 
+	addr.can_ifindex = ifr.ifr_ifindex; 
+	addr.can_family = PF_CAN; 
+
+	// Bind socket to the interface.
+	if (::bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		fprintf(stderr, "open: couldn't bind to [%s]: %s\n", interface_name, strerror(errno));
+		::close(sock);
+		return -1;
+	}
+	
+	// All done.
+	return sock;
+}
+
+static void frame_to_message(const struct can_frame& frame, Can_message& msg)
+{
+	/* wrap ValleyForge frame over SocketCAN frame */
+	msg.dlc = frame.can_dlc;
+	
+	msg.rtr = (frame.can_id & CAN_RTR_FLAG) ? 1 : 0;		// if bit 30 == 1, then RTR
+	
+	if (frame.can_id & CAN_EFF_FLAG)		// if MSB == 1, then extended
+	{
+		msg.ext = 1;
+		msg.id = frame.can_id & CAN_EFF_MASK;
+	}
+	else
+	{
+		msg.ext = 0;
+		msg.id = frame.can_id & CAN_SFF_MASK;
+	}
+	
+	for (int i=0; i<msg.dlc; i++)
+	{
+		msg.data[i] = frame.data[i];
+	}
+	
+	// All done.
+	return;
+}
+
+static void message_to_frame(const Can_message& msg, struct can_frame& frame)
+{
+	/* wrap SocketCAN frame over ValleyForge frame */
+	frame.can_id = msg.id;				// copy ValleyForge frame id to SocketCAN frame
+	
+	if (msg.ext == 1)
+	{
+		frame.can_id |= CAN_EFF_FLAG;	// make MSB = 1 for extended
+	}
+	
+	if (msg.rtr == 1)
+	{
+		frame.can_id |= CAN_RTR_FLAG;	// make bit 30 = 1 for RTR	
+	}
+	
+	frame.can_dlc = msg.dlc;
+	
+	for (int i=0; i<msg.dlc; i++)
+	{
+		frame.data[i] = msg.data[i];
+	}
+	
+	// All done.
+	return;
+}
+
+static Can_buffer_status error_frame_status(const struct can_frame& frame)
+{
+	if (frame.can_id & CAN_ERR_ACK)
+	{
+		return BUF_ACK_ERROR;
+	}
+	
+	if (frame.can_id & CAN_ERR_PROT)
+	{
+		// The kind of protocol error is in data[2], and where in the frame it happened is in data[3].
+		if (frame.data[2] & CAN_ERR_PROT_FORM)
+		{
+			return BUF_FORM_ERROR;
+		}
+		if (frame.data[2] & CAN_ERR_PROT_STUFF)
+		{
+			return BUF_STUFF_ERROR;
+		}
+		if (frame.data[2] & (CAN_ERR_PROT_BIT | CAN_ERR_PROT_BIT0 | CAN_ERR_PROT_BIT1))
+		{
+			return BUF_BIT_ERROR;
+		}
+		if (frame.data[3] == CAN_ERR_PROT_LOC_CRC_SEQ)
+		{
+			return BUF_CRC_ERROR;
+		}
+	}
+	
+	return STAT_ERROR;
+}
+
+static uint64_t timespec_to_ns(const struct timespec& ts)
+{
+	return (static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL) + ts.tv_nsec;
+}
+
+static void histogram_record(Can_histogram& histogram, uint64_t ns)
+{
+	// Find the first bucket this fits under.
+	uint64_t us = ns / 1000;
+	uint8_t bucket = 0;
+	while ((bucket < CAN_HISTOGRAM_BUCKETS - 1) && (us >= (1ULL << bucket)))
+	{
+		bucket++;
+	}
+	histogram.buckets[bucket]++;
+	
+	if ((histogram.count == 0) || (ns < histogram.min_ns))
+	{
+		histogram.min_ns = ns;
+	}
+	if (ns > histogram.max_ns)
+	{
+		histogram.max_ns = ns;
+	}
+	histogram.count++;
+	histogram.total_ns += ns;
+	
+	// All done.
+	return;
+}
+
+static void* can_interrupt_thread(void* arg)
+{
+	static_cast<Can_imp*>(arg)->service_interrupts();
+	
+	// All done.
+	return NULL;
+}
+
+// IMPLEMENT PRIVATE CLASS METHODS
+
+// Can_filmask_imp
+
+Can_filmask_imp::Can_filmask_imp(Can_id_filter filter)
+{
+	// constructor creates a filter 
+	filmask_mode = CAN_FM_FIL;
+	filmask_no = static_cast<Can_id_filmask>(filter);
+}
+
+Can_filmask_imp::Can_filmask_imp(Can_id_mask mask)
+{
+	// constructor creates a mask
+	filmask_mode = CAN_FM_MSK;
+	filmask_no = static_cast<Can_id_filmask>(mask);
+}
+
+Can_filmask_value Can_filmask_imp::get(void)
+{
+	return filmask_val;
 }
 
 void Can_filmask_imp::set(Can_filmask_value value)
@@ -788,14 +1481,18 @@ void Can_filmask_imp::set(Can_filmask_value value)
 Can_filter_bank_imp::Can_filter_bank_imp(Can_id_bank bank)
 {
 	bnk_no = bank;
+	bnk_mode = CAN_BNK_MODE_4FM;
+	buffer_link = NULL;
+	ctrl_link = NULL;
 }
 
 Can_config_status Can_filter_bank_imp::set_buffer(Can_buffer& buffer)
 {
+	Can_buffer* old_buffer = buffer_link;
 	buffer_link = &buffer;
 	
 	/* *** write to SocketCAN filter object *** */
-	for (int i=0; i<bnk_mode-1; i++)
+	for (int i=0; i<=bnk_mode; i++)
 	{	
 		/* filter */
 		uint8_t fil_index = 2*i;		// even number
@@ -836,24 +1533,21 @@ Can_config_status Can_filter_bank_imp::set_buffer(Can_buffer& buffer)
 		
 	}
 	
-	for (int i=bnk_mode; i<CAN_NUM_FILTERS; i++)
-	{
-		/* since mallocing is avoided, 4 filter/mask pairs have been allocated
-		 * but only use as many as bnk_mode field suggests (0-4 pairs),
-		 * writing the rest of the pair's mask values to 0 makes that filter
-		 * inactive */
-		rfilters[i].can_id = 0;
-		rfilters[i].can_mask = 0;
-	}
+	/* since mallocing is avoided, 4 filter/mask pairs have been allocated
+	 * but only as many as bnk_mode field suggests (1-4 pairs) are applied */
 	
 	/* Apply the filter settings to socket:
 	 * Some inelegant abstraction here, setting the buffer of this bank 
 	 * is what applies the filters to the socket. Writing to the 
 	 * filmasks only stores the chosen value to be written by this operation 
 	 * later. If you want to change the value, make this operation again */
-	setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, &rfilters, sizeof(rfilters));
+	if ((old_buffer != NULL) && (old_buffer != &buffer))
+	{
+		// The buffer this bank has left keeps the filters of any other banks still attached to it.
+		ctrl_link->apply_filters(old_buffer);
+	}
 	
-	return CAN_CFG_SUCCESS;
+	return ctrl_link->apply_filters(&buffer);
 }
 
 uint8_t Can_filter_bank_imp::get_num_filmasks(void)
@@ -888,116 +1582,437 @@ Can_config_status Can_filter_bank_imp::set_mode(Can_bank_mode mode)
 Can_buffer_imp::Can_buffer_imp(Can_id_buffer buffer)
 {
 	buf_no = buffer;
-}
-
-Can_send_status Can_buffer_imp::read(Can_message& msg)
-{
-	fcntl(s, F_SETFL, O_NONBLOCK); 		// put into non blocking mode
+	buf_mode = CAN_OBJ_RX;
+	bank_link = NULL;
+	sock = -1;
+	ctrl_link = NULL;
 	
-	Can_send_status ret_code = blocking_read(msg);
+	for (uint8_t i=0; i<CAN_NUM_BUF_INT; i++)
+	{
+		int_handlers[i] = NULL;
+	}
 	
-	fcntl(s, F_SETFL, O_SYNC); 			// put into blocking mode (actually O_SYNC is guess)
+	buf_status = BUF_NOT_COMPLETED;
+	rx_pending = false;
 	
-	return CAN_SND_SUCCESS;
+	memset(&pending_timestamp, 0x0, sizeof(pending_timestamp));
+	memset(&rx_timestamp, 0x0, sizeof(rx_timestamp));
+	
+	pthread_mutex_init(&pending_lock, NULL);
+	pthread_mutex_init(&timing_lock, NULL);
+	memset(histograms, 0x0, sizeof(histograms));
+	last_arrival_ns = 0;
+	tx_head = 0;
+	tx_count = 0;
 }
 
-Can_send_status Can_buffer_imp::blocking_read(Can_message& msg)
+bool Can_buffer_imp::open(const char* interface_name)
 {
-	struct can_frame frame;
-	
-	/* read from CAN interface */
-	int nbytes = ::read(s, &frame, sizeof(struct can_frame));
-	
-	//std::cout << std::dec << "\t" <<  static_cast<int>(s) << " - " << static_cast<int>(errno) << std::endl;
-	
-	/* error checking */
-	if (nbytes < 0)
+	sock = open_can_socket(interface_name);
+	if (sock < 0)
 	{
-		return CAN_SND_MODERR;
-	} 
+		return false;
+	}
 	
-	/* wrap ValleyForge frame over SocketCAN frame */
-	msg.dlc = frame.can_dlc;
+	// Have the frames we send passed back, so we know when they have made it onto the bus.
+	int recv_own_msgs = 1;
+	setsockopt(sock, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS, &recv_own_msgs, sizeof(recv_own_msgs));
 	
-	if (frame.can_id & CAN_RTR_FLAG)		// if bit 30 == 1, then RTR
-	{
-		msg.rtr = 1;
-	}
+	// Have every frame stamped with the time it was received.  Not all drivers can, in which case the time it is read is used instead.
+	int timestamping = CAN_TIMESTAMPING_FLAGS;
+	setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &timestamping, sizeof(timestamping));
 	
-	if (frame.can_id & CAN_EFF_FLAG)		// if MSB == 1, then extended
+	// All done.
+	return true;
+}
+
+void Can_buffer_imp::close(void)
+{
+	if (sock >= 0)
 	{
-		msg.ext = 1;
-		msg.id = frame.can_id & CAN_EFF_MASK;
+		::close(sock);
+		sock = -1;
 	}
-	else
+	
+	// All done.
+	return;
+}
+
+Can_send_status Can_buffer_imp::read(Can_message& msg)
+{
+	// Return straight away if there is nothing waiting, without changing the socket's own blocking mode.
+	return receive(msg, MSG_DONTWAIT);
+}
+
+Can_send_status Can_buffer_imp::blocking_read(Can_message& msg)
+{
+	return receive(msg, 0);
+}
+
+Can_send_status Can_buffer_imp::receive(Can_message& msg, int flags)
+{
+	// A message the interrupt thread has already taken off the socket is handed over first.
+	pthread_mutex_lock(&pending_lock);
+	if (rx_pending)
 	{
-		msg.id = frame.can_id & CAN_SFF_MASK;
+		msg = pending;
+		rx_timestamp = pending_timestamp;
+		rx_pending = false;
+		pthread_mutex_unlock(&pending_lock);
+		
+		return CAN_SND_SUCCESS;
 	}
+	pthread_mutex_unlock(&pending_lock);
 	
-	for (int i=0; i<msg.dlc; i++)
+	struct can_frame frame;
+	int msg_flags;
+	Can_timestamp stamp;
+	
+	/* read from CAN interface, passing over our own frames coming back to confirm they were sent, and error frames */
+	do
 	{
-		msg.data[i] = frame.data[i];
+		/* error checking */
+		if (recv_frame(frame, flags, msg_flags, stamp) < 0)
+		{
+			return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? CAN_SND_BUSY : CAN_SND_MODERR;
+		}
 	}
+	while ((msg_flags & MSG_CONFIRM) || (frame.can_id & CAN_ERR_FLAG));
+	
+	frame_to_message(frame, msg);
+	rx_timestamp = stamp;
 	
 	set_mode(CAN_OBJ_RX);
 	
 	return CAN_SND_SUCCESS;
 }
 
-Can_send_status Can_buffer_imp::write(Can_message msg)
+Can_send_status Can_buffer_imp::read_batch(Can_message* msgs, size_t count, size_t& num_read)
 {
-	if (msg.dlc > 8)
-	{
-		return CAN_SND_DLCERR;
-	}
-	
-	/* wrap SocketCAN frame over ValleyForge frame */
-	struct can_frame frame;
+	struct can_frame frames[CAN_BATCH_SIZE];
+	struct iovec iovs[CAN_BATCH_SIZE];
+	struct mmsghdr hdrs[CAN_BATCH_SIZE];
+	char controls[CAN_BATCH_SIZE][CMSG_SPACE(sizeof(struct scm_timestamping))];
 	
-	frame.can_id = msg.id;				// copy ValleyForge frame id to SocketCAN frame
+	num_read = 0;
 	
-	if (msg.ext == 1)
+	// A message the interrupt thread has already taken off the socket is handed over first.
+	pthread_mutex_lock(&pending_lock);
+	if ((count > 0) && rx_pending)
 	{
-		frame.can_id |= CAN_EFF_FLAG;	// make MSB = 1 for extended
+		msgs[num_read++] = pending;
+		rx_timestamp = pending_timestamp;
+		rx_pending = false;
 	}
+	pthread_mutex_unlock(&pending_lock);
 	
-	if (msg.rtr == 1)
+	while (num_read < count)
 	{
-		frame.can_id |= CAN_RTR_FLAG;	// make bit 30 = 1 for RTR	
+		size_t batch = count - num_read;
+		if (batch > CAN_BATCH_SIZE)
+		{
+			batch = CAN_BATCH_SIZE;
+		}
+		
+		memset(hdrs, 0x0, batch * sizeof(struct mmsghdr));
+		for (size_t i=0; i<batch; i++)
+		{
+			iovs[i].iov_base = &frames[i];
+			iovs[i].iov_len = sizeof(struct can_frame);
+			hdrs[i].msg_hdr.msg_iov = &iovs[i];
+			hdrs[i].msg_hdr.msg_iovlen = 1;
+			hdrs[i].msg_hdr.msg_control = controls[i];
+			hdrs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+		}
+		
+		/* read from CAN interface, as many frames as are waiting in one go */
+		int nframes = ::recvmmsg(sock, hdrs, batch, MSG_DONTWAIT, NULL);
+		
+		/* error checking */
+		if (nframes < 0)
+		{
+			return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? CAN_SND_BUSY : CAN_SND_MODERR;
+		}
+		
+		pthread_mutex_lock(&timing_lock);
+		for (int i=0; i<nframes; i++)
+		{
+			Can_timestamp stamp;
+			take_frame(hdrs[i].msg_hdr, frames[i], stamp);
+			
+			/* pass over our own frames coming back to confirm they were sent, and error frames */
+			if ((hdrs[i].msg_hdr.msg_flags & MSG_CONFIRM) || (frames[i].can_id & CAN_ERR_FLAG))
+			{
+				continue;
+			}
+			
+			frame_to_message(frames[i], msgs[num_read++]);
+			rx_timestamp = stamp;
+		}
+		pthread_mutex_unlock(&timing_lock);
+		
+		set_mode(CAN_OBJ_RX);
 	}
 	
-	frame.can_dlc = msg.dlc;
+	return CAN_SND_SUCCESS;
+}
+
+int Can_buffer_imp::recv_frame(struct can_frame& frame, int flags, int& msg_flags, Can_timestamp& stamp)
+{
+	struct iovec iov;
+	struct msghdr hdr;
+	char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
 	
-	for (int i=0; i<msg.dlc; i++)
-	{
-		frame.data[i] = msg.data[i];
-	}
+	memset(&hdr, 0x0, sizeof(hdr));
+	iov.iov_base = &frame;
+	iov.iov_len = sizeof(frame);
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = control;
+	hdr.msg_controllen = sizeof(control);
 	
-	/* write to CAN interface */
-	int nbytes = ::write(s, &frame, sizeof(frame));
+	int nbytes = ::recvmsg(sock, &hdr, flags);
+	msg_flags = hdr.msg_flags;
 	
-	/* error checking */
 	if (nbytes < 0)
 	{
-		return CAN_SND_MODERR;
+		return nbytes;
 	}
 	
-	set_mode(CAN_OBJ_TX);
+	pthread_mutex_lock(&timing_lock);
+	take_frame(hdr, frame, stamp);
+	pthread_mutex_unlock(&timing_lock);
 	
-	return CAN_SND_SUCCESS;
-}
-
-Can_buffer_mode Can_buffer_imp::get_mode(void)
-{
-	/* more leaky abstraction: the buffer can always receive or transmit, 
-	 * this method simply returns the mode of the last transfer.
-	 */
-	return buf_mode;
+	return nbytes;
 }
 
-bool Can_buffer_imp::get_multimode(void)
+void Can_buffer_imp::take_frame(const struct msghdr& hdr, const struct can_frame& frame, Can_timestamp& stamp)
 {
-	return true;
+	/* take the time the kernel stamped the frame with, preferring the adapter's; ts[0] is the software time and ts[2] the hardware time */
+	uint64_t software_ns = 0;
+	uint64_t hardware_ns = 0;
+	
+	for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(const_cast<struct msghdr*>(&hdr), cmsg))
+	{
+		if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPING))
+		{
+			struct scm_timestamping* stamps = reinterpret_cast<struct scm_timestamping*>(CMSG_DATA(cmsg));
+			software_ns = timespec_to_ns(stamps->ts[0]);
+			hardware_ns = timespec_to_ns(stamps->ts[2]);
+		}
+	}
+	
+	if (software_ns == 0)
+	{
+		// The driver didn't stamp it, so now will have to do.
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		software_ns = timespec_to_ns(now);
+	}
+	
+	stamp.hardware = (hardware_ns != 0);
+	stamp.ns = stamp.hardware ? hardware_ns : software_ns;
+	
+	/* record the latencies */
+	if (hdr.msg_flags & MSG_CONFIRM)
+	{
+		// Match the echo against the oldest message written with the same contents; any older ones whose echoes never came are dropped.
+		for (uint8_t i=0; i<tx_count; i++)
+		{
+			Can_tx_record& record = tx_records[(tx_head + i) % CAN_TX_ECHO_SLOTS];
+			
+			if ((record.can_id == frame.can_id) && (record.dlc == frame.can_dlc) && (memcmp(record.data, frame.data, frame.can_dlc) == 0))
+			{
+				// The software times are on the same clock as the time the message was written.
+				if (software_ns > record.written_ns)
+				{
+					histogram_record(histograms[CAN_HIST_TX_ECHO], software_ns - record.written_ns);
+				}
+				
+				tx_head = (tx_head + i + 1) % CAN_TX_ECHO_SLOTS;
+				tx_count -= i + 1;
+				break;
+			}
+		}
+	}
+	else if (!(frame.can_id & CAN_ERR_FLAG))
+	{
+		if ((last_arrival_ns != 0) && (stamp.ns > last_arrival_ns))
+		{
+			histogram_record(histograms[CAN_HIST_INTERARRIVAL], stamp.ns - last_arrival_ns);
+		}
+		last_arrival_ns = stamp.ns;
+	}
+	
+	// All done.
+	return;
+}
+
+void Can_buffer_imp::remember_written(const struct can_frame* frames, size_t count)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	
+	pthread_mutex_lock(&timing_lock);
+	for (size_t i=0; i<count; i++)
+	{
+		if (tx_count == CAN_TX_ECHO_SLOTS)
+		{
+			// Nobody has been reading the echoes, so forget the oldest.
+			tx_head = (tx_head + 1) % CAN_TX_ECHO_SLOTS;
+			tx_count--;
+		}
+		
+		Can_tx_record& record = tx_records[(tx_head + tx_count) % CAN_TX_ECHO_SLOTS];
+		record.can_id = frames[i].can_id;
+		record.dlc = frames[i].can_dlc;
+		memcpy(record.data, frames[i].data, frames[i].can_dlc);
+		record.written_ns = timespec_to_ns(now);
+		tx_count++;
+	}
+	pthread_mutex_unlock(&timing_lock);
+	
+	// All done.
+	return;
+}
+
+void Can_buffer_imp::forget_written(size_t count)
+{
+	pthread_mutex_lock(&timing_lock);
+	tx_count = (count < tx_count) ? (tx_count - count) : 0;
+	pthread_mutex_unlock(&timing_lock);
+	
+	// All done.
+	return;
+}
+
+void Can_buffer_imp::service_interrupt(void)
+{
+	struct can_frame frame;
+	int msg_flags;
+	Can_timestamp stamp;
+	
+	if (recv_frame(frame, MSG_DONTWAIT, msg_flags, stamp) < 0)
+	{
+		// Someone else read it first.
+		return;
+	}
+	
+	Can_buffer_interrupt_type interrupt;
+	
+	if (msg_flags & MSG_CONFIRM)
+	{
+		// One of our own frames, which SocketCAN passes back once it has been sent.  These come back whether or not anyone is interested.
+		if (!int_handlers[CAN_TX_COMPLETE])
+		{
+			return;
+		}
+		
+		buf_status = BUF_TX_COMPLETED;
+		interrupt = CAN_TX_COMPLETE;
+	}
+	else if (frame.can_id & CAN_ERR_FLAG)
+	{
+		buf_status = error_frame_status(frame);
+		interrupt = CAN_GEN_ERROR;
+	}
+	else
+	{
+		// Like a MOb, there is room for one message; a message nobody has read yet is overwritten.
+		pthread_mutex_lock(&pending_lock);
+		frame_to_message(frame, pending);
+		pending_timestamp = stamp;
+		rx_pending = true;
+		pthread_mutex_unlock(&pending_lock);
+		set_mode(CAN_OBJ_RX);
+		
+		buf_status = BUF_RX_COMPLETED;
+		interrupt = CAN_RX_COMPLETE;
+	}
+	
+	// Run the handler, if there is one.  The handler must clear the interrupt flag itself.
+	IsrHandler handler = int_handlers[interrupt];
+	if (handler)
+	{
+		handler();
+	}
+	
+	// All done.
+	return;
+}
+
+Can_send_status Can_buffer_imp::write(const Can_message& msg)
+{
+	size_t num_written;
+	
+	return write_batch(&msg, 1, num_written);
+}
+
+Can_send_status Can_buffer_imp::write_batch(const Can_message* msgs, size_t count, size_t& num_written)
+{
+	struct can_frame frames[CAN_BATCH_SIZE];
+	struct iovec iovs[CAN_BATCH_SIZE];
+	struct mmsghdr hdrs[CAN_BATCH_SIZE];
+	
+	num_written = 0;
+	
+	while (num_written < count)
+	{
+		/* wrap SocketCAN frames over ValleyForge frames, up to the first with a bad length */
+		size_t batch = 0;
+		while ((batch < CAN_BATCH_SIZE) && ((num_written + batch) < count) && (msgs[num_written + batch].dlc <= 8))
+		{
+			message_to_frame(msgs[num_written + batch], frames[batch]);
+			
+			memset(&hdrs[batch], 0x0, sizeof(struct mmsghdr));
+			iovs[batch].iov_base = &frames[batch];
+			iovs[batch].iov_len = sizeof(struct can_frame);
+			hdrs[batch].msg_hdr.msg_iov = &iovs[batch];
+			hdrs[batch].msg_hdr.msg_iovlen = 1;
+			
+			batch++;
+		}
+		
+		if (batch == 0)
+		{
+			return CAN_SND_DLCERR;
+		}
+		
+		/* remember the messages until their echoes come back, before writing them in case the echoes beat us back here */
+		remember_written(frames, batch);
+		
+		/* write to CAN interface, as many frames as the socket takes in one go */
+		int nframes = ::sendmmsg(sock, hdrs, batch, 0);
+		
+		/* error checking */
+		if (nframes < 0)
+		{
+			// There won't be echoes for them.
+			forget_written(batch);
+			
+			return CAN_SND_MODERR;
+		}
+		
+		forget_written(batch - nframes);
+		num_written += nframes;
+		
+		set_mode(CAN_OBJ_TX);
+	}
+	
+	return CAN_SND_SUCCESS;
+}
+
+Can_buffer_mode Can_buffer_imp::get_mode(void)
+{
+	/* more leaky abstraction: the buffer can always receive or transmit, 
+	 * this method simply returns the mode of the last transfer.
+	 */
+	return buf_mode;
+}
+
+bool Can_buffer_imp::get_multimode(void)
+{
+	return true;
 }
 
 Can_config_status Can_buffer_imp::set_mode(Can_buffer_mode mode)
@@ -1009,16 +2024,21 @@ Can_config_status Can_buffer_imp::set_mode(Can_buffer_mode mode)
 
 Can_buffer_status Can_buffer_imp::get_status(void)
 {
-	/* for SocketCAN, this is useful for getting errors only, there is no
-	 * need to manually reset buffer status after transmission or reception */
+	/* for SocketCAN, this is only set by the interrupt thread, there is no
+	 * need to manually reset buffer status after transmission or reception
+	 * unless interrupts are in use */
 	 
-	 // NB: Haven't figured out how to properly implement this
-	 return BUF_NOT_COMPLETED;
+	 return buf_status;
 }
 
 Can_config_status Can_buffer_imp::free_message(void)
 {
-	return CAN_CFG_IMMUTABLE;
+	// Only a message taken off the socket by the interrupt thread is held by the buffer.
+	pthread_mutex_lock(&pending_lock);
+	rx_pending = false;
+	pthread_mutex_unlock(&pending_lock);
+	
+	return CAN_CFG_SUCCESS;
 }
 
 uint8_t Can_buffer_imp::queue_length(void)
@@ -1030,7 +2050,156 @@ uint8_t Can_buffer_imp::queue_length(void)
 
 void Can_buffer_imp::clear_status(void)
 {
-	// irrelevant for this target, do nothing
+	buf_status = BUF_NOT_COMPLETED;
+}
+
+Can_timestamp Can_buffer_imp::get_timestamp(void)
+{
+	return rx_timestamp;
+}
+
+Can_histogram Can_buffer_imp::get_histogram(Can_histogram_type type)
+{
+	pthread_mutex_lock(&timing_lock);
+	Can_histogram histogram = histograms[type];
+	pthread_mutex_unlock(&timing_lock);
+	
+	return histogram;
+}
+
+void Can_buffer_imp::clear_histograms(void)
+{
+	pthread_mutex_lock(&timing_lock);
+	memset(histograms, 0x0, sizeof(histograms));
+	last_arrival_ns = 0;
+	pthread_mutex_unlock(&timing_lock);
+	
+	// All done.
+	return;
+}
+
+void Can_buffer_imp::enable_interrupt(void)
+{
+	ctrl_link->watch_socket(sock, buf_no, true);
+}
+
+void Can_buffer_imp::disable_interrupt(void)
+{
+	ctrl_link->watch_socket(sock, buf_no, false);
+}
+
+Can_int_status Can_buffer_imp::attach_interrupt(Can_buffer_interrupt_type interrupt, void (*callback)(void))
+{
+	Can_int_status ret_code;
+	
+	/* Check whether callback already exists and adjust return code accordingly */
+	if (int_handlers[interrupt])
+	{
+		ret_code = CAN_INT_EXISTS;
+	}
+	else
+	{
+		ret_code = CAN_INT_NOINT;
+	}
+	
+	/* SocketCAN only passes error frames to sockets which ask for them; sent frames are always passed back.
+	 * 
+	 * Note: a sent frame comes back through this buffer's own filters, so a buffer must accept the ids it sends to see CAN_TX_COMPLETE.
+	 * Error frames are for the whole controller, so every buffer with a CAN_GEN_ERROR handler sees all of them, and bus errors are only
+	 * reported by drivers with berr-reporting turned on. */
+	int ret = 0;
+	switch (interrupt)
+	{
+		case (CAN_GEN_ERROR):
+		{
+			can_err_mask_t err_mask = CAN_GEN_ERROR_MASK;
+			ret = setsockopt(sock, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &err_mask, sizeof(err_mask));
+			break;
+		}
+		default:
+			break;
+	}
+	
+	if (ret < 0)
+	{
+		return CAN_INT_FAILED;
+	}
+
+	int_handlers[interrupt] = callback;	// attach the callback
+	
+	return ret_code;
+}
+
+Can_int_status Can_buffer_imp::detach_interrupt(Can_buffer_interrupt_type interrupt)
+{
+	Can_int_status ret_code;
+	
+	if (int_handlers[interrupt])
+	{
+		ret_code = CAN_INT_EXISTS;		// removed callback
+	}
+	else
+	{
+		ret_code = CAN_INT_NOINT;		// no callback to remove
+	}
+	
+	/* stop SocketCAN passing frames nobody is waiting for any more */
+	switch (interrupt)
+	{
+		case (CAN_GEN_ERROR):
+		{
+			can_err_mask_t err_mask = 0;
+			setsockopt(sock, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &err_mask, sizeof(err_mask));
+			break;
+		}
+		default:
+			break;
+	}
+	
+	int_handlers[interrupt] = NULL;
+	
+	return ret_code;
+}
+
+bool Can_buffer_imp::test_interrupt(Can_buffer_interrupt_type interrupt)
+{
+	return (int_handlers[interrupt] != NULL);
+}
+
+Can_int_status Can_buffer_imp::clear_interrupt_flags(Can_buffer_interrupt_type interrupt)
+{
+	Can_int_status ret_code = CAN_INT_NOINT;
+	Can_buffer_status status = buf_status;
+	
+	switch (interrupt)
+	{
+		case (CAN_RX_COMPLETE):
+			if (status == BUF_RX_COMPLETED)
+			{
+				free_message();
+				ret_code = CAN_INT_EXISTS;		// a receive interrupt actually occured
+			}
+			break;
+		case (CAN_TX_COMPLETE):
+			if (status == BUF_TX_COMPLETED)
+			{
+				ret_code = CAN_INT_EXISTS;		// a transmit interrupt actually occured
+			}
+			break;
+		case (CAN_GEN_ERROR):
+			if ((status != BUF_NOT_COMPLETED) && (status != BUF_RX_COMPLETED) && (status != BUF_TX_COMPLETED))
+			{
+				ret_code = CAN_INT_EXISTS;		// an error actually occured
+			}
+			break;
+	}
+	
+	if (ret_code == CAN_INT_EXISTS)
+	{
+		clear_status();
+	}
+	
+	return ret_code;
 }
 
 // Can_imp
@@ -1040,9 +2209,27 @@ Can_imp::Can_imp(Can_id_controller controller):
 	buf_0i(CAN_BUF_0),
 	buf_0((Can_buffer_imp*) NULL),
 	
+	buf_1i(CAN_BUF_1),
+	buf_1((Can_buffer_imp*) NULL),
+	
+	buf_2i(CAN_BUF_2),
+	buf_2((Can_buffer_imp*) NULL),
+	
+	buf_3i(CAN_BUF_3),
+	buf_3((Can_buffer_imp*) NULL),
+	
 	bnk_0i(CAN_BNK_0),
 	bnk_0((Can_filter_bank_imp*) NULL),
 	
+	bnk_1i(CAN_BNK_1),
+	bnk_1((Can_filter_bank_imp*) NULL),
+	
+	bnk_2i(CAN_BNK_2),
+	bnk_2((Can_filter_bank_imp*) NULL),
+	
+	bnk_3i(CAN_BNK_3),
+	bnk_3((Can_filter_bank_imp*) NULL),
+	
 	fil_0i(CAN_FIL_0),
 	fil_1i(CAN_FIL_1),
 	fil_2i(CAN_FIL_2),
@@ -1053,6 +2240,36 @@ Can_imp::Can_imp(Can_id_controller controller):
 	fil_2((Can_filmask_imp*) NULL),
 	fil_3((Can_filmask_imp*) NULL),
 	
+	fil_4i(CAN_FIL_4),
+	fil_5i(CAN_FIL_5),
+	fil_6i(CAN_FIL_6),
+	fil_7i(CAN_FIL_7),
+	
+	fil_4((Can_filmask_imp*) NULL),
+	fil_5((Can_filmask_imp*) NULL),
+	fil_6((Can_filmask_imp*) NULL),
+	fil_7((Can_filmask_imp*) NULL),
+	
+	fil_8i(CAN_FIL_8),
+	fil_9i(CAN_FIL_9),
+	fil_10i(CAN_FIL_10),
+	fil_11i(CAN_FIL_11),
+	
+	fil_8((Can_filmask_imp*) NULL),
+	fil_9((Can_filmask_imp*) NULL),
+	fil_10((Can_filmask_imp*) NULL),
+	fil_11((Can_filmask_imp*) NULL),
+	
+	fil_12i(CAN_FIL_12),
+	fil_13i(CAN_FIL_13),
+	fil_14i(CAN_FIL_14),
+	fil_15i(CAN_FIL_15),
+	
+	fil_12((Can_filmask_imp*) NULL),
+	fil_13((Can_filmask_imp*) NULL),
+	fil_14((Can_filmask_imp*) NULL),
+	fil_15((Can_filmask_imp*) NULL),
+	
 	msk_0i(CAN_MSK_0),
 	msk_1i(CAN_MSK_1),
 	msk_2i(CAN_MSK_2),
@@ -1061,89 +2278,290 @@ Can_imp::Can_imp(Can_id_controller controller):
 	msk_0((Can_filmask_imp*) NULL),
 	msk_1((Can_filmask_imp*) NULL),
 	msk_2((Can_filmask_imp*) NULL),
-	msk_3((Can_filmask_imp*) NULL)
+	msk_3((Can_filmask_imp*) NULL),
+	
+	msk_4i(CAN_MSK_4),
+	msk_5i(CAN_MSK_5),
+	msk_6i(CAN_MSK_6),
+	msk_7i(CAN_MSK_7),
+	
+	msk_4((Can_filmask_imp*) NULL),
+	msk_5((Can_filmask_imp*) NULL),
+	msk_6((Can_filmask_imp*) NULL),
+	msk_7((Can_filmask_imp*) NULL),
+	
+	msk_8i(CAN_MSK_8),
+	msk_9i(CAN_MSK_9),
+	msk_10i(CAN_MSK_10),
+	msk_11i(CAN_MSK_11),
+	
+	msk_8((Can_filmask_imp*) NULL),
+	msk_9((Can_filmask_imp*) NULL),
+	msk_10((Can_filmask_imp*) NULL),
+	msk_11((Can_filmask_imp*) NULL),
+	
+	msk_12i(CAN_MSK_12),
+	msk_13i(CAN_MSK_13),
+	msk_14i(CAN_MSK_14),
+	msk_15i(CAN_MSK_15),
+	
+	msk_12((Can_filmask_imp*) NULL),
+	msk_13((Can_filmask_imp*) NULL),
+	msk_14((Can_filmask_imp*) NULL),
+	msk_15((Can_filmask_imp*) NULL),
+	
+	ctrl_no(controller)
 	
 {
 	/* ***** Linking to implemenation and adding to arrays ***** */
 	buf_0.imp = &buf_0i;
+	buf_1.imp = &buf_1i;
+	buf_2.imp = &buf_2i;
+	buf_3.imp = &buf_3i;
+	
 	buffers[0] = &buf_0;
+	buffers[1] = &buf_1;
+	buffers[2] = &buf_2;
+	buffers[3] = &buf_3;
 	
 	bnk_0.imp = &bnk_0i;
+	bnk_1.imp = &bnk_1i;
+	bnk_2.imp = &bnk_2i;
+	bnk_3.imp = &bnk_3i;
+	
 	banks[0] = &bnk_0;
+	banks[1] = &bnk_1;
+	banks[2] = &bnk_2;
+	banks[3] = &bnk_3;
 	
 	fil_0.imp = &fil_0i;
 	fil_1.imp = &fil_1i;
 	fil_2.imp = &fil_2i;
 	fil_3.imp = &fil_3i;
+	fil_4.imp = &fil_4i;
+	fil_5.imp = &fil_5i;
+	fil_6.imp = &fil_6i;
+	fil_7.imp = &fil_7i;
+	fil_8.imp = &fil_8i;
+	fil_9.imp = &fil_9i;
+	fil_10.imp = &fil_10i;
+	fil_11.imp = &fil_11i;
+	fil_12.imp = &fil_12i;
+	fil_13.imp = &fil_13i;
+	fil_14.imp = &fil_14i;
+	fil_15.imp = &fil_15i;
 	
 	filters[0] = &fil_0;
 	filters[1] = &fil_1;
 	filters[2] = &fil_2;
 	filters[3] = &fil_3;
+	filters[4] = &fil_4;
+	filters[5] = &fil_5;
+	filters[6] = &fil_6;
+	filters[7] = &fil_7;
+	filters[8] = &fil_8;
+	filters[9] = &fil_9;
+	filters[10] = &fil_10;
+	filters[11] = &fil_11;
+	filters[12] = &fil_12;
+	filters[13] = &fil_13;
+	filters[14] = &fil_14;
+	filters[15] = &fil_15;
 	
 	msk_0.imp = &msk_0i;
 	msk_1.imp = &msk_1i;
 	msk_2.imp = &msk_2i;
 	msk_3.imp = &msk_3i;
+	msk_4.imp = &msk_4i;
+	msk_5.imp = &msk_5i;
+	msk_6.imp = &msk_6i;
+	msk_7.imp = &msk_7i;
+	msk_8.imp = &msk_8i;
+	msk_9.imp = &msk_9i;
+	msk_10.imp = &msk_10i;
+	msk_11.imp = &msk_11i;
+	msk_12.imp = &msk_12i;
+	msk_13.imp = &msk_13i;
+	msk_14.imp = &msk_14i;
+	msk_15.imp = &msk_15i;
 	
 	masks[0] = &msk_0;
 	masks[1] = &msk_1;
 	masks[2] = &msk_2;
 	masks[3] = &msk_3;
+	masks[4] = &msk_4;
+	masks[5] = &msk_5;
+	masks[6] = &msk_6;
+	masks[7] = &msk_7;
+	masks[8] = &msk_8;
+	masks[9] = &msk_9;
+	masks[10] = &msk_10;
+	masks[11] = &msk_11;
+	masks[12] = &msk_12;
+	masks[13] = &msk_13;
+	masks[14] = &msk_14;
+	masks[15] = &msk_15;
 	
 	/* ***** Assembling tree ***** */
 	
-	banks[0]->imp->buffer_link = buffers[0];		// only one buffer and one bank
+	for (uint8_t b=0; b<CAN_NUM_BANKS; b++)
+	{
+		banks[b]->imp->buffer_link = buffers[b];		// each bank starts out attached to the buffer of the same number
+		banks[b]->imp->ctrl_link = this;
+		buffers[b]->imp->ctrl_link = this;
+		
+		for (uint8_t i=0; i<CAN_BANK_PAIRS; i++)
+		{
+			banks[b]->imp->filmasks[2*i] = filters[CAN_BANK_PAIRS*b+i];	// even index is filter
+			banks[b]->imp->filmasks[2*i+1] = masks[CAN_BANK_PAIRS*b+i];	// odd index is mask
+		}
+	}
+	
+	// Open up a socket for each buffer to talk to the SocketCAN driver.
 	
-	for (uint8_t i=0; i<CAN_NUM_FILTERS; i++)
+	// NOTE - SocketCAN loops each frame sent back to every other socket on the interface, so a buffer will also receive the frames other buffers on
+	//	this controller send, if its filters accept them.
+	
+	const char* interface_name = can_interface_names[controller];
+	
+	bool opened = true;
+	for (uint8_t i=0; i<CAN_NUM_BUFFERS; i++)
+	{
+		opened &= buffers[i]->imp->open(interface_name);
+	}
+	if (opened)
 	{
-		banks[0]->imp->filmasks[2*i] = filters[i];	// even index is filter
-		banks[0]->imp->filmasks[2*i+1] = masks[i];	// odd index is mask
-	}	
+		printf("Successfully bound sockets to [%s] interface.\n", interface_name);
+	}
 	
-	// Open up a socket to talk to the SocketCAN driver.
+	// Set up for interrupt emulation; the thread itself isn't started until interrupts are enabled.
 	
-	struct ifreq ifr; 
-	struct sockaddr_can addr; 
-	struct can_frame frame; 
+	err_sock = -1;
+	int_running = false;
+	int_thread_alive = false;
+	int_self_stopped = false;
+	bus_off = false;
+	in_buffer_interrupt = false;
 	
-	// Zero the structures we just created (CPP local variables are not initialised by default, right?)
-	memset(&ifr, 0x0, sizeof(ifr));
-	memset(&addr, 0x0, sizeof(addr));
-	memset(&frame, 0x0, sizeof(frame));
-
-	// Open a CAN_RAW socket.
-	s = socket(PF_CAN, SOCK_RAW, CAN_RAW); 
-
-	// Create the interface name and convert it to interface index.
-	char* interface_name; 
-	if (controller == CAN_0)
+	for (uint8_t i=0; i<CAN_NUM_CHAN_INT; i++)
 	{
-		interface_name = "can0";
-		strcpy(ifr.ifr_name, interface_name);
+		chan_int_handlers[i] = NULL;
 	}
-	ioctl(s, SIOCGIFINDEX, &ifr); 
-
-	// Setup address for bind. 
-	addr.can_ifindex = ifr.ifr_ifindex; 
-	addr.can_family = PF_CAN; 
-
-	// Bind socket to the can0 interface.
-	::bind(s, (struct sockaddr *)&addr, sizeof(addr));
-	printf("Successfully bound socket to [%s] interface.\n", interface_name);
+	
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	watch_socket(wake_fd, CAN_INT_WAKE_EVENT, true);
+	
+	// All done.
+	return;
 }
 
 Can_imp::~Can_imp(void)
 {
-	// Close the socket.
-	::close(s);
+	// Stop the interrupt thread, if it is running.
+	disable_interrupts();
+	
+	if (err_sock >= 0)
+	{
+		::close(err_sock);
+	}
+	::close(wake_fd);
+	::close(epoll_fd);
+	
+	// Close the sockets.
+	for (uint8_t i=0; i<CAN_NUM_BUFFERS; i++)
+	{
+		buffers[i]->imp->close();
+	}
 		
 	// All done.
 	return;
 }
 
+Can_config_status Can_imp::apply_filters(Can_buffer* buffer)
+{
+	struct can_filter rfilters[CAN_NUM_BANKS*CAN_BANK_PAIRS];
+	int num_rfilters = 0;
+	
+	// Gather up the filters of every bank attached to this buffer; the socket accepts a frame which passes any one of them.
+	for (uint8_t b=0; b<CAN_NUM_BANKS; b++)
+	{
+		Can_filter_bank_imp* bank = banks[b]->imp;
+		
+		if (bank->buffer_link != buffer)
+		{
+			continue;
+		}
+		
+		for (int i=0; i<=bank->bnk_mode; i++)
+		{
+			rfilters[num_rfilters++] = bank->rfilters[i];
+		}
+	}
+	
+	int ret;
+	if (num_rfilters > 0)
+	{
+		ret = setsockopt(buffer->imp->sock, SOL_CAN_RAW, CAN_RAW_FILTER, rfilters, num_rfilters * sizeof(struct can_filter));
+	}
+	else
+	{
+		// No banks left, so go back to the default filter which SocketCAN gives a new socket.
+		struct can_filter accept_all;
+		accept_all.can_id = 0;
+		accept_all.can_mask = 0;
+		
+		ret = setsockopt(buffer->imp->sock, SOL_CAN_RAW, CAN_RAW_FILTER, &accept_all, sizeof(accept_all));
+	}
+	
+	return (ret < 0) ? CAN_CFG_FAILED : CAN_CFG_SUCCESS;
+}
+
 Can_config_status Can_imp::initialise(Can_rate rate)
 {	
+	// A virtual interface has no bit rate to set.
+	if (ctrl_no == CAN_VCAN_0)
+	{
+		return CAN_CFG_SUCCESS;
+	}
+	
+	// The other SocketCAN interfaces have their bit rate set through netlink, with the link taken down while it changes.
+	if (ctrl_no != CAN_0)
+	{
+		uint32_t bitrate;
+		switch (rate)
+		{
+			case (CAN_1000K):
+				bitrate = 1000000;
+				break;
+			case (CAN_500K):
+				bitrate = 500000;
+				break;
+			case (CAN_250K):
+				bitrate = 250000;
+				break;
+			case (CAN_200K):
+				bitrate = 200000;
+				break;
+			case (CAN_125K):
+				bitrate = 125000;
+				break;
+			case (CAN_100K):
+				bitrate = 100000;
+				break;
+			default:
+				fprintf(stderr, "initialise: baud rate not supported by HAL, defaulting to 500K\n");	
+				bitrate = 500000;
+		}
+		
+		char command[128];
+		snprintf(command, sizeof(command), "sudo ip link set %s down && sudo ip link set %s type can bitrate %u && sudo ip link set %s up",
+			can_interface_names[ctrl_no], can_interface_names[ctrl_no], bitrate, can_interface_names[ctrl_no]);
+		
+		return (system(command) == 0) ? CAN_CFG_SUCCESS : CAN_CFG_FAILED;
+	}
+	
+	// The first controller is the PCAN adapter, which takes its bit rate through its character device.
 	switch (rate)
 	{
 		case (CAN_1000K): 
@@ -1166,6 +2584,276 @@ Can_config_status Can_imp::initialise(Can_rate rate)
 	return CAN_CFG_SUCCESS;
 }
 
+void Can_imp::enable_interrupts(void)
+{
+	if (int_running)
+	{
+		return;
+	}
+	
+	// Called from a handler which disabled interrupts, so the thread hasn't stopped yet and can just carry on.
+	if (int_thread_alive && pthread_equal(pthread_self(), int_thread))
+	{
+		int_self_stopped = false;
+		int_running = true;
+		return;
+	}
+	
+	// A thread which was stopped from one of its own handlers may still be finishing, and has to be gone before another one starts.
+	wait_for_interrupt_thread();
+	
+	// Interrupts are emulated by a thread, which waits on the sockets of the buffers with interrupts enabled.
+	int_running = true;
+	int_thread_alive = true;
+	int_self_stopped = false;
+	if (pthread_create(&int_thread, NULL, can_interrupt_thread, this) != 0)
+	{
+		int_running = false;
+		int_thread_alive = false;
+		fprintf(stderr, "enable_interrupts: couldn't start the interrupt thread for [%s]\n", can_interface_names[ctrl_no]);
+	}
+	
+	// All done.
+	return;
+}
+
+void Can_imp::disable_interrupts(void)
+{
+	// Only one caller gets to stop the thread, even if a handler is disabling interrupts at the same time.
+	bool running = true;
+	if (!int_running.compare_exchange_strong(running, false))
+	{
+		// The thread may have been stopped from one of its handlers and still be finishing, which matters if the caller is about to go away.
+		if (int_thread_alive && !pthread_equal(pthread_self(), int_thread))
+		{
+			wait_for_interrupt_thread();
+		}
+		return;
+	}
+	
+	if (pthread_equal(pthread_self(), int_thread))
+	{
+		// Called from a handler, so the thread stops by itself once the handler returns, and cleans up after itself since nothing joins it.
+		int_self_stopped = true;
+		return;
+	}
+	
+	// Wake the thread up so it sees it should stop, and wait for it.
+	uint64_t wake = 1;
+	if (::write(wake_fd, &wake, sizeof(wake)) != sizeof(wake))
+	{
+		// Without the wake up the thread could wait for traffic forever, so it has to be cancelled instead.  It waits for traffic in epoll_wait(),
+		// which is a cancellation point.
+		fprintf(stderr, "disable_interrupts: couldn't wake the interrupt thread for [%s]: %s\n", can_interface_names[ctrl_no], strerror(errno));
+		pthread_cancel(int_thread);
+	}
+	pthread_join(int_thread, NULL);
+	int_thread_alive = false;
+	
+	// All done.
+	return;
+}
+
+Can_int_status Can_imp::attach_interrupt(Can_channel_interrupt_type interrupt, void (*callback)(void))
+{
+	// SocketCAN has nothing like the AVR's CAN timer, so it can't overrun.
+	if (interrupt == CAN_TIME_OVERRUN)
+	{
+		return CAN_INT_FAILED;
+	}
+	
+	Can_int_status ret_code;
+	
+	/* determine return code */
+	if (chan_int_handlers[interrupt])
+	{
+		ret_code = CAN_INT_EXISTS;	// replacing an exsting callback
+	}
+	else
+	{
+		ret_code = CAN_INT_NOINT;	// added a new callback
+	}
+	
+	/* bus off notices arrive as error frames, on a socket of their own which takes no data frames */
+	if (err_sock < 0)
+	{
+		err_sock = open_can_socket(can_interface_names[ctrl_no]);
+		if (err_sock < 0)
+		{
+			return CAN_INT_FAILED;
+		}
+		
+		can_err_mask_t err_mask = CAN_ERR_BUSOFF;
+		setsockopt(err_sock, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0);
+		setsockopt(err_sock, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &err_mask, sizeof(err_mask));
+		
+		watch_socket(err_sock, CAN_INT_ERROR_EVENT, true);
+	}
+	
+	chan_int_handlers[interrupt] = callback;	// attach callback
+	
+	return ret_code;
+}
+
+Can_int_status Can_imp::detach_interrupt(Can_channel_interrupt_type interrupt)
+{
+	Can_int_status ret_code;
+	
+	/* determine return code */
+	if (chan_int_handlers[interrupt])
+	{
+		ret_code = CAN_INT_EXISTS;	// removed a callback
+	}
+	else
+	{
+		ret_code = CAN_INT_NOINT;	// there was no callback to remove
+	}
+	
+	chan_int_handlers[interrupt] = NULL;	// detach callblack
+	
+	if ((interrupt == CAN_BUS_OFF) && (err_sock >= 0))
+	{
+		watch_socket(err_sock, CAN_INT_ERROR_EVENT, false);
+		::close(err_sock);
+		err_sock = -1;
+	}
+	
+	return ret_code;
+}
+
+bool Can_imp::test_interrupt(Can_channel_interrupt_type interrupt)
+{
+	return (chan_int_handlers[interrupt] != NULL);
+}
+
+Can_int_status Can_imp::clear_interrupt_flags(Can_channel_interrupt_type interrupt)
+{
+	Can_int_status ret_code = CAN_INT_NOINT;
+	
+	if ((interrupt == CAN_BUS_OFF) && bus_off)
+	{
+		ret_code = CAN_INT_EXISTS;
+		bus_off = false;	// clearing flag
+	}
+	
+	return ret_code;
+}
+
+Can_buffer* Can_imp::get_interrupted_buffer(void)
+{
+	if (in_buffer_interrupt)
+	{
+		return buffers[interrupt_service_buffer];
+	}
+	else
+	{
+		return NULL;
+	}
+}
+
+void Can_imp::watch_socket(int fd, uint32_t source, bool watch)
+{
+	if (watch)
+	{
+		struct epoll_event event;
+		
+		memset(&event, 0x0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.u32 = source;
+		
+		// Enabling twice leaves the socket watched once.
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+	}
+	else
+	{
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	}
+	
+	// All done.
+	return;
+}
+
+void Can_imp::service_interrupts(void)
+{
+	struct epoll_event events[CAN_INT_MAX_EVENTS];
+	
+	while (int_running)
+	{
+		int num_events = epoll_wait(epoll_fd, events, CAN_INT_MAX_EVENTS, -1);
+		
+		for (int i=0; (i<num_events) && int_running; i++)
+		{
+			uint32_t source = events[i].data.u32;
+			
+			if (source < CAN_NUM_BUFFERS)
+			{
+				in_buffer_interrupt = true;
+				interrupt_service_buffer = static_cast<Can_id_buffer>(source);
+				
+				buffers[source]->imp->service_interrupt();
+				
+				in_buffer_interrupt = false;
+			}
+			else if (source == CAN_INT_ERROR_EVENT)
+			{
+				service_channel_interrupt();
+			}
+			else
+			{
+				// Woken up to check whether to stop; take the count off so the wake up isn't seen again.
+				uint64_t wake;
+				ssize_t nbytes = ::read(wake_fd, &wake, sizeof(wake));
+				(void) nbytes;
+			}
+		}
+	}
+	
+	// Nothing joins a thread stopped by one of its own handlers, so it has to detach itself.
+	if (int_self_stopped)
+	{
+		pthread_detach(pthread_self());
+	}
+	
+	// Anything waiting to start another thread can now go ahead.
+	int_thread_alive = false;
+	
+	// All done.
+	return;
+}
+
+void Can_imp::wait_for_interrupt_thread(void)
+{
+	// Once detached, the thread can't be joined, so this just waits for it to say it has finished.
+	while (int_thread_alive)
+	{
+		usleep(1000);
+	}
+	
+	// All done.
+	return;
+}
+
+void Can_imp::service_channel_interrupt(void)
+{
+	struct can_frame frame;
+	
+	if (::recv(err_sock, &frame, sizeof(frame), MSG_DONTWAIT) < 0)
+	{
+		return;
+	}
+	
+	/* execute channel interrupt callback */
+	IsrHandler handler = chan_int_handlers[CAN_BUS_OFF];
+	if ((frame.can_id & CAN_ERR_BUSOFF) && handler)
+	{
+		bus_off = true;
+		handler();
+	}
+	
+	// All done.
+	return;
+}
+
 uint8_t Can_imp::get_num_banks(void)
 {
 	return CAN_NUM_BANKS;
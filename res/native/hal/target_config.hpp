@@ -61,22 +61,33 @@
 #ifdef __linux__
 	
 	/* CAN */
-	#define CAN_NUM_BUFFERS  1
-	#define CAN_NUM_FILTERS  4
-	#define CAN_NUM_MASKS 	4
-	#define CAN_NUM_BANKS	1
+	#define CAN_NUM_BUFFERS  4
+	#define CAN_NUM_FILTERS  16
+	#define CAN_NUM_MASKS 	16
+	#define CAN_NUM_BANKS	4
 
- 	enum Can_id_controller { CAN_0 };
+	// Each controller is a SocketCAN network interface, named here in the same order as the controller ids.
+ 	enum Can_id_controller { CAN_0, CAN_1, CAN_2, CAN_3, CAN_VCAN_0, NB_CTRL };
+	#define CAN_INTERFACE_NAMES { "can0", "can1", "can2", "can3", "vcan0" }
 	
-	enum Can_id_buffer { CAN_BUF_0 };
-	enum Can_id_filmask{ CAN_FM_0, CAN_FM_1, CAN_FM_2, CAN_FM_3 };
-	enum Can_id_filter { CAN_FIL_0, CAN_FIL_1, CAN_FIL_2, CAN_FIL_3 };
-	enum Can_id_mask   { CAN_MSK_0, CAN_MSK_1, CAN_MSK_2, CAN_MSK_3 };
-	enum Can_id_bank   { CAN_BNK_0 }; 
+	// Each buffer is a CAN_RAW socket of its own, and each bank holds up to four filter/mask pairs (filters and masks 4n to 4n+3 make up bank n).
+	enum Can_id_buffer { CAN_BUF_0, CAN_BUF_1, CAN_BUF_2, CAN_BUF_3 };
+	enum Can_id_filmask{ CAN_FM_0, CAN_FM_1, CAN_FM_2, CAN_FM_3, CAN_FM_4, CAN_FM_5, CAN_FM_6, CAN_FM_7, CAN_FM_8, CAN_FM_9, CAN_FM_10, CAN_FM_11, CAN_FM_12, CAN_FM_13, CAN_FM_14, CAN_FM_15 };
+	enum Can_id_filter { CAN_FIL_0, CAN_FIL_1, CAN_FIL_2, CAN_FIL_3, CAN_FIL_4, CAN_FIL_5, CAN_FIL_6, CAN_FIL_7, CAN_FIL_8, CAN_FIL_9, CAN_FIL_10, CAN_FIL_11, CAN_FIL_12, CAN_FIL_13, CAN_FIL_14, CAN_FIL_15 };
+	enum Can_id_mask   { CAN_MSK_0, CAN_MSK_1, CAN_MSK_2, CAN_MSK_3, CAN_MSK_4, CAN_MSK_5, CAN_MSK_6, CAN_MSK_7, CAN_MSK_8, CAN_MSK_9, CAN_MSK_10, CAN_MSK_11, CAN_MSK_12, CAN_MSK_13, CAN_MSK_14, CAN_MSK_15 };
+	enum Can_id_bank   { CAN_BNK_0, CAN_BNK_1, CAN_BNK_2, CAN_BNK_3 }; 
 	enum Can_bank_mode { CAN_BNK_MODE_1FM, CAN_BNK_MODE_2FM, CAN_BNK_MODE_3FM, CAN_BNK_MODE_4FM };
 	
-	enum Can_buffer_interrupt_type {};
-	enum Can_channel_interrupt_type {};
+	// Interrupts are emulated by a thread for each controller, which runs the handlers when frames arrive on the buffers' sockets.  There is
+	// nothing like the CAN timer on SocketCAN, so CAN_TIME_OVERRUN can't be attached.
+	#define CAN_NUM_BUF_INT	3
+	#define CAN_NUM_CHAN_INT 2
+	
+	enum Can_buffer_interrupt_type { CAN_RX_COMPLETE, CAN_TX_COMPLETE, CAN_GEN_ERROR };
+	enum Can_channel_interrupt_type { CAN_BUS_OFF, CAN_TIME_OVERRUN };
+	
+	// The kernel timestamps each frame, on the adapter where it can and in software otherwise.
+	#define HAL_CAN_TIMESTAMPS_ENABLE true
 
 #else
 	#error "No HAL configuration for this target."